@@ -30,6 +30,19 @@ Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 
 #include "astar.h"
 
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#  include <pthread.h>
+#  define ASTAR_THREADS
+#endif // HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif // HAVE_SYS_MMAN_H
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif // HAVE_UNISTD_H
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -51,7 +64,7 @@ FILE * __astar_debugfp = NULL;
 #  ifdef SQUARE_HAS_OFS
 #    define __debug_square(as, s) \
         __debug("(%d,%d) ofs=%u: f=%u, g=%u, h=%d, o=%d, c=%d\n",       \
-                s->ofs % as->w, s->ofs / as->w,                         \
+                getx(as, s), gety(as, s),                               \
                 s->ofs, s->f, s->g, s->h, s->open, s->closed)
 #  else
 #    define __debug_square(as, s) \
@@ -87,8 +100,10 @@ static const int32_t _dx[8] = {   0,    1,   1,    1,    0,   -1,   -1,   -1 };
 static const int32_t _dy[8] = {  -1,   -1,   0,    1,    1,    1,    0,   -1 };
 static const int32_t _mc[8] = {  CC,   CD,  CC,   CD,   CC,   CD,   CC,   CD };
 #if defined(ASTAR_DEBUG) || defined(TEST_ASTAR)
-static const char * dirs[8] = { "N", "\'", "E",  ".",  "S",  "/",  "W",  "`" };
-static const char *names[8] = { "N", "NE", "E", "SE",  "S", "SW",  "W", "NW" };
+static const char * dirs[16] = { "N", "\'", "E",  ".",  "S",  "/",  "W",  "`",
+                                 "^", "?", "?", "?", "v", "?", "?", "?" };
+static const char *names[16] = { "N", "NE", "E", "SE",  "S", "SW",  "W", "NW",
+                                 "UP", "?", "?", "?", "DOWN", "?", "?", "?" };
 #endif // defined(ASTAR_DEBUG) || defined(TEST_ASTAR)
 
 // Reverse a direction. Funny how simple this is.
@@ -100,6 +115,15 @@ static const char *names[8] = { "N", "NE", "E", "SE",  "S", "SW",  "W", "NW" };
 // The penalty incurred by changing direction.
 #define _STEER_PENALTY ((CC) - 5)
 
+// Initial size of the heap. It doubles in size as needed.
+#define _HEAP_INITIAL 256
+
+// With a tie-breaking policy, heap keys are F in the upper bits and the tie
+// breaker in the lower ones.
+#define TIE_BITS 8
+#define TIE_MAX  ((1 << TIE_BITS) - 1)
+#define TIE_FMAX ((1 << (32 - TIE_BITS)) - 1)
+
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -116,8 +140,68 @@ static const char *names[8] = { "N", "NE", "E", "SE",  "S", "SW",  "W", "NW" };
                 exit (EXIT_FAILURE); \
         }
 
-// Calculate a grid offset given x, y and the grid's width (pitch).
-#define mkofs(as, x, y) ((y) * ((as)->w) + (x))
+// In the tiled layout, the grid is stored as square tiles of 8x8 squares,
+// each tile in row-major order. Tiles are also laid out in row-major order.
+#define TILE_SHIFT 3
+#define TILE_MASK  ((1 << TILE_SHIFT) - 1)
+
+
+// Calculate a grid offset given co-ordinates that include the border (if
+// any) around the grid.
+static inline uint32_t
+_astar_ofs (const astar_t * as, const uint32_t px, const uint32_t py)
+{
+        if (!as->tiled) return py * as->pitch + px;
+
+        uint32_t tile = (py >> TILE_SHIFT) * as->tiles_w + (px >> TILE_SHIFT);
+        return (tile << (2 * TILE_SHIFT)) | ((py & TILE_MASK) << TILE_SHIFT) | (px & TILE_MASK);
+}
+
+
+// The offset of a square within its layer. Layers are stored one after the
+// other, so this is the offset itself unless the grid is layered.
+static inline uint32_t
+_astar_local (const astar_t * as, const uint32_t ofs)
+{
+        return as->layers > 1 ? ofs % as->layer_area : ofs;
+}
+
+
+// And the reverse (these remove the border, too).
+static inline uint32_t
+_astar_ofsx (const astar_t * as, uint32_t ofs)
+{
+        ofs = _astar_local (as, ofs);
+        if (!as->tiled) return ofs % as->pitch - as->pad;
+        uint32_t tile = ofs >> (2 * TILE_SHIFT);
+        return (((tile % as->tiles_w) << TILE_SHIFT) | (ofs & TILE_MASK)) - as->pad;
+}
+
+
+static inline uint32_t
+_astar_ofsy (const astar_t * as, uint32_t ofs)
+{
+        ofs = _astar_local (as, ofs);
+        if (!as->tiled) return ofs / as->pitch - as->pad;
+        uint32_t tile = ofs >> (2 * TILE_SHIFT);
+        return (((tile / as->tiles_w) << TILE_SHIFT) | ((ofs >> TILE_SHIFT) & TILE_MASK)) - as->pad;
+}
+
+
+// Calculate a grid offset given x and y. The grid may be surrounded by a
+// blocked border and laid out in tiles, but this is invisible to the caller.
+#define mkofs(as, x, y) _astar_ofs ((as), (x) + (as)->pad, (y) + (as)->pad)
+
+// The same on a layered grid.
+#define mkofs3(as, x, y, z) ((z) * (as)->layer_area + mkofs ((as), (x), (y)))
+
+// And the reverse.
+#define ofsx(as, ofs) _astar_ofsx ((as), (ofs))
+#define ofsy(as, ofs) _astar_ofsy ((as), (ofs))
+#define ofsz(as, ofs) ((as)->layers > 1 ? (ofs) / (as)->layer_area : 0)
+
+// The offset of the first square of the layer ofs is on.
+#define layerbase(as, ofs) ((ofs) - _astar_local ((as), (ofs)))
 
 #ifdef SQUARE_HAS_OFS
 // Use the embedded offset field.
@@ -127,8 +211,40 @@ static const char *names[8] = { "N", "NE", "E", "SE",  "S", "SW",  "W", "NW" };
 #define getofs(as, s) ((s) - ((as)->grid))
 #endif // SQUARE_HAS_OFS
 
-#define getx(as, s) (getofs((as),(s)) % (as)->w)
-#define gety(as, s) (getofs((as),(s)) / (as)->w)
+#define getx(as, s) ofsx((as), getofs((as),(s)))
+#define gety(as, s) ofsy((as), getofs((as),(s)))
+
+
+// Bring co-ordinates that just left the grid back in from the other side, if
+// the map wraps around along that axis. Returns 0 if they're off the grid.
+static inline int
+_astar_wrap (const astar_t * as, uint32_t * x, uint32_t * y)
+{
+        if (*x >= as->w) {
+                if (!(as->wrap & ASTAR_WRAP_X)) return 0;
+                *x = (int32_t) *x < 0 ? *x + as->w : *x - as->w;
+        }
+        if (*y >= as->h) {
+                if (!(as->wrap & ASTAR_WRAP_Y)) return 0;
+                *y = (int32_t) *y < 0 ? *y + as->h : *y - as->h;
+        }
+        return 1;
+}
+
+
+// The offset of the square next to ofs in direction dir. This is a constant
+// delta, unless the grid is tiled or wraps around. The portal directions move
+// to the same square on the next layer.
+static inline uint32_t
+_astar_step (const astar_t * as, const uint32_t ofs, const int dir)
+{
+        if (dir >= NUM_DIRS)
+                return dir == DIR_UP ? ofs + as->layer_area : ofs - as->layer_area;
+        if (!as->tiled && !as->wrap) return ofs + as->dofs[dir];
+        uint32_t x = ofsx (as, ofs) + as->dx[dir], y = ofsy (as, ofs) + as->dy[dir];
+        _astar_wrap (as, &x, &y);
+        return layerbase (as, ofs) + mkofs (as, x, y);
+}
 
 // Used as return astar_error (as, error_code) to stop processing when
 // an error occurs. It updates statistics.
@@ -140,15 +256,32 @@ static const char *names[8] = { "N", "NE", "E", "SE",  "S", "SW",  "W", "NW" };
 
 #define set_result(as,err) ((as)->result = err, (as)->str_result = #err)
 
+// Fetch a square of a layered grid, along with its portals. Portals leading
+// off the top and bottom layers are ignored.
+static inline uint8_t
+_astar_get_layer (astar_t * as, square_t * s, const uint32_t x, const uint32_t y)
+{
+        uint32_t z = (s - as->grid) / as->layer_area;
+        uint8_t portals = 0;
+        uint8_t cost = (*as->get_layer)(as->origin_x + x, as->origin_y + y, z, &portals);
+        s->up = (portals & ASTAR_PORTAL_UP) && (z + 1 < as->layers);
+        s->down = (portals & ASTAR_PORTAL_DOWN) && (z > 0);
+        return cost;
+}
+
 // We use this to initialise a square_t payload.
 #define __get_square(as, s, x, y)                                 \
-        s->cost = (*as->get)(as->origin_x + x, as->origin_y + y); \
+        s->cost = as->get_layer != NULL ?                         \
+                _astar_get_layer (as, s, x, y) :                  \
+                (*as->get)(as->origin_x + x, as->origin_y + y);   \
         s->g = 0;                                                 \
         s->h = 0;                                                 \
         s->f = 0;                                                 \
         s->open = 0;                                              \
         s->closed = 0;                                            \
         s->route = 0;                                             \
+        s->seen = 0;                                              \
+        s->incons = 0;                                            \
         s->init = 1;
 
 
@@ -187,6 +320,67 @@ manhattan_distance (const uint32_t x0, const uint32_t y0,
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// DIFFERENTIAL HEURISTIC (LANDMARKS)
+//
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * The tables are indexed by grid offset, so they follow the layout of the
+ * grid and are freed when the grid is reallocated.
+ *
+ * Let D(v) be the cost of moving from landmark L to square v. For any target
+ * t, D(t) <= D(v) + d(v,t), so D(t) - D(v) is a lower bound of d(v,t).
+ *
+ * Moves aren't symmetric, as the cost of a move includes the cost of the
+ * square being entered. Reversing a path from a to b adds cost(a) and
+ * subtracts cost(b), so d(v,t) = d(t,v) + cost(t) - cost(v) >= D(v) - D(t) -
+ * cost(v). That holds only if every move costs the same as the move back:
+ * otherwise, only the first bound is used. Squares not reachable from a
+ * landmark hold an infinite distance and don't contribute a bound.
+ *
+ * The distances are those of routes on the grid. Any-angle routes may be
+ * shorter, so the bounds aren't used in any-angle searches.
+ */
+
+#define ALT_INF16 0xffff
+#define ALT_INF32 0xffffffff
+
+// Scratch planes used while building the tables are in row-major order.
+#define altofs(as, x, y) ((y) * (as)->w + (x))
+
+#define _ALT_BOUND(type, table, inf)                                    \
+        do {                                                            \
+                const type * dv = &(table)[v * alt->num];               \
+                const type * dt = &(table)[t * alt->num];               \
+                for (i = 0; i < alt->num; i++) {                        \
+                        if ((dv[i] == (inf)) || (dt[i] == (inf))) continue; \
+                        if (dt[i] > dv[i]) {                            \
+                                b = dt[i] - dv[i];                      \
+                        } else if (alt->symmetric &&                    \
+                                   (dv[i] > dt[i] + cost_v)) {          \
+                                b = dv[i] - dt[i] - cost_v;             \
+                        } else continue;                                \
+                        if (b > bound) bound = b;                       \
+                }                                                       \
+        } while (0)
+
+static inline uint32_t
+astar_alt_bound (const astar_alt_t * alt, const uint32_t v, const uint32_t t,
+                 const uint32_t cost_v)
+{
+        uint32_t i, b, bound = 0;
+
+        if (alt->wide) {
+                _ALT_BOUND (uint32_t, alt->dist32, ALT_INF32);
+        } else {
+                _ALT_BOUND (uint16_t, alt->dist16, ALT_INF16);
+        }
+        return bound;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // INTERNAL USE ONLY
@@ -194,17 +388,261 @@ manhattan_distance (const uint32_t x0, const uint32_t y0,
 ///////////////////////////////////////////////////////////////////////////////
 
 
+static inline void
+_astar_block_square (astar_t * as, const uint32_t ofs)
+{
+        square_t * s = &as->grid[ofs];
+        memset (s, 0, sizeof (square_t));
+        s->cost = COST_BLOCKED;
+        s->init = 1;
+#ifdef SQUARE_HAS_OFS
+        s->ofs = ofs;
+#endif // SQUARE_HAS_OFS
+}
+
+
+static void
+astar_mark_border (astar_t * as)
+{
+        // The border squares are blocked and always initialised, so the main
+        // loop never calls get() for them and never steps onto them.
+        uint32_t i, z, base, rows = as->h + 2 * as->pad;
+        if (!as->pad) return;
+
+        for (z = 0, base = 0; z < as->layers; z++, base += as->layer_area) {
+                for (i = 0; i < as->pitch; i++) {
+                        _astar_block_square (as, base + _astar_ofs (as, i, 0));
+                        _astar_block_square (as, base + _astar_ofs (as, i, rows - 1));
+                }
+                for (i = 1; i < rows - 1; i++) {
+                        _astar_block_square (as, base + _astar_ofs (as, 0, i));
+                        _astar_block_square (as, base + _astar_ofs (as, as->pitch - 1, i));
+                }
+        }
+}
+
+
+// Transparent huge pages are this large on most platforms that have them.
+#define ASTAR_THP_SIZE (2 << 20)
+
+
+static size_t
+astar_page_size (void)
+{
+        // The size of small pages, for pre-faulting.
+#if defined(HAVE_UNISTD_H) && defined(_SC_PAGESIZE)
+        long size = sysconf (_SC_PAGESIZE);
+        if (size > 0) return size;
+#endif // HAVE_UNISTD_H && _SC_PAGESIZE
+        return 4096;
+}
+
+
+#ifdef HAVE_SYS_MMAN_H
+static size_t
+astar_huge_page_size (void)
+{
+        // The size of the default explicit huge pages, which mappings of them
+        // must be a multiple of. Returns 0 if it isn't known.
+        size_t size = 0;
+        char line[128];
+        unsigned long kb;
+        FILE * fp = fopen ("/proc/meminfo", "r");
+        if (fp == NULL) return 0;
+        while (fgets (line, sizeof (line), fp) != NULL) {
+                if (sscanf (line, "Hugepagesize: %lu kB", &kb) == 1) {
+                        size = (size_t) kb << 10;
+                        break;
+                }
+        }
+        fclose (fp);
+        return size;
+}
+#endif // HAVE_SYS_MMAN_H
+
+
+static void *
+astar_alloc_pages (astar_t * as, size_t size)
+{
+        // Allocate zeroed memory for a large plane according to the allocation
+        // policy, falling back to plain calloc(). Record the mode we ended up
+        // using.
+        void * p = NULL;
+        as->alloc_mode = ASTAR_ALLOC_DEFAULT;
+        as->mapped = 0;
+
+#ifdef HAVE_SYS_MMAN_H
+        if (as->alloc_policy & (ASTAR_ALLOC_HUGE | ASTAR_ALLOC_HUGETLB)) {
+                size_t len = (size + ASTAR_THP_SIZE - 1) & ~(size_t)(ASTAR_THP_SIZE - 1);
+
+#  ifdef MAP_HUGETLB
+                // Explicit huge pages. These must have been reserved by the
+                // administrator (e.g. vm.nr_hugepages), so this often fails.
+                // Don't try if we can't tell how large they are: the mapping
+                // couldn't be unmapped.
+                size_t huge = as->alloc_policy & ASTAR_ALLOC_HUGETLB ? astar_huge_page_size () : 0;
+                if (huge) {
+                        size_t huge_len = (size + huge - 1) / huge * huge;
+                        p = mmap (NULL, huge_len, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                        if (p == MAP_FAILED) {
+                                p = NULL;
+                        } else {
+                                as->alloc_mode = ASTAR_ALLOC_HUGETLB;
+                                len = huge_len;
+                        }
+                }
+#  endif // MAP_HUGETLB
+
+                // Transparent huge pages: ask the kernel to back the mapping
+                // with huge pages where it can.
+                if (p == NULL) {
+                        p = mmap (NULL, len, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                        if (p == MAP_FAILED) {
+                                p = NULL;
+                        }
+#  if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+                        else if (madvise (p, len, MADV_HUGEPAGE) == 0) {
+                                as->alloc_mode = ASTAR_ALLOC_HUGE;
+                        }
+#  endif // HAVE_MADVISE && MADV_HUGEPAGE
+                }
+
+                if (p != NULL) as->mapped = len;
+        }
+#endif // HAVE_SYS_MMAN_H
+
+        if (p == NULL) {
+                p = calloc (size, 1);
+                check_null (p, "astar_alloc_pages(), allocating memory");
+        }
+
+        // Fault the pages in now, from this thread. This saves page-fault
+        // time during the first search and, on NUMA machines, places the pages
+        // on the node of the calling thread.
+        if (as->alloc_policy & ASTAR_ALLOC_LOCAL) {
+                volatile uint8_t * vp = (volatile uint8_t *) p;
+                size_t i, page = astar_page_size ();
+                for (i = 0; i < size; i += page) vp[i] = 0;
+                as->alloc_mode |= ASTAR_ALLOC_LOCAL;
+        }
+
+        return p;
+}
+
+
+static void
+astar_free_grid (astar_t * as)
+{
+        // The parent plane follows the layout of the grid.
+        free (as->parent);
+        as->parent = NULL;
+
+
+#ifdef HAVE_SYS_MMAN_H
+        if (as->mapped) {
+                munmap (as->grid, as->mapped);
+                as->grid = NULL;
+                as->mapped = 0;
+                return;
+        }
+#endif // HAVE_SYS_MMAN_H
+        free (as->grid);
+        as->grid = NULL;
+}
+
+
+static void
+astar_alloc_grid (astar_t * as)
+{
+        // Allocate the grid (initialised to zeroes), with room for the border
+        // if needed. Tiled grids are rounded up to a whole number of tiles.
+        // Layered grids store their layers one after the other.
+        uint32_t rows = as->h + 2 * as->pad;
+        as->pitch = as->w + 2 * as->pad;
+        if (as->tiled) {
+                as->tiles_w = (as->pitch + TILE_MASK) >> TILE_SHIFT;
+                as->layer_area = (as->tiles_w * ((rows + TILE_MASK) >> TILE_SHIFT)) << (2 * TILE_SHIFT);
+        } else {
+                as->tiles_w = 0;
+                as->layer_area = as->pitch * rows;
+        }
+        as->grid_area = as->layer_area * as->layers;
+
+        as->grid = (square_t *) astar_alloc_pages (as, as->grid_area * sizeof (square_t));
+        as->grid_init = 0;
+        as->grid_clean = 0;
+        as->grid_full = 0;
+        astar_mark_border (as);
+
+        // The heap keeps track of the squares on it, so updating them is
+        // cheap.
+        astar_heap_clear (as->heap);
+        astar_heap_track (as->heap, as->grid_area);
+}
+
+
 static void
 astar_reset_grid (astar_t * as)
 {
         // Don't reset it if it's already clean.
         if (as->grid_clean) return;
         __debug ("Resetting grid...\n");
-        uint32_t i = 0, area = as->w * as->h;
+        uint32_t i = 0, area = as->grid_area;
+
+        // If astar_init_grid() fetched the whole grid, keep the costs and only
+        // clear the state of the last search.
+        if (as->grid_full) {
+                for (i = 0; i < area; i++) {
+                        as->grid[i].g = 0;
+                        as->grid[i].h = 0;
+                        as->grid[i].f = 0;
+                        as->grid[i].open = 0;
+                        as->grid[i].closed = 0;
+                        as->grid[i].route = 0;
+                        as->grid[i].seen = 0;
+                        as->grid[i].incons = 0;
+                }
+                as->grid_clean = 1;
+                return;
+        }
+
         for (i = 0; i < area; i++) {
                 as->grid[i].init = 0;
                 as->grid[i].route = 0;
         }
+        astar_mark_border (as);
+        as->grid_clean = 1;
+}
+
+
+static void
+astar_update_dirs (astar_t * as)
+{
+        // Precalculate everything the main loop needs to know about the
+        // directions, so it doesn't need to work it out for every square.
+        int dir;
+        as->num_dirs = 0;
+        as->margin = 0;
+        for (dir = 0; dir < NUM_DIRS; dir++) {
+                as->dofs[dir] = as->dx[dir] + as->dy[dir] * (int32_t) as->pitch;
+
+                // Odd-numbered directions are the non-cardinal ones. If the
+                // movement mode is along the cardinal directions, skip odd
+                // directions.
+                if ((as->move_8way == 0) && (dir & 1)) continue;
+                as->dirs[as->num_dirs++] = dir;
+
+                uint32_t m = abs (as->dx[dir]);
+                if ((uint32_t) abs (as->dy[dir]) > m) m = abs (as->dy[dir]);
+                if (m > as->margin) as->margin = m;
+        }
+
+        // If all moves are to adjacent squares, the border (if there is one)
+        // stops them from leaving the grid.
+        // Wrapped moves leave the grid on purpose.
+        as->border_safe = as->pad && (as->margin <= as->pad) && !as->wrap;
 }
 
 
@@ -225,9 +663,9 @@ get_square (astar_t * as, const uint32_t ofs, const uint32_t x, const uint32_t y
         }
 
 #ifdef ASTAR_DEBUG
-        assert (ofs == mkofs (as, x, y));
+        assert (_astar_local (as, ofs) == mkofs (as, x, y));
 #ifdef SQUARE_HAS_OFS
-        assert (s->ofs == mkofs (as, x, y));
+        assert (_astar_local (as, s->ofs) == mkofs (as, x, y));
 #endif // SQUARE_HAS_OFS
         //__debug ("Got square: ");
         //__debug_square (as, s);
@@ -237,13 +675,110 @@ get_square (astar_t * as, const uint32_t ofs, const uint32_t x, const uint32_t y
 }
 
 
+// The F value of a square, with h weighted by the current weight.
+static inline uint32_t
+_astar_f (const astar_t * as, const uint32_t g, const uint32_t h)
+{
+        if (as->weight == ASTAR_EPSILON_ONE) return g + h;
+        return g + (uint32_t) (((uint64_t) h * as->weight) / ASTAR_EPSILON_ONE);
+}
+
+
+// The heap key of a square: F, and the tie breaker if there is one.
+static inline uint32_t
+_astar_key (const astar_t * as, const square_t * s, const uint32_t ofs)
+{
+        uint32_t tie;
+        int64_t cross;
+
+        if (as->tie_break == ASTAR_TIE_NONE) return s->f;
+
+        // Keys of squares whose F doesn't fit all rank the same. Otherwise,
+        // lowering G would raise the tie breaker but not lower F.
+        if (s->f > TIE_FMAX) return ((uint32_t) TIE_FMAX << TIE_BITS) | TIE_MAX;
+
+        switch (as->tie_break) {
+        case ASTAR_TIE_HIGH_G:
+                tie = s->g >> as->tie_shift;
+                tie = tie < TIE_MAX ? TIE_MAX - tie : 0;
+                break;
+        case ASTAR_TIE_LOW_H:
+                tie = s->h >> as->tie_shift;
+                break;
+        default:
+                // The cross product of the vectors from the target to this
+                // square and to the start, scaled down to roughly the
+                // distance from the line between them.
+                cross = ((int64_t) ofsx (as, ofs) - as->x1) * ((int64_t) as->y0 - as->y1) -
+                        ((int64_t) as->x0 - as->x1) * ((int64_t) ofsy (as, ofs) - as->y1);
+                if (cross < 0) cross = -cross;
+                cross /= as->tie_len;
+                tie = cross > TIE_MAX ? TIE_MAX : cross;
+                break;
+        }
+
+        if (tie > TIE_MAX) tie = TIE_MAX;
+        return (s->f << TIE_BITS) | tie;
+}
+
+
+// Append a grid offset to a growable list.
+static void
+astar_list_push (uint32_t ** list, uint32_t * len, uint32_t * alloc, const uint32_t ofs)
+{
+        if (*len == *alloc) {
+                *alloc = *alloc ? *alloc * 2 : 256;
+                *list = (uint32_t *) realloc (*list, *alloc * sizeof (uint32_t));
+                check_null (*list, "astar_list_push(), growing list");
+        }
+        (*list)[(*len)++] = ofs;
+}
+
+
+static void
+astar_prune_open (astar_t * as)
+{
+        // Drop the worst open squares, with some headroom so this doesn't
+        // happen on every step. They're forgotten entirely, so they can be
+        // reached again.
+        uint32_t i, n = astar_heap_prune (as->heap, as->max_open - as->max_open / 4);
+        asheap_entry_t * dropped = &as->heap->e[as->heap->length];
+
+        for (i = 0; i < n; i++) {
+                square_t * s = &as->grid[dropped[i].ofs];
+
+                // The heap holds one entry per open square, and squares
+                // leave it when they're closed, so all of these are open.
+                assert (s->open && !s->closed);
+                s->open = 0;
+                s->seen = 0;
+                as->open--;
+                as->pruned++;
+        }
+        __debug ("Pruned the open list to %u squares.\n", as->heap->length);
+}
+
+
+static inline int
+astar_trim_heap (astar_t * as, const int result)
+{
+        // Give back the memory of an unusually large search. The heap isn't
+        // needed after the search is over.
+        if (as->heap_trim && (as->heap->alloc > as->heap_trim)) {
+                astar_heap_clear (as->heap);
+                astar_heap_shrink (as->heap, as->heap_trim);
+        }
+        return result;
+}
+
+
 static uint32_t
 astar_find_best_compromise (astar_t * as)
 {
         // All the work is done incrementally in astar_add_closed(). Calculate the last
         // bits.
-        as->bestx = as->bestofs % as->w;
-        as->besty = as->bestofs / as->w;
+        as->bestx = ofsx (as, as->bestofs);
+        as->besty = ofsy (as, as->bestofs);
         return as->bestofs;
 }
 
@@ -261,23 +796,24 @@ astar_add_open (astar_t * as, square_t * s, uint32_t gridofs, uint32_t g, uint32
 #endif // TEST_ASTAR
 
         // As per A* algorithm.
-        uint32_t f = g + h;
+        uint32_t f = _astar_f (as, g, h);
         
         __debug("\t+O Adding (%d,%d) (ofs=%d, f=%u, g=%u, h=%u) to open list.\n",
-                gridofs % as->w, gridofs / as->w, gridofs, f, g, h);
+                ofsx (as, gridofs), ofsy (as, gridofs), gridofs, f, g, h);
 
         // Set values.
         s->f = f;
         s->g = g;
         s->h = h;
         s->open = 1;
+        s->seen = 1;
 
         // Add the F value and square to the heap. Keep the heap offset.
-        astar_heap_add (as->heap, f, s);
+        astar_heap_add (as->heap, _astar_key (as, s, gridofs), gridofs);
         as->open++;
 
         //__debug("++ Added (%d,%d) (ofs=%d, f=%u, g=%u, h=%u) to open list.\n",
-        //      gridofs % as->w, gridofs / as->w, gridofs, f, g, h);
+        //      ofsx (as, gridofs), ofsy (as, gridofs), gridofs, f, g, h);
         //astar_print_heap (as, "*** AFTER ADDITION");
 }
 
@@ -286,7 +822,7 @@ inline static void
 astar_add_closed (astar_t * as, square_t * s, uint32_t gridofs)
 {
         __debug("\t+C Adding (%d,%d) (ofs=%d) to closed list:",
-                gridofs % as->w, gridofs / as->w, gridofs);
+                ofsx (as, gridofs), ofsy (as, gridofs), gridofs);
         __debug_square (as, s);
 
         assert (as != NULL);
@@ -315,7 +851,7 @@ astar_add_closed (astar_t * as, square_t * s, uint32_t gridofs)
         }
 
         //__debug ("-- Added (%d,%d) (ofs=%d, f=%u, g=%u, h=%u) to closed list.\n",
-        //       gridofs % as->w, gridofs / as->w, gridofs, s->f, s->g, s->h);
+        //       ofsx (as, gridofs), ofsy (as, gridofs), gridofs, s->f, s->g, s->h);
         //astar_print_heap (as, "*** AFTER REMOVAL (ADDITION TO CLOSED LIST)");
 }
 
@@ -328,7 +864,7 @@ astar_update (astar_t * as, square_t * square, uint32_t gridofs, uint32_t g)
 
         // As per A* algorithm (h doesn't change because it only depends on the location
         // of the square).
-        uint32_t f = g + square->h;
+        uint32_t f = _astar_f (as, g, square->h);
 
         // Paranoia -- we should only be updating to lower g.
         assert (&(as->grid[gridofs]) == square);
@@ -345,15 +881,16 @@ astar_update (astar_t * as, square_t * square, uint32_t gridofs, uint32_t g)
                 __debug("*** astar_heap_update: ");
                 __debug_square (as, square);
 
-                uint32_t newofs = astar_heap_update (as->heap, square);
-                assert (as->heap->data[newofs] == square->f);
+                uint32_t key = _astar_key (as, square, gridofs);
+                uint32_t newofs = astar_heap_update (as->heap, gridofs, key);
+                assert (as->heap->e[newofs].key == key);
                 as->updates++;
                 __debug("++ Updated (%d,%d) (new_ofs=%d, new_f=%u, new_g=%u, h=%u).\n",
-                        gridofs % as->w, gridofs / as->w, gridofs, f, g, square->h);
+                        ofsx (as, gridofs), ofsy (as, gridofs), gridofs, f, g, square->h);
         } else {
                 __debug("++ Updated (%d,%d) (new_ofs=%d, new_f=%u, new_g=%u, h=%u). "
                         "NO HEAP UPDATE NECESSARY.\n",
-                        gridofs % as->w, gridofs / as->w, gridofs, f, g, square->h);
+                        ofsx (as, gridofs), ofsy (as, gridofs), gridofs, f, g, square->h);
         }
 
         // Change the remaining grid values.
@@ -385,27 +922,49 @@ astar_new (const uint32_t w,
         // Set initial configuration.
         as->w = w;
         as->h = h;
+        as->pad = 0;
+        as->tiled = 0;
+        as->layers = 1;
+        as->alloc_policy = ASTAR_ALLOC_DEFAULT;
 
         // Initialise internal/statistics fields.
         as->max_cost = 0;
         as->timeout = 0;
+        as->max_open = 0;
+        as->heap_trim = 0;
+        as->reopen = 0;
+        as->smoothing = ASTAR_SMOOTH_NONE;
+        as->any_angle = ASTAR_ANY_ANGLE_NONE;
+        as->wrap = 0;
         as->x0 = 0;
         as->y0 = 0;
         as->x1 = 0;
         as->y1 = 0;
+        as->z0 = 0;
+        as->z1 = 0;
         as->ofs0 = 0;
         as->ofs1 = 0;
         as->bestscore = 0xffffffff;
-        as->grid_init = 0;
-        as->grid_clean = 0;
         as->gets = 0;
         as->updates = 0;
         as->open = 0;
         as->closed = 0;
+        as->pruned = 0;
+        as->stale_pops = 0;
+        as->reopens = 0;
+        as->los_checks = 0;
         as->usecs = 0;
         as->loops = 0;
         as->result = 0;
         as->str_result = NULL;
+        as->alt = NULL;
+        as->cc = NULL;
+        as->clearance = NULL;
+        as->num_overlays = 0;
+        as->ov_ofs = NULL;
+        as->ov_cost = NULL;
+        as->ov_num = 0;
+        as->ov_mask = 0;
         
         // Store default configuration: costs and deltas. This allows
         // reconfiguration by the advanced user.
@@ -418,21 +977,42 @@ astar_new (const uint32_t w,
         memcpy (as->mc, _mc, sizeof(as->mc));
         as->steering_penalty = _STEER_PENALTY;
         as->heuristic_factor = _HEURISTIC_FACTOR;
+        as->epsilon = ASTAR_EPSILON_ONE;
+        as->weight = ASTAR_EPSILON_ONE;
+        as->tie_break = ASTAR_TIE_NONE;
+        as->agent_size = 1;
+        as->tie_shift = 0;
+        as->tie_len = 1;
+        as->bound = ASTAR_EPSILON_ONE;
+        as->anytime = 0;
+        as->theta = 0;
+        as->ara_closed = NULL;
+        as->ara_nclosed = 0;
+        as->ara_closed_alloc = 0;
+        as->ara_incons = NULL;
+        as->ara_nincons = 0;
+        as->ara_incons_alloc = 0;
+        as->parent = NULL;
 
         // Set the heuristic callback. Go for manhattan_distance if it hasn't been provided.
         as->heuristic = heuristic != NULL? heuristic: manhattan_distance;
 
         // Set the map getter callback.
         as->get = get;
+        as->get_layer = NULL;
+        as->climb_cost = CC;
+
+        // Allocate data structures (initialise the grid to zeroes). Most
+        // searches only visit a small part of the grid, so the heap starts
+        // small.
+        as->heap = astar_heap_new (_HEAP_INITIAL, 0);
+        astar_alloc_grid (as);
 
-        // Allocate data structures (initialise the grid to zeroes).
-        uint32_t area = w * h;
-        as->heap = astar_heap_new (area, area);
-        as->grid = (square_t *) calloc (area, sizeof (square_t));
+        astar_update_dirs (as);
 
         __debug ("Allocated %dx%d search grid and %d-item heap, %d bytes total.\n",
                  as->w, as->h, as->heap->alloc,
-                 sizeof(as) + astar_heap_sizeof(as->heap) + as->w * as->h * sizeof(square_t));
+                 sizeof(as) + astar_heap_sizeof(as->heap) + as->grid_area * sizeof(square_t));
 
         return as;
 }
@@ -449,6 +1029,14 @@ void
 astar_set_origin (astar_t * as, const uint32_t x, const uint32_t y)
 {
         assert (as != NULL);
+
+        // The landmarks, labels and clearances describe the map under the
+        // old origin.
+        if (!as->origin_set || (x != as->origin_x) || (y != as->origin_y)) {
+                astar_alt_free (as);
+                astar_cc_free (as);
+                astar_clearance_free (as);
+        }
         as->origin_x = x;
         as->origin_y = y;
         as->origin_set = 1;
@@ -470,125 +1058,1441 @@ astar_set_timeout (astar_t *as, const uint32_t timeout)
 
 
 void
-astar_set_movement_mode (astar_t * as, int mode)
+astar_set_max_open (astar_t *as, const uint32_t max_open)
 {
-	assert (as != NULL);
-	as->move_8way = mode & 1;
+        assert (as != NULL);
+        as->max_open = max_open;
 }
 
 
 void
-astar_set_dxy (astar_t *as, const uint8_t dir, const int dx, const int dy)
+astar_set_reopen (astar_t *as, const int reopen)
 {
         assert (as != NULL);
-        as->dx[dir & 7] = dx;
-        as->dy[dir & 7] = dy;
+        as->reopen = reopen != 0;
 }
 
 
 void
-astar_set_cost (astar_t *as, const uint8_t dir, const uint32_t cost)
+astar_set_smoothing (astar_t *as, const uint32_t smoothing)
 {
         assert (as != NULL);
-        as->mc[dir & 7] = cost;
+        as->smoothing = smoothing;
 }
 
 
 void
-astar_set_steering_penalty (astar_t *as, const uint32_t steering_penalty)
+astar_set_any_angle (astar_t *as, const uint32_t mode)
 {
         assert (as != NULL);
-        as->steering_penalty = steering_penalty;
+        assert (mode <= ASTAR_LAZY_THETA);
+        as->any_angle = mode;
 }
 
 
 void
-astar_set_heuristic_factor (astar_t *as, const uint32_t heuristic_factor)
+astar_set_heap_trim (astar_t *as, const uint32_t heap_trim)
 {
         assert (as != NULL);
-        as->heuristic_factor = heuristic_factor;
+        as->heap_trim = heap_trim;
 }
 
 
-///////////////////////////////////////////////////////////////////////////////
-//
-// PUBLIC USE FUNCTIONS
-//
-///////////////////////////////////////////////////////////////////////////////
+void
+astar_set_movement_mode (astar_t * as, int mode)
+{
+	assert (as != NULL);
+	as->move_8way = mode & 1;
+        astar_update_dirs (as);
+        astar_cc_free (as);
+}
 
 
 void
-astar_reset (astar_t * as)
+astar_set_wrap (astar_t * as, const uint32_t wrap)
 {
-        assert (as != NULL);
+	assert (as != NULL);
+	as->wrap = wrap & (ASTAR_WRAP_X | ASTAR_WRAP_Y);
+        astar_update_dirs (as);
+        astar_cc_free (as);
+}
 
-        __debug ("Resetting A* structure for another run.\n");
 
-        // Initialise internal/statistics fields.
-        as->steps = 0;
-        as->score = 0;
-	set_result (as, ASTAR_NOTHING);
-        as->usecs = 0;
-        as->gets = 0;
-        as->bestofs = 0;
-        as->bestx = 0;
-        as->besty = 0;
-        as->have_best = 0;
-        as->have_route = 0;
+void
+astar_set_layers (astar_t * as, const uint32_t layers,
+                  uint8_t (*get_layer) (const uint32_t x, const uint32_t y,
+                                        const uint32_t z, uint8_t * portals),
+                  const uint32_t climb_cost)
+{
+        assert (as != NULL);
+        assert (layers > 0);
+        assert ((layers == 1) || (get_layer != NULL));
+
+        // The grid has to be reallocated, and its contents are lost. Landmark
+        // tables and component labels only cover one layer.
+        astar_alt_free (as);
+        astar_cc_free (as);
+        astar_clearance_free (as);
+        astar_free_grid (as);
+        as->layers = layers;
+        as->get_layer = get_layer;
+        as->climb_cost = climb_cost;
+        astar_alloc_grid (as);
+        astar_update_dirs (as);
+}
 
-        // Reset the heap.
-        astar_heap_clear (as->heap);
 
-        // Reset the grid.
-        astar_reset_grid (as);
+void
+astar_set_grid_padding (astar_t * as, const int padded)
+{
+        assert (as != NULL);
+        if ((padded != 0) == as->pad) return;
+
+        // The grid has to be reallocated, and its contents are lost.
+        astar_alt_free (as);
+        astar_clearance_free (as);
+        astar_free_grid (as);
+        as->pad = padded != 0;
+        astar_alloc_grid (as);
+        astar_update_dirs (as);
 }
 
 
 void
-astar_destroy (astar_t * as)
+astar_set_grid_layout (astar_t * as, const int layout)
 {
         assert (as != NULL);
-        astar_heap_destroy (as->heap);
-        free (as->grid);
-        free (as);
+        if ((layout == ASTAR_LAYOUT_TILED) == as->tiled) return;
+
+        // The grid has to be reallocated, and its contents are lost.
+        astar_alt_free (as);
+        astar_clearance_free (as);
+        astar_free_grid (as);
+        as->tiled = layout == ASTAR_LAYOUT_TILED;
+        astar_alloc_grid (as);
+        astar_update_dirs (as);
 }
 
 
 void
-astar_init_grid (astar_t * as,
-                 uint32_t origin_x, uint32_t origin_y,
-                 uint8_t(*get)(const uint32_t, const uint32_t))
+astar_set_alloc_policy (astar_t * as, const uint32_t policy)
 {
         assert (as != NULL);
-        assert (as->grid != NULL);
-        assert (as->w > 0);
-        assert (as->h > 0);
-
-        astar_set_origin (as, origin_x, origin_y);
-        as->get = get;
 
-        register uint32_t x, y;
-        register square_t * square = as->grid;
-        
-        for (y = 0; y < as->h; y++) {
-                for (x = 0; x < as->w; x++) {
-                        __get_square(as, square, x, y);
-                        assert (square->init);
-#ifdef ASTAR_DEBUG
-                        square->ofs = mkofs (as, x, y);
-#endif // ASTAR_DEBUG
-                        square++;
-                }
-        }
-        as->gets += as->w * as->h;
-        as->grid_init = 1;
-        as->grid_clean = 1;
+        // The grid has to be reallocated, and its contents are lost. Its
+        // layout doesn't change, so landmark tables remain valid.
+        astar_free_grid (as);
+        as->alloc_policy = policy;
+        astar_alloc_grid (as);
 }
 
 
-///////////////////////////////////////////////////////////////////////////////
-//
-// MAIN CODE
+void
+astar_set_dxy (astar_t *as, const uint8_t dir, const int dx, const int dy)
+{
+        assert (as != NULL);
+        as->dx[dir & 7] = dx;
+        as->dy[dir & 7] = dy;
+        astar_update_dirs (as);
+        astar_cc_free (as);
+}
+
+
+void
+astar_set_cost (astar_t *as, const uint8_t dir, const uint32_t cost)
+{
+        assert (as != NULL);
+        as->mc[dir & 7] = cost;
+}
+
+
+void
+astar_set_steering_penalty (astar_t *as, const uint32_t steering_penalty)
+{
+        assert (as != NULL);
+        as->steering_penalty = steering_penalty;
+}
+
+
+void
+astar_set_heuristic_factor (astar_t *as, const uint32_t heuristic_factor)
+{
+        assert (as != NULL);
+        as->heuristic_factor = heuristic_factor;
+}
+
+
+void
+astar_set_epsilon (astar_t *as, const uint32_t epsilon)
+{
+        assert (as != NULL);
+        as->epsilon = epsilon;
+}
+
+
+void
+astar_set_tie_break (astar_t *as, const uint32_t policy)
+{
+        assert (as != NULL);
+        as->tie_break = policy;
+}
+
+
+void
+astar_set_agent_size (astar_t *as, const uint32_t size)
+{
+        assert (as != NULL);
+        assert ((size > 0) && (size < 256));
+        as->agent_size = size;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// PUBLIC USE FUNCTIONS
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+void
+astar_reset (astar_t * as)
+{
+        assert (as != NULL);
+
+        __debug ("Resetting A* structure for another run.\n");
+
+        // Initialise internal/statistics fields.
+        as->steps = 0;
+        as->score = 0;
+	set_result (as, ASTAR_NOTHING);
+        as->usecs = 0;
+        as->gets = 0;
+        as->pruned = 0;
+        as->stale_pops = 0;
+        as->reopens = 0;
+        as->los_checks = 0;
+        as->bestofs = 0;
+        as->bestx = 0;
+        as->besty = 0;
+        as->have_best = 0;
+        as->have_route = 0;
+
+        // Reset the heap.
+        astar_heap_clear (as->heap);
+
+        // Reset the grid.
+        astar_reset_grid (as);
+}
+
+
+void
+astar_destroy (astar_t * as)
+{
+        assert (as != NULL);
+        astar_alt_free (as);
+        astar_cc_free (as);
+        astar_clearance_free (as);
+        astar_heap_destroy (as->heap);
+        free (as->ov_ofs);
+        free (as->ov_cost);
+        astar_free_grid (as);
+        free (as->ara_closed);
+        free (as->ara_incons);
+        free (as);
+}
+
+
+void
+astar_init_grid (astar_t * as,
+                 uint32_t origin_x, uint32_t origin_y,
+                 uint8_t(*get)(const uint32_t, const uint32_t))
+{
+        assert (as != NULL);
+        assert (as->grid != NULL);
+        assert (as->w > 0);
+        assert (as->h > 0);
+
+        astar_set_origin (as, origin_x, origin_y);
+        as->get = get;
+
+        register uint32_t x, y, z;
+        register square_t * square;
+        
+        // On layered grids, get_layer() fetches the squares of every layer.
+        for (z = 0; z < as->layers; z++) {
+                for (y = 0; y < as->h; y++) {
+                        for (x = 0; x < as->w; x++) {
+                                square = &as->grid[mkofs3 (as, x, y, z)];
+                                __get_square(as, square, x, y);
+                                assert (square->init);
+#ifdef ASTAR_DEBUG
+                                square->ofs = mkofs3 (as, x, y, z);
+#endif // ASTAR_DEBUG
+                        }
+                }
+        }
+        as->gets += as->w * as->h * as->layers;
+        as->grid_init = 1;
+        as->grid_clean = 1;
+        as->grid_full = 1;
+}
+
+
+void
+astar_shift_origin (astar_t * as, const int32_t dx, const int32_t dy)
+{
+        assert (as != NULL);
+        assert (as->grid != NULL);
+        assert (as->origin_set);
+
+        // Squares of partially fetched grids are fetched again by every
+        // search anyway, and there's nothing to keep if we moved too far.
+        if (!as->grid_full) {
+                astar_set_origin (as, as->origin_x + dx, as->origin_y + dy);
+                return;
+        }
+        if (((uint32_t) abs (dx) >= as->w) || ((uint32_t) abs (dy) >= as->h)) {
+                astar_init_grid (as, as->origin_x + dx, as->origin_y + dy, as->get);
+                return;
+        }
+        astar_set_origin (as, as->origin_x + dx, as->origin_y + dy);
+
+        // Square (x,y) of the new window was square (x+dx,y+dy) of the old
+        // one. Walk the grid away from the squares we copy from, like
+        // memmove(), so they're not overwritten before they're copied. Only
+        // the newly exposed squares are fetched.
+        uint32_t i, j, z;
+        for (z = 0; z < as->layers; z++) {
+                for (j = 0; j < as->h; j++) {
+                        uint32_t y = dy >= 0 ? j : as->h - 1 - j;
+                        uint32_t sy = y + dy;
+                        for (i = 0; i < as->w; i++) {
+                                uint32_t x = dx >= 0 ? i : as->w - 1 - i;
+                                uint32_t sx = x + dx;
+                                square_t * square = &as->grid[mkofs3 (as, x, y, z)];
+                                if ((sx < as->w) && (sy < as->h)) {
+                                        square_t * src = &as->grid[mkofs3 (as, sx, sy, z)];
+                                        square->cost = src->cost;
+                                        square->up = src->up;
+                                        square->down = src->down;
+                                } else {
+                                        __get_square (as, square, x, y);
+                                        as->gets++;
+                                }
+                        }
+                }
+        }
+
+        // The squares still hold the state of the last search.
+        as->grid_clean = 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// LANDMARK PREPROCESSING
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+// One landmark table building job. Threads build every step-th landmark,
+// starting with the first-th.
+typedef struct {
+        astar_t *       as;
+        const uint8_t * cost;   // Cost plane of the whole grid.
+        astar_alt_t *   alt;
+        uint32_t *      dist;   // Wide distance tables (num per square).
+        uint32_t        first;
+        uint32_t        step;
+} _alt_job_t;
+
+
+/*
+ * A pseudo-angle in [0,4) for the vector (dx,dy), monotonic with the true
+ * angle. Cheaper than atan2() and good enough to divide the grid in sectors.
+ */
+
+static double
+_alt_pseudo_angle (const int32_t dx, const int32_t dy)
+{
+        if (dy >= 0) {
+                return dx >= 0 ? (double) dy / (dx + dy) : 1 - (double) dx / (-dx + dy);
+        } else {
+                return dx < 0 ? 2 - (double) dy / (-dx - dy) : 3 + (double) dx / (dx - dy);
+        }
+}
+
+
+static uint32_t
+astar_alt_select (astar_t * as, const uint8_t * cost, const uint32_t num,
+                  uint32_t * lx, uint32_t * ly)
+{
+        // Planar landmark selection: divide the grid into num sectors around
+        // its centre, and pick the passable square furthest from the centre in
+        // each one. Landmarks near the edges give the best bounds.
+
+        uint32_t * best = (uint32_t *) calloc (num, sizeof (uint32_t));
+        check_null (best, "astar_alt_select(), allocating memory");
+
+        int32_t cx = (as->w - 1) / 2, cy = (as->h - 1) / 2;
+        uint32_t x, y, i, found = 0;
+
+        for (i = 0; i < num; i++) lx[i] = ALT_INF32;
+        
+        for (y = 0; y < as->h; y++) {
+                for (x = 0; x < as->w; x++) {
+                        int32_t dx = (int32_t) x - cx, dy = (int32_t) y - cy;
+                        if ((dx == 0) && (dy == 0)) continue;
+                        if (cost[altofs (as, x, y)] == COST_BLOCKED) continue;
+
+                        uint32_t sector = _alt_pseudo_angle (dx, dy) * num / 4;
+                        uint32_t d = dx * dx + dy * dy;
+                        if (sector >= num) sector = num - 1;
+                        if (d <= best[sector]) continue;
+                        best[sector] = d;
+                        lx[sector] = x;
+                        ly[sector] = y;
+                }
+        }
+
+        // Drop empty sectors.
+        for (i = 0; i < num; i++) {
+                if (lx[i] == ALT_INF32) continue;
+                lx[found] = lx[i];
+                ly[found] = ly[i];
+                found++;
+        }
+
+        free (best);
+        return found;
+}
+
+
+static void
+astar_alt_dijkstra (_alt_job_t * job, square_t * squares, asheap_t * heap,
+                    const uint32_t landmark)
+{
+        astar_t * as = job->as;
+        uint32_t area = as->w * as->h, i;
+        int dir;
+
+        // The squares hold tentative distances in g.
+        for (i = 0; i < area; i++) {
+                squares[i].g = ALT_INF32;
+                squares[i].closed = 0;
+        }
+
+        uint32_t ofs = altofs (as, job->alt->x[landmark], job->alt->y[landmark]);
+        squares[ofs].g = 0;
+        astar_heap_clear (heap);
+        astar_heap_add (heap, 0, ofs);
+
+        // Stale heap entries are left in place and skipped when they're popped.
+        while (!astar_heap_is_empty (heap)) {
+                uint32_t g = astar_heap_pop (heap, &ofs);
+                square_t * s = &squares[ofs];
+                if (s->closed) continue;
+                s->closed = 1;
+
+                uint32_t x = ofs % as->w;
+                uint32_t y = ofs / as->w;
+
+                for (dir = 0; dir < NUM_DIRS; dir++) {
+                        if ((as->move_8way == 0) && (dir & 1)) continue;
+
+                        uint32_t adj_x = x + as->dx[dir];
+                        uint32_t adj_y = y + as->dy[dir];
+                        if (!_astar_wrap (as, &adj_x, &adj_y)) continue;
+
+                        uint32_t adj_ofs = altofs (as, adj_x, adj_y);
+                        if (job->cost[adj_ofs] == COST_BLOCKED) continue;
+
+                        square_t * adj = &squares[adj_ofs];
+                        if (adj->closed) continue;
+
+                        // Moves cost what _astar_eval_g() charges for them.
+                        uint32_t adj_g = g + as->mc[REVERSE_DIR (dir)] + job->cost[adj_ofs];
+                        if (adj_g < adj->g) {
+                                adj->g = adj_g;
+                                astar_heap_add (heap, adj_g, adj_ofs);
+                        }
+                }
+        }
+
+        // Scatter the distances to the interleaved tables.
+        uint32_t x, y;
+        for (y = 0; y < as->h; y++) {
+                for (x = 0; x < as->w; x++) {
+                        job->dist[mkofs (as, x, y) * job->alt->num + landmark] =
+                                squares[altofs (as, x, y)].g;
+                }
+        }
+}
+
+
+static void *
+astar_alt_worker (void * arg)
+{
+        _alt_job_t * job = (_alt_job_t *) arg;
+        uint32_t area = job->as->w * job->as->h, i;
+
+        // Every worker needs its own scratch grid and heap.
+        square_t * squares = (square_t *) calloc (area, sizeof (square_t));
+        check_null (squares, "astar_alt_worker(), allocating grid");
+        asheap_t * heap = astar_heap_new (_HEAP_INITIAL, 0);
+
+        for (i = job->first; i < job->alt->num; i += job->step) {
+                astar_alt_dijkstra (job, squares, heap, i);
+        }
+
+        astar_heap_destroy (heap);
+        free (squares);
+        return NULL;
+}
+
+
+uint32_t
+astar_alt_build (astar_t * as, const uint32_t num_landmarks,
+                 const uint32_t num_threads)
+{
+        assert (as != NULL);
+        assert (as->grid != NULL);
+        assert (num_landmarks > 0);
+
+        astar_alt_free (as);
+
+        // Landmarks only work on a single layer.
+        if (as->layers > 1) return 0;
+
+        // Obtain the cost plane.
+        uint32_t area = as->w * as->h, i;
+        uint8_t * cost = (uint8_t *) malloc (area);
+        check_null (cost, "astar_alt_build(), allocating cost plane");
+
+        if (!as->grid_full && ((as->get == NULL) || !as->origin_set)) {
+                free (cost);
+                return 0;
+        }
+
+        uint32_t x, y;
+        for (y = 0; y < as->h; y++) {
+                for (x = 0; x < as->w; x++) {
+                        cost[altofs (as, x, y)] = as->grid_full ?
+                                as->grid[mkofs (as, x, y)].cost :
+                                (*as->get)(as->origin_x + x, as->origin_y + y);
+                }
+        }
+
+        // Place the landmarks.
+        astar_alt_t * alt = (astar_alt_t *) calloc (1, sizeof (astar_alt_t));
+        check_null (alt, "astar_alt_build(), allocating memory");
+        alt->w = as->w;
+        alt->h = as->h;
+        alt->x = (uint32_t *) malloc (num_landmarks * sizeof (uint32_t));
+        alt->y = (uint32_t *) malloc (num_landmarks * sizeof (uint32_t));
+        check_null (alt->x, "astar_alt_build(), allocating landmarks");
+        check_null (alt->y, "astar_alt_build(), allocating landmarks");
+        alt->num = astar_alt_select (as, cost, num_landmarks, alt->x, alt->y);
+        alt->symmetric = 1;
+        for (i = 0; i < NUM_DIRS / 2; i++) {
+                if (as->mc[i] != as->mc[i + 4]) alt->symmetric = 0;
+        }
+
+        if (alt->num == 0) {
+                free (alt->x);
+                free (alt->y);
+                free (alt);
+                free (cost);
+                return 0;
+        }
+
+        // Build the tables wide, then compact them if possible. Squares
+        // outside the w x h area (e.g. the border) are unreachable.
+        uint32_t n = as->grid_area * alt->num;
+        alt->dist32 = (uint32_t *) malloc (sizeof (uint32_t) * n);
+        check_null (alt->dist32, "astar_alt_build(), allocating tables");
+        memset (alt->dist32, 0xff, sizeof (uint32_t) * n);
+
+        uint32_t nt = num_threads > alt->num ? alt->num : num_threads;
+        if (nt < 1) nt = 1;
+        _alt_job_t * jobs = (_alt_job_t *) malloc (nt * sizeof (_alt_job_t));
+        check_null (jobs, "astar_alt_build(), allocating jobs");
+        for (i = 0; i < nt; i++) {
+                jobs[i].as = as;
+                jobs[i].cost = cost;
+                jobs[i].alt = alt;
+                jobs[i].dist = alt->dist32;
+                jobs[i].first = i;
+                jobs[i].step = nt;
+        }
+
+#ifdef ASTAR_THREADS
+        if (nt > 1) {
+                pthread_t * threads = (pthread_t *) malloc (nt * sizeof (pthread_t));
+                check_null (threads, "astar_alt_build(), allocating threads");
+                for (i = 0; i < nt; i++) {
+                        if (pthread_create (&threads[i], NULL, astar_alt_worker, &jobs[i])) {
+                                perror ("astar_alt_build(), starting thread");
+                                exit (EXIT_FAILURE);
+                        }
+                }
+                for (i = 0; i < nt; i++) pthread_join (threads[i], NULL);
+                free (threads);
+        } else
+#endif // ASTAR_THREADS
+        {
+                // Single-threaded build (or no thread support).
+                jobs[0].step = 1;
+                astar_alt_worker (&jobs[0]);
+        }
+
+        free (jobs);
+        free (cost);
+
+        uint32_t max = 0;
+        for (i = 0; i < n; i++) {
+                if ((alt->dist32[i] != ALT_INF32) && (alt->dist32[i] > max)) {
+                        max = alt->dist32[i];
+                }
+        }
+
+        if (max < ALT_INF16) {
+                alt->dist16 = (uint16_t *) malloc (sizeof (uint16_t) * n);
+                check_null (alt->dist16, "astar_alt_build(), compacting tables");
+                for (i = 0; i < n; i++) {
+                        alt->dist16[i] = alt->dist32[i] == ALT_INF32 ? ALT_INF16 : alt->dist32[i];
+                }
+                free (alt->dist32);
+                alt->dist32 = NULL;
+                alt->wide = 0;
+        } else {
+                alt->wide = 1;
+        }
+
+        __debug ("Built %u landmark tables, %u bytes each per square.\n",
+                 alt->num, alt->wide ? 4 : 2);
+
+        as->alt = alt;
+        return alt->num;
+}
+
+
+void
+astar_alt_free (astar_t * as)
+{
+        assert (as != NULL);
+        if (as->alt == NULL) return;
+        free (as->alt->x);
+        free (as->alt->y);
+        free (as->alt->dist16);
+        free (as->alt->dist32);
+        free (as->alt);
+        as->alt = NULL;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CONNECTED COMPONENTS
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Not labelled yet (during astar_cc_build() only).
+#define CC_UNSEEN 0xffffffff
+
+#define ccofs(cc, x, y) ((y) * (cc)->w + (x))
+
+
+static uint32_t
+astar_cc_new_label (astar_cc_t * cc)
+{
+        // Components never outnumber the squares, so labels 1 to w*h are
+        // enough for all of them.
+        uint32_t label = cc->num_spare ? cc->spare[--cc->num_spare] : cc->next++;
+        assert (label <= cc->w * cc->h);
+        cc->size[label] = 0;
+        cc->num++;
+        return label;
+}
+
+
+static void
+astar_cc_retire (astar_cc_t * cc, const uint32_t label)
+{
+        cc->size[label] = 0;
+        cc->spare[cc->num_spare++] = label;
+        cc->num--;
+}
+
+
+// The square next to (x,y) in direction dir, as a label offset, or -1 if
+// it's off the grid.
+static inline uint32_t
+astar_cc_step (astar_t * as, const uint32_t x, const uint32_t y, const int dir)
+{
+        uint32_t adj_x = x + as->dx[dir], adj_y = y + as->dy[dir];
+        if (!_astar_wrap (as, &adj_x, &adj_y)) return (uint32_t) -1;
+        return ccofs (as->cc, adj_x, adj_y);
+}
+
+
+static uint32_t
+astar_cc_flood (astar_t * as, const uint32_t start, const uint32_t from, const uint32_t to)
+{
+        // Relabel the squares labelled 'from' that can be reached from
+        // start. Squares are relabelled as they're pushed, so each one is
+        // pushed once and the stack never overflows. Returns the number of
+        // squares relabelled.
+        astar_cc_t * cc = as->cc;
+        uint32_t sp = 0, count = 0, i;
+
+        assert (cc->label[start] == from);
+        cc->label[start] = to;
+        cc->stack[sp++] = start;
+        while (sp) {
+                uint32_t ofs = cc->stack[--sp];
+                uint32_t x = ofs % cc->w, y = ofs / cc->w;
+                count++;
+                for (i = 0; i < as->num_dirs; i++) {
+                        uint32_t adj = astar_cc_step (as, x, y, as->dirs[i]);
+                        if ((adj == (uint32_t) -1) || (cc->label[adj] != from)) continue;
+                        cc->label[adj] = to;
+                        cc->stack[sp++] = adj;
+                }
+        }
+        return count;
+}
+
+
+uint32_t
+astar_cc_build (astar_t * as)
+{
+        assert (as != NULL);
+        assert (as->grid != NULL);
+
+        astar_cc_free (as);
+
+        // Labels only cover a single layer.
+        if (as->layers > 1) return 0;
+        if (!as->grid_full && ((as->get == NULL) || !as->origin_set)) return 0;
+
+        uint32_t area = as->w * as->h, x, y;
+        astar_cc_t * cc = (astar_cc_t *) calloc (1, sizeof (astar_cc_t));
+        check_null (cc, "astar_cc_build(), allocating memory");
+        cc->w = as->w;
+        cc->h = as->h;
+        cc->label = (uint32_t *) malloc (area * sizeof (uint32_t));
+        cc->size = (uint32_t *) malloc ((area + 1) * sizeof (uint32_t));
+        cc->spare = (uint32_t *) malloc ((area + 1) * sizeof (uint32_t));
+        cc->stack = (uint32_t *) malloc (area * sizeof (uint32_t));
+        check_null (cc->label, "astar_cc_build(), allocating labels");
+        check_null (cc->size, "astar_cc_build(), allocating labels");
+        check_null (cc->spare, "astar_cc_build(), allocating labels");
+        check_null (cc->stack, "astar_cc_build(), allocating labels");
+        cc->next = 1;
+        as->cc = cc;
+
+        // Obtain the cost plane: all that matters is which squares are
+        // blocked.
+        for (y = 0; y < as->h; y++) {
+                for (x = 0; x < as->w; x++) {
+                        uint8_t cost = as->grid_full ?
+                                as->grid[mkofs (as, x, y)].cost :
+                                (*as->get)(as->origin_x + x, as->origin_y + y);
+                        cc->label[ccofs (cc, x, y)] = cost == COST_BLOCKED ? 0 : CC_UNSEEN;
+                }
+        }
+
+        // Flood every component in turn.
+        uint32_t i;
+        for (i = 0; i < area; i++) {
+                if (cc->label[i] != CC_UNSEEN) continue;
+                uint32_t label = astar_cc_new_label (cc);
+                cc->size[label] = astar_cc_flood (as, i, CC_UNSEEN, label);
+        }
+
+        __debug ("Labelled %u connected components.\n", cc->num);
+        return cc->num;
+}
+
+
+void
+astar_cc_free (astar_t * as)
+{
+        assert (as != NULL);
+        if (as->cc == NULL) return;
+        free (as->cc->label);
+        free (as->cc->size);
+        free (as->cc->spare);
+        free (as->cc->stack);
+        free (as->cc);
+        as->cc = NULL;
+}
+
+
+static int
+astar_cc_still_connected (astar_t * as, const uint32_t x, const uint32_t y)
+{
+        // Blocking (x,y) can't split its component if its open neighbours
+        // are connected to each other by the ring of eight squares around
+        // it. Only works with the standard moves, on grids large enough
+        // that the ring doesn't overlap itself.
+        astar_cc_t * cc = as->cc;
+        if ((cc->w < 3) || (cc->h < 3)) return 0;
+        if (memcmp (as->dx, _dx, sizeof (_dx)) || memcmp (as->dy, _dy, sizeof (_dy))) return 0;
+
+        // Neighbouring squares of the ring can reach each other. So can
+        // cardinal squares two apart, through the corner, with 8-way moves.
+        uint32_t cls[NUM_DIRS], open[NUM_DIRS], i, changed;
+        for (i = 0; i < NUM_DIRS; i++) {
+                uint32_t adj = astar_cc_step (as, x, y, i);
+                open[i] = (adj != (uint32_t) -1) && (cc->label[adj] != 0);
+                cls[i] = i;
+        }
+        do {
+                changed = 0;
+                for (i = 0; i < NUM_DIRS; i++) {
+                        uint32_t j, k;
+                        for (k = 1; k <= 2; k++) {
+                                j = (i + k) % NUM_DIRS;
+                                if ((k == 2) && (!as->move_8way || (i & 1))) continue;
+                                if (!open[i] || !open[j] || (cls[i] == cls[j])) continue;
+                                cls[i] = cls[j] = cls[i] < cls[j] ? cls[i] : cls[j];
+                                changed = 1;
+                        }
+                }
+        } while (changed);
+
+        // Are all the squares we can move to in the same class?
+        uint32_t first = NUM_DIRS;
+        for (i = 0; i < as->num_dirs; i++) {
+                int dir = as->dirs[i];
+                if (!open[dir]) continue;
+                if (first == NUM_DIRS) first = cls[dir];
+                else if (cls[dir] != first) return 0;
+        }
+        return 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLEARANCE
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+// The cost of a square on layer z: the cached one if the grid is full,
+// otherwise a fresh one.
+static uint8_t
+astar_fetch_cost (astar_t * as, const uint32_t x, const uint32_t y, const uint32_t z)
+{
+        if (as->grid_full) return as->grid[mkofs3 (as, x, y, z)].cost;
+
+        uint8_t portals = 0;
+        as->gets++;
+        return as->get_layer != NULL ?
+                (*as->get_layer)(as->origin_x + x, as->origin_y + y, z, &portals) :
+                (*as->get)(as->origin_x + x, as->origin_y + y);
+}
+
+
+// Is the square at ofs large enough for the agent?
+#define _astar_fits(as, ofs) \
+        (((as)->clearance == NULL) || ((as)->clearance[ofs] >= (as)->agent_size))
+
+
+// The clearance of an unblocked square: one more than the smallest
+// clearance of the squares right, below, and below right of it. The edges
+// of the grid are walls.
+static inline uint8_t
+astar_clearance_of (astar_t * as, const uint32_t x, const uint32_t y, const uint32_t z)
+{
+        if ((x + 1 >= as->w) || (y + 1 >= as->h)) return 1;
+
+        uint8_t * c = as->clearance;
+        uint8_t m = c[mkofs3 (as, x + 1, y, z)];
+        if (c[mkofs3 (as, x, y + 1, z)] < m) m = c[mkofs3 (as, x, y + 1, z)];
+        if (c[mkofs3 (as, x + 1, y + 1, z)] < m) m = c[mkofs3 (as, x + 1, y + 1, z)];
+        return m < 255 ? m + 1 : 255;
+}
+
+
+int
+astar_clearance_build (astar_t * as)
+{
+        assert (as != NULL);
+        assert (as->grid != NULL);
+
+        astar_clearance_free (as);
+
+        if (!as->grid_full && (((as->get == NULL) && (as->get_layer == NULL)) ||
+                               !as->origin_set)) return 0;
+
+        // Squares outside the w x h area (e.g. the border) have no
+        // clearance.
+        as->clearance = (uint8_t *) calloc (as->grid_area, 1);
+        check_null (as->clearance, "astar_clearance_build(), allocating memory");
+
+        // One pass from the bottom right corner: the squares each square
+        // depends on have been done by the time we reach it.
+        uint32_t x, y, z;
+        for (z = 0; z < as->layers; z++) {
+                for (y = as->h; y-- > 0;) {
+                        for (x = as->w; x-- > 0;) {
+                                as->clearance[mkofs3 (as, x, y, z)] =
+                                        astar_fetch_cost (as, x, y, z) == COST_BLOCKED ? 0 :
+                                        astar_clearance_of (as, x, y, z);
+                        }
+                }
+        }
+        return 1;
+}
+
+
+void
+astar_clearance_free (astar_t * as)
+{
+        assert (as != NULL);
+        free (as->clearance);
+        as->clearance = NULL;
+}
+
+
+static void
+astar_clearance_update (astar_t * as, const uint32_t x, const uint32_t y,
+                        const uint32_t z, const uint8_t cost)
+{
+        // Square (x,y) changed. Only squares above and left of it (and
+        // within 255 squares of it) depend on it. Blocked squares still have
+        // no clearance, so only unblocked ones need a look. Each row only
+        // depends on itself and the one below, so stop at the first row that
+        // didn't change.
+        uint8_t * c = as->clearance;
+        c[mkofs3 (as, x, y, z)] = cost == COST_BLOCKED ? 0 : astar_clearance_of (as, x, y, z);
+
+        uint32_t x0 = x >= 254 ? x - 254 : 0, y0 = y >= 254 ? y - 254 : 0;
+        uint32_t i, j = y;
+        do {
+                int changed = j == y;
+                for (i = j == y ? x : x + 1; i-- > x0;) {
+                        uint32_t ofs = mkofs3 (as, i, j, z);
+                        if (c[ofs] == 0) continue;
+                        uint8_t v = astar_clearance_of (as, i, j, z);
+                        if (v == c[ofs]) continue;
+                        c[ofs] = v;
+                        changed = 1;
+                }
+                if (!changed) break;
+        } while (j-- > y0);
+}
+
+
+void
+astar_cc_update (astar_t * as, const uint32_t x, const uint32_t y)
+{
+        assert (as != NULL);
+        assert (x < as->w);
+        assert (y < as->h);
+
+        // Fetch the square again.
+        uint32_t z, i;
+        if (as->grid_full) {
+                for (z = 0; z < as->layers; z++) {
+                        square_t * square = &as->grid[mkofs3 (as, x, y, z)];
+                        __get_square (as, square, x, y);
+                        as->gets++;
+                }
+                as->grid_clean = 0;
+        }
+
+        if (as->clearance != NULL) {
+                for (z = 0; z < as->layers; z++) {
+                        astar_clearance_update (as, x, y, z, astar_fetch_cost (as, x, y, z));
+                }
+        }
+
+        astar_cc_t * cc = as->cc;
+        if (cc == NULL) return;
+
+        uint8_t cost = astar_fetch_cost (as, x, y, 0);
+
+        uint32_t ofs = ccofs (cc, x, y), label = cc->label[ofs];
+        uint32_t adj[NUM_DIRS];
+        for (i = 0; i < as->num_dirs; i++) {
+                adj[i] = astar_cc_step (as, x, y, as->dirs[i]);
+        }
+
+        if ((cost != COST_BLOCKED) && (label == 0)) {
+
+                // Opened: join the largest component around the square, and
+                // relabel the others to match.
+                uint32_t best = 0;
+                for (i = 0; i < as->num_dirs; i++) {
+                        if (adj[i] == (uint32_t) -1) continue;
+                        uint32_t l = cc->label[adj[i]];
+                        if ((l != 0) && ((best == 0) || (cc->size[l] > cc->size[best]))) best = l;
+                }
+                if (best == 0) best = astar_cc_new_label (cc);
+                cc->label[ofs] = best;
+                cc->size[best]++;
+
+                for (i = 0; i < as->num_dirs; i++) {
+                        if (adj[i] == (uint32_t) -1) continue;
+                        uint32_t l = cc->label[adj[i]];
+                        if ((l == 0) || (l == best)) continue;
+                        cc->size[best] += astar_cc_flood (as, adj[i], l, best);
+                        astar_cc_retire (cc, l);
+                }
+
+        } else if ((cost == COST_BLOCKED) && (label != 0)) {
+
+                // Blocked: the component may have split.
+                cc->label[ofs] = 0;
+                if (--cc->size[label] == 0) {
+                        astar_cc_retire (cc, label);
+                        return;
+                }
+                if (astar_cc_still_connected (as, x, y)) return;
+
+                // Give every piece a new label.
+                for (i = 0; i < as->num_dirs; i++) {
+                        if ((adj[i] == (uint32_t) -1) || (cc->label[adj[i]] != label)) continue;
+                        uint32_t l = astar_cc_new_label (cc);
+                        cc->size[l] = astar_cc_flood (as, adj[i], label, l);
+                }
+                astar_cc_retire (cc, label);
+        }
+}
+
+
+int
+astar_cc_nearest (astar_t * as,
+                  const uint32_t x0, const uint32_t y0,
+                  const uint32_t x1, const uint32_t y1,
+                  uint32_t * x, uint32_t * y)
+{
+        assert (as != NULL);
+        assert (x != NULL);
+        assert (y != NULL);
+        assert ((x0 < as->w) && (y0 < as->h));
+        assert ((x1 < as->w) && (y1 < as->h));
+
+        astar_cc_t * cc = as->cc;
+        if ((cc == NULL) || (cc->label[ccofs (cc, x0, y0)] == 0)) return 0;
+        uint32_t label = cc->label[ccofs (cc, x0, y0)];
+
+        // Look at squares further and further away from the target, in
+        // square rings. Squares on ring r are at least r squares away, so
+        // stop when no ring can hold anything nearer than the best so far.
+        // The start is a match, so we'll always find one.
+        // On wrap-around maps, squares more than half way round are nearer
+        // the other way, and are looked at from that side.
+        uint32_t r, best = (uint32_t) -1, rmax = as->w > as->h ? as->w : as->h;
+        int32_t half_w = as->wrap & ASTAR_WRAP_X ? as->w / 2 : as->w;
+        int32_t half_h = as->wrap & ASTAR_WRAP_Y ? as->h / 2 : as->h;
+        for (r = 0; (r <= rmax) && (r <= best); r++) {
+                int32_t i, j;
+                for (j = -(int32_t) r; j <= (int32_t) r; j++) {
+                        if (abs (j) > half_h) continue;
+                        int32_t di = ((j == -(int32_t) r) || (j == (int32_t) r)) ? 1 : 2 * r;
+                        for (i = -(int32_t) r; i <= (int32_t) r; i += di) {
+                                if (abs (i) > half_w) continue;
+                                uint32_t sx = x1 + i, sy = y1 + j;
+                                if (!_astar_wrap (as, &sx, &sy)) continue;
+                                if (cc->label[ccofs (cc, sx, sy)] != label) continue;
+                                uint32_t d = abs (i) + abs (j);
+                                if (d < best) {
+                                        best = d;
+                                        *x = sx;
+                                        *y = sy;
+                                }
+                        }
+                }
+        }
+        assert (best != (uint32_t) -1);
+        return 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// COST OVERLAYS
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Initial size of overlay tables (a power of two).
+#define OVERLAY_INITIAL 64
+
+// An empty slot of the merged table.
+#define OVERLAY_EMPTY 0xffffffff
+
+
+static inline uint32_t
+astar_overlay_hash (const uint32_t x, const uint32_t y, const uint32_t z)
+{
+        uint32_t h = (x * 0x9e3779b1u) ^ (y * 0x85ebca77u) ^ (z * 0xc2b2ae3du);
+        return h ^ (h >> 15);
+}
+
+
+// Costs add up, but blocked squares stay blocked.
+static inline uint32_t
+astar_overlay_sum (const uint32_t a, const uint32_t b)
+{
+        if ((a == COST_BLOCKED) || (b == COST_BLOCKED)) return COST_BLOCKED;
+        return a + b < COST_BLOCKED ? a + b : COST_BLOCKED - 1;
+}
+
+
+astar_overlay_t *
+astar_overlay_new (void)
+{
+        astar_overlay_t * ov = (astar_overlay_t *) calloc (1, sizeof (astar_overlay_t));
+        check_null (ov, "astar_overlay_new(), allocating memory");
+        ov->squares = (astar_overlay_square_t *) calloc (OVERLAY_INITIAL,
+                                                         sizeof (astar_overlay_square_t));
+        check_null (ov->squares, "astar_overlay_new(), allocating memory");
+        ov->mask = OVERLAY_INITIAL - 1;
+        return ov;
+}
+
+
+void
+astar_overlay_destroy (astar_overlay_t * ov)
+{
+        assert (ov != NULL);
+        free (ov->squares);
+        free (ov);
+}
+
+
+void
+astar_overlay_clear (astar_overlay_t * ov)
+{
+        assert (ov != NULL);
+        memset (ov->squares, 0, (ov->mask + 1) * sizeof (astar_overlay_square_t));
+        ov->num = 0;
+}
+
+
+static astar_overlay_square_t *
+astar_overlay_find (astar_overlay_t * ov, const uint32_t x, const uint32_t y, const uint32_t z)
+{
+        // Linear probing. Empty slots have no cost.
+        uint32_t i = astar_overlay_hash (x, y, z) & ov->mask;
+        for (;; i = (i + 1) & ov->mask) {
+                astar_overlay_square_t * sq = &ov->squares[i];
+                if ((sq->cost == 0) || ((sq->x == x) && (sq->y == y) && (sq->z == z))) return sq;
+        }
+}
+
+
+void
+astar_overlay_add (astar_overlay_t * ov,
+                   const uint32_t x, const uint32_t y, const uint32_t z,
+                   const uint32_t cost)
+{
+        assert (ov != NULL);
+        if (cost == 0) return;
+
+        // Keep the table at most half full.
+        if (2 * (ov->num + 1) > ov->mask + 1) {
+                astar_overlay_square_t * old = ov->squares;
+                uint32_t i, size = ov->mask + 1;
+                ov->squares = (astar_overlay_square_t *) calloc (2 * size,
+                                                                 sizeof (astar_overlay_square_t));
+                check_null (ov->squares, "astar_overlay_add(), growing overlay");
+                ov->mask = 2 * size - 1;
+                for (i = 0; i < size; i++) {
+                        if (old[i].cost == 0) continue;
+                        *astar_overlay_find (ov, old[i].x, old[i].y, old[i].z) = old[i];
+                }
+                free (old);
+        }
+
+        astar_overlay_square_t * sq = astar_overlay_find (ov, x, y, z);
+        if (sq->cost == 0) {
+                sq->x = x;
+                sq->y = y;
+                sq->z = z;
+                ov->num++;
+        }
+        sq->cost = astar_overlay_sum (sq->cost, cost == COST_BLOCKED ? cost :
+                                      (cost < COST_BLOCKED ? cost : COST_BLOCKED - 1));
+}
+
+
+void
+astar_add_overlay (astar_t * as, astar_overlay_t * ov)
+{
+        assert (as != NULL);
+        assert (ov != NULL);
+        assert (as->num_overlays < ASTAR_MAX_OVERLAYS);
+        as->overlays[as->num_overlays++] = ov;
+}
+
+
+static void
+astar_merge_overlays (astar_t * as)
+{
+        // Merge the overlays added for this search into one table keyed by
+        // grid offset, so the search never has to work out the map
+        // co-ordinates of a square to look it up.
+        uint32_t total = 0, i, j;
+        as->ov_num = 0;
+        if (as->num_overlays == 0) return;
+        for (i = 0; i < as->num_overlays; i++) total += as->overlays[i]->num;
+
+        uint32_t size = OVERLAY_INITIAL;
+        while (size < 2 * total) size *= 2;
+        if ((as->ov_ofs == NULL) || (size > as->ov_mask + 1)) {
+                free (as->ov_ofs);
+                free (as->ov_cost);
+                as->ov_ofs = (uint32_t *) malloc (size * sizeof (uint32_t));
+                as->ov_cost = (uint32_t *) malloc (size * sizeof (uint32_t));
+                check_null (as->ov_ofs, "astar_merge_overlays(), allocating memory");
+                check_null (as->ov_cost, "astar_merge_overlays(), allocating memory");
+                as->ov_mask = size - 1;
+        }
+        memset (as->ov_ofs, 0xff, (as->ov_mask + 1) * sizeof (uint32_t));
+
+        for (i = 0; i < as->num_overlays; i++) {
+                const astar_overlay_t * ov = as->overlays[i];
+                for (j = 0; j <= ov->mask; j++) {
+                        const astar_overlay_square_t * sq = &ov->squares[j];
+                        if (sq->cost == 0) continue;
+
+                        // Squares left of or above the origin wrap around
+                        // to large values, and are ignored too.
+                        uint32_t x = sq->x - as->origin_x, y = sq->y - as->origin_y;
+                        if ((x >= as->w) || (y >= as->h) || (sq->z >= as->layers)) continue;
+
+                        uint32_t ofs = mkofs3 (as, x, y, sq->z);
+                        uint32_t k = astar_overlay_hash (ofs, 0, 0) & as->ov_mask;
+                        while ((as->ov_ofs[k] != OVERLAY_EMPTY) && (as->ov_ofs[k] != ofs))
+                                k = (k + 1) & as->ov_mask;
+                        if (as->ov_ofs[k] == OVERLAY_EMPTY) {
+                                as->ov_ofs[k] = ofs;
+                                as->ov_cost[k] = 0;
+                                as->ov_num++;
+                        }
+                        as->ov_cost[k] = astar_overlay_sum (as->ov_cost[k], sq->cost);
+                }
+        }
+        as->num_overlays = 0;
+}
+
+
+// The extra cost of the square at ofs in the current search.
+static inline uint32_t
+_astar_overlay_cost (const astar_t * as, const uint32_t ofs)
+{
+        if (as->ov_num == 0) return 0;
+
+        uint32_t k = astar_overlay_hash (ofs, 0, 0) & as->ov_mask;
+        for (;; k = (k + 1) & as->ov_mask) {
+                if (as->ov_ofs[k] == ofs) return as->ov_cost[k];
+                if (as->ov_ofs[k] == OVERLAY_EMPTY) return 0;
+        }
+}
+
+
+// Can the agent enter the square at ofs (leaving its cost aside)?
+#define _astar_usable(as, ofs) \
+        (_astar_fits ((as), (ofs)) && (_astar_overlay_cost ((as), (ofs)) != COST_BLOCKED))
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// LINES OF SIGHT
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+// The direction that moves by (dx,dy) in the current movement mode, or -1.
+static int
+_astar_dir_of (const astar_t * as, const int32_t dx, const int32_t dy)
+{
+        int i;
+        for (i = 0; i < as->num_dirs; i++) {
+                int dir = as->dirs[i];
+                if ((as->dx[dir] == dx) && (as->dy[dir] == dy)) return dir;
+        }
+        return -1;
+}
+
+
+static inline int
+_astar_passable (astar_t * as, const uint32_t x, const uint32_t y, const uint32_t z)
+{
+        uint32_t ofs = mkofs3 (as, x, y, z);
+        return _astar_usable (as, ofs) && (get_square (as, ofs, x, y)->cost != COST_BLOCKED);
+}
+
+
+// Line of sight: walk the supercover of the line between the centres of two
+// squares on layer z, i.e. every square the line touches. Where the line passes
+// exactly through a corner, it may squeeze between the squares beside it if
+// the search can (in the 8-way mode). Otherwise, both must be passable. If
+// terrain isn't NULL, it's set to the mean cost of the squares the line
+// enters, times the number of moves it would take to follow it.
+static int
+astar_line_of_sight (astar_t * as,
+                     uint32_t x, uint32_t y,
+                     const uint32_t x1, const uint32_t y1, const uint32_t z,
+                     uint32_t * terrain)
+{
+        int32_t dx = abs ((int32_t) x1 - (int32_t) x);
+        int32_t dy = abs ((int32_t) y1 - (int32_t) y);
+        int32_t sx = x1 > x ? 1 : -1;
+        int32_t sy = y1 > y ? 1 : -1;
+        int32_t error = dx - dy;
+        int32_t n = dx + dy;
+        uint32_t moves = as->move_8way ? (dx > dy ? dx : dy) : dx + dy;
+        uint32_t sum = 0, entered = 0;
+
+        for (dx *= 2, dy *= 2; n > 0; n--) {
+                if (error > 0) {
+                        x += sx;
+                        error -= dy;
+                } else if (error < 0) {
+                        y += sy;
+                        error += dx;
+                } else {
+                        if (!as->move_8way && (!_astar_passable (as, x + sx, y, z) ||
+                                               !_astar_passable (as, x, y + sy, z))) return 0;
+                        x += sx;
+                        y += sy;
+                        error += dx - dy;
+                        n--;
+                }
+                uint32_t ofs = mkofs3 (as, x, y, z);
+                uint32_t cost = get_square (as, ofs, x, y)->cost;
+                uint32_t extra = _astar_overlay_cost (as, ofs);
+                if ((cost == COST_BLOCKED) || (extra == COST_BLOCKED) || !_astar_fits (as, ofs))
+                        return 0;
+                sum += cost + extra;
+                entered++;
+        }
+        if (terrain != NULL) *terrain = entered ? sum * moves / entered : 0;
+        return 1;
+}
+
+
+// The cost of following the line between two squares with the moves of
+// the current movement mode (Bresenham's algorithm in the 8-way mode) on
+// layer z,
+// without the steering penalty. Returns 0xffffffff if it can't be done. If
+// mark is set, the moves are also marked on the grid as part of the route.
+static uint32_t
+astar_line_walk (astar_t * as,
+                 uint32_t x, uint32_t y,
+                 const uint32_t x1, const uint32_t y1, const uint32_t z,
+                 const int mark)
+{
+        square_t * from = &as->grid[mkofs3 (as, x, y, z)];
+        int32_t dx = abs ((int32_t) x1 - (int32_t) x);
+        int32_t dy = abs ((int32_t) y1 - (int32_t) y);
+        int32_t sx = x1 > x ? 1 : -1;
+        int32_t sy = y1 > y ? 1 : -1;
+        int dir_x = _astar_dir_of (as, sx, 0);
+        int dir_y = _astar_dir_of (as, 0, sy);
+        int dir_xy = _astar_dir_of (as, sx, sy);
+        int32_t error = dx - dy;
+        uint32_t cost = 0;
+
+        if ((dir_x < 0) || (dir_y < 0)) return 0xffffffff;
+        while ((x != x1) || (y != y1)) {
+                int dir = -1;
+                int32_t e2 = 2 * error;
+                if (dir_xy >= 0) {
+                        // Bresenham: step along the major axis, and
+                        // diagonally when we've drifted half a square.
+                        if (e2 > -dy) {
+                                error -= dy;
+                                x += sx;
+                                dir = dir_x;
+                        }
+                        if (e2 < dx) {
+                                error += dx;
+                                y += sy;
+                                dir = dir < 0 ? dir_y : dir_xy;
+                        }
+                } else if (((e2 > 0) && (x != x1)) || (y == y1)) {
+                        // Cardinal moves only: step along whichever axis
+                        // we're further behind on.
+                        error -= 2 * dy;
+                        x += sx;
+                        dir = dir_x;
+                } else {
+                        error += 2 * dx;
+                        y += sy;
+                        dir = dir_y;
+                }
+                uint32_t ofs = mkofs3 (as, x, y, z);
+                square_t * s = get_square (as, ofs, x, y);
+                uint32_t extra = _astar_overlay_cost (as, ofs);
+                if ((s->cost == COST_BLOCKED) || (extra == COST_BLOCKED) || !_astar_fits (as, ofs))
+                        return 0xffffffff;
+                cost += as->mc[dir] + s->cost + extra;
+                if (mark) {
+                        from->rdir = dir;
+                        s->route = 1;
+                        as->steps++;
+                }
+                from = s;
+        }
+        return cost;
+}
+
+
+// Integer square root (rounded down), so we don't need libm.
+static uint32_t
+_astar_isqrt (uint64_t n)
+{
+        uint64_t r = 0, bit = (uint64_t) 1 << 62;
+        while (bit > n) bit >>= 2;
+        while (bit) {
+                if (n >= r + bit) {
+                        n -= r + bit;
+                        r = (r >> 1) + bit;
+                } else r >>= 1;
+                bit >>= 2;
+        }
+        return r;
+}
+
+
+// The cost of moving in a straight line between two squares, scaled like
+// cardinal moves: the Euclidean distance times their cost, rounded.
+static inline uint32_t
+_astar_move_cost (const astar_t * as, const int32_t dx, const int32_t dy)
+{
+        uint64_t c = as->mc[DIR_N];
+        return (_astar_isqrt (4 * c * c * ((uint64_t) dx * dx + (uint64_t) dy * dy)) + 1) / 2;
+}
+
+
+// The cost of an any-angle move between two squares, or 0xffffffff if they
+// aren't in line of sight.
+static uint32_t
+astar_segment_cost (astar_t * as,
+                    const uint32_t x0, const uint32_t y0,
+                    const uint32_t x1, const uint32_t y1)
+{
+        uint32_t terrain;
+        as->los_checks++;
+        if (!astar_line_of_sight (as, x0, y0, x1, y1, 0, &terrain)) return 0xffffffff;
+        return _astar_move_cost (as, (int32_t) x1 - (int32_t) x0, (int32_t) y1 - (int32_t) y0) + terrain;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// MAIN CODE
 //
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -606,6 +2510,27 @@ get_time_difference (struct timeval *t0)
 }
 
 
+static int
+astar_mark_any_angle_route (astar_t *as, uint32_t ofs)
+{
+        // Follow the lines between the squares of the route and their
+        // parents with grid moves, so the directions are available too.
+        as->grid[ofs].route = 1;
+        as->steps = 0;
+        while (ofs != as->ofs0) {
+                uint32_t parent_ofs = as->parent[ofs];
+                if (astar_line_walk (as, ofsx (as, parent_ofs), ofsy (as, parent_ofs),
+                                     ofsx (as, ofs), ofsy (as, ofs), 0, 1) == 0xffffffff) {
+                        __debug ("*** Can't follow the line to %u.\n", ofs);
+                        return 0;
+                }
+                ofs = parent_ofs;
+        }
+        as->grid[ofs].route = 1;
+        return 1;
+}
+
+
 static int
 astar_mark_route (astar_t *as, uint32_t ofs)
 {
@@ -617,6 +2542,8 @@ astar_mark_route (astar_t *as, uint32_t ofs)
          * reverse direction.
          */
 
+        if (as->theta) return astar_mark_any_angle_route (as, ofs);
+
         square_t * s = &as->grid[ofs];
         uint32_t dir;
 
@@ -627,7 +2554,7 @@ astar_mark_route (astar_t *as, uint32_t ofs)
                 dir = s->dir;
 
                 // Find the offset of this square's parent on the route.
-                uint32_t parent_ofs = ofs + as->dx[dir] + as->dy[dir] * as->w;
+                uint32_t parent_ofs = _astar_step (as, ofs, dir);
                 __debug ("ofs=%u, dir=%u (%s), parent_ofs=%u\n", ofs, dir, names[dir], parent_ofs);
 
                 // Set the route direction in the parent.
@@ -703,7 +2630,7 @@ _astar_main_blocked (astar_t * as, square_t * square,
         // loop (e.g. during incremental runs when the map changes and the user isn't
         // careful enough to restart the path search. So we check every time for sanity's
         // sake.
-        if (square->cost != COST_BLOCKED) return 0;
+        if ((square->cost != COST_BLOCKED) && _astar_fits (as, current_ofs)) return 0;
 
         __debug("We're embedded in a blocked square at (%d,%d)!\n", x, y);
         as->bestofs = current_ofs;
@@ -716,12 +2643,12 @@ _astar_main_blocked (astar_t * as, square_t * square,
 
 
 static inline int
-_astar_main_found (astar_t * as, square_t * square, uint32_t current_ofs)
+_astar_main_found (astar_t * as, uint32_t current_ofs)
 {
         if (current_ofs != as->ofs1) return 0;
 
         __debug("Found it! ");
-        __debug_square (as, square);
+        __debug_square (as, (&as->grid[current_ofs]));
         astar_mark_route (as, current_ofs);
         //astar_print (as); // This is a null statement unless debugging.
         as->bestofs = as->ofs1;
@@ -734,7 +2661,7 @@ _astar_main_found (astar_t * as, square_t * square, uint32_t current_ofs)
 
 
 static inline int
-_astar_main_timeout (astar_t * as)
+_astar_time_up (astar_t * as)
 {
         // Timeout set?
         if (!as->timeout) return 0;
@@ -743,7 +2670,14 @@ _astar_main_timeout (astar_t * as)
         __debug("Time so far: %d microseconds.\n", d);
 
         // Timeout expired?
-        if (d < as->timeout) return 0;
+        return d >= as->timeout;
+}
+
+
+static inline int
+_astar_main_timeout (astar_t * as)
+{
+        if (!_astar_time_up (as)) return 0;
         
         // Nope, we ran out of moves to check. There's no route.
         if (as->have_best) {
@@ -776,11 +2710,11 @@ _astar_eval_g (astar_t * as, square_t * from, square_t * to, int rdir)
         // Original G.
         uint32_t g = from->g;
 
-        // Add movement cost.
-        g += as->mc [dir];
+        // Add movement cost. Portals have a cost of their own.
+        g += dir < NUM_DIRS ? (uint32_t) as->mc [dir] : as->climb_cost;
 
-        // Add cost of new square.
-        g += to->cost;
+        // Add cost of new square, and any overlays on it.
+        g += to->cost + _astar_overlay_cost (as, getofs (as, to));
         
         // Penalise direction changes. Note: 'dir' comes to us reversed (first
         // to second square). Only do this for moves other than first one (with
@@ -796,8 +2730,42 @@ _astar_eval_g (astar_t * as, square_t * from, square_t * to, int rdir)
 }
 
 
-#define _astar_eval_h(as, x0, y0, x1, y1) \
-        (((*as->heuristic)(x0, y0, x1, y1)) * ((as)->heuristic_factor))
+static inline uint32_t
+_astar_eval_h (astar_t * as, const uint32_t x, const uint32_t y,
+               const uint32_t ofs, const uint32_t cost)
+{
+        uint32_t x1 = as->x1, y1 = as->y1;
+
+        // On wrap-around maps, aim for the nearest copy of the target.
+        if (as->wrap) {
+                int32_t dx = (int32_t) x1 - (int32_t) x, dy = (int32_t) y1 - (int32_t) y;
+                if (as->wrap & ASTAR_WRAP_X) {
+                        if (2 * dx > (int32_t) as->w) x1 -= as->w;
+                        else if (-2 * dx > (int32_t) as->w) x1 += as->w;
+                }
+                if (as->wrap & ASTAR_WRAP_Y) {
+                        if (2 * dy > (int32_t) as->h) y1 -= as->h;
+                        else if (-2 * dy > (int32_t) as->h) y1 += as->h;
+                }
+        }
+
+        uint32_t h = (*as->heuristic)(x, y, x1, y1) * as->heuristic_factor;
+
+        // Every layer between here and the target takes a trip through a
+        // portal.
+        if (as->layers > 1) {
+                uint32_t z = ofsz (as, ofs);
+                h += (z > as->z1 ? z - as->z1 : as->z1 - z) * as->climb_cost;
+        }
+
+        // Landmark tables, if available, may give us a tighter bound.
+        if ((as->alt != NULL) && !as->theta) {
+                uint32_t b = astar_alt_bound (as->alt, ofs, as->ofs1, cost);
+                if (b > h) h = b;
+        }
+        
+        return h;
+}
 
 
 static inline void
@@ -825,12 +2793,265 @@ _astar_main_maybe_update_square (astar_t * as, square_t * square,
 }
 
 
+static inline void
+_astar_ara_maybe_incons (astar_t * as, square_t * square,
+                         square_t * adj, uint32_t adj_ofs, int dir)
+{
+        // A better path to a closed square. The square isn't expanded
+        // again in this iteration of the anytime search, but it will be
+        // reopened by the next one.
+        uint32_t g = _astar_eval_g (as, square, adj, dir);
+        if (g >= adj->g) return;
+
+        adj->g = g;
+        adj->f = _astar_f (as, g, adj->h);
+        adj->dir = REVERSE_DIR(dir);
+        if (!adj->incons) {
+                adj->incons = 1;
+                astar_list_push (&as->ara_incons, &as->ara_nincons,
+                                 &as->ara_incons_alloc, adj_ofs);
+        }
+}
+
+
+static inline void
+_astar_main_maybe_reopen (astar_t * as, square_t * square,
+                          square_t * adj, uint32_t adj_ofs, int dir)
+{
+        // A better path to a closed square. This can only happen if the
+        // heuristic is inconsistent (or the steering penalty is in play). Move
+        // it back to the open list, so its neighbours benefit too.
+        uint32_t g = _astar_eval_g (as, square, adj, dir);
+        if (g >= adj->g) return;
+
+        __debug ("\t...reopening (new g=%u, old g=%u).\n", g, adj->g);
+        adj->closed = 0;
+        as->closed--;
+        astar_add_open (as, adj, adj_ofs, g, adj->h);
+        adj->dir = REVERSE_DIR(dir);
+        as->reopens++;
+}
+
+
+static inline void
+_astar_expand_to (astar_t * as, square_t * square, const uint32_t adj_ofs,
+                  const uint32_t adj_x, const uint32_t adj_y, const int dir)
+{
+        // Consider the move from square to its neighbour at adj_ofs.
+        square_t * adj = get_square (as, adj_ofs, adj_x, adj_y);
+
+        __debug ("Step 2, dir=%d d=(%d,%d): ", dir,
+                 astar_get_dx (as, dir), astar_get_dy (as, dir));
+        __debug_square (as, adj);
+
+        // We don't care if it's blocked, or too small for the agent.
+        if (adj->cost == COST_BLOCKED) {
+                __debug ("\t...blocked.\n");
+                return;
+        }
+        if (!_astar_fits (as, adj_ofs)) {
+                __debug ("\t...too small.\n");
+                return;
+        }
+        if (_astar_overlay_cost (as, adj_ofs) == COST_BLOCKED) {
+                __debug ("\t...blocked by an overlay.\n");
+                return;
+        }
+
+        // We don't care if it's on the closed list, unless this is
+        // an anytime search or closed squares may be reopened.
+        if (adj->closed) {
+                __debug ("\t...on the closed list.\n");
+                if (as->anytime) {
+                        _astar_ara_maybe_incons (as, square, adj, adj_ofs, dir);
+                } else if (as->reopen) {
+                        _astar_main_maybe_reopen (as, square, adj, adj_ofs, dir);
+                }
+                return;
+        }
+
+        // Is it on the open list?
+        if (adj->open) {
+                _astar_main_maybe_update_square (as, square, adj, adj_ofs, dir);
+        } else {
+
+                // Not on the open list, add it.
+                uint32_t g = _astar_eval_g (as, square, adj, dir);
+
+                // An anytime search may have reached it in an
+                // earlier iteration. Is this a better path?
+                if (adj->seen && (g >= adj->g)) return;
+
+                // Only add to the open set if this move has a low
+                // enough cost. Otherwise, leave the square alone.
+                if ((as->max_cost != 0) && (g >= as->max_cost)) return;
+
+                uint32_t h = _astar_eval_h (as, adj_x, adj_y, adj_ofs, adj->cost);
+                astar_add_open (as, adj, adj_ofs, g, h);
+
+                // Set the direction of the parent square. This
+                // is the OPPOSITE direction to dir.
+                adj->dir = REVERSE_DIR(dir);
+        }
+}
+
+
+static inline void
+_astar_expand (astar_t * as, square_t * square,
+               const uint32_t x, const uint32_t y, const uint32_t current_ofs)
+{
+        register int dir, i;
+
+        // Squares away from the edges of the grid have all their
+        // neighbours in it. Check this once here, rather than once
+        // for every neighbour.
+        int interior = as->border_safe ||
+                ((x >= as->margin) && (x + as->margin < as->w) &&
+                 (y >= as->margin) && (y + as->margin < as->h));
+
+        // Offsets computed from co-ordinates are relative to the square's
+        // layer.
+        uint32_t base = layerbase (as, current_ofs);
+
+        for (i = 0; i < as->num_dirs; i++) {
+                dir = as->dirs[i];
+                uint32_t adj_x = x + as->dx[dir];
+                uint32_t adj_y = y + as->dy[dir];
+
+                // Rather than co-ordinates, calculate the offset of the adjacent
+                // square directly.
+                uint32_t adj_ofs = as->tiled ? base + mkofs (as, adj_x, adj_y) :
+                        current_ofs + as->dofs[dir];
+
+                // Ensure we're still within the bounds of the search
+                // grid. As the co-ordinates are all unsigned, reaching
+                // -1 isn't possible, but reaching MAXINT (wrap-around)
+                // is, So we only check whether the upper bound of the
+                // grid has been violated and save two comparisons that
+                // would never succeed. On wrap-around maps, the square
+                // may be on the other side of the grid.
+                if (!interior && ((adj_x >= as->w) || (adj_y >= as->h))) {
+                        if (!_astar_wrap (as, &adj_x, &adj_y)) continue;
+                        adj_ofs = base + mkofs (as, adj_x, adj_y);
+                }
+
+                _astar_expand_to (as, square, adj_ofs, adj_x, adj_y, dir);
+        }
+
+        // Portals lead to the same square on another layer.
+        if (square->up)
+                _astar_expand_to (as, square, current_ofs + as->layer_area, x, y, DIR_UP);
+        if (square->down)
+                _astar_expand_to (as, square, current_ofs - as->layer_area, x, y, DIR_DOWN);
+}
+
+
+static inline void
+_astar_theta_expand (astar_t * as, square_t * square,
+                     const uint32_t x, const uint32_t y, const uint32_t current_ofs)
+{
+        // Like _astar_expand(), but neighbours may be reached in a straight
+        // line from the current square's parent, skipping the current
+        // square. Lazy Theta* assumes the line is clear, and leaves the
+        // check to _astar_lazy_theta_check().
+        uint32_t parent_ofs = as->parent[current_ofs];
+        uint32_t px = ofsx (as, parent_ofs), py = ofsy (as, parent_ofs);
+        square_t * parent = &as->grid[parent_ofs];
+        register int dir, i;
+
+        for (i = 0; i < as->num_dirs; i++) {
+                dir = as->dirs[i];
+                uint32_t adj_x = x + as->dx[dir];
+                uint32_t adj_y = y + as->dy[dir];
+                if ((adj_x >= as->w) || (adj_y >= as->h)) continue;
+
+                uint32_t adj_ofs = mkofs (as, adj_x, adj_y);
+                square_t * adj = get_square (as, adj_ofs, adj_x, adj_y);
+                if ((adj->cost == COST_BLOCKED) || adj->closed || !_astar_usable (as, adj_ofs)) continue;
+
+                // The grid move...
+                uint32_t g = _astar_eval_g (as, square, adj, dir);
+                uint32_t best = current_ofs;
+
+                // ...or a straight line from the parent, if it's cheaper.
+                if (parent_ofs != current_ofs) {
+                        int32_t dx = (int32_t) adj_x - (int32_t) px;
+                        int32_t dy = (int32_t) adj_y - (int32_t) py;
+                        uint32_t c;
+                        if (as->any_angle == ASTAR_LAZY_THETA) {
+                                uint32_t moves = abs (dx) > abs (dy) ? abs (dx) : abs (dy);
+                                if (!as->move_8way) moves = abs (dx) + abs (dy);
+                                c = _astar_move_cost (as, dx, dy) + moves * adj->cost;
+                        } else {
+                                c = astar_segment_cost (as, px, py, adj_x, adj_y);
+                        }
+                        if ((c != 0xffffffff) && (parent->g + c <= g)) {
+                                g = parent->g + c;
+                                best = parent_ofs;
+                        }
+                }
+
+                if (adj->open) {
+                        if (g >= adj->g) continue;
+                        astar_update (as, adj, adj_ofs, g);
+                } else {
+                        if ((as->max_cost != 0) && (g >= as->max_cost)) continue;
+                        uint32_t h = _astar_eval_h (as, adj_x, adj_y, adj_ofs, adj->cost);
+                        astar_add_open (as, adj, adj_ofs, g, h);
+                }
+                as->parent[adj_ofs] = best;
+                adj->dir = REVERSE_DIR(dir);
+        }
+}
+
+
+static inline void
+_astar_lazy_theta_check (astar_t * as, square_t * square,
+                         const uint32_t x, const uint32_t y, const uint32_t current_ofs)
+{
+        // Lazy Theta*: the square was reached in a straight line from its
+        // parent, assuming it was clear and costs as much as the square
+        // itself. Check this now. If there's no line of sight, fall back to
+        // the best closed neighbour, which must exist: the square was
+        // reached from one of them.
+        uint32_t parent_ofs = as->parent[current_ofs];
+        uint32_t px = ofsx (as, parent_ofs), py = ofsy (as, parent_ofs);
+        if (_astar_dir_of (as, (int32_t) x - (int32_t) px, (int32_t) y - (int32_t) py) >= 0) return;
+
+        uint32_t c = astar_segment_cost (as, px, py, x, y);
+        if (c != 0xffffffff) {
+                square->g = as->grid[parent_ofs].g + c;
+        } else {
+                register int dir, i;
+                square->g = 0xffffffff;
+                for (i = 0; i < as->num_dirs; i++) {
+                        dir = as->dirs[i];
+                        uint32_t adj_x = x + as->dx[dir];
+                        uint32_t adj_y = y + as->dy[dir];
+                        if ((adj_x >= as->w) || (adj_y >= as->h)) continue;
+
+                        uint32_t adj_ofs = mkofs (as, adj_x, adj_y);
+                        square_t * adj = &as->grid[adj_ofs];
+                        if (!adj->init || !adj->closed) continue;
+
+                        uint32_t g = _astar_eval_g (as, adj, square, REVERSE_DIR (dir));
+                        if (g < square->g) {
+                                square->g = g;
+                                square->dir = dir;
+                                as->parent[current_ofs] = adj_ofs;
+                        }
+                }
+                assert (square->g != 0xffffffff);
+        }
+        square->f = _astar_f (as, square->g, square->h);
+}
+
+
 static inline int
 astar_main_loop (astar_t * as)
 {
         square_t * square = NULL;
-        uint32_t   current_ofs;
-        register int dir;
+        uint32_t   current_ofs, current_key;
 
         // Obtain the starting square.
         current_ofs = as->ofs0;
@@ -842,18 +3063,65 @@ astar_main_loop (astar_t * as)
         assert (square->open == 0);
         assert (square->closed == 0);
 
+        ///////////////////////////////////////////////////////////////////////
+        //
+        // TERMINATING CONDITION: STARTING SQUARE BLOCKED
+        //
+        ///////////////////////////////////////////////////////////////////////
+
+        if (_astar_main_blocked (as, square, current_ofs, as->x0, as->y0)) {
+                // ASTAR_EMBEDDED is an alias for this error condition.
+                return astar_error (as, ASTAR_AMONTILLADO);
+        }
+
         ///////////////////////////////////////////////////////////////////////
         //
         // STEP 1. ADD STARTING SQUARE TO THE OPEN LIST
         //
         ///////////////////////////////////////////////////////////////////////////////
-        uint32_t h = _astar_eval_h (as, as->x0, as->y0, as->x1, as->y1);
+        uint32_t h = _astar_eval_h (as, as->x0, as->y0, current_ofs, square->cost);
         astar_add_open (as, square, current_ofs, 0, h);
+        if (as->theta) as->parent[current_ofs] = current_ofs;
 
+        // Every square on the open list is on the heap exactly once, and
+        // nothing else is: squares are only closed once they've been popped,
+        // and better paths to open squares update their entries in place.
 
         // Now start adding squares.
         while (1) {
 
+                ///////////////////////////////////////////////////////////////
+                //
+                // TERMINATING CONDITION: HEAP EMPTY (SOLUTION NOT FOUND)
+                //
+                ///////////////////////////////////////////////////////////////
+
+                if (_astar_main_notfound (as)) {
+                        return astar_error (as, ASTAR_NOTFOUND);
+                }
+
+
+                ///////////////////////////////////////////////////////////////
+                //
+                // STEP 2. CHOOSE THE NEXT SQUARE TO EXAMINE
+                //
+                ///////////////////////////////////////////////////////////////
+
+                // Obtain the cheapest move on the open list.
+                current_key = astar_heap_pop (as->heap, &current_ofs);
+                square = &as->grid[current_ofs];
+
+                // This can't happen, but count it if it does.
+                if (!square->open) {
+                        __debug ("\tStale heap entry: ");
+                        __debug_square (as, square);
+                        as->stale_pops++;
+                        continue;
+                }
+
+                // Sanity check.
+                assert (_astar_key (as, square, current_ofs) == current_key);
+
 
 #ifdef ASTAR_DEBUG
                 astar_print (as);
@@ -867,9 +3135,8 @@ astar_main_loop (astar_t * as)
                 __debug ("\n");
 
                 // Get the co-ordinates of the current square.
-                uint32_t x = getx (as, square);
-                uint32_t y = gety (as, square);
-                current_ofs = getofs (as, square);
+                uint32_t x = ofsx (as, current_ofs);
+                uint32_t y = ofsy (as, current_ofs);
 
                 ///////////////////////////////////////////////////////////////
                 //
@@ -877,8 +3144,13 @@ astar_main_loop (astar_t * as)
                 //
                 ///////////////////////////////////////////////////////////////
 
+                // Lazy Theta* hasn't checked how we got here yet.
+                if (as->theta && (as->any_angle == ASTAR_LAZY_THETA)) {
+                        _astar_lazy_theta_check (as, square, x, y, current_ofs);
+                }
+
                 // Have we just reached the target?
-                if (_astar_main_found (as, square, current_ofs)) {
+                if (_astar_main_found (as, current_ofs)) {
                         return astar_error (as, ASTAR_FOUND);
                 }
 
@@ -896,154 +3168,138 @@ astar_main_loop (astar_t * as)
 
                 ///////////////////////////////////////////////////////////////
                 //
-                // TERMINATING CONDITION: HEAP EMPTY (SOLUTION NOT FOUND)
+                // STEP 3. ADD NEIGHBOURING SQUARES
                 //
                 ///////////////////////////////////////////////////////////////
 
-                if (_astar_main_notfound (as)) {
-                        return astar_error (as, ASTAR_NOTFOUND);
+                if (as->theta) {
+                        _astar_theta_expand (as, square, x, y, current_ofs);
+                } else {
+                        _astar_expand (as, square, x, y, current_ofs);
                 }
 
 
                 ///////////////////////////////////////////////////////////////
                 //
-                // TERMINATING CONDITION: STARTING SQUARE BLOCKED
+                // STEP 4. MOVE CURRENT SQUARE TO THE CLOSED LIST
                 //
                 ///////////////////////////////////////////////////////////////
 
-                if (_astar_main_blocked (as, square, current_ofs, x, y)) {
-                        // ASTAR_EMBEDDED is an alias for this error condition.
-                        return astar_error (as, ASTAR_AMONTILLADO);
-                }
-
+                // Add it to the closed list.
+                __debug("\nStep 4. Adding current square to closed list (ofs=%u).\n", current_ofs);
+                astar_add_closed (as, square, current_ofs);
+                assert (square->open == 0);
+                assert (square->closed == 1);
 
-                ///////////////////////////////////////////////////////////////
-                //
-                // STEP 2. ADD NEIGHBOURING SQUARES
-                //
-                ///////////////////////////////////////////////////////////////
+                // Keep the open list within bounds.
+                if (as->max_open && (as->heap->length > as->max_open)) astar_prune_open (as);
+        }
+}
 
-		// The order doesn't matter, so start at num_dirs - 1 and step
-		// down to 0. This is faster (simpler loop conditionals)
 
-                for (dir = 0; dir < NUM_DIRS; dir++) {
-                        uint32_t adj_x = x + as->dx[dir];
-                        uint32_t adj_y = y + as->dy[dir];
+static int
+astar_begin (astar_t *as,
+             const uint32_t x0, const uint32_t y0, const uint32_t z0,
+             const uint32_t x1, const uint32_t y1, const uint32_t z1)
+{
+        // Prepare for a search. Returns ASTAR_NOTHING if the search should
+        // go ahead, or the result code of the search otherwise.
+        assert (as != NULL);
+        assert (as->grid != NULL);
+        assert (as->heap != NULL);
+        assert (z0 < as->layers);
+        assert (z1 < as->layers);
 
-			// Odd-numbered directions are the non-cardinal
-			// ones. If the movement mode is along the cardinal
-			// directions, skip odd directions.
-			if ((as->move_8way == 0) && (dir & 1)) continue;
-
-                        // Ensure we're still within the bounds of the search
-                        // grid. As the co-ordinates are all unsigned, reaching
-                        // -1 isn't possible, but reaching MAXINT (wrap-around)
-                        // is, So we only check whether the upper bound of the
-                        // grid has been violated and save two comparisons that
-                        // would never succeed.
-                        if ((adj_x >= as->w) || (adj_y >= as->h)) continue;
+        // Store the start time.
+        gettimeofday (&as->t0, &_tz);
 
-                        // Rather than co-ordinates, calculate the offset of the adjacent
-                        // square directly.
-                        uint32_t adj_ofs = mkofs (as, adj_x, adj_y);
-                        square_t * adj = get_square (as, adj_ofs, adj_x, adj_y);
+        // Reset?
+        if (as->must_reset) astar_reset (as);
+        as->must_reset = 1;
+        as->grid_clean = 0;
 
-                        __debug ("Step 2, dir=%d d=(%d,%d): ", dir, as->dx[dir], as->dy[dir]);
-                        __debug_square (as, adj);
+        // At the end of this, the grid will initialised (perhaps partially).
+        as->grid_init = 1;
+        
+        // Configure.
+        as->x0 = x0;
+        as->y0 = y0;
 
-                        // We don't care if it's blocked.
-                        if (adj->cost == COST_BLOCKED) {
-                                __debug ("\t...blocked.\n");
-                                continue;
-                        }
+        as->x1 = x1;
+        as->y1 = y1;
 
-                        // We don't care if it's on the closed list.
-                        if (adj->closed) {
-                                __debug ("\t...on the closed list.\n");
-                                continue;
-                        }
+        as->z0 = z0;
+        as->z1 = z1;
 
-                        // Is it on the open list?
-                        if (adj->open) {
-                                _astar_main_maybe_update_square (as, square, adj, adj_ofs, dir);
-                        } else {
+        as->ofs0 = mkofs3(as, x0, y0, z0);
+        as->ofs1 = mkofs3(as, x1, y1, z1);
 
-                                // Not on the open list, add it.
-                                uint32_t g = _astar_eval_g (as, square, adj, dir);
-                                uint32_t h = _astar_eval_h (as,
-                                                            x + as->dx[dir],
-                                                            y + as->dy[dir],
-                                                            as->x1,
-                                                            as->y1);
-
-                                // Only add to the open set if this move has a low enough
-                                // cost.
-                                if ((as->max_cost == 0) || (g < as->max_cost))
-                                        astar_add_open (as, adj, adj_ofs, g, h);
-
-                                // Set the direction of the parent square. This
-                                // is the OPPOSITE direction to dir.
-                                adj->dir = REVERSE_DIR(dir);
-                        }
-                }
+        as->weight = as->epsilon;
+        as->bound = as->epsilon > ASTAR_EPSILON_ONE ? as->epsilon : ASTAR_EPSILON_ONE;
+        as->anytime = 0;
+        as->theta = (as->any_angle != ASTAR_ANY_ANGLE_NONE) && (as->layers == 1);
 
+        // Overlays only last for one search.
+        astar_merge_overlays (as);
 
-                ///////////////////////////////////////////////////////////////
-                //
-                // STEP 3. MOVE STARTING SQUARE TO THE CLOSED LIST
-                //
-                ///////////////////////////////////////////////////////////////
+        // Any-angle searches need somewhere to keep parents.
+        if (as->theta && (as->parent == NULL)) {
+                as->parent = (uint32_t *) malloc (as->grid_area * sizeof (uint32_t));
+                check_null (as->parent, "astar_begin(), allocating parents");
+        }
 
-                // Add it to the closed list.
-                __debug("\nStep 3. Adding current square to closed list (ofs=%u).\n", current_ofs);
-                astar_add_closed (as, square, getofs (as, square));
-                assert (square->open == 0);
-                assert (square->closed == 1);
+        // Set the default heuristic if needed.
+        if (as->heuristic == NULL) {
+                as->heuristic = manhattan_distance;
+        }
 
+        // Scale tie breakers to this search: G and H should mostly be less
+        // than the estimated cost of the route, and the cross product less
+        // than its length times the distance from the line.
+        uint32_t h0 = (*as->heuristic) (x0, y0, x1, y1) * as->heuristic_factor;
+        for (as->tie_shift = 0; (h0 >> as->tie_shift) > TIE_MAX; as->tie_shift++);
+        as->tie_len = abs ((int32_t) x1 - (int32_t) x0);
+        if ((uint32_t) abs ((int32_t) y1 - (int32_t) y0) > as->tie_len) {
+                as->tie_len = abs ((int32_t) y1 - (int32_t) y0);
+        }
+        if (as->tie_len == 0) as->tie_len = 1;
 
-                ///////////////////////////////////////////////////////////////
-                //
-                // STEP 4. CHOOSE THE NEXT SQUARE TO EXAMINE
-                //
-                ///////////////////////////////////////////////////////////////
+        // Fail if the grid hasn't been initialised and there's no getter.
+        if ((as->grid_init == 0) && (as->get == NULL) && (as->get_layer == NULL)) {
+                as->have_route = 0;
+                return astar_error (as, ASTAR_GRID_NOT_INITIALISED);
+        }
 
-                // Obtain the cheapest move on the open list. Pass square by
-                // reference, so it can be modified. Discard squares that are
-                // on the closed list as, by definition, they aren't on the
-                // open list. When adding squares to the closed list, we don't
-                // remove them from the heap. Instead we do this here, on
-                // demand. It saves processor cycles.
-                uint32_t current_f;
-                __debug ("\nStep 4. Popping best next square\n");
-                while (!astar_heap_is_empty (as->heap)) {
-                        current_f = astar_heap_pop (as->heap, &square);
-                        assert (square->f == current_f);
-                        if (square->closed) {
-                                __debug ("\ton Closed list: ");
-                                __debug_square (as, square);
-                                continue;
-                        } else {
-                                __debug ("\tFound: ");
-                                __debug_square (as, square);
-                                break;
-                        }
-                }
+        // Fail if the origin hasn't been set.
+        if (!as->origin_set) {
+                as->have_route = 0;
+                return astar_error (as, ASTAR_ORIGIN_NOT_SET);
+        }
 
-                // The heap is empty. Whoops. Loop again using the current
-                // square, and the empty-heap condition will be detected and
-                // acted on at that point.
-                if (astar_heap_is_empty (as->heap)) continue;
+        __debug ("Will look for a path from (%d,%d)->(%d,%d). Estimated cost %d.\n",
+                 as->x0, as->y0,
+                 as->x1, as->y1,
+                 (*as->heuristic) (as->x0, as->y0, as->x1, as->y1) * as->heuristic_factor);
 
-                __debug ("\nStep 4. Best move: ");
-                __debug_square (as, square);
-                __debug ("OFFSET = %u, F (heap) = %u, F (square) = %u\n",
-                         getofs (as, square), current_f, square->f);
+        // Handle the trivial case here. Saves us some pain later.
+        if (as->ofs0 == as->ofs1) {
+                as->bestofs = as->ofs1;
+                as->score = 0;
+                as->have_route = 0;
+                return astar_error (as, ASTAR_TRIVIAL);
+        }
 
-                // Sanity check.
-                assert (square->f == current_f);
-                __debug("Best move: ");
-                __debug_square(as, square);
+        // Don't bother searching for targets in another component. Blocked
+        // starting squares are reported by the search.
+        if ((as->cc != NULL) && (z0 == 0) && (z1 == 0)) {
+                uint32_t l0 = as->cc->label[ccofs (as->cc, x0, y0)];
+                if ((l0 != 0) && (as->cc->label[ccofs (as->cc, x1, y1)] != l0)) {
+                        as->have_route = 0;
+                        return astar_error (as, ASTAR_UNREACHABLE);
+                }
         }
+
+        return ASTAR_NOTHING;
 }
 
 
@@ -1052,61 +3308,192 @@ astar_run (astar_t *as,
            const uint32_t x0, const uint32_t y0,
            const uint32_t x1, const uint32_t y1)
 {
-        assert (as != NULL);
-        assert (as->grid != NULL);
-        assert (as->heap != NULL);
+        int result = astar_begin (as, x0, y0, 0, x1, y1, 0);
+        if (result != ASTAR_NOTHING) return result;
 
-        // Store the start time.
-        gettimeofday (&as->t0, &_tz);
+        return astar_trim_heap (as, astar_main_loop (as));
+}
 
-        // Reset?
-        if (as->must_reset) astar_reset (as);
-        as->must_reset = 1;
 
-        // At the end of this, the grid will initialised (perhaps partially).
-        as->grid_init = 1;
-        
-        // Configure.
-        as->x0 = x0;
-        as->y0 = y0;
+int
+astar_run_layers (astar_t *as,
+                  const uint32_t x0, const uint32_t y0, const uint32_t z0,
+                  const uint32_t x1, const uint32_t y1, const uint32_t z1)
+{
+        int result = astar_begin (as, x0, y0, z0, x1, y1, z1);
+        if (result != ASTAR_NOTHING) return result;
+
+        return astar_trim_heap (as, astar_main_loop (as));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// ANYTIME SEARCH (ARA*)
+//
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * ARA* runs a series of weighted A* searches with decreasing weights. Each
+ * search stops as soon as no open square could lead to a cheaper route to the
+ * target than the one it already has, so the target is never expanded. The
+ * next search carries on with the same open list: it only needs to reopen the
+ * squares whose g improved after they were closed (the INCONS list), and to
+ * recalculate the F values of all open squares for the new weight. Squares
+ * closed by the previous search may be closed again by this one, so the
+ * closed flags are cleared, but their g values are kept (the 'seen' flag),
+ * so they're only reopened if a better path to them is found.
+ */
+
+
+static int
+astar_ara_improve (astar_t * as, const int found)
+{
+        square_t * square, * goal = &as->grid[as->ofs1];
+        uint32_t ofs;
+
+        while (!astar_heap_is_empty (as->heap)) {
+                // Stop once the route can't be improved upon at this
+                // weight.
+                if (goal->init && goal->seen &&
+                    (_astar_key (as, goal, as->ofs1) <= astar_heap_min (as->heap))) {
+                        return ASTAR_FOUND;
+                }
+
+                // Without a route yet, mark the best compromise.
+                if (found ? _astar_time_up (as) : _astar_main_timeout (as)) {
+                        return ASTAR_TIMEOUT;
+                }
+
+                astar_heap_pop (as->heap, &ofs);
+                square = &as->grid[ofs];
+                if (!square->open) {
+                        as->stale_pops++;
+                        continue;
+                }
+                as->loops++;
+
+                _astar_expand (as, square, ofsx (as, ofs), ofsy (as, ofs), ofs);
+                astar_add_closed (as, square, ofs);
+                astar_list_push (&as->ara_closed, &as->ara_nclosed,
+                                 &as->ara_closed_alloc, ofs);
+
+                if (as->max_open && (as->heap->length > as->max_open)) astar_prune_open (as);
+        }
+
+        return (goal->init && goal->seen) ? ASTAR_FOUND : ASTAR_NOTFOUND;
+}
+
+
+static void
+astar_ara_publish (astar_t * as, void (*publish) (astar_t * as))
+{
+        uint32_t i, ofs = as->ofs0;
+
+        // Clear the previous route, if any.
+        if (as->have_route) {
+                for (i = 0; i < as->steps; i++) {
+                        as->grid[ofs].route = 0;
+                        ofs = _astar_step (as, ofs, as->grid[ofs].rdir);
+                }
+                as->grid[ofs].route = 0;
+        }
+
+        astar_mark_route (as, as->ofs1);
+        as->bestofs = as->ofs1;
+        as->bestx = as->x1;
+        as->besty = as->y1;
+        as->score = as->grid[as->ofs1].g;
+        as->bound = as->weight;
+        as->have_route = 1;
+        set_result (as, ASTAR_FOUND);
+        as->usecs = get_time_difference (&as->t0);
 
-        as->x1 = x1;
-        as->y1 = y1;
+        __debug ("Published route: score %u, epsilon %u.\n", as->score, as->bound);
+        if (publish != NULL) (*publish) (as);
+}
 
-        as->ofs0 = mkofs(as, x0, y0);
-        as->ofs1 = mkofs(as, x1, y1);
 
-        // Set the default heuristic if needed.
-        if (as->heuristic == NULL) {
-                as->heuristic = manhattan_distance;
-        }
+static void
+astar_ara_next (astar_t * as)
+{
+        asheap_t * heap = as->heap;
+        uint32_t i, n = heap->length;
 
-        // Fail if the grid hasn't been initialised and as->get isn't set.
-        if ((as->grid_init == 0) && (as->get == NULL)) {
-                as->have_route = 0;
-                return astar_error (as, ASTAR_GRID_NOT_INITIALISED);
+        // Closed squares may be expanded again.
+        for (i = 0; i < as->ara_nclosed; i++) {
+                as->grid[as->ara_closed[i]].closed = 0;
+        }
+        as->ara_nclosed = 0;
+
+        // Recalculate F for the new weight. Entries are re-added in order,
+        // so the heap never grows over an entry that hasn't been read yet.
+        astar_heap_clear (heap);
+        for (i = 0; i < n; i++) {
+                uint32_t ofs = heap->e[i].ofs;
+                square_t * s = &as->grid[ofs];
+                s->f = _astar_f (as, s->g, s->h);
+                astar_heap_add (heap, _astar_key (as, s, ofs), ofs);
         }
 
-        // Fail if the origin hasn't been set.
-        if (!as->origin_set) {
-                as->have_route = 0;
-                return astar_error (as, ASTAR_ORIGIN_NOT_SET);
+        // Reopen the squares whose g improved after they were closed.
+        for (i = 0; i < as->ara_nincons; i++) {
+                square_t * s = &as->grid[as->ara_incons[i]];
+                s->incons = 0;
+                if (!s->open) astar_add_open (as, s, as->ara_incons[i], s->g, s->h);
         }
+        as->ara_nincons = 0;
+}
 
-        __debug ("Will look for a path from (%d,%d)->(%d,%d). Estimated cost %d.\n",
-                 as->x0, as->y0,
-                 as->x1, as->y1,
-                 (*as->heuristic) (as->x0, as->y0, as->x1, as->y1) * as->heuristic_factor);
 
-        // Handle the trivial case here. Saves us some pain later.
-        if ((as->x0 == as->x1) && (as->y0 == as->y1)) {
-                as->bestofs = as->ofs1;
-                as->score = 0;
-                as->have_route = 0;
-                return astar_error (as, ASTAR_TRIVIAL);
+int
+astar_run_anytime (astar_t * as,
+                   const uint32_t x0, const uint32_t y0,
+                   const uint32_t x1, const uint32_t y1,
+                   const uint32_t epsilon, const uint32_t delta,
+                   void (*publish) (astar_t * as))
+{
+        int found = 0, result = astar_begin (as, x0, y0, 0, x1, y1, 0);
+        if (result != ASTAR_NOTHING) return result;
+
+        as->weight = epsilon > ASTAR_EPSILON_ONE ? epsilon : ASTAR_EPSILON_ONE;
+        as->anytime = 1;
+        as->theta = 0;
+        as->ara_nclosed = 0;
+        as->ara_nincons = 0;
+
+        square_t * square = get_square (as, as->ofs0, as->x0, as->y0);
+        if (_astar_main_blocked (as, square, as->ofs0, as->x0, as->y0)) {
+                as->anytime = 0;
+                return astar_error (as, ASTAR_AMONTILLADO);
+        }
+        astar_add_open (as, square, as->ofs0, 0,
+                        _astar_eval_h (as, as->x0, as->y0, as->ofs0, square->cost));
+
+        for (;;) {
+                result = astar_ara_improve (as, found);
+                if (result != ASTAR_FOUND) break;
+
+                astar_ara_publish (as, publish);
+                found = 1;
+
+                // Lower the weight for the next iteration.
+                if (as->weight == ASTAR_EPSILON_ONE) break;
+                if (delta && (as->weight - ASTAR_EPSILON_ONE > delta)) {
+                        as->weight -= delta;
+                } else {
+                        as->weight = ASTAR_EPSILON_ONE;
+                }
+                astar_ara_next (as);
         }
+        as->anytime = 0;
+
+        if (found) return astar_trim_heap (as, astar_error (as, ASTAR_FOUND));
+        if (result == ASTAR_TIMEOUT) return astar_trim_heap (as, astar_error (as, ASTAR_TIMEOUT));
 
-        return astar_main_loop (as);
+        // No route. Mark the best compromise.
+        _astar_main_notfound (as);
+        return astar_trim_heap (as, astar_error (as, ASTAR_NOTFOUND));
 }
 
 
@@ -1143,7 +3530,7 @@ astar_get_directions (astar_t *as, direction_t ** directions)
                 // Store the direction.
                 *dp++ = dir;
                 // Move to the next square.
-                ofs += as->dx[dir] + as->dy[dir] * as->w;
+                ofs = _astar_step (as, ofs, dir);
         }
         // Terminate the directions (for good measure).
         *dp = DIR_END;
@@ -1161,6 +3548,129 @@ astar_free_directions (direction_t * directions)
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// WAYPOINTS AND SMOOTHING
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Does the move between two adjacent squares cross the edge of a wrap-around
+// map, or go through a portal?
+static inline int
+_astar_seam (const astar_t * as, const uint32_t ofs0, const uint32_t ofs1)
+{
+        return (ofsz (as, ofs0) != ofsz (as, ofs1)) ||
+                ((uint32_t) abs ((int32_t) ofsx (as, ofs1) - (int32_t) ofsx (as, ofs0)) > as->margin) ||
+                ((uint32_t) abs ((int32_t) ofsy (as, ofs1) - (int32_t) ofsy (as, ofs0)) > as->margin);
+}
+
+
+uint32_t
+astar_get_waypoints (astar_t *as, astar_waypoint_t ** waypoints)
+{
+        assert (as != NULL);
+        assert (as->grid != NULL);
+        assert (waypoints != NULL);
+
+	if (!as->have_route) {
+		__debug ("astar_get_waypoints(): No route exists, nothing to return.\n");
+		return 0;
+	}
+
+        // Any-angle routes are made of waypoints already.
+        if (as->theta) {
+                uint32_t n = 1, ofs;
+                for (ofs = as->bestofs; ofs != as->ofs0; ofs = as->parent[ofs]) n++;
+                *waypoints = (astar_waypoint_t *) malloc (n * sizeof (astar_waypoint_t));
+                check_null (*waypoints, "astar_get_waypoints(), allocating waypoints");
+                astar_waypoint_t * wp = *waypoints + n;
+                for (ofs = as->bestofs; ; ofs = as->parent[ofs]) {
+                        wp--;
+                        wp->x = ofsx (as, ofs);
+                        wp->y = ofsy (as, ofs);
+                        wp->z = ofsz (as, ofs);
+                        if (ofs == as->ofs0) break;
+                }
+                return n;
+        }
+
+        // Walk the route once, noting its squares and what it costs to get
+        // to each of them.
+        uint32_t n = as->steps + 1;
+        uint32_t * route = (uint32_t *) malloc (2 * n * sizeof (uint32_t));
+        uint32_t * cost = route + n;
+        check_null (route, "astar_get_waypoints(), allocating route");
+        *waypoints = (astar_waypoint_t *) malloc (n * sizeof (astar_waypoint_t));
+        check_null (*waypoints, "astar_get_waypoints(), allocating waypoints");
+
+        uint32_t i, ofs = as->ofs0;
+        route[0] = ofs;
+        cost[0] = 0;
+        for (i = 1; i < n; i++) {
+                uint32_t dir = as->grid[ofs].rdir;
+                ofs = _astar_step (as, ofs, dir);
+                route[i] = ofs;
+                cost[i] = cost[i - 1] + as->grid[ofs].cost +
+                        (dir < NUM_DIRS ? (uint32_t) as->mc[dir] : as->climb_cost);
+        }
+
+        // Keep the first square, then each square the route can't skip:
+        // with no smoothing, where it turns; otherwise, the last one we can
+        // see from the previous waypoint.
+        astar_waypoint_t * wp = *waypoints;
+        uint32_t a = 0;
+        wp->x = ofsx (as, route[0]);
+        wp->y = ofsy (as, route[0]);
+        wp->z = ofsz (as, route[0]);
+        wp++;
+        for (i = 1; i + 1 < n; i++) {
+                uint32_t x0 = ofsx (as, route[a]), y0 = ofsy (as, route[a]);
+                uint32_t z0 = ofsz (as, route[a]);
+                uint32_t x = ofsx (as, route[i + 1]), y = ofsy (as, route[i + 1]);
+                int skip;
+                if ((as->wrap || (as->layers > 1)) &&
+                    (_astar_seam (as, route[i - 1], route[i]) ||
+                     _astar_seam (as, route[i], route[i + 1]))) {
+                        // Keep both ends of moves across the edge of the
+                        // map or through portals: lines don't wrap around
+                        // or change layers.
+                        skip = 0;
+                } else if ((as->smoothing & ASTAR_SMOOTH_LOS) == 0) {
+                        skip = as->grid[route[i]].rdir == as->grid[route[i - 1]].rdir;
+                } else {
+                        skip = astar_line_of_sight (as, x0, y0, x, y, z0, NULL);
+                        if (skip && (as->smoothing & ASTAR_SMOOTH_KEEP_COST)) {
+                                skip = astar_line_walk (as, x0, y0, x, y, z0, 0) <=
+                                        cost[i + 1] - cost[a];
+                        }
+                }
+                if (skip) continue;
+
+                wp->x = ofsx (as, route[i]);
+                wp->y = ofsy (as, route[i]);
+                wp->z = ofsz (as, route[i]);
+                wp++;
+                a = i;
+        }
+        wp->x = ofsx (as, route[n - 1]);
+        wp->y = ofsy (as, route[n - 1]);
+        wp->z = ofsz (as, route[n - 1]);
+        wp++;
+
+        free (route);
+        return wp - *waypoints;
+}
+
+
+void
+astar_free_waypoints (astar_waypoint_t * waypoints)
+{
+	assert (waypoints != NULL);
+	free (waypoints);
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // DEBUGGING FUNCTIONS
@@ -1177,20 +3687,22 @@ astar_print_heap (astar_t * as, const char * title)
         uint32_t x;
         __debug ("\n%s (length=%d)\n", title, as->heap->length);
         for (x = 0; x < as->heap->length; x++) {
+                uint32_t ofs = as->heap->e[x].ofs;
+                square_t * s = &as->grid[ofs];
                 __debug("%3d. (%d,%d) [ofs %d] -> f=%d==%d %2s -> GRID "
                         "(f %3d, g %3d, h %3d, o=%d, c=%d)\n",
                         x,
-                        as->heap->squares[x]->ofs % as->w,
-                        as->heap->squares[x]->ofs / as->h,
-                        as->heap->squares[x]->ofs,
-                        as->heap->squares[x]->f,
-                        as->heap->data[x],
-                        names[as->heap->squares[x]->dir],
-                        as->heap->squares[x]->f,
-                        as->heap->squares[x]->g,
-                        as->heap->squares[x]->h,
-                        as->heap->squares[x]->open,
-                        as->heap->squares[x]->closed
+                        ofsx (as, ofs),
+                        ofsy (as, ofs),
+                        ofs,
+                        s->f,
+                        as->heap->e[x].key,
+                        names[s->dir],
+                        s->f,
+                        s->g,
+                        s->h,
+                        s->open,
+                        s->closed
                         );
         }
         __debug("\n\n");
@@ -1207,8 +3719,10 @@ astar_print (astar_t * as)
         uint8_t grid_get (uint32_t, uint32_t);
 #endif // TEST_ASTAR
 
+        // Layered grids: show the starting layer.
         __debug("So far:\n");
         for (y = 0; y < as->h; y++) {
+                s = &as->grid[mkofs3 (as, 0, y, as->z0)];
                 for (x = 0; x < as->w; x++) {
                         if ((x == as->x0) && (y == as->y0)) {
                                 __debug("\033[0;41;1m*\033[0m");
@@ -1365,6 +3879,160 @@ grid_get (uint32_t x, uint32_t y)
 }
 
 
+// A 30x20 map split in two by walls, which only wrapping around gets past.
+static uint8_t
+wrap_get (uint32_t x, uint32_t y)
+{
+        assert ((x < 30) && (y < 20));
+        return ((x == 15) || (y == 10)) ? COST_BLOCKED : 1;
+}
+
+
+// Three 20x12 floors with stairs between them. The ground and top floors
+// are split in two by walls, so the only way across is through the middle
+// floor. A chute leads down to the far side of the ground floor. The stairs
+// down from the top floor can be taken out.
+static int layer_oneway;
+
+static uint8_t
+layer_get (uint32_t x, uint32_t y, uint32_t z, uint8_t * portals)
+{
+        assert ((x < 20) && (y < 12) && (z < 3));
+        if ((x == 5) && (y == 5) && (z < 2)) {
+                *portals = z == 0 ? ASTAR_PORTAL_UP : ASTAR_PORTAL_DOWN;
+        }
+        if ((x == 14) && (y == 6) && (z > 0)) {
+                *portals = z == 1 ? ASTAR_PORTAL_UP :
+                        (layer_oneway ? 0 : ASTAR_PORTAL_DOWN);
+        }
+        if ((x == 16) && (y == 2) && (z == 1)) *portals = ASTAR_PORTAL_DOWN;
+        return ((x == 10) && (z != 1)) ? COST_BLOCKED : 1;
+}
+
+
+// A 40x30 map for the connected component tests, changed as they go.
+static uint8_t cc_map[30][40];
+
+static uint8_t
+cc_get (uint32_t x, uint32_t y)
+{
+        assert ((x < 40) && (y < 30));
+        return cc_map[y][x];
+}
+
+
+// A walled-in target square at (1,2), nearer the left edge than the right.
+static uint8_t
+seam_get (uint32_t x, uint32_t y)
+{
+        assert ((x < 20) && (y < 5));
+        return (x < 4) && ((x != 1) || (y != 2)) ? COST_BLOCKED : 1;
+}
+
+
+// Check that two labellings split the map the same way.
+static void
+cc_check_labels (const astar_cc_t * a, const astar_cc_t * b)
+{
+        uint32_t area = a->w * a->h, i;
+        uint32_t * ab = (uint32_t *) calloc (area + 1, sizeof (uint32_t));
+        uint32_t * ba = (uint32_t *) calloc (area + 1, sizeof (uint32_t));
+        assert (a->num == b->num);
+        for (i = 0; i < area; i++) {
+                uint32_t la = a->label[i], lb = b->label[i];
+                assert ((la == 0) == (lb == 0));
+                if (ab[la] == 0) ab[la] = lb + 1;
+                if (ba[lb] == 0) ba[lb] = la + 1;
+                assert ((ab[la] == lb + 1) && (ba[lb] == la + 1));
+                assert ((la == 0) || (a->size[la] == b->size[lb]));
+        }
+        free (ab);
+        free (ba);
+}
+
+
+// A 40x20 map with two thick walls, crossed by gaps of different widths:
+// squeezing through the narrow gaps at the top is quicker, if the agent
+// fits. Squares of the map can be closed for the tests, too.
+static uint8_t sizes_closed[20][40];
+
+static uint8_t
+sizes_get (uint32_t x, uint32_t y)
+{
+        assert ((x < 40) && (y < 20));
+        if (sizes_closed[y][x]) return COST_BLOCKED;
+        if ((x == 12) || (x == 13)) {
+                return ((y == 2) || (y == 3) || ((y >= 15) && (y <= 17))) ? 2 : COST_BLOCKED;
+        }
+        if ((x == 26) || (x == 27)) {
+                return ((y == 2) || ((y >= 15) && (y <= 17))) ? 2 : COST_BLOCKED;
+        }
+        return 1;
+}
+
+
+// The same map, pre-inflated for agents of size sizes_inflate.
+static uint32_t sizes_inflate;
+
+static uint8_t
+sizes_inflated_get (uint32_t x, uint32_t y)
+{
+        uint32_t i, j;
+        for (j = y; j < y + sizes_inflate; j++) {
+                for (i = x; i < x + sizes_inflate; i++) {
+                        if ((i >= 40) || (j >= 20) || (sizes_get (i, j) == COST_BLOCKED))
+                                return COST_BLOCKED;
+                }
+        }
+        return sizes_get (x, y);
+}
+
+
+// A 30x20 open map. With overlay_baked set, it has the obstacles the
+// overlay tests add: a wall with a single gap, and a costly danger zone.
+static int overlay_baked;
+
+static uint8_t
+overlay_get (uint32_t x, uint32_t y)
+{
+        assert ((x < 30) && (y < 20));
+        if (!overlay_baked) return 1;
+        if ((x == 15) && (y != 3)) return COST_BLOCKED;
+        if ((x >= 18) && (x <= 24) && (y >= 5) && (y <= 15)) return 1 + 50;
+        return 1;
+}
+
+
+// Keep track of the routes published by an anytime search.
+static uint32_t published, published_bound, published_score;
+
+static void
+test_publish (astar_t * as)
+{
+        uint8_t * directions;
+        uint32_t j, x = as->x0, y = as->y0;
+        uint32_t route_steps = astar_get_directions (as, &directions);
+
+        // The route must be complete...
+        for (j = 0; j < route_steps; j++) {
+                x += as->dx[directions[j]];
+                y += as->dy[directions[j]];
+                assert (grid_get (x, y) != COST_BLOCKED);
+        }
+        assert ((x == as->x1) && (y == as->y1));
+        free (directions);
+
+        // ...and better than the last one, with a tighter bound.
+        if (published) {
+                assert (as->bound < published_bound);
+                assert (as->score <= published_score);
+        }
+        published++;
+        published_bound = as->bound;
+        published_score = as->score;
+}
+
+
 int
 main (int argc, char ** argv)
 {
@@ -1378,6 +4046,7 @@ main (int argc, char ** argv)
 
         astar_t * as = astar_new (40, 40, grid_get, NULL);
         uint32_t result_code, i, rep;
+        uint32_t results[40], loops[40], scores[40], steps[40];
 
         //astar_t * as = astar_new (0,0, 0,0, 25,20, 40);
         //astar_t * as = astar_new (0,0, 5,5, 25,20, 40);
@@ -1423,8 +4092,13 @@ main (int argc, char ** argv)
 			//astar_init_grid (as, 0,0, grid_get);
 			
 			printf("Running A* (%d,%d) -> (%d,%d)\n", 1,i, 39,39-i);
+			as->loops = 0;
 			result_code = astar_run (as, 1,i, 39,39-i);
 			printf("Result: %d (%s)\n", as->result, as->str_result);
+			results[i] = result_code;
+			loops[i] = as->loops;
+			scores[i] = as->score;
+			steps[i] = as->steps;
 			
 			astar_print (as);
 			assert (result_code == as->result);
@@ -1502,6 +4176,798 @@ main (int argc, char ** argv)
 		}
 	}
 
+        // Landmarks only guide the search. They must not change its outcome,
+        // and their bounds must never exceed the real cost of a route.
+        assert (astar_alt_build (as, 8, 4) > 0);
+        printf("Verified: landmark tables built (%u landmarks).\n", as->alt->num);
+        astar_set_heuristic_factor (as, 0);
+        for (i = 0; i < 40; i++) {
+                as->loops = 0;
+                result_code = astar_run (as, 1,i, 39,39-i);
+                assert (result_code == results[i]);
+                if (result_code == ASTAR_FOUND) {
+                        assert (as->grid[as->ofs0].h <= as->score);
+                }
+                printf("(%d,%d) -> (%d,%d): %u loops with landmarks, %u without.\n",
+                       1, i, 39, 39-i, as->loops, loops[i]);
+        }
+        astar_alt_free (as);
+        astar_set_heuristic_factor (as, _HEURISTIC_FACTOR);
+        printf("Verified: landmarks give the same results with admissible bounds.\n");
+
+        // Moving west costs more than moving east, so distances from the
+        // landmarks can't be reversed. (Without steering penalties, routes
+        // cost the same whatever order squares are expanded in.)
+        uint32_t alt_results[40], alt_scores[40], alt_loops[40], east = as->mc[DIR_E];
+        uint32_t steering_penalty = as->steering_penalty;
+        astar_set_steering_penalty (as, 0);
+        astar_set_cost (as, DIR_W, 5 * east);
+        for (i = 0; i < 40; i++) {
+                alt_results[i] = astar_run (as, 39,39-i, 1,i);
+                alt_scores[i] = as->score;
+        }
+        assert (astar_alt_build (as, 8, 1) > 0);
+        astar_set_heuristic_factor (as, 0);
+        for (i = 0; i < 40; i++) {
+                assert (astar_run (as, 39,39-i, 1,i) == alt_results[i]);
+                assert (as->score == alt_scores[i]);
+        }
+        astar_set_heuristic_factor (as, _HEURISTIC_FACTOR);
+        astar_set_cost (as, DIR_W, east);
+        astar_set_steering_penalty (as, steering_penalty);
+        astar_alt_free (as);
+        printf("Verified: landmarks stay admissible with one-way costs.\n");
+
+        // Any-angle routes are shorter than grid routes, so landmarks are
+        // no use to them.
+        astar_set_any_angle (as, ASTAR_THETA);
+        for (i = 0; i < 40; i++) {
+                as->loops = 0;
+                alt_results[i] = astar_run (as, 1,i, 39,39-i);
+                alt_scores[i] = as->score;
+                alt_loops[i] = as->loops;
+        }
+        assert (astar_alt_build (as, 8, 1) > 0);
+        for (i = 0; i < 40; i++) {
+                as->loops = 0;
+                assert (astar_run (as, 1,i, 39,39-i) == alt_results[i]);
+                assert ((as->score == alt_scores[i]) && (as->loops == alt_loops[i]));
+        }
+        astar_alt_free (as);
+        astar_set_any_angle (as, ASTAR_ANY_ANGLE_NONE);
+        printf("Verified: any-angle searches ignore landmarks.\n");
+
+        // Padded and tiled grids must behave exactly like plain ones.
+        for (rep = 1; rep < 5; rep++) {
+        if (rep == 4) {
+                // And with whatever huge pages we can get.
+                astar_set_alloc_policy (as, ASTAR_ALLOC_HUGETLB | ASTAR_ALLOC_LOCAL);
+                assert (astar_alloc_mode (as) & ASTAR_ALLOC_LOCAL);
+                printf("Grid allocation mode: %u\n", astar_alloc_mode (as));
+        }
+        astar_set_grid_padding (as, rep & 1);
+        astar_set_grid_layout (as, rep & 2 ? ASTAR_LAYOUT_TILED : ASTAR_LAYOUT_ROWS);
+        assert (as->border_safe == (rep & 1));
+        if (rep == 3) {
+                // With landmarks, too.
+                assert (astar_alt_build (as, 8, 1) > 0);
+        }
+        for (i = 0; i < 40; i++) {
+                result_code = astar_run (as, 1,i, 39,39-i);
+                assert (result_code == results[i]);
+                if (as->alt == NULL) {
+                        assert (as->score == scores[i]);
+                        assert (as->steps == steps[i]);
+                }
+                if (!as->have_route) continue;
+
+                uint8_t * directions;
+                uint32_t j, x = as->x0, y = as->y0;
+                uint32_t route_steps = astar_get_directions (as, &directions);
+                for (j = 0; j < route_steps; j++) {
+                        x += as->dx[directions[j]];
+                        y += as->dy[directions[j]];
+                        assert ((x < as->w) && (y < as->h));
+                        assert (grid_get (x, y) != COST_BLOCKED);
+                }
+                assert ((x == as->bestx) && (y == as->besty));
+                free (directions);
+        }
+        if (rep == 3) astar_alt_free (as);
+        }
+        astar_set_alloc_policy (as, ASTAR_ALLOC_DEFAULT);
+        printf("Verified: padded, tiled and huge page grids give the same results.\n");
+
+        // Weighting the heuristic changes the routes, but not whether
+        // there is one.
+        astar_set_epsilon (as, 300);
+        for (i = 0; i < 40; i++) {
+                as->loops = 0;
+                result_code = astar_run (as, 1,i, 39,39-i);
+                assert (result_code == results[i]);
+                if (result_code == ASTAR_FOUND) assert (as->bound == 300);
+                printf("(%d,%d) -> (%d,%d): %u loops with epsilon 3.0, %u without.\n",
+                       1, i, 39, 39-i, as->loops, loops[i]);
+        }
+        // Lighter weights can't find routes better than the best ones.
+        astar_set_epsilon (as, 50);
+        for (i = 0; i < 40; i++) {
+                result_code = astar_run (as, 1,i, 39,39-i);
+                assert (result_code == results[i]);
+                if (result_code == ASTAR_FOUND) assert (as->bound == ASTAR_EPSILON_ONE);
+        }
+        astar_set_epsilon (as, ASTAR_EPSILON_ONE);
+        printf("Verified: weighted A* finds the same routes.\n");
+
+        // Anytime searches publish better routes until epsilon reaches 1.
+        for (i = 0; i < 40; i++) {
+                published = 0;
+                result_code = astar_run_anytime (as, 1,i, 39,39-i, 300, 50, test_publish);
+                assert (result_code == results[i]);
+                if (result_code != ASTAR_FOUND) continue;
+                assert (published > 0);
+                assert (as->bound == ASTAR_EPSILON_ONE);
+                assert (as->score == published_score);
+                printf("(%d,%d) -> (%d,%d): %u route(s), score %u, %u with A*.\n",
+                       1, i, 39, 39-i, published, as->score, scores[i]);
+        }
+        printf("Verified: anytime search publishes improving routes.\n");
+
+        // A small open list may lose routes, but must stay small and never
+        // produce a broken route.
+        astar_set_max_open (as, 16);
+        for (i = 0; i < 40; i++) {
+                result_code = astar_run (as, 1,i, 39,39-i);
+                assert ((result_code == results[i]) ||
+                        ((result_code == ASTAR_NOTFOUND) && astar_may_be_suboptimal (as)));
+                assert (as->heap->length <= 16 + NUM_DIRS);
+                if (result_code == ASTAR_FOUND) {
+                        published = 0;
+                        test_publish (as);
+                }
+                printf("(%d,%d) -> (%d,%d): result %u, score %u, %u squares pruned.\n",
+                       1, i, 39, 39-i, result_code, as->score, as->pruned);
+        }
+        astar_set_max_open (as, 0);
+        printf("Verified: bounded open list stays within bounds.\n");
+
+        // Contexts can give memory back after large searches.
+        astar_set_heap_trim (as, 16);
+        result_code = astar_run (as, 1,0, 39,39);
+        assert (result_code == results[0]);
+        assert (as->heap->alloc <= 16);
+        assert (as->heap->peak > 16);
+        printf("Verified: heap trimmed after the search (peak %u entries).\n", as->heap->peak);
+        astar_set_heap_trim (as, 0);
+
+        // Tie-breaking changes the order of expansion, not the outcome, and
+        // is repeatable.
+        uint32_t tie;
+        for (tie = ASTAR_TIE_HIGH_G; tie <= ASTAR_TIE_CROSS; tie++) {
+                astar_set_tie_break (as, tie);
+                for (i = 0; i < 40; i++) {
+                        as->loops = 0;
+                        result_code = astar_run (as, 1,i, 39,39-i);
+                        assert (result_code == results[i]);
+                        uint32_t tie_loops = as->loops, tie_score = as->score;
+                        as->loops = 0;
+                        assert (astar_run (as, 1,i, 39,39-i) == result_code);
+                        assert ((as->loops == tie_loops) && (as->score == tie_score));
+                        if (result_code == ASTAR_FOUND) {
+                                published = 0;
+                                test_publish (as);
+                        }
+                        printf("(%d,%d) -> (%d,%d): %u loops with tie-breaking policy %u, "
+                               "%u without.\n", 1, i, 39, 39-i, as->loops, tie, loops[i]);
+                }
+        }
+        astar_set_tie_break (as, ASTAR_TIE_NONE);
+        printf("Verified: tie-breaking policies give the same, repeatable results.\n");
+
+        // A huge weight pushes F past what the keys can hold. Lowering G must
+        // still never raise a key.
+        for (tie = ASTAR_TIE_HIGH_G; tie <= ASTAR_TIE_CROSS; tie++) {
+                square_t sat;
+                uint32_t key;
+                memset (&sat, 0, sizeof (sat));
+                astar_set_tie_break (as, tie);
+                as->tie_shift = 0;
+                sat.g = 200;
+                sat.h = 100;
+                sat.f = TIE_FMAX + 1000;
+                key = _astar_key (as, &sat, 0);
+                sat.g -= 100;
+                sat.f -= 100;
+                assert (_astar_key (as, &sat, 0) <= key);
+                sat.f = TIE_FMAX;
+                assert (_astar_key (as, &sat, 0) < key);
+        }
+        astar_set_epsilon (as, 100000000);
+        for (tie = ASTAR_TIE_HIGH_G; tie <= ASTAR_TIE_CROSS; tie++) {
+                astar_set_tie_break (as, tie);
+                for (i = 0; i < 40; i++) {
+                        result_code = astar_run (as, 1,i, 39,39-i);
+                        assert (result_code == results[i]);
+                        if (result_code != ASTAR_FOUND) continue;
+                        published = 0;
+                        test_publish (as);
+                }
+        }
+        astar_set_tie_break (as, ASTAR_TIE_NONE);
+        astar_set_epsilon (as, ASTAR_EPSILON_ONE);
+        printf("Verified: tie-breaking survives keys with saturated F values.\n");
+
+        // Every square is on the heap at most once, so nothing popped is
+        // ever stale. A weighted heuristic is inconsistent, so reopening
+        // closed squares has some work to do.
+        uint32_t reopens = 0;
+        astar_set_epsilon (as, 300);
+        astar_set_reopen (as, 1);
+        for (i = 0; i < 40; i++) {
+                result_code = astar_run (as, 1,i, 39,39-i);
+                assert (result_code == results[i]);
+                assert (as->stale_pops == 0);
+                assert (as->heap->length <= as->grid_area);
+                reopens += as->reopens;
+                if (result_code == ASTAR_FOUND) {
+                        published = 0;
+                        test_publish (as);
+                }
+                printf("(%d,%d) -> (%d,%d): score %u with reopening, %u squares reopened.\n",
+                       1, i, 39, 39-i, as->score, as->reopens);
+        }
+        assert (reopens > 0);
+        astar_set_reopen (as, 0);
+        astar_set_epsilon (as, ASTAR_EPSILON_ONE);
+        printf("Verified: no stale heap entries, closed squares reopened.\n");
+
+        // Waypoints start and end where the route does, and each leg is
+        // a straight line through passable squares. String pulling leaves
+        // fewer of them, and costs no more than the route if asked not to.
+        uint32_t smoothing, counts[3], pulled = 0;
+        for (i = 0; i < 80; i++) {
+                // Try both movement modes.
+                astar_set_movement_mode (as, i < 40 ? DIR_CARDINAL : DIR_8WAY);
+                result_code = astar_run (as, 1,i % 40, 39,39-i % 40);
+                if (!as->have_route) continue;
+
+                uint8_t * directions;
+                uint32_t j, route_cost = 0, x = as->x0, y = as->y0;
+                uint32_t route_steps = astar_get_directions (as, &directions);
+                for (j = 0; j < route_steps; j++) {
+                        x += as->dx[directions[j]];
+                        y += as->dy[directions[j]];
+                        route_cost += as->mc[directions[j]] + grid_get (x, y);
+                }
+                free (directions);
+
+                for (smoothing = 0; smoothing < 3; smoothing++) {
+                        astar_waypoint_t * wp;
+                        astar_set_smoothing (as, smoothing ? ASTAR_SMOOTH_LOS : ASTAR_SMOOTH_NONE);
+                        if (smoothing == 2) astar_set_smoothing (as, ASTAR_SMOOTH_LOS | ASTAR_SMOOTH_KEEP_COST);
+                        uint32_t n = astar_get_waypoints (as, &wp);
+                        uint32_t line_cost = 0;
+                        assert (n >= 2);
+                        assert ((wp[0].x == as->x0) && (wp[0].y == as->y0));
+                        assert ((wp[n - 1].x == x) && (wp[n - 1].y == y));
+                        for (j = 1; j < n; j++) {
+                                assert (astar_line_of_sight (as, wp[j-1].x, wp[j-1].y, wp[j].x, wp[j].y, 0, NULL));
+                                line_cost += astar_line_walk (as, wp[j-1].x, wp[j-1].y, wp[j].x, wp[j].y, 0, 0);
+                        }
+                        if (smoothing == 2) assert (line_cost <= route_cost);
+                        if (smoothing > 0) assert (n <= counts[smoothing - 1]);
+                        counts[smoothing] = n;
+                        astar_free_waypoints (wp);
+                }
+                pulled += counts[0] - counts[1];
+                printf("(%d,%d) -> (%d,%d): %u steps, %u turns, %u waypoints, %u keeping the cost.\n",
+                       1, i % 40, 39, 39-i % 40, route_steps, counts[0] - 2, counts[1], counts[2]);
+        }
+        assert (pulled > 0);
+        astar_set_movement_mode (as, DIR_CARDINAL);
+        astar_set_smoothing (as, ASTAR_SMOOTH_NONE);
+        printf("Verified: waypoints follow clear lines of sight.\n");
+
+        // Any-angle searches find the same routes, in straight lines
+        // between waypoints. Lazy Theta* checks fewer of them.
+        uint32_t mode, checks[3], any_scores[3];
+        for (i = 0; i < 80; i++) {
+                astar_set_movement_mode (as, i < 40 ? DIR_CARDINAL : DIR_8WAY);
+                for (mode = ASTAR_ANY_ANGLE_NONE; mode <= ASTAR_LAZY_THETA; mode++) {
+                        astar_set_any_angle (as, mode);
+                        result_code = astar_run (as, 1,i % 40, 39,39-i % 40);
+                        any_scores[mode] = as->score;
+                        checks[mode] = as->los_checks;
+                        if (i < 40) assert (result_code == results[i]);
+                        if (result_code != ASTAR_FOUND) continue;
+                        assert (as->score <= any_scores[ASTAR_ANY_ANGLE_NONE]);
+
+                        astar_waypoint_t * wp;
+                        uint8_t * directions;
+                        uint32_t j, x = as->x0, y = as->y0;
+                        uint32_t n = astar_get_waypoints (as, &wp);
+                        assert ((wp[0].x == as->x0) && (wp[0].y == as->y0));
+                        assert ((wp[n - 1].x == as->x1) && (wp[n - 1].y == as->y1));
+                        for (j = 1; (mode != ASTAR_ANY_ANGLE_NONE) && (j < n); j++) {
+                                assert (astar_line_of_sight (as, wp[j-1].x, wp[j-1].y, wp[j].x, wp[j].y, 0, NULL));
+                        }
+                        astar_free_waypoints (wp);
+
+                        uint32_t route_steps = astar_get_directions (as, &directions);
+                        for (j = 0; j < route_steps; j++) {
+                                x += as->dx[directions[j]];
+                                y += as->dy[directions[j]];
+                                assert (grid_get (x, y) != COST_BLOCKED);
+                        }
+                        assert ((x == as->x1) && (y == as->y1));
+                        free (directions);
+                }
+                if (result_code == ASTAR_FOUND) {
+                        printf("(%d,%d) -> (%d,%d): score %u on the grid, %u with Theta* "
+                               "(%u lines checked), %u with Lazy Theta* (%u lines).\n",
+                               1, i % 40, 39, 39-i % 40, any_scores[ASTAR_ANY_ANGLE_NONE],
+                               any_scores[ASTAR_THETA], checks[ASTAR_THETA],
+                               any_scores[ASTAR_LAZY_THETA], checks[ASTAR_LAZY_THETA]);
+                }
+        }
+        astar_set_any_angle (as, ASTAR_ANY_ANGLE_NONE);
+        astar_set_movement_mode (as, DIR_CARDINAL);
+        printf("Verified: any-angle searches find routes in straight lines.\n");
+
+        // A window moved over the map only fetches the squares that come
+        // into view, and searches just like one fetched from scratch.
+        static const int32_t shifts[][2] = {
+                { 3, 0 }, { 0, 5 }, { -2, 4 }, { 5, -3 }, { -7, -6 }, { 20, 0 }, { 0, 0 }
+        };
+        astar_t * win = astar_new (16, 16, grid_get, NULL);
+        astar_t * ref = astar_new (16, 16, grid_get, NULL);
+        astar_set_steering_penalty (win, 20);
+        astar_set_steering_penalty (ref, 20);
+        astar_init_grid (win, 10, 10, grid_get);
+        for (i = 0; i < sizeof (shifts) / sizeof (shifts[0]); i++) {
+                int32_t dx = shifts[i][0], dy = shifts[i][1];
+                uint32_t x, y, gets = win->gets;
+                astar_shift_origin (win, dx, dy);
+                uint32_t kept = (16 - abs (dx)) * (16 - abs (dy));
+                if ((abs (dx) >= 16) || (abs (dy) >= 16)) kept = 0;
+                assert (win->gets - gets == 16 * 16 - kept);
+                for (y = 0; y < 16; y++) {
+                        for (x = 0; x < 16; x++) {
+                                assert (win->grid[mkofs (win, x, y)].cost ==
+                                        grid_get (win->origin_x + x, win->origin_y + y));
+                        }
+                }
+
+                // Search between the first and last open squares.
+                uint32_t a = 0, b = 16 * 16 - 1;
+                while (win->grid[mkofs (win, a % 16, a / 16)].cost == COST_BLOCKED) a++;
+                while (win->grid[mkofs (win, b % 16, b / 16)].cost == COST_BLOCKED) b--;
+                astar_init_grid (ref, win->origin_x, win->origin_y, grid_get);
+                result_code = astar_run (win, a % 16, a / 16, b % 16, b / 16);
+                assert (astar_run (ref, a % 16, a / 16, b % 16, b / 16) == result_code);
+                assert ((win->score == ref->score) && (win->steps == ref->steps));
+                printf("Window at (%u,%u): %u squares fetched, result %u, score %u.\n",
+                       win->origin_x, win->origin_y, 16 * 16 - kept, result_code, win->score);
+        }
+        printf("Verified: moving windows only fetch what comes into view.\n");
+
+        // Landmarks describe the old window, so they must go whichever way
+        // the window is moved: over a partially fetched grid, or too far to
+        // keep anything. (Without steering penalties, optimal routes all
+        // cost the same.)
+        astar_t * part = astar_new (16, 16, grid_get, NULL);
+        astar_set_origin (part, 10, 10);
+        astar_set_steering_penalty (part, 0);
+        astar_set_steering_penalty (win, 0);
+        astar_set_steering_penalty (ref, 0);
+        astar_init_grid (win, 10, 10, grid_get);
+        for (i = 0; i < 2; i++) {
+                astar_t * moved = i ? win : part;
+                assert (astar_alt_build (moved, 8, 1) > 0);
+                astar_shift_origin (moved, i ? 20 : 3, i ? 0 : 2);
+                assert (moved->alt == NULL);
+
+                uint32_t a = 0, b = 16 * 16 - 1;
+                astar_init_grid (ref, moved->origin_x, moved->origin_y, grid_get);
+                while (ref->grid[mkofs (ref, a % 16, a / 16)].cost == COST_BLOCKED) a++;
+                while (ref->grid[mkofs (ref, b % 16, b / 16)].cost == COST_BLOCKED) b--;
+                result_code = astar_run (moved, a % 16, a / 16, b % 16, b / 16);
+                assert (astar_run (ref, a % 16, a / 16, b % 16, b / 16) == result_code);
+                assert (moved->score == ref->score);
+        }
+        astar_destroy (part);
+        astar_destroy (ref);
+        astar_destroy (win);
+        printf("Verified: moving windows drop their landmarks.\n");
+
+        // Routes across the edges of wrap-around maps are found in a single
+        // search, whose heuristic knows the way round. Every other route
+        // is blocked by the walls.
+        static const uint32_t wrap_tests[][7] = {
+                // x0, y0, x1, y1, wrap, 8-way, steps
+                { 2, 5, 27, 5, ASTAR_WRAP_X, 0, 5 },
+                { 5, 18, 5, 1, ASTAR_WRAP_Y, 0, 3 },
+                { 1, 18, 28, 1, ASTAR_WRAP_X | ASTAR_WRAP_Y, 1, 3 },
+                { 1, 18, 28, 1, ASTAR_WRAP_X | ASTAR_WRAP_Y, 0, 6 },
+        };
+        astar_t * wrap = astar_new (30, 20, wrap_get, NULL);
+        astar_set_origin (wrap, 0, 0);
+        for (i = 0; i < sizeof (wrap_tests) / sizeof (wrap_tests[0]); i++) {
+                const uint32_t * t = wrap_tests[i];
+                astar_set_movement_mode (wrap, t[5] ? DIR_8WAY : DIR_CARDINAL);
+                astar_set_wrap (wrap, 0);
+                assert (astar_run (wrap, t[0], t[1], t[2], t[3]) == ASTAR_NOTFOUND);
+
+                for (rep = 0; rep < 3; rep++) {
+                        astar_set_wrap (wrap, t[4]);
+                        astar_set_grid_padding (wrap, rep == 1);
+                        if (rep == 2) {
+                                astar_init_grid (wrap, 0, 0, wrap_get);
+                                assert (astar_alt_build (wrap, 4, 1) > 0);
+                        }
+                        wrap->loops = 0;
+                        assert (astar_run (wrap, t[0], t[1], t[2], t[3]) == ASTAR_FOUND);
+                        assert (wrap->steps == t[6]);
+                        assert (wrap->loops <= 4 * t[6]);
+
+                        uint8_t * directions;
+                        uint32_t j, x = t[0], y = t[1];
+                        uint32_t route_steps = astar_get_directions (wrap, &directions);
+                        for (j = 0; j < route_steps; j++) {
+                                x = (x + 30 + wrap->dx[directions[j]]) % 30;
+                                y = (y + 20 + wrap->dy[directions[j]]) % 20;
+                                assert (wrap_get (x, y) != COST_BLOCKED);
+                        }
+                        assert ((x == t[2]) && (y == t[3]));
+                        free (directions);
+
+                        astar_waypoint_t * wp;
+                        astar_set_smoothing (wrap, ASTAR_SMOOTH_LOS);
+                        uint32_t n = astar_get_waypoints (wrap, &wp);
+                        assert ((wp[0].x == t[0]) && (wp[n - 1].x == t[2]));
+                        for (j = 1; j < n; j++) {
+                                assert (_astar_seam (wrap, mkofs (wrap, wp[j-1].x, wp[j-1].y),
+                                                     mkofs (wrap, wp[j].x, wp[j].y)) ||
+                                        astar_line_of_sight (wrap, wp[j-1].x, wp[j-1].y,
+                                                             wp[j].x, wp[j].y, 0, NULL));
+                        }
+                        astar_free_waypoints (wp);
+                        printf("(%u,%u) -> (%u,%u): %u steps, %u loops, %u waypoints.\n",
+                               t[0], t[1], t[2], t[3], wrap->steps, wrap->loops, n);
+                }
+                astar_alt_free (wrap);
+        }
+        astar_destroy (wrap);
+        printf("Verified: routes wrap around the edges of the map.\n");
+
+        // Routes between floors take the stairs, and are found in a single
+        // search. The heuristic counts the floors still to climb.
+        static const uint32_t layer_tests[][6] = {
+                // x0, y0, z0, x1, y1, z1
+                { 2, 2, 0, 17, 9, 2 },
+                { 17, 9, 2, 2, 2, 0 },
+                { 8, 1, 0, 12, 1, 0 },
+        };
+        astar_t * floors = astar_new (20, 12, NULL, NULL);
+        astar_set_layers (floors, 3, layer_get, 20);
+        astar_set_origin (floors, 0, 0);
+        for (i = 0; i < sizeof (layer_tests) / sizeof (layer_tests[0]); i++) {
+                const uint32_t * t = layer_tests[i];
+                for (rep = 0; rep < 4; rep++) {
+                        astar_set_grid_padding (floors, rep == 1);
+                        astar_set_grid_layout (floors, rep == 2 ? ASTAR_LAYOUT_TILED :
+                                               ASTAR_LAYOUT_ROWS);
+                        if (rep == 3) astar_init_grid (floors, 0, 0, NULL);
+                        floors->loops = 0;
+                        assert (astar_run_layers (floors, t[0], t[1], t[2],
+                                                  t[3], t[4], t[5]) == ASTAR_FOUND);
+                        assert (floors->loops < 3 * 20 * 12 / 2);
+
+                        // Follow the route, floor by floor.
+                        uint8_t * directions;
+                        uint32_t j, x = t[0], y = t[1], z = t[2], climbs = 0;
+                        uint32_t route_steps = astar_get_directions (floors, &directions);
+                        assert (route_steps == floors->steps);
+                        for (j = 0; j < route_steps; j++) {
+                                uint8_t portals = 0;
+                                layer_get (x, y, z, &portals);
+                                if (directions[j] == DIR_UP) {
+                                        assert (portals & ASTAR_PORTAL_UP);
+                                        z++;
+                                        climbs++;
+                                } else if (directions[j] == DIR_DOWN) {
+                                        assert (portals & ASTAR_PORTAL_DOWN);
+                                        z--;
+                                        climbs++;
+                                }
+                                x += astar_get_dx (floors, directions[j]);
+                                y += astar_get_dy (floors, directions[j]);
+                                assert (layer_get (x, y, z, &portals) != COST_BLOCKED);
+                        }
+                        assert ((x == t[3]) && (y == t[4]) && (z == t[5]));
+                        assert (climbs >= 2);
+                        free (directions);
+
+                        // Waypoints change floors where the route does.
+                        astar_waypoint_t * wp;
+                        astar_set_smoothing (floors, ASTAR_SMOOTH_LOS);
+                        uint32_t n = astar_get_waypoints (floors, &wp);
+                        assert ((wp[0].z == t[2]) && (wp[n - 1].z == t[5]));
+                        for (j = 1; j < n; j++) {
+                                assert ((wp[j].z != wp[j-1].z) ?
+                                        (wp[j].x == wp[j-1].x) && (wp[j].y == wp[j-1].y) :
+                                        astar_line_of_sight (floors, wp[j-1].x, wp[j-1].y,
+                                                             wp[j].x, wp[j].y, wp[j].z, NULL));
+                        }
+                        astar_free_waypoints (wp);
+                        printf("(%u,%u,%u) -> (%u,%u,%u): %u steps, %u loops, %u waypoints.\n",
+                               t[0], t[1], t[2], t[3], t[4], t[5],
+                               floors->steps, floors->loops, n);
+                }
+        }
+
+        // The stairs only go one way now.
+        layer_oneway = 1;
+        astar_set_layers (floors, 3, layer_get, 20);
+        astar_set_origin (floors, 0, 0);
+        assert (astar_run_layers (floors, 2, 2, 0, 17, 9, 2) == ASTAR_FOUND);
+        assert (astar_run_layers (floors, 17, 9, 2, 2, 2, 0) == ASTAR_NOTFOUND);
+        astar_destroy (floors);
+        printf("Verified: routes take the stairs between layers.\n");
+
+        // Targets walled off from the start are rejected without searching,
+        // and the labels stay right as walls come and go.
+        uint32_t j;
+        for (j = 0; j < 30; j++) {
+                for (i = 0; i < 40; i++) {
+                        cc_map[j][i] = (rand () % 100 < 38) ? COST_BLOCKED : 1 + rand () % 4;
+                }
+        }
+        astar_t * cc = astar_new (40, 30, cc_get, NULL);
+        astar_t * plain = astar_new (40, 30, cc_get, NULL);
+        astar_t * fresh = astar_new (40, 30, cc_get, NULL);
+        for (rep = 0; rep < 2; rep++) {
+                uint32_t unreachable = 0, wasted = 0;
+                int mode = rep ? DIR_8WAY : DIR_CARDINAL;
+                astar_set_movement_mode (cc, mode);
+                astar_set_movement_mode (plain, mode);
+                astar_set_movement_mode (fresh, mode);
+                astar_set_origin (plain, 0, 0);
+                astar_set_origin (fresh, 0, 0);
+                astar_init_grid (cc, 0, 0, cc_get);
+                assert (astar_cc_build (cc) > 1);
+
+                for (i = 0; i < 2000; i++) {
+                        uint32_t x = rand () % 40, y = rand () % 30;
+                        if (i % 4 == 0) {
+                                cc_map[y][x] = cc_map[y][x] == COST_BLOCKED ? 1 : COST_BLOCKED;
+                                astar_cc_update (cc, x, y);
+                        }
+                        if (i % 200 == 0) {
+                                assert (astar_cc_build (fresh) == cc->cc->num);
+                                cc_check_labels (cc->cc, fresh->cc);
+                        }
+
+                        uint32_t x0 = rand () % 40, y0 = rand () % 30;
+                        uint32_t x1 = rand () % 40, y1 = rand () % 30;
+                        int r = astar_run (cc, x0, y0, x1, y1);
+                        plain->loops = 0;
+                        int r_plain = astar_run (plain, x0, y0, x1, y1);
+                        if (r != ASTAR_UNREACHABLE) {
+                                assert (r == r_plain);
+                                assert ((r != ASTAR_FOUND) || (cc->score == plain->score));
+                                continue;
+                        }
+                        assert (r_plain == ASTAR_NOTFOUND);
+                        unreachable++;
+                        wasted += plain->loops;
+
+                        // The nearest reachable square is reachable, and
+                        // there's nothing reachable any nearer.
+                        uint32_t nx, ny, sx, sy;
+                        assert (astar_cc_nearest (cc, x0, y0, x1, y1, &nx, &ny));
+                        r = astar_run (cc, x0, y0, nx, ny);
+                        assert ((r == ASTAR_FOUND) || (r == ASTAR_TRIVIAL));
+                        uint32_t d = abs ((int) nx - (int) x1) + abs ((int) ny - (int) y1);
+                        for (sy = 0; sy < 30; sy++) {
+                                for (sx = 0; sx < 40; sx++) {
+                                        if (cc->cc->label[sy * 40 + sx] != cc->cc->label[y0 * 40 + x0]) continue;
+                                        assert ((uint32_t) (abs ((int) sx - (int) x1) +
+                                                            abs ((int) sy - (int) y1)) >= d);
+                                }
+                        }
+                }
+                printf("%s: %u components, %u unreachable targets rejected "
+                       "(saving %u search loops).\n", rep ? "8-way" : "Cardinal",
+                       cc->cc->num, unreachable, wasted);
+                assert (unreachable > 0);
+        }
+        astar_destroy (fresh);
+        astar_destroy (plain);
+        astar_destroy (cc);
+
+        // On wrap-around maps, the nearest square may be across the edge.
+        astar_t * seam = astar_new (20, 5, seam_get, NULL);
+        astar_init_grid (seam, 0, 0, seam_get);
+        astar_set_wrap (seam, ASTAR_WRAP_X);
+        assert (astar_cc_build (seam) == 2);
+        uint32_t nx, ny;
+        assert (astar_run (seam, 10, 2, 1, 2) == ASTAR_UNREACHABLE);
+        assert (astar_cc_nearest (seam, 10, 2, 1, 2, &nx, &ny));
+        assert ((nx == 19) && (ny == 2));
+        astar_set_wrap (seam, 0);
+        assert (astar_cc_build (seam) == 2);
+        assert (astar_cc_nearest (seam, 10, 2, 1, 2, &nx, &ny));
+        assert ((nx == 4) && (ny == 2));
+        astar_destroy (seam);
+        printf("Verified: unreachable targets are rejected by component labels.\n");
+
+        // One grid serves agents of all sizes, and their routes cost the
+        // same as on maps inflated for each size.
+        astar_t * sizes = astar_new (40, 20, sizes_get, NULL);
+        astar_t * inflated = astar_new (40, 20, sizes_inflated_get, NULL);
+        astar_set_origin (inflated, 0, 0);
+        astar_set_steering_penalty (sizes, 0);
+        astar_set_steering_penalty (inflated, 0);
+        astar_set_heuristic_factor (sizes, 0);
+        astar_set_heuristic_factor (inflated, 0);
+        for (rep = 0; rep < 4; rep++) {
+                uint32_t size, last = 0, smallest = 0;
+                int mode = rep & 1 ? DIR_8WAY : DIR_CARDINAL;
+                astar_set_movement_mode (sizes, mode);
+                astar_set_movement_mode (inflated, mode);
+                astar_set_any_angle (sizes, ASTAR_ANY_ANGLE_NONE);
+                if (rep < 2) astar_set_origin (sizes, 0, 0);
+                else astar_init_grid (sizes, 0, 0, sizes_get);
+                assert (astar_clearance_build (sizes));
+                assert (sizes->clearance[mkofs (sizes, 0, 0)] == 12);
+                assert (sizes->clearance[mkofs (sizes, 12, 15)] == 3);
+                for (size = 1; size <= 4; size++) {
+                        astar_set_agent_size (sizes, size);
+                        sizes_inflate = size;
+                        int r = astar_run (sizes, 2, 2, 35, 2);
+                        assert (r == astar_run (inflated, 2, 2, 35, 2));
+                        if (size == 4) {
+                                assert (r == ASTAR_NOTFOUND);
+                                break;
+                        }
+                        assert (r == ASTAR_FOUND);
+                        assert (sizes->score == inflated->score);
+                        assert (sizes->score >= last);
+                        assert ((size == 1) || (sizes->score > smallest));
+                        if (size == 1) smallest = sizes->score;
+                        last = sizes->score;
+
+                        // The whole footprint stays clear along the route.
+                        uint8_t * directions;
+                        uint32_t j, x = 2, y = 2;
+                        uint32_t route_steps = astar_get_directions (sizes, &directions);
+                        for (j = 0; j < route_steps; j++) {
+                                x += sizes->dx[directions[j]];
+                                y += sizes->dy[directions[j]];
+                                assert (sizes_inflated_get (x, y) != COST_BLOCKED);
+                        }
+                        assert ((x == 35) && (y == 2));
+                        free (directions);
+
+                        // So do lines of sight between waypoints.
+                        astar_set_any_angle (sizes, ASTAR_THETA);
+                        assert (astar_run (sizes, 2, 2, 35, 2) == ASTAR_FOUND);
+                        astar_waypoint_t * wp;
+                        uint32_t n = astar_get_waypoints (sizes, &wp);
+                        for (j = 1; j < n; j++) {
+                                assert (astar_line_of_sight (inflated, wp[j-1].x, wp[j-1].y,
+                                                             wp[j].x, wp[j].y, 0, NULL));
+                        }
+                        astar_free_waypoints (wp);
+                        astar_set_any_angle (sizes, ASTAR_ANY_ANGLE_NONE);
+                        printf("Size %u: score %u, %u waypoints.\n", size, last, n);
+                }
+
+                // Big agents can't even stand in a gap.
+                assert (astar_run (sizes, 12, 2, 2, 2) == ASTAR_EMBEDDED);
+                astar_set_agent_size (sizes, 1);
+                assert (astar_run (sizes, 12, 2, 2, 2) == ASTAR_FOUND);
+
+                // Close the wide gaps and open them again.
+                astar_set_agent_size (sizes, 3);
+                sizes_closed[16][12] = sizes_closed[16][26] = 1;
+                astar_cc_update (sizes, 12, 16);
+                astar_cc_update (sizes, 26, 16);
+                assert (astar_run (sizes, 2, 2, 35, 2) == ASTAR_NOTFOUND);
+                sizes_closed[16][12] = sizes_closed[16][26] = 0;
+                astar_cc_update (sizes, 12, 16);
+                astar_cc_update (sizes, 26, 16);
+                assert (astar_run (sizes, 2, 2, 35, 2) == ASTAR_FOUND);
+
+                // Updated clearances match rebuilt ones.
+                uint8_t * updated = (uint8_t *) malloc (sizes->grid_area);
+                for (j = 0; j < 300; j++) {
+                        uint32_t x = rand () % 40, y = rand () % 20;
+                        sizes_closed[y][x] = !sizes_closed[y][x];
+                        astar_cc_update (sizes, x, y);
+                }
+                memcpy (updated, sizes->clearance, sizes->grid_area);
+                astar_clearance_build (sizes);
+                assert (memcmp (updated, sizes->clearance, sizes->grid_area) == 0);
+                free (updated);
+                memset (sizes_closed, 0, sizeof (sizes_closed));
+                astar_set_agent_size (sizes, 1);
+        }
+        astar_destroy (inflated);
+        astar_destroy (sizes);
+        printf("Verified: agents only go where they fit.\n");
+
+        // Overlays add obstacles for one search only, and searches with
+        // them find the same routes as on a map that has the obstacles.
+        astar_overlay_t * wall = astar_overlay_new ();
+        astar_overlay_t * danger = astar_overlay_new ();
+        for (j = 0; j < 20; j++) {
+                if (j != 3) astar_overlay_add (wall, 15, j, 0, COST_BLOCKED);
+        }
+        astar_overlay_add (wall, 1000, 1000, 0, COST_BLOCKED);
+        for (j = 5; j <= 15; j++) {
+                for (i = 18; i <= 24; i++) {
+                        astar_overlay_add (danger, i, j, 0, 20);
+                        astar_overlay_add (danger, i, j, 0, 30);
+                }
+        }
+        assert (wall->num == 20);
+        assert (danger->num == 7 * 11);
+
+        astar_t * ovl = astar_new (30, 20, overlay_get, NULL);
+        astar_t * baked = astar_new (30, 20, overlay_get, NULL);
+        astar_set_origin (baked, 0, 0);
+        for (rep = 0; rep < 4; rep++) {
+                int mode = rep & 1 ? DIR_8WAY : DIR_CARDINAL;
+                astar_set_movement_mode (ovl, mode);
+                astar_set_movement_mode (baked, mode);
+                astar_set_any_angle (ovl, rep & 2 ? ASTAR_THETA : ASTAR_ANY_ANGLE_NONE);
+                astar_set_any_angle (baked, rep & 2 ? ASTAR_THETA : ASTAR_ANY_ANGLE_NONE);
+                overlay_baked = 0;
+                astar_init_grid (ovl, 0, 0, overlay_get);
+                overlay_baked = 1;
+
+                assert (astar_run (ovl, 2, 10, 27, 10) == ASTAR_FOUND);
+                uint32_t plain_score = ovl->score, gets = ovl->gets;
+
+                astar_add_overlay (ovl, wall);
+                astar_add_overlay (ovl, danger);
+                assert (astar_run (ovl, 2, 10, 27, 10) == ASTAR_FOUND);
+                assert (astar_run (baked, 2, 10, 27, 10) == ASTAR_FOUND);
+                assert (ovl->score == baked->score);
+                assert (ovl->score > plain_score);
+
+                // The route goes through the gap, and so do the lines of
+                // sight between its waypoints.
+                astar_waypoint_t * wp;
+                uint32_t n = astar_get_waypoints (ovl, &wp);
+                for (j = 1; j < n; j++) {
+                        assert (astar_line_of_sight (baked, wp[j-1].x, wp[j-1].y,
+                                                     wp[j].x, wp[j].y, 0, NULL));
+                }
+                astar_free_waypoints (wp);
+
+                // The next search doesn't see the overlays, and the cached
+                // grid is still good.
+                assert (astar_run (ovl, 2, 10, 27, 10) == ASTAR_FOUND);
+                assert (ovl->score == plain_score);
+                assert (ovl->gets == gets);
+
+                // Blocked targets can't be reached.
+                astar_add_overlay (ovl, wall);
+                assert (astar_run (ovl, 2, 10, 15, 10) == ASTAR_NOTFOUND);
+                printf("Overlays: score %u, %u without them.\n", baked->score, plain_score);
+        }
+        astar_overlay_clear (wall);
+        assert (wall->num == 0);
+        astar_overlay_destroy (wall);
+        astar_overlay_destroy (danger);
+        astar_destroy (baked);
+        astar_destroy (ovl);
+        overlay_baked = 0;
+        printf("Verified: cost overlays last for one search.\n");
+
         astar_destroy (as);
         printf("All tests were successful.\n");
 }
@@ -1509,4 +4975,168 @@ main (int argc, char ** argv)
 #endif // TEST_ASTAR
 
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// BENCHMARKING
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef BENCH_ASTAR
+
+#ifdef __linux__
+#  include <unistd.h>
+#  include <sys/syscall.h>
+#  include <linux/perf_event.h>
+#endif // __linux__
+
+#ifndef BENCH_SIZE
+#define BENCH_SIZE 512
+#endif // BENCH_SIZE
+
+#ifndef BENCH_RUNS
+#define BENCH_RUNS 200
+#endif // BENCH_RUNS
+
+// Percentage of blocked squares on the benchmark map.
+#ifndef BENCH_WALLS
+#define BENCH_WALLS 20
+#endif // BENCH_WALLS
+
+
+static uint8_t bench_map [BENCH_SIZE * BENCH_SIZE];
+
+
+static uint8_t
+bench_get (const uint32_t x, const uint32_t y)
+{
+        return bench_map [y * BENCH_SIZE + x];
+}
+
+
+// Open a hardware event counter for this thread. Returns -1 if the kernel or
+// the machine don't support it.
+static int
+bench_counter (uint32_t type, uint64_t config)
+{
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset (&attr, 0, sizeof (attr));
+        attr.size = sizeof (attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+        return -1;
+#endif // __linux__
+}
+
+
+static uint64_t
+bench_read (int fd)
+{
+        uint64_t count = 0;
+        if ((fd < 0) || (read (fd, &count, sizeof (count)) != sizeof (count))) return 0;
+        return count;
+}
+
+
+static void
+bench_run (const char * name, const int layout, const uint32_t tie_break, const int open)
+{
+        uint32_t i, found = 0, loops = 0, updates = 0, usecs = 0;
+        uint32_t walls = open ? 0 : BENCH_WALLS;
+        uint64_t misses = 0, tlb_misses = 0;
+
+        // A reproducible random map of 2x1 walls on open ground.
+        srand (0);
+        for (i = 0; i < BENCH_SIZE * BENCH_SIZE; i++) bench_map[i] = 1;
+        for (i = 0; i < BENCH_SIZE * BENCH_SIZE * walls / 200; i++) {
+                uint32_t ofs = rand() % (BENCH_SIZE * BENCH_SIZE - 1);
+                bench_map[ofs] = bench_map[ofs + 1] = COST_BLOCKED;
+        }
+
+        astar_t * as = astar_new (BENCH_SIZE, BENCH_SIZE, bench_get, NULL);
+        astar_set_origin (as, 0, 0);
+#ifdef BENCH_PADDED
+        astar_set_grid_padding (as, 1);
+#endif // BENCH_PADDED
+        astar_set_grid_layout (as, layout);
+        astar_set_tie_break (as, tie_break);
+        if (open) {
+                // Open ground with an exact heuristic: the worst case for
+                // ties.
+                astar_set_movement_mode (as, DIR_CARDINAL);
+                astar_set_steering_penalty (as, 0);
+                astar_set_heuristic_factor (as, CC + 1);
+        }
+#ifdef BENCH_ALLOC
+        astar_set_alloc_policy (as, BENCH_ALLOC);
+#endif // BENCH_ALLOC
+
+        int fd_misses = bench_counter (PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        int fd_tlb = bench_counter (PERF_TYPE_HW_CACHE,
+                                    PERF_COUNT_HW_CACHE_DTLB |
+                                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+        // The same queries for every layout.
+        for (i = 0; i < BENCH_RUNS; i++) {
+                uint32_t x0 = rand() % BENCH_SIZE, y0 = rand() % BENCH_SIZE;
+                uint32_t x1 = rand() % BENCH_SIZE, y1 = rand() % BENCH_SIZE;
+                bench_map[y0 * BENCH_SIZE + x0] = 1;
+                bench_map[y1 * BENCH_SIZE + x1] = 1;
+
+                as->loops = 0;
+                as->updates = 0;
+                uint64_t m0 = bench_read (fd_misses), t0 = bench_read (fd_tlb);
+                if (astar_run (as, x0, y0, x1, y1) == ASTAR_FOUND) found++;
+                misses += bench_read (fd_misses) - m0;
+                tlb_misses += bench_read (fd_tlb) - t0;
+                loops += as->loops;
+                updates += as->updates;
+                usecs += as->usecs;
+        }
+
+        printf ("\n%s: %u runs on a %ux%u map (%u%% walls), %u found.\n",
+                name, BENCH_RUNS, BENCH_SIZE, BENCH_SIZE, walls, found);
+        printf ("Allocation:    mode %u\n", astar_alloc_mode (as));
+        printf ("Expansions:    %.1f per run\n", (double) loops / BENCH_RUNS);
+        printf ("Heap updates:  %.1f per run\n", (double) updates / BENCH_RUNS);
+        printf ("Time:          %.3f ms per run\n", usecs / 1000.0 / BENCH_RUNS);
+        printf ("Expansion:     %.1f ns\n", loops ? usecs * 1000.0 / loops : 0);
+        if (fd_misses >= 0) {
+                printf ("Cache misses:  %.2f per expansion\n", loops ? (double) misses / loops : 0);
+        } else {
+                printf ("Cache misses:  (no hardware counters available)\n");
+        }
+        if (fd_tlb >= 0) {
+                printf ("dTLB misses:   %.2f per expansion\n", loops ? (double) tlb_misses / loops : 0);
+        }
+
+        if (fd_misses >= 0) close (fd_misses);
+        if (fd_tlb >= 0) close (fd_tlb);
+        astar_destroy (as);
+}
+
+
+int
+main (int argc, char ** argv)
+{
+        bench_run ("Row-major layout", ASTAR_LAYOUT_ROWS, ASTAR_TIE_NONE, 0);
+        bench_run ("Tiled layout", ASTAR_LAYOUT_TILED, ASTAR_TIE_NONE, 0);
+
+        // Tie-breaking matters most on open ground.
+        bench_run ("Open ground, no tie-breaking", ASTAR_LAYOUT_ROWS, ASTAR_TIE_NONE, 1);
+        bench_run ("Open ground, ties to higher G", ASTAR_LAYOUT_ROWS, ASTAR_TIE_HIGH_G, 1);
+        bench_run ("Open ground, ties to lower H", ASTAR_LAYOUT_ROWS, ASTAR_TIE_LOW_H, 1);
+        bench_run ("Open ground, ties to the line", ASTAR_LAYOUT_ROWS, ASTAR_TIE_CROSS, 1);
+        return 0;
+}
+
+#endif // BENCH_ASTAR
+
+
 // End of file.
@@ -42,6 +42,82 @@ extern "C" {
 typedef uint8_t direction_t;
 
 
+// Smoothed routes are returned as an array of waypoints, in the co-ordinate
+// system of the A* grid (like the start and target squares).
+typedef struct {
+	uint32_t    x;
+	uint32_t    y;
+	uint32_t    z;          // Layer (always 0 unless the grid is layered).
+} astar_waypoint_t;
+
+
+/*
+ * Landmark tables for the differential (ALT) heuristic, built once for a
+ * static map by astar_alt_build(). For every square of the search grid, the
+ * tables hold the exact cost of reaching it from each landmark. The distances
+ * of all landmarks are stored contiguously for each square, so one lookup
+ * touches one cache line, and squares are in the same order as in the grid.
+ * They are stored as uint16_t if they all fit, and as uint32_t otherwise.
+ */
+
+typedef struct {
+	uint32_t    num;        // Number of landmarks.
+	uint32_t    w;          // Width of the tables (same as the grid's).
+	uint32_t    h;          // Height of the tables (same as the grid's).
+	uint32_t *  x;          // X ordinates of the landmarks.
+	uint32_t *  y;          // Y ordinates of the landmarks.
+	uint32_t    wide:1;     // Distances are uint32_t, not uint16_t.
+	uint32_t    symmetric:1; // Moves cost the same both ways.
+	uint16_t *  dist16;     // Compact distance tables...
+	uint32_t *  dist32;     // ...or wide ones.
+} astar_alt_t;
+
+
+/*
+ * Connected components of the search grid, labelled once for a static map by
+ * astar_cc_build() and kept up to date by astar_cc_update(). Squares that can
+ * reach each other have the same label, and blocked squares are labelled 0.
+ * Labels of components that were merged or split are recycled.
+ */
+
+typedef struct {
+	uint32_t    w;          // Width of the labels (same as the grid's).
+	uint32_t    h;          // Height of the labels (same as the grid's).
+	uint32_t *  label;      // Component of each square, in row-major order.
+	uint32_t *  size;       // Number of squares in each component.
+	uint32_t    num;        // Number of components.
+	uint32_t    next;       // The next label never handed out...
+	uint32_t *  spare;      // ...and labels free for reuse.
+	uint32_t    num_spare;
+	uint32_t *  stack;      // Scratch space for flood fills.
+} astar_cc_t;
+
+
+/*
+ * Cost overlays: sparse sets of squares that cost extra, or are blocked, for
+ * a single search (see astar_add_overlay()). Squares are in map co-ordinates
+ * (like those passed to get()), so overlays can be shared between A*
+ * contexts and survive moving the origin. They're kept in an open addressing
+ * hash table.
+ */
+
+typedef struct {
+	uint32_t    x;
+	uint32_t    y;
+	uint32_t    z;          // Layer (0 unless the grid is layered).
+	uint32_t    cost;       // Extra cost, or COST_BLOCKED (0 if the slot is empty).
+} astar_overlay_square_t;
+
+typedef struct {
+	astar_overlay_square_t * squares;
+	uint32_t    num;        // Number of squares in the overlay.
+	uint32_t    mask;       // Size of the table, minus one.
+} astar_overlay_t;
+
+// The most overlays a single search can use.
+#define ASTAR_MAX_OVERLAYS 8
+
+
 /*
  * The A* data structure itself.
  *
@@ -73,9 +149,9 @@ typedef uint8_t direction_t;
  *
  * Note that this is an oversimplification. Since game maps can be
  * topologically torroidal (if wrap-around is used), the actual mapping may
- * vary (e.g. may be modulo the size of the map). This algorithm won't handle
- * this case internally. The caller should have massaged numbers
- * appropriately.
+ * vary (e.g. may be modulo the size of the map). If the grid spans the whole
+ * map along an axis, astar_set_wrap() lets routes cross that edge of the map.
+ * Otherwise, the caller should have massaged numbers appropriately.
  *
  * If your map is sufficiently small, you can find paths on the entire map by
  * setting the origin to (0,0) and making the width and height match those of
@@ -96,9 +172,11 @@ typedef struct {
 
 	uint32_t    x0, y0;     // Starting location.
 	uint32_t    x1, y1;     // Destination location.
+	uint32_t    z0, z1;     // Layers of the above (layered grids).
 
 	uint32_t    w;          // Width (pitch) of the grid.
 	uint32_t    h;		// Height of the grid.
+	uint32_t    layers;     // Number of layers of the grid (1 unless layered).
 
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -116,12 +194,47 @@ typedef struct {
 
 	uint32_t    timeout;
 
+	// Maximum number of squares on the open list (0 for no limit).
+
+	uint32_t    max_open;
+
+	// Shrink the heap to this many entries after a search, if it grew
+	// larger (0 to never shrink it).
+
+	uint32_t    heap_trim;
+
+	// Move closed squares back to the open list if a better path to them
+	// is found.
+
+	uint32_t    reopen;
+
+	// How astar_get_waypoints() smooths routes (ASTAR_SMOOTH_x flags).
+
+	uint32_t    smoothing;
+
+	// Any-angle search mode (ASTAR_ANY_ANGLE_x).
+
+	uint32_t    any_angle;
+
+	// The axes along which the map wraps around (ASTAR_WRAP_x flags).
+
+	uint32_t    wrap;
+
 	// Arrays of 8 elements holding delta-x and delta-y pairs for the eight
 	// directions.
 
 	int32_t dx[NUM_DIRS];
 	int32_t dy[NUM_DIRS];
 
+	// Derived from the above and the movement mode: the grid offset delta
+	// of each direction, the directions in use, and how far from the edges
+	// of the grid a square must be for all its neighbours to be in it.
+
+	int32_t  dofs[NUM_DIRS];
+	uint8_t  dirs[NUM_DIRS];
+	uint8_t  num_dirs;
+	uint32_t margin;
+
 	// An array of 8 elements holding the costs of moving in each of the
 	// directions.
 
@@ -138,6 +251,20 @@ typedef struct {
 
 	int32_t heuristic_factor;
 
+	// Weighted A*: the weight of h in f = g + h, in units of
+	// ASTAR_EPSILON_ONE.
+
+	uint32_t epsilon;
+
+	// How to order squares with equal F values (ASTAR_TIE_x).
+
+	uint32_t tie_break;
+
+	// Size of the agent's (square) footprint, anchored at its top left
+	// square. Only used if the clearance plane has been built.
+
+	uint32_t agent_size;
+
 	///////////////////////////////////////////////////////////////////////////////
 	//
 	// User functions
@@ -165,6 +292,16 @@ typedef struct {
 
 	uint8_t (*get) (const uint32_t x, const uint32_t y);
 
+	// Layered grids use this instead. It also sets the ASTAR_PORTAL_x flags
+	// of the portals leading out of the square.
+
+	uint8_t (*get_layer) (const uint32_t x, const uint32_t y, const uint32_t z,
+			      uint8_t * portals);
+
+	// The cost of moving through a portal to the next layer.
+
+	uint32_t climb_cost;
+
 	///////////////////////////////////////////////////////////////////////////////
 	//
 	// Data needed to run the algorithm
@@ -176,6 +313,35 @@ typedef struct {
 	uint32_t    bestscore;  // Best H so far.
 	asheap_t *  heap;	// The binary heap holds F |-> square_t mappings.
 	square_t *  grid;	// The grid holds the actual square_t structs.
+	uint32_t    grid_area;  // Number of squares in the grid (with the border).
+	uint32_t    layer_area; // Number of squares in each layer of the grid.
+	uint32_t    pitch;      // Length of a grid row in memory (with the border).
+	uint32_t    pad;        // Width of the blocked border around the grid.
+	uint32_t    tiles_w;    // Tiles per row of tiles (tiled layout only).
+	uint32_t    alloc_policy; // How to allocate the grid (ASTAR_ALLOC_x flags).
+	size_t      mapped;     // Size of the grid mapping, if it was mmap()ed.
+	astar_alt_t * alt;      // Landmark tables (or NULL if not built).
+	astar_cc_t * cc;        // Connected components (or NULL if not labelled).
+	uint8_t *   clearance;  // Clearance of every square (or NULL if not built).
+
+	// Overlays added for the next search, and those of the last search,
+	// merged and keyed by grid offset.
+	astar_overlay_t * overlays[ASTAR_MAX_OVERLAYS];
+	uint32_t    num_overlays;
+	uint32_t *  ov_ofs;
+	uint32_t *  ov_cost;
+	uint32_t    ov_num;
+	uint32_t    ov_mask;
+	uint32_t    weight;     // Weight of h in the current search (ASTAR_EPSILON_ONE=1).
+	uint32_t    tie_shift;  // Scale of g or h in heap keys (tie-breaking).
+	uint32_t    tie_len;    // Scale of the cross product in heap keys.
+	uint32_t *  ara_closed; // Anytime search: squares closed in this iteration...
+	uint32_t    ara_nclosed;
+	uint32_t    ara_closed_alloc;
+	uint32_t *  ara_incons; // ...and closed squares whose g has improved since.
+	uint32_t    ara_nincons;
+	uint32_t    ara_incons_alloc;
+	uint32_t *  parent;     // Any-angle search: the parent of every square seen.
 
 	// Bitfield holding search state.
 
@@ -183,9 +349,14 @@ typedef struct {
 	uint32_t  must_reset:1; // A search has ran, must reset.
 	uint32_t  grid_init:1;  // The grid has been initialised.
 	uint32_t  grid_clean:1; // The grid is ready for use.
+	uint32_t  grid_full:1;  // All squares of the grid have been fetched.
 	uint32_t  have_route:1; // A (partial) route has been found.
 	uint32_t  have_best:1;  // There's a compromise route.
         uint32_t  move_8way:1;   // Move along all 8 directions.
+	uint32_t  border_safe:1; // The border stops all moves leaving the grid.
+	uint32_t  tiled:1;      // The grid is stored in tiles (ASTAR_LAYOUT_TILED).
+	uint32_t  anytime:1;    // An anytime search is in progress.
+	uint32_t  theta:1;      // The last search was an any-angle one.
 	
 	struct timeval t0;      // Algorithm start time.
 
@@ -197,6 +368,7 @@ typedef struct {
 
 	uint32_t    steps;	// Number of moves in the route.
 	uint32_t    score;	// Score of the route.
+	uint32_t    bound;      // Suboptimality bound of the route (ASTAR_EPSILON_ONE=1).
 	uint32_t    result;	// Result code of the routing.
 	char *      str_result; // Stringified result code.
 	uint32_t    usecs;      // Search time in microseconds.
@@ -205,6 +377,12 @@ typedef struct {
 	uint32_t    updates;    // Keeps track of heap updates (they're expensive).
 	uint32_t    open;       // Number of open positions.
 	uint32_t    closed;     // Number of closed positions.
+	uint32_t    pruned;     // Open positions dropped to stay within max_open.
+	uint32_t    stale_pops; // Heap entries popped that weren't open (wasted work).
+	uint32_t    reopens;    // Closed positions moved back to the open list.
+	uint32_t    los_checks; // Lines of sight checked by any-angle searches.
+
+	uint32_t    alloc_mode; // How the grid was actually allocated (ASTAR_ALLOC_x flags).
 
 	uint32_t    bestofs;    // If a route wasn't found, the best offset we could reach.
 	uint32_t    bestx;      // Likewise, the X ordinate of the best ending point.
@@ -227,6 +405,8 @@ typedef struct {
 #define ASTAR_ORIGIN_NOT_SET        6 // astar_t.get() called, but the origin wasn't set.
 #define ASTAR_EMBEDDED              7 // The origin is embedded in a blocked square, can't move.
 #define ASTAR_AMONTILLADO           ASTAR_EMBEDDED // E. A. Poe alias.
+#define ASTAR_UNREACHABLE           8 // The target is in another connected component.
+#define ASTAR_DROPPED               9 // Dropped by a service to make room for more urgent requests.
 
 
 // We use three bits to specify the direction of a square's 'parent'.
@@ -239,10 +419,55 @@ typedef struct {
 #define DIR_SW 5
 #define DIR_NW 7
 
+// Moves through portals on layered grids. These don't move on the plane.
+// Like the others, reversing them flips bit 2.
+#define DIR_UP   8
+#define DIR_DOWN 12
+
+// Staying on the same square for a turn (cooperative searches only).
+#define DIR_WAIT 10
+
+// Portal flags (for layered grids).
+#define ASTAR_PORTAL_UP    1 // Leads to the same square on the layer above.
+#define ASTAR_PORTAL_DOWN  2 // Leads to the same square on the layer below.
+
 // Movement modes.
 #define DIR_CARDINAL  0
 #define DIR_8WAY      1
 
+// Grid layouts.
+#define ASTAR_LAYOUT_ROWS   0 // Row-major (the default).
+#define ASTAR_LAYOUT_TILED  1 // Row-major tiles of 8x8 squares.
+
+// Fixed point epsilon (weight of h) of 1.0.
+#define ASTAR_EPSILON_ONE   100
+
+// Tie-breaking policies for squares with equal F values.
+#define ASTAR_TIE_NONE      0 // Whichever comes first.
+#define ASTAR_TIE_HIGH_G    1 // Prefer the square furthest from the start.
+#define ASTAR_TIE_LOW_H     2 // Prefer the square nearest the target.
+#define ASTAR_TIE_CROSS     3 // Prefer the square nearest the straight line.
+
+// Route smoothing flags (for astar_get_waypoints()).
+#define ASTAR_SMOOTH_NONE      0 // Waypoints at every turn of the route.
+#define ASTAR_SMOOTH_LOS       1 // Skip waypoints in line of sight (string pulling).
+#define ASTAR_SMOOTH_KEEP_COST 2 // ...but only if the cost doesn't go up.
+
+// Any-angle search modes.
+#define ASTAR_ANY_ANGLE_NONE   0 // Moves between adjacent squares only.
+#define ASTAR_THETA            1 // Theta*: parents may be any visible square.
+#define ASTAR_LAZY_THETA       2 // Lazy Theta*: ...checked when expanded.
+
+// Wrap-around flags.
+#define ASTAR_WRAP_X           1 // The left and right edges of the map meet.
+#define ASTAR_WRAP_Y           2 // The top and bottom edges of the map meet.
+
+// Grid allocation policy flags.
+#define ASTAR_ALLOC_DEFAULT 0 // Use calloc().
+#define ASTAR_ALLOC_HUGE    1 // Transparent huge pages (madvise()).
+#define ASTAR_ALLOC_HUGETLB 2 // Explicit huge pages (MAP_HUGETLB).
+#define ASTAR_ALLOC_LOCAL   4 // Fault all pages in from the calling thread.
+
 
 // This is only used in directions_t to signify the end of the directions (for
 // added safety).
@@ -280,6 +505,14 @@ astar_new (const uint32_t w, const uint32_t h,
 	   uint32_t  (*heuristic) (const uint32_t, const uint32_t,
 				   const uint32_t, const uint32_t));
 
+/**
+ * Destroy an A* context, freeing all memory it uses.
+ *
+ * @param as An initialised A* context.
+ */
+
+void astar_destroy (astar_t * as);
+
 
 /** 
  * Initialise fully the A* grid.
@@ -307,6 +540,28 @@ void astar_init_grid (astar_t * as,
 		      uint32_t origin_x, uint32_t origin_y,
 		      uint8_t(*get)(const uint32_t, const uint32_t));
 
+/** 
+ * Move the search grid over the map.
+ *
+ * Units planning in a window around themselves move the window as they go.
+ * If the grid was fetched with astar_init_grid(), the costs of the squares
+ * still in the window are moved to their new place, and only the squares
+ * that came into view are fetched. The number of squares fetched grows with
+ * the distance moved, not the size of the window. Otherwise, this is the
+ * same as moving the origin with astar_set_origin().
+ *
+ * Landmark tables (see astar_alt_build()) describe a fixed part of the map,
+ * and are freed.
+ * 
+ * @param as An initialised A* context.
+ *
+ * @param dx How far to move the origin along the X axis.
+ *
+ * @param dy How far to move the origin along the Y axis.
+ */
+
+void astar_shift_origin (astar_t * as, const int32_t dx, const int32_t dy);
+
 /** 
  * Set cardinal or eight-way pathfinding mode.
  *
@@ -322,6 +577,147 @@ void astar_init_grid (astar_t * as,
 
 void astar_set_movement_mode (astar_t * as, int movement_mode);
 
+/** 
+ * Search wrap-around maps.
+ *
+ * On maps whose edges meet, the grid should cover the whole map along the
+ * wrapping axes (with the origin at 0). Moves off one edge of the grid then
+ * come back in at the opposite edge, and routes across the edge are found in
+ * one search. The heuristic is given the copy of the target nearest each
+ * square, so its co-ordinates may be beyond the edge of the map (negative
+ * ones wrap around, as they're unsigned). Landmark tables built with
+ * astar_alt_build() follow the wrapped moves, too.
+ *
+ * astar_get_waypoints() keeps a waypoint on both sides of every move across
+ * an edge, as the lines between waypoints don't wrap around. For the same
+ * reason, any-angle searches (see astar_set_any_angle()) don't cross edges.
+ * 
+ * @param as An initialised A* context.
+ *
+ * @param wrap A combination of <tt>ASTAR_WRAP_X</tt> and
+ * <tt>ASTAR_WRAP_Y</tt>, or 0 (the default) for maps with edges.
+ */
+
+void astar_set_wrap (astar_t * as, const uint32_t wrap);
+
+/** 
+ * Search grids with several layers (e.g. the floors of a building).
+ *
+ * All layers are the same size as the grid, and are stacked on top of each
+ * other. Moves on a layer are the same as on a flat grid. Portals (e.g.
+ * stairs) connect squares to the same square on the layer above or below,
+ * and moving through one costs climb_cost plus the cost of the square it
+ * leads to. Portals are one-way: to go back, the square on the other layer
+ * needs a portal of its own. The heuristic adds climb_cost for every layer
+ * between a square and the target, so routes head for the right layer early.
+ *
+ * Squares are fetched with get_layer() instead of get(), which returns the
+ * cost of the square and sets the <tt>ASTAR_PORTAL_</tt>x flags of the
+ * portals leading out of it. Use astar_run_layers() to search. Landmark
+ * tables (see astar_alt_build()) and any-angle searches are only available
+ * on grids with one layer.
+ *
+ * The grid is reallocated, so its contents (including any initialisation by
+ * astar_init_grid()) are lost.
+ * 
+ * @param as An initialised A* context.
+ *
+ * @param layers The number of layers. One layer, with a NULL get_layer(),
+ * turns layered grids off.
+ *
+ * @param get_layer The map getter. Given the co-ordinates of a square on the
+ * map and its layer, it returns its cost and sets the
+ * <tt>ASTAR_PORTAL_</tt>x flags in *portals (which are initially clear).
+ *
+ * @param climb_cost The cost of moving through a portal.
+ */
+
+void astar_set_layers (astar_t * as, const uint32_t layers,
+		       uint8_t (*get_layer) (const uint32_t x, const uint32_t y,
+					     const uint32_t z, uint8_t * portals),
+		       const uint32_t climb_cost);
+
+/** 
+ * Surround the search grid with a blocked border.
+ *
+ * By default, the main loop checks that every neighbour of a square it
+ * examines lies within the grid, and calculates its position. If the grid
+ * is allocated with a one-square border of impassable squares around it, the
+ * border stops the search from leaving the grid, and neighbours are found by
+ * adding a constant to the current offset. The border is internal: all
+ * co-ordinates passed to and returned by the library are unchanged, and
+ * get() is never called for border squares.
+ *
+ * The bounds checks are only skipped while all moves (see astar_set_dxy())
+ * are to adjacent squares.
+ *
+ * The grid is reallocated, so its contents (including any initialisation by
+ * astar_init_grid()) are lost. Landmark tables are freed, too.
+ * 
+ * @param as An initialised A* context.
+ *
+ * @param padded Non-zero to add the border, zero to remove it.
+ */
+
+void astar_set_grid_padding (astar_t * as, const int padded);
+
+/** 
+ * Set the memory layout of the search grid.
+ *
+ * By default, the grid is stored in row-major order, like most maps. On wide
+ * grids, this places the squares above and below a square a whole row
+ * apart. The search frontier of a large search then spreads over many pages,
+ * and the TLB and caches thrash. In the tiled layout, the grid is stored in
+ * tiles of 8x8 squares (1k each), so most neighbours of a square are in the
+ * same tile. Converting co-ordinates to offsets is slightly more expensive,
+ * as neighbours are no longer at a constant distance.
+ *
+ * The layout is internal: all co-ordinates passed to and returned by the
+ * library are unchanged. The grid and any landmark tables (see
+ * astar_alt_build()) are reallocated, so their contents are lost.
+ * 
+ * @param as An initialised A* context.
+ *
+ * @param layout Either <tt>ASTAR_LAYOUT_ROWS</tt> or
+ * <tt>ASTAR_LAYOUT_TILED</tt>.
+ */
+
+void astar_set_grid_layout (astar_t * as, const int layout);
+
+/** 
+ * Set how the search grid is allocated.
+ *
+ * Large grids are expensive to allocate and search: every page is faulted in
+ * the first time it's touched, and the search misses the TLB constantly. On
+ * systems that support huge pages, the grid may be allocated using them. The
+ * policy is a combination of these flags:
+ *
+ *   - <tt>ASTAR_ALLOC_HUGETLB</tt>: use explicit huge pages. These must have
+ *        been reserved by the system administrator. If that fails, the
+ *        <tt>ASTAR_ALLOC_HUGE</tt> policy is tried.
+ *   - <tt>ASTAR_ALLOC_HUGE</tt>: ask the kernel to back the grid with
+ *        transparent huge pages.
+ *   - <tt>ASTAR_ALLOC_LOCAL</tt>: fault all pages of the grid in from the
+ *        calling thread. This moves the cost of page faults out of the first
+ *        search. On NUMA machines, pages are placed on the memory node of the
+ *        thread that touches them first, so call this from the thread that
+ *        will be using this context to keep the grid local to it.
+ *
+ * If neither kind of huge page is available, the grid is allocated normally.
+ * The flags for the mode actually used are stored in
+ * <tt>astar_t.alloc_mode</tt>; see astar_alloc_mode().
+ *
+ * The grid is reallocated, so its contents (including any initialisation by
+ * astar_init_grid()) are lost.
+ * 
+ * @param as An initialised A* context.
+ *
+ * @param policy A combination of <tt>ASTAR_ALLOC_</tt>x flags, or
+ * <tt>ASTAR_ALLOC_DEFAULT</tt> to use calloc().
+ */
+
+void astar_set_alloc_policy (astar_t * as, const uint32_t policy);
+
 /** 
  * Retrieve the path found my A*
  *
@@ -386,6 +782,50 @@ uint32_t astar_get_directions (astar_t *as, direction_t ** directions);
 
 void astar_free_directions (direction_t * directions);
 
+/** 
+ * Retrieve the path found by A* as a list of waypoints.
+ *
+ * Grid routes zig-zag. This returns (by reference) the squares where the
+ * route changes course, starting with the starting square and ending with
+ * the last square of the route. How far this goes depends on the smoothing
+ * flags set with astar_set_smoothing(). With <tt>ASTAR_SMOOTH_LOS</tt>,
+ * waypoints are dropped as long as the straight line between their
+ * neighbours only touches passable squares (string pulling). The resulting
+ * route may cross squares the original one didn't, and these may cost more
+ * to cross. Adding <tt>ASTAR_SMOOTH_KEEP_COST</tt> only drops waypoints if
+ * following the line with the moves of the current movement mode costs no
+ * more than the part of the route it replaces.
+ *
+ * The costs are taken from the A* grid, so only squares never seen by the
+ * search are fetched with the <tt>get()</tt> callback.
+ *
+ * @warning The function astar_free_waypoints() must be used with
+ * <tt>waypoints</tt> as its argument to deallocate the array when you are
+ * done processing it. If this is not done, a memory leak will occur.
+ *
+ * @param as An initialised A* context.
+ *
+ * @param waypoints An unallocated variable of type <tt>astar_waypoint_t
+ * *</tt> passed by reference. This will be set to point to a newly allocated
+ * array of waypoints.
+ * 
+ * @return The number of waypoints returned, or 0 if there's no route.
+ */
+
+uint32_t astar_get_waypoints (astar_t *as, astar_waypoint_t ** waypoints);
+
+/** 
+ * Free memory used by a list of waypoints.
+ *
+ * Call this function to deallocate the array yielded by
+ * astar_get_waypoints().
+ * 
+ * @param waypoints An array of waypoints previously allocated by
+ * astar_get_waypoints().
+ */
+
+void astar_free_waypoints (astar_waypoint_t * waypoints);
+
 /** 
  * Set the origin of the path finding map.
  *
@@ -399,6 +839,9 @@ void astar_free_directions (direction_t * directions);
  * technique in conserving CPU cycles if a game unit is meant to plan in small
  * chunks. Using it, you may form small path finding plans (which are not
  * guaranteed to be optimal) and move a unit incrementally.
+ *
+ * Landmark tables, connected component labels and clearances describe the
+ * map under the old origin, and are freed when it moves.
  * 
  * @param as An initialised A* context.
  * @param x The X co-ordinate of the origin.
@@ -411,6 +854,99 @@ void astar_set_max_cost (astar_t *as, const uint32_t max_cost);
 
 void astar_set_timeout (astar_t *as, const uint32_t timeout);
 
+/** 
+ * Limit the size of the open list (bounded-memory search).
+ *
+ * Whenever the open list grows past the limit, the squares on it with the
+ * highest F values are dropped, leaving three quarters of the limit. Dropped
+ * squares are forgotten: they may be reached again later, but the search may
+ * miss the best route, or fail to find a route that exists. Use
+ * astar_may_be_suboptimal() to check if this happened.
+ * 
+ * @param as An initialised A* context.
+ *
+ * @param max_open The maximum number of open squares, or 0 (the default) for
+ * no limit.
+ */
+
+void astar_set_max_open (astar_t *as, const uint32_t max_open);
+
+/** 
+ * Give back heap memory after unusually large searches.
+ *
+ * The heap starts small and doubles in size whenever it fills up, so its
+ * size follows the largest search so far. Contexts kept around for many
+ * searches (e.g. in a pool) may shrink it back after each search that grew
+ * it past a threshold. The largest number of entries ever used is kept in
+ * <tt>astar_t.heap->peak</tt>, and may help choose one.
+ * 
+ * @param as An initialised A* context.
+ *
+ * @param heap_trim The number of heap entries to keep, or 0 (the default)
+ * to never shrink the heap.
+ */
+
+void astar_set_heap_trim (astar_t *as, const uint32_t heap_trim);
+
+/** 
+ * Reopen closed squares when a better path to them is found.
+ *
+ * If the heuristic is consistent, a square's G can't improve once it has
+ * been closed. With an inconsistent heuristic (or the steering penalty),
+ * it can. By default, the improvement is ignored, which is faster but may
+ * give worse routes. If reopening is enabled, the square is moved back to
+ * the open list and expanded again. The number of squares reopened is kept
+ * in <tt>astar_t.reopens</tt>.
+ * 
+ * @param as An initialised A* context.
+ *
+ * @param reopen Non-zero to reopen squares, zero (the default) not to.
+ */
+
+void astar_set_reopen (astar_t *as, const int reopen);
+
+/** 
+ * Choose how astar_get_waypoints() smooths routes.
+ *
+ * @param as An initialised A* context.
+ *
+ * @param smoothing <tt>ASTAR_SMOOTH_NONE</tt> (the default) for a waypoint at
+ * every turn, or <tt>ASTAR_SMOOTH_LOS</tt>, optionally ORed with
+ * <tt>ASTAR_SMOOTH_KEEP_COST</tt>, to pull the route straight.
+ */
+
+void astar_set_smoothing (astar_t *as, const uint32_t smoothing);
+
+/** 
+ * Search for any-angle routes.
+ *
+ * In the any-angle modes, a square's parent on the route may be any square
+ * in line of sight of it (see astar_get_waypoints() for what this means),
+ * not just its neighbours. Routes are straight lines between waypoints, and
+ * are returned by astar_get_waypoints() regardless of the smoothing flags.
+ * Moving along a line costs its length (times the cost of cardinal moves)
+ * plus the mean cost of the squares it enters for every move it would take
+ * on the grid. The steering penalty only applies to moves between
+ * neighbours. astar_get_directions() still works: it follows each line with
+ * grid moves.
+ *
+ * Theta* (<tt>ASTAR_THETA</tt>) checks the line of sight from the parent of
+ * each square expanded to each of its neighbours. Lazy Theta*
+ * (<tt>ASTAR_LAZY_THETA</tt>) assumes it's there, and only checks when the
+ * neighbour is expanded in turn, which takes far fewer checks. The number of
+ * lines checked is kept in <tt>astar_t.los_checks</tt>.
+ *
+ * The any-angle modes need a plane of parent offsets as large as the grid.
+ * They're ignored by astar_run_anytime().
+ * 
+ * @param as An initialised A* context.
+ *
+ * @param mode <tt>ASTAR_ANY_ANGLE_NONE</tt> (the default),
+ * <tt>ASTAR_THETA</tt> or <tt>ASTAR_LAZY_THETA</tt>.
+ */
+
+void astar_set_any_angle (astar_t *as, const uint32_t mode);
+
 void astar_set_dxy (astar_t *as, const uint8_t dir, const int dx, const int dy);
 
 void astar_set_cost (astar_t *as, const uint8_t dir, const uint32_t cost);
@@ -419,6 +955,306 @@ void astar_set_steering_penalty (astar_t *as, const uint32_t steering_penalty);
 
 void astar_set_heuristic_factor (astar_t *as, const uint32_t heuristic_factor);
 
+/** 
+ * Set the weight of the heuristic (weighted A*).
+ *
+ * The search orders squares by f = g + epsilon * h. Weights above 1 make it
+ * greedier: it expands fewer squares and finds routes faster, but they may
+ * cost more. As long as the heuristic (times the heuristic factor) never
+ * overestimates the cost of reaching the target, a route found with weight
+ * epsilon costs at most epsilon times as much as the best one. The built-in
+ * Manhattan heuristic only does so in the cardinal movement mode. Weights
+ * below 1 expand more squares, and their routes are bounded like those
+ * found with a weight of 1.
+ *
+ * The weight of the route found, but no less than 1, is stored in
+ * <tt>astar_t.bound</tt>.
+ * 
+ * @param as An initialised A* context.
+ *
+ * @param epsilon The weight in fixed point: <tt>ASTAR_EPSILON_ONE</tt>
+ * (the default) is 1.0, 150 is 1.5, etc.
+ */
+
+void astar_set_epsilon (astar_t * as, const uint32_t epsilon);
+
+/** 
+ * Choose how to order squares with equal F values.
+ *
+ * On open maps, large numbers of squares have the same F value, and the
+ * search may expand all of them before reaching the target. Preferring the
+ * squares nearer the target among them cuts this down dramatically. The
+ * preference is encoded in the low eight bits of the heap key, so it costs
+ * nothing when comparing keys, and the search remains deterministic. The
+ * policy is one of:
+ *
+ *   - <tt>ASTAR_TIE_NONE</tt>: no preference (the default).
+ *   - <tt>ASTAR_TIE_HIGH_G</tt>: prefer squares with a higher G.
+ *   - <tt>ASTAR_TIE_LOW_H</tt>: prefer squares with a lower H.
+ *   - <tt>ASTAR_TIE_CROSS</tt>: prefer squares nearer the straight line
+ *        from the start to the target. This gives straighter routes on open
+ *        ground.
+ *
+ * With any policy other than <tt>ASTAR_TIE_NONE</tt>, F values are limited
+ * to 24 bits. Larger ones are treated as equal.
+ * 
+ * @param as An initialised A* context.
+ *
+ * @param policy One of the <tt>ASTAR_TIE_</tt>x policies.
+ */
+
+void astar_set_tie_break (astar_t * as, const uint32_t policy);
+
+/** 
+ * Precompute landmark tables for the differential (ALT) heuristic.
+ *
+ * On maze-like maps, the Manhattan heuristic is very weak and A* ends up
+ * expanding most of the map. If the map is static, the search can be guided
+ * much better by picking a few landmarks and calculating, once, the exact
+ * cost of reaching every square of the grid from each of them. By the
+ * triangle inequality, the difference between two squares' distances from a
+ * landmark is a lower bound of the cost of moving between them. The
+ * heuristic then becomes the maximum of these bounds over all landmarks and
+ * the configured heuristic function. Set the heuristic factor to zero to use
+ * the landmark bounds alone.
+ *
+ * Where moves cost more one way than the other (see astar_set_cost()),
+ * fewer bounds are usable and the tables help less. Any-angle searches
+ * (see astar_set_any_angle()) don't use them at all: their routes may be
+ * shorter than the distances in the tables.
+ *
+ * Landmarks are chosen automatically around the edges of the grid. Each
+ * table is filled in by a full Dijkstra search over the grid, using the
+ * movement costs and mode in effect when this function is called (the
+ * steering penalty is ignored). Rebuild the tables if any of these or the
+ * map change.
+ *
+ * If the grid has been initialised with astar_init_grid(), the cached costs
+ * are used. Otherwise, the whole grid is read using the get() callback. The
+ * origin must have been set either way.
+ *
+ * @param as An initialised A* context.
+ *
+ * @param num_landmarks The number of landmarks to pick. Every landmark costs
+ * two or four bytes per grid square. Somewhere between 4 and 16 works well.
+ *
+ * @param num_threads The number of threads used to build the tables (one
+ * landmark per thread at a time). Values of 0 or 1 build them in the calling
+ * thread. Ignored if the library was built without thread support.
+ *
+ * @return The number of landmarks placed. This is zero if the grid could not
+ * be read or has more than one layer, and may be less than
+ * <tt>num_landmarks</tt> on small or mostly blocked maps.
+ */
+
+uint32_t astar_alt_build (astar_t * as, const uint32_t num_landmarks,
+			  const uint32_t num_threads);
+
+/** 
+ * Free the landmark tables built by astar_alt_build().
+ *
+ * Subsequent searches revert to the plain heuristic. This is done
+ * automatically when the A* context is destroyed.
+ * 
+ * @param as An initialised A* context.
+ */
+
+void astar_alt_free (astar_t * as);
+
+/** 
+ * Label the connected components of the search grid.
+ *
+ * When the target can't be reached, A* has to flood every square reachable
+ * from the start before it gives up, which is the slowest search there
+ * is. Once the components of a static map are labelled, astar_run() compares
+ * the labels of the start and target squares instead, and returns
+ * <tt>ASTAR_UNREACHABLE</tt> at once if they differ. Use
+ * astar_cc_nearest() to pick a reachable target instead.
+ *
+ * The labels follow the movement mode and map wrapping in effect when this
+ * function is called, and are dropped when either changes or the origin
+ * moves. They assume every move can be made in reverse. When squares of the
+ * map change to or from <tt>COST_BLOCKED</tt>, call astar_cc_update() for
+ * each of them.
+ *
+ * If the grid has been initialised with astar_init_grid(), the cached costs
+ * are used. Otherwise, the whole grid is read using the get() callback. The
+ * origin must have been set either way.
+ *
+ * @param as An initialised A* context.
+ *
+ * @return The number of components. This is zero if the grid could not be
+ * read or has more than one layer.
+ */
+
+uint32_t astar_cc_build (astar_t * as);
+
+/** 
+ * Free the labels built by astar_cc_build().
+ *
+ * This is done automatically when the A* context is destroyed.
+ * 
+ * @param as An initialised A* context.
+ */
+
+void astar_cc_free (astar_t * as);
+
+/** 
+ * Tell the A* context that a square of the map has changed.
+ *
+ * The square is fetched again using the get() callback if the grid has been
+ * initialised with astar_init_grid(). If the components are labelled, the
+ * labels are updated: opening a square merges the components around it, and
+ * blocking one relabels its component, unless the squares around it are
+ * still connected to each other (which is the usual case, and takes constant
+ * time). The clearance plane is updated too, if it has been built.
+ *
+ * @param as An initialised A* context.
+ * @param x The X ordinate of the square (on the A* grid).
+ * @param y The Y ordinate of the square (on the A* grid).
+ */
+
+void astar_cc_update (astar_t * as, const uint32_t x, const uint32_t y);
+
+/** 
+ * Find the square nearest to the target that can be reached from the start.
+ *
+ * Distances are Manhattan distances. This looks at labels only, without
+ * searching.
+ *
+ * @param as An initialised A* context, with labelled components.
+ * @param x0 The X ordinate of the starting location.
+ * @param y0 The Y ordinate of the starting location.
+ * @param x1 The X ordinate of the target location.
+ * @param y1 The Y ordinate of the target location.
+ * @param x Where to store the X ordinate of the nearest reachable square.
+ * @param y Where to store the Y ordinate of the nearest reachable square.
+ *
+ * @return 1 if a square was found (the target itself, if it's reachable), or
+ * 0 if the components aren't labelled or the start is blocked.
+ */
+
+int astar_cc_nearest (astar_t * as,
+		      const uint32_t x0, const uint32_t y0,
+		      const uint32_t x1, const uint32_t y1,
+		      uint32_t * x, uint32_t * y);
+
+/** 
+ * Build the clearance plane of the search grid, for agents larger than one
+ * square.
+ *
+ * The clearance of a square is the size of the largest unblocked square
+ * area with the square at its top left corner, up to 255. With the plane
+ * built, a single grid serves agents of any size: set the size of the next
+ * search's agent with astar_set_agent_size(), and squares too small for its
+ * footprint are skipped with a single compare. Moves cost the same as for a
+ * single square agent.
+ *
+ * The plane is dropped if the grid is reallocated or the origin moves. The
+ * edges of the grid count as walls, even on wrap-around maps. When squares
+ * of the map change to or from <tt>COST_BLOCKED</tt>, call
+ * astar_cc_update() for each of them.
+ *
+ * If the grid has been initialised with astar_init_grid(), the cached costs
+ * are used. Otherwise, the whole grid is read using the get() (or
+ * get_layer()) callback. The origin must have been set either way.
+ *
+ * @param as An initialised A* context.
+ *
+ * @return 1 if the plane was built, or 0 if the grid could not be read.
+ */
+
+int astar_clearance_build (astar_t * as);
+
+/** 
+ * Free the clearance plane built by astar_clearance_build().
+ *
+ * Subsequent searches are for single square agents again. This is done
+ * automatically when the A* context is destroyed.
+ * 
+ * @param as An initialised A* context.
+ */
+
+void astar_clearance_free (astar_t * as);
+
+/** 
+ * Set the size of the agent for the following searches.
+ *
+ * The agent occupies a square area of size x size squares, with the square
+ * it's on at the top left. Only used if the clearance plane has been built
+ * (see astar_clearance_build()). The default is 1.
+ *
+ * @param as An initialised A* context.
+ * @param size The size of the agent, from 1 to 255.
+ */
+
+void astar_set_agent_size (astar_t * as, const uint32_t size);
+
+/** 
+ * Create an empty cost overlay.
+ *
+ * @return A pointer to a new astar_overlay_t structure.
+ */
+
+astar_overlay_t * astar_overlay_new (void);
+
+/** 
+ * Destroy a cost overlay, freeing all memory it uses.
+ *
+ * @param ov A cost overlay.
+ */
+
+void astar_overlay_destroy (astar_overlay_t * ov);
+
+/** 
+ * Remove all squares from a cost overlay, keeping its memory for reuse.
+ *
+ * @param ov A cost overlay.
+ */
+
+void astar_overlay_clear (astar_overlay_t * ov);
+
+/** 
+ * Add a square to a cost overlay.
+ *
+ * Costs added to the same square more than once add up (up to 254). Adding
+ * <tt>COST_BLOCKED</tt> blocks the square.
+ *
+ * @param ov A cost overlay.
+ * @param x The X ordinate of the square on the game map.
+ * @param y The Y ordinate of the square on the game map.
+ * @param z The layer of the square (0 unless the grid is layered).
+ * @param cost The extra cost of stepping onto the square, or
+ * <tt>COST_BLOCKED</tt>.
+ */
+
+void astar_overlay_add (astar_overlay_t * ov,
+			const uint32_t x, const uint32_t y, const uint32_t z,
+			const uint32_t cost);
+
+/** 
+ * Use a cost overlay in the next search.
+ *
+ * Temporary obstacles like other units, danger zones or reservations can be
+ * added to overlays, instead of changing the map. The extra costs of all
+ * overlays added before a search are added to the costs of the grid's
+ * squares while it runs, and their blocked squares can't be entered (except
+ * by the starting square). Lines of sight used by any-angle searches and
+ * smoothing honour them too. The grid itself doesn't change, so the squares
+ * cached by astar_init_grid() stay valid.
+ *
+ * Overlays are only used by the next search (and the route retrieval
+ * functions that follow it), so they must be added again before each
+ * search that needs them. They're merged when the search starts, and may be
+ * changed or reused for other contexts from then on. Squares outside the
+ * grid are ignored.
+ *
+ * @param as An initialised A* context.
+ * @param ov A cost overlay. Up to <tt>ASTAR_MAX_OVERLAYS</tt> can be added.
+ */
+
+void astar_add_overlay (astar_t * as, astar_overlay_t * ov);
+
 /** 
  * Run the A* algorithm.
  *
@@ -448,6 +1284,9 @@ void astar_set_heuristic_factor (astar_t *as, const uint32_t heuristic_factor);
  *        allotted time ran out before a (full) route was found. A partial path
  *        to a location as near the target as possible may be available. Use
  *        astar_have_route() to check.
+ *   - <tt>ASTAR_UNREACHABLE</tt> means the components of the grid are labelled
+ *        (see astar_cc_build()) and the target is in a different one than the
+ *        starting location. No work was done, and there's no route.
  *   - <tt>ASTAR_GRID_NOT_INITIALISED</tt> (or <tt>ASTAR_GRID_NOT_INITIALIZED</tt>)
  *        is an error condition thrown when a map getter function hasn't been
  *        set and astar_init_grid() hasn't been called in this astar_t context.
@@ -459,19 +1298,86 @@ int astar_run (astar_t * as,
 	       const uint32_t x0, const uint32_t y0,
 	       const uint32_t x1, const uint32_t y1);
 
+/** 
+ * Find a route on a layered grid.
+ *
+ * Like astar_run(), but the starting and target squares may be on any layer
+ * (see astar_set_layers()). Routes may include <tt>DIR_UP</tt> and
+ * <tt>DIR_DOWN</tt> moves through portals.
+ * 
+ * @param as An initialised A* context.
+ * @param x0 The X ordinate of the starting location.
+ * @param y0 The Y ordinate of the starting location.
+ * @param z0 The layer of the starting location.
+ * @param x1 The X ordinate of the target location.
+ * @param y1 The Y ordinate of the target location.
+ * @param z1 The layer of the target location.
+ * 
+ * @return The same result codes as astar_run().
+ */
+int astar_run_layers (astar_t * as,
+		      const uint32_t x0, const uint32_t y0, const uint32_t z0,
+		      const uint32_t x1, const uint32_t y1, const uint32_t z1);
+
+/** 
+ * Run an anytime (ARA*) search.
+ *
+ * This finds a first route quickly using weighted A* with a large weight,
+ * then keeps lowering the weight and improving the route until the weight
+ * reaches 1 or the timeout (see astar_set_timeout()) expires. Each
+ * iteration continues from the open and closed squares of the previous
+ * one, so it only examines squares whose cost has improved since.
+ *
+ * Every route found is published: it is marked on the grid, and the result
+ * fields (<tt>score</tt>, <tt>steps</tt> and <tt>bound</tt>, the weight it
+ * was found with) are set before calling publish(). The callback may use
+ * astar_get_directions(), but must not otherwise modify the context. The
+ * bound holds under the same conditions as with astar_set_epsilon().
+ * 
+ * @param as An initialised A* context.
+ * @param x0 The X ordinate of the starting location.
+ * @param y0 The Y ordinate of the starting location.
+ * @param x1 The X ordinate of the target location.
+ * @param y1 The Y ordinate of the target location.
+ *
+ * @param epsilon The initial weight (<tt>ASTAR_EPSILON_ONE</tt> is 1.0).
+ *
+ * @param delta How much to lower the weight by after each route. Zero lowers
+ * it to 1 straight after the first route.
+ *
+ * @param publish Called with the context every time a better route is
+ * found. May be <tt>NULL</tt>.
+ *
+ * @return The same result codes as astar_run(). If the timeout expires after
+ * a route has been found, the best route so far is kept and
+ * <tt>ASTAR_FOUND</tt> is returned.
+ */
+int astar_run_anytime (astar_t * as,
+		       const uint32_t x0, const uint32_t y0,
+		       const uint32_t x1, const uint32_t y1,
+		       const uint32_t epsilon, const uint32_t delta,
+		       void (*publish) (astar_t * as));
+
 // Return the last A* result code.
 #define astar_result(as) (as)->result
 
 // Return the last A* result code (string version).
 #define astar_str_result(as) (as)->str_result
 
+// Return non-zero if the open list had to be pruned, so the route (or the
+// lack of one) may not be the best possible.
+#define astar_may_be_suboptimal(as) ((as)->pruned != 0)
+
+// Return the way the grid was allocated (ASTAR_ALLOC_x flags).
+#define astar_alloc_mode(as) (as)->alloc_mode
+
 // Return non-zero if the A* algorithm has a route. This is only a
 // full route if ASTAR_FOUND is the result code.
 #define astar_have_route(as) (as)->have_route
 
 // Convert directions to dx, dy.
-#define astar_get_dx(as,dir) ((as)->dx[dir])
-#define astar_get_dy(as,dir) ((as)->dy[dir])
+#define astar_get_dx(as,dir) ((dir) < NUM_DIRS ? (as)->dx[dir] : 0)
+#define astar_get_dy(as,dir) ((dir) < NUM_DIRS ? (as)->dy[dir] : 0)
 
 
 #ifdef ASTAR_DEBUG
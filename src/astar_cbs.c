@@ -0,0 +1,798 @@
+/*
+
+$Id
+
+Copyright (C) 2009 Alexios Chouchoulas
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "astar_cbs.h"
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#  include <pthread.h>
+#  define ASTAR_THREADS
+#endif // HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CONSTANTS AND MACROS
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define check_null(p,err) \
+        if ((p) == NULL) {    \
+                perror (err); \
+                exit (EXIT_FAILURE); \
+        }
+
+// Used as return astar_error (cbs, error_code) to stop processing when
+// an error occurs. It updates statistics.
+#define astar_error(cbs,err)                                            \
+        (((cbs)->result=(err)),                                         \
+         ((cbs)->str_result=#err),                                      \
+         (cbs)->usecs = get_time_difference (&t0),                      \
+         (err))
+
+// Did a search find a route?
+#define routed(r) (((r) == ASTAR_FOUND) || ((r) == ASTAR_TRIVIAL))
+
+// Heap keys are the cost, shifted left to make room for tie-breaking.
+#define TIE_BITS 8
+#define TIE_MAX ((1 << TIE_BITS) - 1)
+
+#define _NODES_INITIAL 256
+
+
+// The UTC timezone -- we only operate on time deltas.
+static struct timezone _tz = { 0, 0 };
+
+
+static inline uint32_t
+get_time_difference (struct timeval *t0)
+{
+        struct timeval t;
+        gettimeofday (&t, &_tz);
+        return (t.tv_sec * 1000000 + t.tv_usec) - (t0->tv_sec * 1000000 + t0->tv_usec);
+}
+
+
+// A collision: agents a and b on the same square on turn t, or swapping
+// squares with the moves they make on turn t.
+typedef struct {
+        uint32_t    a;
+        uint32_t    b;
+        uint32_t    t;
+        uint8_t     swap;
+} _cbs_conflict_t;
+
+// A share of the agents to route, for one thread.
+typedef struct {
+        astar_cbs_t *       cbs;
+        astar_coop_t *      co;
+        astar_cbs_node_t ** nodes;
+        uint32_t            num;
+        uint32_t            first;
+        uint32_t            step;
+} _cbs_job_t;
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CONSTRUCTION AND DESTRUCTION
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+astar_cbs_t *
+astar_cbs_new (astar_t * as, const uint32_t max_time, const uint32_t num_threads)
+{
+        assert (as != NULL);
+        assert (as->layers == 1);
+
+        if ((as->get == NULL) || !as->origin_set) return NULL;
+
+        uint32_t nt = num_threads < 1 ? 1 : num_threads, i;
+        astar_cbs_t * cbs = (astar_cbs_t *) calloc (1, sizeof (astar_cbs_t));
+        check_null (cbs, "astar_cbs_new(), allocating memory");
+        cbs->num_threads = nt;
+        cbs->workers = (astar_coop_t **) malloc (nt * sizeof (astar_coop_t *));
+        check_null (cbs->workers, "astar_cbs_new(), allocating memory");
+        for (i = 0; i < nt; i++) cbs->workers[i] = astar_coop_new (as, max_time);
+
+        uint32_t area = as->w * as->h;
+        cbs->occupant = (uint32_t *) calloc (area, sizeof (uint32_t));
+        cbs->previous = (uint32_t *) calloc (area, sizeof (uint32_t));
+        check_null (cbs->occupant, "astar_cbs_new(), allocating memory");
+        check_null (cbs->previous, "astar_cbs_new(), allocating memory");
+        cbs->open = astar_heap_new (_NODES_INITIAL, 0);
+
+        cbs->result = ASTAR_NOTHING;
+        cbs->str_result = "ASTAR_NOTHING";
+        return cbs;
+}
+
+
+// Forget the constraint tree and the routes of the last search.
+static void
+cbs_reset (astar_cbs_t * cbs)
+{
+        uint32_t i;
+        for (i = 0; i < cbs->num_nodes; i++) {
+                free (cbs->nodes[i]->route);
+                free (cbs->nodes[i]->moves);
+                free (cbs->nodes[i]);
+        }
+        cbs->num_nodes = 0;
+        astar_heap_clear (cbs->open);
+
+        for (i = 0; i < cbs->num_agents; i++) {
+                free (cbs->routes[i]);
+                free (cbs->moves[i]);
+                cbs->routes[i] = NULL;
+                cbs->moves[i] = NULL;
+                cbs->steps[i] = 0;
+        }
+        cbs->cost = 0;
+        cbs->optimal = 0;
+        cbs->loops = 0;
+}
+
+
+void
+astar_cbs_destroy (astar_cbs_t * cbs)
+{
+        assert (cbs != NULL);
+        uint32_t i;
+        cbs_reset (cbs);
+        for (i = 0; i < cbs->num_threads; i++) astar_coop_destroy (cbs->workers[i]);
+        astar_heap_destroy (cbs->open);
+        free (cbs->workers);
+        free (cbs->start);
+        free (cbs->goal);
+        free (cbs->nodes);
+        free (cbs->occupant);
+        free (cbs->previous);
+        free (cbs->owner);
+        free (cbs->routes);
+        free (cbs->moves);
+        free (cbs->steps);
+        free (cbs);
+}
+
+
+uint32_t
+astar_cbs_add_agent (astar_cbs_t * cbs,
+                     const uint32_t x0, const uint32_t y0,
+                     const uint32_t x1, const uint32_t y1)
+{
+        assert (cbs != NULL);
+        uint32_t w = cbs->workers[0]->w, h = cbs->workers[0]->h;
+        assert ((x0 < w) && (y0 < h));
+        assert ((x1 < w) && (y1 < h));
+
+        cbs_reset (cbs);
+        uint32_t n = cbs->num_agents++;
+        cbs->start = (uint32_t *) realloc (cbs->start, cbs->num_agents * sizeof (uint32_t));
+        cbs->goal = (uint32_t *) realloc (cbs->goal, cbs->num_agents * sizeof (uint32_t));
+        cbs->owner = (astar_cbs_node_t **) realloc (cbs->owner, cbs->num_agents * sizeof (astar_cbs_node_t *));
+        cbs->routes = (uint32_t **) realloc (cbs->routes, cbs->num_agents * sizeof (uint32_t *));
+        cbs->moves = (uint8_t **) realloc (cbs->moves, cbs->num_agents * sizeof (uint8_t *));
+        cbs->steps = (uint32_t *) realloc (cbs->steps, cbs->num_agents * sizeof (uint32_t));
+        check_null (cbs->start, "astar_cbs_add_agent(), allocating memory");
+        check_null (cbs->goal, "astar_cbs_add_agent(), allocating memory");
+        check_null (cbs->owner, "astar_cbs_add_agent(), allocating memory");
+        check_null (cbs->routes, "astar_cbs_add_agent(), allocating memory");
+        check_null (cbs->moves, "astar_cbs_add_agent(), allocating memory");
+        check_null (cbs->steps, "astar_cbs_add_agent(), allocating memory");
+
+        cbs->start[n] = x0 + y0 * w;
+        cbs->goal[n] = x1 + y1 * w;
+        cbs->routes[n] = NULL;
+        cbs->moves[n] = NULL;
+        cbs->steps[n] = 0;
+        return n;
+}
+
+
+void
+astar_cbs_set_budget (astar_cbs_t * cbs, const uint32_t budget)
+{
+        assert (cbs != NULL);
+        cbs->budget = budget;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// LOW LEVEL: ROUTING AGENTS
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+static astar_cbs_node_t *
+cbs_node_new (astar_cbs_t * cbs, astar_cbs_node_t * parent, const uint32_t agent)
+{
+        if (cbs->num_nodes == cbs->nodes_alloc) {
+                cbs->nodes_alloc = cbs->nodes_alloc ? 2 * cbs->nodes_alloc : _NODES_INITIAL;
+                cbs->nodes = (astar_cbs_node_t **)
+                        realloc (cbs->nodes, cbs->nodes_alloc * sizeof (astar_cbs_node_t *));
+                check_null (cbs->nodes, "cbs_node_new(), allocating memory");
+        }
+        astar_cbs_node_t * node = (astar_cbs_node_t *) calloc (1, sizeof (astar_cbs_node_t));
+        check_null (node, "cbs_node_new(), allocating memory");
+        node->parent = parent;
+        node->agent = agent;
+        node->constraint.dir = DIR_END;
+        node->result = ASTAR_NOTHING;
+        cbs->nodes[cbs->num_nodes++] = node;
+        return node;
+}
+
+
+// Route the agent of a node, under the constraints of the node and its
+// ancestors.
+static void
+cbs_plan (astar_cbs_t * cbs, astar_coop_t * co, astar_cbs_node_t * node)
+{
+        uint32_t agent = node->agent, w = co->w;
+        astar_cbs_node_t * n;
+
+        astar_coop_clear (co);
+        for (n = node; n != NULL; n = n->parent) {
+                astar_cbs_constraint_t * c = &n->constraint;
+                if ((c->dir == DIR_END) || (c->agent != agent)) continue;
+                if (c->dir == DIR_WAIT) astar_coop_forbid (co, c->square % w, c->square / w, c->t);
+                else astar_coop_forbid_move (co, c->square % w, c->square / w, c->dir, c->t);
+        }
+
+        node->result = astar_coop_find (co, cbs->start[agent] % w, cbs->start[agent] / w,
+                                        cbs->goal[agent] % w, cbs->goal[agent] / w);
+        if (!routed (node->result)) return;
+
+        node->steps = co->steps;
+        node->score = co->score;
+        node->route = (uint32_t *) malloc ((co->steps + 1) * sizeof (uint32_t));
+        node->moves = (uint8_t *) malloc (co->steps + 1);
+        check_null (node->route, "cbs_plan(), allocating route");
+        check_null (node->moves, "cbs_plan(), allocating route");
+        memcpy (node->route, co->route, (co->steps + 1) * sizeof (uint32_t));
+        memcpy (node->moves, co->moves, co->steps + 1);
+}
+
+
+static void *
+cbs_worker (void * arg)
+{
+        _cbs_job_t * job = (_cbs_job_t *) arg;
+        uint32_t i;
+        for (i = job->first; i < job->num; i += job->step) {
+                cbs_plan (job->cbs, job->co, job->nodes[i]);
+        }
+        return NULL;
+}
+
+
+// Route the agents of a few nodes, in as many threads as we're allowed.
+// Searches stop after timeout microseconds (0 for no limit).
+static void
+cbs_plan_all (astar_cbs_t * cbs, astar_cbs_node_t ** nodes, const uint32_t num,
+              const uint32_t timeout)
+{
+        uint32_t nt = cbs->num_threads > num ? num : cbs->num_threads, i;
+        _cbs_job_t jobs[nt];
+        for (i = 0; i < nt; i++) {
+                jobs[i].cbs = cbs;
+                jobs[i].co = cbs->workers[i];
+                jobs[i].co->timeout = timeout;
+                jobs[i].nodes = nodes;
+                jobs[i].num = num;
+                jobs[i].first = i;
+                jobs[i].step = nt;
+        }
+
+#ifdef ASTAR_THREADS
+        if (nt > 1) {
+                pthread_t threads[nt];
+                for (i = 0; i < nt; i++) {
+                        if (pthread_create (&threads[i], NULL, cbs_worker, &jobs[i])) {
+                                perror ("cbs_plan_all(), starting thread");
+                                exit (EXIT_FAILURE);
+                        }
+                }
+                for (i = 0; i < nt; i++) pthread_join (threads[i], NULL);
+        } else
+#endif // ASTAR_THREADS
+        {
+                jobs[0].step = 1;
+                cbs_worker (&jobs[0]);
+        }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// HIGH LEVEL: THE CONSTRAINT TREE
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Find the node holding the route of every agent, for a node.
+static void
+cbs_owners (astar_cbs_t * cbs, astar_cbs_node_t * node)
+{
+        uint32_t i, left = cbs->num_agents;
+        for (i = 0; i < cbs->num_agents; i++) cbs->owner[i] = NULL;
+        for (; (node != NULL) && left; node = node->parent) {
+                if (cbs->owner[node->agent] != NULL) continue;
+                cbs->owner[node->agent] = node;
+                left--;
+        }
+}
+
+
+// The square of agent a on turn t. Agents stay on their target.
+#define at(cbs,a,t) ((cbs)->owner[a]->route[(t) < (cbs)->owner[a]->steps ? (t) : (cbs)->owner[a]->steps])
+
+
+// Count the collisions between the routes of a node, and find the earliest.
+static uint32_t
+cbs_conflicts (astar_cbs_t * cbs, astar_cbs_node_t * node, _cbs_conflict_t * first)
+{
+        uint32_t n = cbs->num_agents, longest = 0, count = 0, a, t;
+        cbs_owners (cbs, node);
+        for (a = 0; a < n; a++) {
+                if (cbs->owner[a]->steps > longest) longest = cbs->owner[a]->steps;
+        }
+
+        first->t = 0xffffffff;
+        for (t = 0; t <= longest; t++) {
+                for (a = 0; a < n; a++) {
+                        uint32_t square = at (cbs, a, t), other = cbs->occupant[square];
+                        if (other == 0) {
+                                cbs->occupant[square] = a + 1;
+                        } else {
+                                count++;
+                                if (t < first->t) {
+                                        first->a = other - 1;
+                                        first->b = a;
+                                        first->t = t;
+                                        first->swap = 0;
+                                }
+                        }
+
+                        // Did we swap squares with whoever was here?
+                        if (t == 0) continue;
+                        uint32_t from = at (cbs, a, t - 1), was = cbs->previous[square];
+                        if ((from == square) || (was == 0) || (was - 1 <= a)) continue;
+                        if (at (cbs, was - 1, t) != from) continue;
+                        count++;
+                        if (t - 1 < first->t) {
+                                first->a = a;
+                                first->b = was - 1;
+                                first->t = t - 1;
+                                first->swap = 1;
+                        }
+                }
+
+                // This turn is the previous one now.
+                for (a = 0; a < n; a++) {
+                        if (t > 0) cbs->previous[at (cbs, a, t - 1)] = 0;
+                }
+                for (a = 0; a < n; a++) {
+                        uint32_t square = at (cbs, a, t);
+                        if (cbs->occupant[square]) cbs->previous[square] = cbs->occupant[square];
+                        cbs->occupant[square] = 0;
+                }
+        }
+        for (a = 0; a < n; a++) cbs->previous[at (cbs, a, longest)] = 0;
+        return count;
+}
+
+
+// Keep agent a off what it collided with in a child of node.
+static astar_cbs_node_t *
+cbs_branch (astar_cbs_t * cbs, astar_cbs_node_t * node, const _cbs_conflict_t * c, const uint32_t a)
+{
+        astar_cbs_node_t * child = cbs_node_new (cbs, node, a);
+        astar_cbs_node_t * owner = cbs->owner[a];
+        child->constraint.agent = a;
+        child->constraint.t = c->t;
+        if (c->swap) {
+                child->constraint.square = owner->route[c->t];
+                child->constraint.dir = owner->moves[c->t];
+        } else {
+                child->constraint.square = at (cbs, a, c->t);
+                child->constraint.dir = DIR_WAIT;
+        }
+        return child;
+}
+
+
+static void
+cbs_push (astar_cbs_t * cbs, astar_cbs_node_t * node, const uint32_t index)
+{
+        _cbs_conflict_t c;
+        node->conflicts = cbs_conflicts (cbs, node, &c);
+        assert (node->cost < (1 << (32 - TIE_BITS)));
+        astar_heap_add (cbs->open, (node->cost << TIE_BITS) |
+                        (node->conflicts < TIE_MAX ? node->conflicts : TIE_MAX), index);
+}
+
+
+// Keep the routes of a node.
+static void
+cbs_solution (astar_cbs_t * cbs, astar_cbs_node_t * node)
+{
+        uint32_t a;
+        cbs_owners (cbs, node);
+        cbs->cost = node->cost;
+        for (a = 0; a < cbs->num_agents; a++) {
+                astar_cbs_node_t * owner = cbs->owner[a];
+                cbs->steps[a] = owner->steps;
+                cbs->routes[a] = (uint32_t *) malloc ((owner->steps + 1) * sizeof (uint32_t));
+                cbs->moves[a] = (uint8_t *) malloc (owner->steps + 1);
+                check_null (cbs->routes[a], "cbs_solution(), allocating route");
+                check_null (cbs->moves[a], "cbs_solution(), allocating route");
+                memcpy (cbs->routes[a], owner->route, (owner->steps + 1) * sizeof (uint32_t));
+                memcpy (cbs->moves[a], owner->moves, owner->steps + 1);
+        }
+}
+
+
+// Out of time: route the agents one after the other, in the order they
+// were added, in what's left of the budget. Returns 0 if some agent
+// couldn't be routed (or there wasn't time).
+static int
+cbs_prioritised (astar_cbs_t * cbs, struct timeval * t0)
+{
+        astar_coop_t * co = cbs->workers[0];
+        uint32_t a, w = co->w;
+        astar_coop_clear (co);
+        for (a = 0; a < cbs->num_agents; a++) {
+                uint32_t elapsed = get_time_difference (t0);
+                if (cbs->budget && (elapsed >= cbs->budget)) return 0;
+                co->timeout = cbs->budget ? cbs->budget - elapsed : 0;
+                int r = astar_coop_run (co, cbs->start[a] % w, cbs->start[a] / w,
+                                        cbs->goal[a] % w, cbs->goal[a] / w);
+                if (!routed (r)) return 0;
+
+                // Keep the routes in nodes, so they're freed along with the
+                // rest.
+                astar_cbs_node_t * node = cbs_node_new (cbs, a ? cbs->nodes[cbs->num_nodes - 1] : NULL, a);
+                node->steps = co->steps;
+                node->score = co->score;
+                node->cost = (node->parent ? node->parent->cost : 0) + co->score;
+                node->route = (uint32_t *) malloc ((co->steps + 1) * sizeof (uint32_t));
+                node->moves = (uint8_t *) malloc (co->steps + 1);
+                check_null (node->route, "cbs_prioritised(), allocating route");
+                check_null (node->moves, "cbs_prioritised(), allocating route");
+                memcpy (node->route, co->route, (co->steps + 1) * sizeof (uint32_t));
+                memcpy (node->moves, co->moves, co->steps + 1);
+        }
+        cbs_solution (cbs, cbs->nodes[cbs->num_nodes - 1]);
+        return 1;
+}
+
+
+int
+astar_cbs_run (astar_cbs_t * cbs)
+{
+        assert (cbs != NULL);
+        assert (cbs->num_agents > 0);
+
+        struct timeval t0;
+        gettimeofday (&t0, &_tz);
+
+        cbs_reset (cbs);
+        uint32_t n = cbs->num_agents, a, elapsed;
+
+        // The search gets half the budget. The rest is kept for routing the
+        // agents one after the other, should it run out.
+        uint32_t budget = cbs->budget ? (cbs->budget + 1) / 2 : 0;
+
+        // Agents can't share starting squares or targets.
+        for (a = 0; a < n; a++) {
+                if (cbs->occupant[cbs->start[a]]) break;
+                cbs->occupant[cbs->start[a]] = 1;
+        }
+        memset (cbs->occupant, 0, cbs->workers[0]->w * cbs->workers[0]->h * sizeof (uint32_t));
+        if (a < n) return astar_error (cbs, ASTAR_EMBEDDED);
+        for (a = 0; a < n; a++) {
+                if (cbs->occupant[cbs->goal[a]]) break;
+                cbs->occupant[cbs->goal[a]] = 1;
+        }
+        memset (cbs->occupant, 0, cbs->workers[0]->w * cbs->workers[0]->h * sizeof (uint32_t));
+        if (a < n) return astar_error (cbs, ASTAR_NOTFOUND);
+
+        // The root: every agent on its own.
+        for (a = 0; a < n; a++) cbs_node_new (cbs, a ? cbs->nodes[a - 1] : NULL, a);
+        cbs_plan_all (cbs, cbs->nodes, n, budget);
+        astar_cbs_node_t * node = NULL;
+        for (a = 0; a < n; a++) {
+                node = cbs->nodes[a];
+                if (node->result == ASTAR_TIMEOUT) goto out_of_time;
+                if (node->result == ASTAR_EMBEDDED) return astar_error (cbs, ASTAR_EMBEDDED);
+                if (!routed (node->result)) return astar_error (cbs, ASTAR_NOTFOUND);
+                node->cost = (node->parent ? node->parent->cost : 0) + node->score;
+        }
+        cbs_push (cbs, node, n - 1);
+
+        while (!astar_heap_is_empty (cbs->open)) {
+                uint32_t index;
+                astar_heap_pop (cbs->open, &index);
+                node = cbs->nodes[index];
+                cbs->loops++;
+                if (node->conflicts == 0) {
+                        cbs_solution (cbs, node);
+                        cbs->optimal = 1;
+                        return astar_error (cbs, ASTAR_FOUND);
+                }
+
+                elapsed = get_time_difference (&t0);
+                if (budget && (elapsed >= budget)) goto out_of_time;
+
+                // Branch on the earliest collision, and route the agent
+                // kept off it in each branch.
+                _cbs_conflict_t c;
+                cbs_conflicts (cbs, node, &c);
+                astar_cbs_node_t * children[2];
+                children[0] = cbs_branch (cbs, node, &c, c.a);
+                children[1] = cbs_branch (cbs, node, &c, c.b);
+                cbs_plan_all (cbs, children, 2, budget ? budget - elapsed : 0);
+
+                for (a = 0; a < 2; a++) {
+                        astar_cbs_node_t * child = children[a];
+                        if (child->result == ASTAR_TIMEOUT) goto out_of_time;
+                        if (!routed (child->result)) continue;
+                        cbs_owners (cbs, node);
+                        child->cost = node->cost - cbs->owner[child->agent]->score + child->score;
+                        cbs_push (cbs, child, cbs->num_nodes - 2 + a);
+                }
+        }
+        return astar_error (cbs, ASTAR_NOTFOUND);
+
+out_of_time:
+        if (cbs_prioritised (cbs, &t0)) return astar_error (cbs, ASTAR_FOUND);
+        return astar_error (cbs, ASTAR_TIMEOUT);
+}
+
+
+uint32_t
+astar_cbs_get_directions (astar_cbs_t * cbs, const uint32_t agent, direction_t ** directions)
+{
+        assert (cbs != NULL);
+        assert (agent < cbs->num_agents);
+        assert (directions != NULL);
+        if ((cbs->result != ASTAR_FOUND) || (cbs->steps[agent] == 0)) return 0;
+
+        uint32_t steps = cbs->steps[agent];
+        direction_t * dp = (direction_t *) malloc ((steps + 1) * sizeof (direction_t));
+        check_null (dp, "astar_cbs_get_directions(), allocating directions");
+        memcpy (dp, cbs->moves[agent], steps + 1);
+        *directions = dp;
+        return steps;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TESTING
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef TEST_CBS
+
+// Count collisions between the routes found, following them step by step.
+// Agents stay on their targets.
+static uint32_t
+count_collisions (astar_cbs_t * cbs, const astar_t * as)
+{
+        uint32_t n = cbs->num_agents, w = as->w, h = as->h, a, b, t, longest = 0, count = 0;
+        uint32_t x[n], y[n], px[n], py[n];
+        direction_t * dirs[n];
+        for (a = 0; a < n; a++) {
+                x[a] = cbs->start[a] % w;
+                y[a] = cbs->start[a] / w;
+                dirs[a] = NULL;
+                astar_cbs_get_directions (cbs, a, &dirs[a]);
+                if (cbs->steps[a] > longest) longest = cbs->steps[a];
+        }
+        for (t = 1; t <= longest; t++) {
+                for (a = 0; a < n; a++) {
+                        px[a] = x[a];
+                        py[a] = y[a];
+                        if (t > cbs->steps[a]) continue;
+                        x[a] = (x[a] + w + astar_get_dx (as, dirs[a][t - 1])) % w;
+                        y[a] = (y[a] + h + astar_get_dy (as, dirs[a][t - 1])) % h;
+                }
+                for (a = 0; a < n; a++) {
+                        for (b = a + 1; b < n; b++) {
+                                if ((x[a] == x[b]) && (y[a] == y[b])) count++;
+                                if ((x[a] == px[b]) && (y[a] == py[b]) &&
+                                    (x[b] == px[a]) && (y[b] == py[a]) &&
+                                    ((x[a] != px[a]) || (y[a] != py[a]))) count++;
+                        }
+                }
+        }
+        for (a = 0; a < n; a++) {
+                assert ((x[a] == cbs->goal[a] % w) && (y[a] == cbs->goal[a] / w));
+                if (dirs[a] != NULL) astar_free_directions (dirs[a]);
+        }
+        return count;
+}
+
+
+// A corridor with a passing place half way along it.
+//
+//   #######.###
+//   ...........
+//   ###########
+static uint8_t
+corridor_get (const uint32_t x, const uint32_t y)
+{
+        assert ((x < 11) && (y < 3));
+        if (y == 2) return COST_BLOCKED;
+        if ((y == 0) && (x != 7)) return COST_BLOCKED;
+        return 1;
+}
+
+
+// A 16x16 room with a few pillars.
+static uint8_t
+room_get (const uint32_t x, const uint32_t y)
+{
+        assert ((x < 16) && (y < 16));
+        if ((x % 4 == 2) && (y % 4 == 2)) return COST_BLOCKED;
+        return 1;
+}
+
+
+#define NUM_AGENTS 12
+
+int
+main (int argc, char ** argv)
+{
+        uint32_t i, rep;
+        srand (0);
+
+        // Two agents walking towards each other along the corridor: one of
+        // them steps aside, and the one further from the passing place goes
+        // straight through.
+        astar_t * as = astar_new (11, 3, corridor_get, NULL);
+        astar_set_origin (as, 0, 0);
+        astar_set_movement_mode (as, DIR_CARDINAL);
+        astar_cbs_t * cbs = astar_cbs_new (as, 64, 2);
+        assert (cbs != NULL);
+        assert (astar_cbs_add_agent (cbs, 0, 1, 9, 1) == 0);
+        assert (astar_cbs_add_agent (cbs, 10, 1, 1, 1) == 1);
+        assert (astar_cbs_run (cbs) == ASTAR_FOUND);
+        assert (cbs->optimal);
+        assert (count_collisions (cbs, as) == 0);
+
+        // The cheapest routes are cheaper than routing the agents in order.
+        uint32_t cost = cbs->cost;
+        astar_coop_t * co = astar_coop_new (as, 64);
+        assert (astar_coop_run (co, 0, 1, 9, 1) == ASTAR_FOUND);
+        uint32_t order = co->score;
+        assert (astar_coop_run (co, 10, 1, 1, 1) == ASTAR_FOUND);
+        order += co->score;
+        assert (cost <= order);
+        astar_coop_destroy (co);
+
+        // Agents can't share targets.
+        astar_cbs_add_agent (cbs, 3, 1, 9, 1);
+        assert (astar_cbs_run (cbs) == ASTAR_NOTFOUND);
+        astar_cbs_destroy (cbs);
+        astar_destroy (as);
+        printf("Verified: agents make way for each other in corridors.\n");
+
+        // A squad crossing a room. Any number of threads finds routes that
+        // cost the same, no more than routing the agents in order, and no
+        // less than routing them on their own.
+        as = astar_new (16, 16, room_get, NULL);
+        astar_set_origin (as, 0, 0);
+        astar_set_movement_mode (as, DIR_8WAY);
+        astar_set_steering_penalty (as, 0);
+        for (rep = 0; rep < 10; rep++) {
+                uint32_t x0[NUM_AGENTS], y0[NUM_AGENTS], x1[NUM_AGENTS], y1[NUM_AGENTS];
+                uint8_t used[256] = { 0 }, goal[256] = { 0 };
+                for (i = 0; i < NUM_AGENTS; i++) {
+                        do {
+                                x0[i] = rand () % 16;
+                                y0[i] = rand () % 16;
+                        } while ((room_get (x0[i], y0[i]) == COST_BLOCKED) || used[x0[i] + y0[i] * 16]);
+                        used[x0[i] + y0[i] * 16] = 1;
+                        do {
+                                x1[i] = rand () % 16;
+                                y1[i] = rand () % 16;
+                        } while ((room_get (x1[i], y1[i]) == COST_BLOCKED) || goal[x1[i] + y1[i] * 16]);
+                        goal[x1[i] + y1[i] * 16] = 1;
+                }
+
+                uint32_t costs[2], threads[2] = { 1, 4 };
+                for (i = 0; i < 2; i++) {
+                        uint32_t a;
+                        cbs = astar_cbs_new (as, 256, threads[i]);
+                        for (a = 0; a < NUM_AGENTS; a++) astar_cbs_add_agent (cbs, x0[a], y0[a], x1[a], y1[a]);
+                        assert (astar_cbs_run (cbs) == ASTAR_FOUND);
+                        assert (cbs->optimal);
+                        assert (count_collisions (cbs, as) == 0);
+                        costs[i] = cbs->cost;
+                        astar_cbs_destroy (cbs);
+                }
+                assert (costs[0] == costs[1]);
+
+                uint32_t alone = 0, a;
+                order = 0;
+                co = astar_coop_new (as, 256);
+                for (a = 0; a < NUM_AGENTS; a++) {
+                        int r = astar_coop_run (co, x0[a], y0[a], x1[a], y1[a]);
+                        if (!routed (r)) {
+                                order = 0xffffffff;
+                                break;
+                        }
+                        order += co->score;
+                }
+                astar_coop_destroy (co);
+                for (a = 0; a < NUM_AGENTS; a++) {
+                        co = astar_coop_new (as, 256);
+                        astar_coop_find (co, x0[a], y0[a], x1[a], y1[a]);
+                        alone += co->score;
+                        astar_coop_destroy (co);
+                }
+                assert ((alone <= costs[0]) && (costs[0] <= order));
+        }
+        printf("Verified: squads get the cheapest routes that don't collide.\n");
+
+        // Out of time: the agents are routed one after the other instead.
+        cbs = astar_cbs_new (as, 256, 1);
+        for (i = 0; i < 16; i++) astar_cbs_add_agent (cbs, i, 0, 15 - i, 15);
+        for (i = 1; i < 15; i++) astar_cbs_add_agent (cbs, 0, i, 15, 15 - i);
+        int r;
+        uint32_t budgets[] = { 1, 20000 };
+        for (i = 0; i < 2; i++) {
+                astar_cbs_set_budget (cbs, budgets[i]);
+                r = astar_cbs_run (cbs);
+                assert ((r == ASTAR_TIMEOUT) || ((r == ASTAR_FOUND) && !cbs->optimal));
+                if (r == ASTAR_FOUND) assert (count_collisions (cbs, as) == 0);
+                printf("%u us budget: %s, %u us.\n", budgets[i], cbs->str_result, cbs->usecs);
+
+                // Searches only check the time every few hundred expansions,
+                // and loaded machines are slow, so only catch runaways.
+                assert (cbs->usecs <= budgets[i] + 1000000);
+        }
+        astar_cbs_destroy (cbs);
+        astar_destroy (as);
+        printf("Verified: searches stay within their time limit.\n");
+
+        printf("All tests were successful.\n");
+        return 0;
+}
+
+#endif // TEST_CBS
+
+
+// End of file.
@@ -0,0 +1,219 @@
+/*
+
+$Id
+
+Copyright (C) 2009 Alexios Chouchoulas
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#ifndef __ASTAR_CBS_H
+#define __ASTAR_CBS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+#include "astar_coop.h"
+
+
+/*
+ * Conflict-Based Search, for small squads of agents that need the cheapest
+ * routes that don't collide, rather than just routes that don't collide.
+ *
+ * Every agent is routed on its own first. Where two routes collide (both
+ * agents on the same square at the same turn, or swapping squares), the
+ * search branches in two: one branch keeps the first agent off that square
+ * (or move) at that turn, the other branch keeps the second one off it. Only
+ * the agent that was constrained is routed again, with the space-time
+ * search of astar_coop_find(). The branch with the cheapest routes (the sum
+ * of the scores of all agents) is always taken next, so the first routes
+ * without collisions are the cheapest.
+ *
+ * The search may take a long time with many agents in tight spaces. If it
+ * runs out of time, the agents are routed one after the other with
+ * astar_coop_run() instead, which is quick but not the cheapest.
+ */
+
+// A constraint: keep an agent off a square (dir is DIR_WAIT) or a move
+// (dir is the direction) at a turn.
+typedef struct {
+	uint32_t    agent;
+	uint32_t    square;
+	uint32_t    t;
+	uint8_t     dir;        // DIR_END if there's no constraint.
+} astar_cbs_constraint_t;
+
+// A node of the constraint tree. Each node adds a constraint to its parent,
+// and holds the new route of the agent it applies to. The routes of other
+// agents are those of the nearest ancestor that routed them. The top few
+// nodes have no constraints, and route one agent each.
+typedef struct astar_cbs_node_s {
+	struct astar_cbs_node_s * parent;
+	astar_cbs_constraint_t constraint;
+	uint32_t    agent;      // The agent routed.
+	uint32_t *  route;      // Its square at each turn.
+	uint8_t *   moves;      // Its move at each turn.
+	uint32_t    steps;
+	uint32_t    score;
+	int         result;     // Result code of the search.
+	uint32_t    cost;       // Sum of the scores of all agents.
+	uint32_t    conflicts;  // Collisions between the routes.
+} astar_cbs_node_t;
+
+
+typedef struct {
+	astar_coop_t ** workers; // A space-time search context per thread.
+	uint32_t    num_threads;
+	uint32_t    budget;     // Time limit (microseconds, 0 for none).
+
+	uint32_t    num_agents;
+	uint32_t *  start;      // Starting square of each agent, as x + y * w.
+	uint32_t *  goal;       // Target square of each agent.
+
+	///////////////////////////////////////////////////////////////////////////////
+	//
+	// Search state.
+	//
+	///////////////////////////////////////////////////////////////////////////////
+
+	astar_cbs_node_t ** nodes; // All nodes of the constraint tree.
+	uint32_t    num_nodes;
+	uint32_t    nodes_alloc;
+	asheap_t *  open;
+	uint32_t *  occupant;   // Agent (plus one) on each square, scratch.
+	uint32_t *  previous;   // Likewise, on the turn before.
+	astar_cbs_node_t ** owner; // Node holding the route of each agent, scratch.
+
+	///////////////////////////////////////////////////////////////////////////////
+	//
+	// Results
+	//
+	///////////////////////////////////////////////////////////////////////////////
+
+	uint32_t ** routes;     // The square of each agent at each turn.
+	uint8_t **  moves;      // The move of each agent at each turn.
+	uint32_t *  steps;      // Number of turns in the route of each agent.
+	uint32_t    cost;       // Sum of the scores of all routes.
+	uint32_t    optimal:1;  // Are the routes the cheapest ones?
+	uint32_t    result;     // Result code of the search.
+	char *      str_result; // Stringified result code.
+	uint32_t    usecs;      // Search time in microseconds.
+	uint32_t    loops;      // Number of nodes of the constraint tree expanded.
+} astar_cbs_t;
+
+
+/**
+ * Create a Conflict-Based Search context.
+ *
+ * See astar_coop_new() for what's used of the A* context.
+ *
+ * @param as An initialised A* context. Its origin must have been set, and
+ * get() must be set (e.g. by astar_init_grid()). Layered grids aren't
+ * supported.
+ *
+ * @param max_time The most turns a route may take.
+ *
+ * @param num_threads The number of threads agents are routed in. Values of 0
+ * or 1 route them in the calling thread. Ignored if the library was built
+ * without thread support.
+ *
+ * @return A pointer to a new astar_cbs_t structure, or NULL if the grid
+ * can't be read.
+ */
+
+astar_cbs_t * astar_cbs_new (astar_t * as, const uint32_t max_time, const uint32_t num_threads);
+
+/**
+ * Destroy a Conflict-Based Search context, freeing all memory it uses.
+ *
+ * @param cbs A Conflict-Based Search context.
+ */
+
+void astar_cbs_destroy (astar_cbs_t * cbs);
+
+/**
+ * Add an agent.
+ *
+ * @param cbs A Conflict-Based Search context.
+ * @param x0 The X ordinate of the starting square.
+ * @param y0 The Y ordinate of the starting square.
+ * @param x1 The X ordinate of the target square.
+ * @param y1 The Y ordinate of the target square.
+ *
+ * @return The number of the agent, starting from 0.
+ */
+
+uint32_t astar_cbs_add_agent (astar_cbs_t * cbs,
+			      const uint32_t x0, const uint32_t y0,
+			      const uint32_t x1, const uint32_t y1);
+
+/**
+ * Set the time limit of astar_cbs_run().
+ *
+ * The search for the cheapest routes gets half of it. The rest is kept for
+ * routing the agents one after the other, if the search runs out of time.
+ *
+ * @param cbs A Conflict-Based Search context.
+ * @param budget The time limit in microseconds, or 0 for none (the
+ * default).
+ */
+
+void astar_cbs_set_budget (astar_cbs_t * cbs, const uint32_t budget);
+
+/**
+ * Route all agents so that they don't collide.
+ *
+ * @param cbs A Conflict-Based Search context.
+ *
+ * @return <tt>ASTAR_FOUND</tt> if there are routes for all agents. They are
+ * the cheapest unless the search ran out of time (then cbs->optimal is 0).
+ * <tt>ASTAR_TIMEOUT</tt> if the search ran out of time without finding any
+ * routes, <tt>ASTAR_NOTFOUND</tt> if there are no routes (two agents have
+ * the same target, for instance), or <tt>ASTAR_EMBEDDED</tt> if an agent
+ * starts on a blocked square or on the same square as another one.
+ */
+
+int astar_cbs_run (astar_cbs_t * cbs);
+
+/**
+ * Get the directions of an agent, as found by the last astar_cbs_run().
+ *
+ * Works like astar_coop_get_directions().
+ *
+ * @param cbs A Conflict-Based Search context.
+ * @param agent The number of the agent.
+ *
+ * @param directions A pointer to a direction_t pointer. A new array will be
+ * allocated and returned there (unless there's no route). Free it with
+ * astar_free_directions().
+ *
+ * @return The number of steps returned, or 0 if there's no route (or the
+ * agent is already on its target).
+ */
+
+uint32_t astar_cbs_get_directions (astar_cbs_t * cbs, const uint32_t agent,
+				   direction_t ** directions);
+
+
+#ifdef __cplusplus
+};
+#endif // __cplusplus
+
+#endif // __ASTAR_CBS_H
+
+// End of file.
@@ -0,0 +1,869 @@
+/*
+
+$Id
+
+Copyright (C) 2009 Alexios Chouchoulas
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "astar_ch.h"
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CONSTANTS AND MACROS
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define check_null(p,err) \
+        if ((p) == NULL) {    \
+                perror (err); \
+                exit (EXIT_FAILURE); \
+        }
+
+// Initial size of the heaps.
+#define _HEAP_INITIAL 256
+
+// Witness searches give up after settling this many nodes. A lower limit
+// makes preprocessing faster, but adds shortcuts that aren't needed.
+#define WITNESS_LIMIT 500
+
+// Node priorities may be negative. Keys are offset by this much.
+#define PRIORITY_BIAS 0x40000000
+
+// Unreachable.
+#define INFINITE 0xffffffff
+
+// Saved hierarchies start with this.
+static const char _magic[8] = { 'A', 'S', 'T', 'A', 'R', 'C', 'H', '1' };
+
+// Used as return astar_error (ch, error_code) to stop processing when an
+// error occurs. It updates statistics.
+#define astar_error(ch, err) \
+        (((ch)->result=(err)),                                          \
+         ((ch)->str_result=#err),                                       \
+         (ch)->usecs = get_time_difference (&(ch)->t0),                 \
+         (err))
+
+
+// The UTC timezone -- we only operate on time deltas.
+static struct timezone _tz = { 0, 0 };
+
+
+static inline uint32_t
+get_time_difference (struct timeval *t0)
+{
+        struct timeval t;
+        gettimeofday (&t, &_tz);
+        return (t.tv_sec * 1000000 + t.tv_usec) - (t0->tv_sec * 1000000 + t0->tv_usec);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// PREPROCESSING
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+// The edges of a node while the graph is being contracted.
+typedef struct {
+        astar_ch_edge_t * e;
+        uint32_t    n;
+        uint32_t    alloc;
+} ch_edges_t;
+
+
+typedef struct {
+        uint32_t    num_nodes;
+        ch_edges_t * out;       // Edges leaving each node.
+        ch_edges_t * in;        // Edges reaching each node.
+        uint8_t *   contracted;
+        uint32_t *  deleted;    // Contracted neighbours of each node.
+
+        // Witness searches.
+        asheap_t *  heap;
+        uint32_t *  dist;
+        uint32_t *  stamp;
+        uint32_t    search;
+} ch_builder_t;
+
+
+static void
+ch_edges_push (ch_edges_t * edges, const uint32_t node, const uint32_t cost,
+               const uint32_t middle)
+{
+        if (edges->n == edges->alloc) {
+                edges->alloc = edges->alloc ? 2 * edges->alloc : 4;
+                edges->e = (astar_ch_edge_t *) realloc (edges->e, edges->alloc * sizeof (astar_ch_edge_t));
+                check_null (edges->e, "ch_edges_push(), growing edge list");
+        }
+        astar_ch_edge_t * e = &edges->e[edges->n++];
+        e->node = node;
+        e->cost = cost;
+        e->middle = middle;
+}
+
+
+static astar_ch_edge_t *
+ch_edges_find (ch_edges_t * edges, const uint32_t node)
+{
+        uint32_t i;
+        for (i = 0; i < edges->n; i++) {
+                if (edges->e[i].node == node) return &edges->e[i];
+        }
+        return NULL;
+}
+
+
+static void
+ch_add_edge (ch_builder_t * b, const uint32_t u, const uint32_t w,
+             const uint32_t cost, const uint32_t middle)
+{
+        // Add the edge u->w, or make the existing one cheaper. There's never
+        // more than one edge between two nodes in the same direction.
+        astar_ch_edge_t * e = ch_edges_find (&b->out[u], w);
+        if (e == NULL) {
+                ch_edges_push (&b->out[u], w, cost, middle);
+                ch_edges_push (&b->in[w], u, cost, middle);
+        } else if (cost < e->cost) {
+                e->cost = cost;
+                e->middle = middle;
+                e = ch_edges_find (&b->in[w], u);
+                e->cost = cost;
+                e->middle = middle;
+        }
+}
+
+
+static void
+ch_witness_search (ch_builder_t * b, const uint32_t u, const uint32_t v,
+                   const uint32_t limit)
+{
+        // Dijkstra from u, avoiding v and the nodes contracted before it.
+        // Stop once everything within limit is settled (or we've looked
+        // long enough). Nodes not reached are at INFINITE.
+        uint32_t settled = 0;
+        if (++b->search == 0) {
+                memset (b->stamp, 0, b->num_nodes * sizeof (uint32_t));
+                b->search = 1;
+        }
+        astar_heap_clear (b->heap);
+        b->stamp[u] = b->search;
+        b->dist[u] = 0;
+        astar_heap_add (b->heap, 0, u);
+
+        while (!astar_heap_is_empty (b->heap) && (settled < WITNESS_LIMIT)) {
+                uint32_t x, i;
+                uint32_t d = astar_heap_pop (b->heap, &x);
+                if (d > limit) break;
+                settled++;
+
+                ch_edges_t * out = &b->out[x];
+                for (i = 0; i < out->n; i++) {
+                        uint32_t y = out->e[i].node;
+                        if ((y == v) || b->contracted[y]) continue;
+                        uint32_t dy = d + out->e[i].cost;
+                        if (b->stamp[y] != b->search) {
+                                b->stamp[y] = b->search;
+                                b->dist[y] = dy;
+                                astar_heap_add (b->heap, dy, y);
+                        } else if (dy < b->dist[y]) {
+                                // Settled nodes never get cheaper, so
+                                // this one is still on the heap.
+                                b->dist[y] = dy;
+                                astar_heap_update (b->heap, y, dy);
+                        }
+                }
+        }
+}
+
+
+static inline uint32_t
+ch_witness_dist (ch_builder_t * b, const uint32_t x)
+{
+        return b->stamp[x] == b->search ? b->dist[x] : INFINITE;
+}
+
+
+static uint32_t
+ch_contract (ch_builder_t * b, const uint32_t v, const int apply)
+{
+        // Find the shortcuts contracting v needs: for every pair of
+        // neighbours u->v->w, unless there's another route from u to w that
+        // costs no more. If apply is set, add them. Returns their number.
+        uint32_t i, j, shortcuts = 0;
+
+        for (i = 0; i < b->in[v].n; i++) {
+                uint32_t u = b->in[v].e[i].node;
+                uint32_t c_uv = b->in[v].e[i].cost;
+                if (b->contracted[u]) continue;
+
+                // Edges may be free, so the limit may well be 0.
+                uint32_t limit = 0, candidates = 0;
+                for (j = 0; j < b->out[v].n; j++) {
+                        astar_ch_edge_t * e = &b->out[v].e[j];
+                        if ((e->node == u) || b->contracted[e->node]) continue;
+                        if (c_uv + e->cost > limit) limit = c_uv + e->cost;
+                        candidates++;
+                }
+                if (candidates == 0) continue;
+
+                ch_witness_search (b, u, v, limit);
+                for (j = 0; j < b->out[v].n; j++) {
+                        uint32_t w = b->out[v].e[j].node;
+                        uint32_t c = c_uv + b->out[v].e[j].cost;
+                        if ((w == u) || b->contracted[w]) continue;
+                        if (ch_witness_dist (b, w) <= c) continue;
+                        if (apply) ch_add_edge (b, u, w, c, v);
+                        shortcuts++;
+                }
+        }
+        return shortcuts;
+}
+
+
+static uint32_t
+ch_priority (ch_builder_t * b, const uint32_t v)
+{
+        // Contract nodes that add few shortcuts for the edges they remove
+        // first, and spread the contractions over the graph.
+        uint32_t i, degree = 0;
+        for (i = 0; i < b->in[v].n; i++) degree += !b->contracted[b->in[v].e[i].node];
+        for (i = 0; i < b->out[v].n; i++) degree += !b->contracted[b->out[v].e[i].node];
+        return PRIORITY_BIAS + ch_contract (b, v, 0) + b->deleted[v] - degree;
+}
+
+
+static void
+ch_build_csr (astar_ch_t * ch, ch_edges_t * edges, const int up,
+              uint32_t ** first, astar_ch_edge_t ** out, uint32_t * num)
+{
+        // Keep the edges of each node that lead to (or come from) higher
+        // ranked nodes.
+        uint32_t v, i, n = 0;
+        for (v = 0; v < ch->num_nodes; v++) {
+                for (i = 0; i < edges[v].n; i++) {
+                        n += ch->rank[edges[v].e[i].node] > ch->rank[v];
+                }
+        }
+
+        *first = (uint32_t *) malloc ((ch->num_nodes + 1) * sizeof (uint32_t));
+        *out = (astar_ch_edge_t *) malloc ((n ? n : 1) * sizeof (astar_ch_edge_t));
+        check_null (*first, "ch_build_csr(), allocating nodes");
+        check_null (*out, "ch_build_csr(), allocating edges");
+        *num = n;
+
+        for (v = 0, n = 0; v < ch->num_nodes; v++) {
+                (*first)[v] = n;
+                for (i = 0; i < edges[v].n; i++) {
+                        astar_ch_edge_t * e = &edges[v].e[i];
+                        if (ch->rank[e->node] < ch->rank[v]) continue;
+                        (*out)[n++] = *e;
+                        if (up && (e->middle != ASTAR_CH_NONE)) ch->shortcuts++;
+                }
+        }
+        (*first)[ch->num_nodes] = n;
+}
+
+
+static astar_ch_t *
+astar_ch_alloc (const uint32_t num_nodes)
+{
+        // Allocate a hierarchy and the query state (but not the edges).
+        astar_ch_t * ch = (astar_ch_t *) calloc (1, sizeof (astar_ch_t));
+        check_null (ch, "astar_ch_alloc(), allocating memory");
+
+        ch->num_nodes = num_nodes;
+        ch->rank = (uint32_t *) malloc ((num_nodes ? num_nodes : 1) * sizeof (uint32_t));
+        check_null (ch->rank, "astar_ch_alloc(), allocating ranks");
+        ch->nodes = (astar_ch_node_t *) calloc (num_nodes ? num_nodes : 1, sizeof (astar_ch_node_t));
+        check_null (ch->nodes, "astar_ch_alloc(), allocating nodes");
+        ch->search = 0;
+
+        int i;
+        for (i = 0; i < 2; i++) {
+                ch->heap[i] = astar_heap_new (_HEAP_INITIAL, 0);
+                astar_heap_track (ch->heap[i], num_nodes);
+        }
+        ch->meet = ASTAR_CH_NONE;
+        ch->str_result = NULL;
+        return ch;
+}
+
+
+astar_ch_t *
+astar_ch_build (const astar_graph_t * g)
+{
+        assert (g != NULL);
+
+        struct timeval t0;
+        gettimeofday (&t0, &_tz);
+
+        uint32_t n = g->num_nodes, v, i;
+        astar_ch_t * ch = astar_ch_alloc (n);
+
+        ch_builder_t b;
+        b.num_nodes = n;
+        b.out = (ch_edges_t *) calloc (n ? n : 1, sizeof (ch_edges_t));
+        b.in = (ch_edges_t *) calloc (n ? n : 1, sizeof (ch_edges_t));
+        b.contracted = (uint8_t *) calloc (n ? n : 1, 1);
+        b.deleted = (uint32_t *) calloc (n ? n : 1, sizeof (uint32_t));
+        b.dist = (uint32_t *) malloc ((n ? n : 1) * sizeof (uint32_t));
+        b.stamp = (uint32_t *) calloc (n ? n : 1, sizeof (uint32_t));
+        check_null (b.out, "astar_ch_build(), allocating memory");
+        check_null (b.in, "astar_ch_build(), allocating memory");
+        check_null (b.contracted, "astar_ch_build(), allocating memory");
+        check_null (b.deleted, "astar_ch_build(), allocating memory");
+        check_null (b.dist, "astar_ch_build(), allocating memory");
+        check_null (b.stamp, "astar_ch_build(), allocating memory");
+        b.search = 0;
+        b.heap = astar_heap_new (_HEAP_INITIAL, 0);
+        astar_heap_track (b.heap, n);
+
+        // The original edges, without loops or parallel edges.
+        for (v = 0; v < n; v++) {
+                for (i = g->first[v]; i < g->first[v + 1]; i++) {
+                        if (g->target[i] == v) continue;
+                        ch_add_edge (&b, v, g->target[i], g->cost[i], ASTAR_CH_NONE);
+                }
+        }
+
+        // Order the nodes. Priorities only go up as the graph is contracted,
+        // so they're updated lazily: a node whose priority has gone up since
+        // it was queued goes back on the queue.
+        asheap_t * queue = astar_heap_new (n ? n : 1, 0);
+        astar_heap_track (queue, n);
+        for (v = 0; v < n; v++) astar_heap_add (queue, ch_priority (&b, v), v);
+
+        uint32_t rank = 0;
+        while (!astar_heap_is_empty (queue)) {
+                astar_heap_pop (queue, &v);
+                uint32_t p = ch_priority (&b, v);
+                if (!astar_heap_is_empty (queue) && (p > astar_heap_min (queue))) {
+                        astar_heap_add (queue, p, v);
+                        continue;
+                }
+
+                ch_contract (&b, v, 1);
+                b.contracted[v] = 1;
+                ch->rank[v] = rank++;
+                for (i = 0; i < b.in[v].n; i++) b.deleted[b.in[v].e[i].node]++;
+                for (i = 0; i < b.out[v].n; i++) b.deleted[b.out[v].e[i].node]++;
+        }
+        astar_heap_destroy (queue);
+
+        // Every edge, original or shortcut, goes up from one end.
+        ch->shortcuts = 0;
+        ch_build_csr (ch, b.out, 1, &ch->up_first, &ch->up, &ch->num_up);
+        ch_build_csr (ch, b.in, 0, &ch->down_first, &ch->down, &ch->num_down);
+
+        for (v = 0; v < n; v++) {
+                free (b.out[v].e);
+                free (b.in[v].e);
+        }
+        free (b.out);
+        free (b.in);
+        free (b.contracted);
+        free (b.deleted);
+        free (b.dist);
+        free (b.stamp);
+        astar_heap_destroy (b.heap);
+
+        ch->usecs = get_time_difference (&t0);
+        return ch;
+}
+
+
+void
+astar_ch_destroy (astar_ch_t * ch)
+{
+        assert (ch != NULL);
+        astar_heap_destroy (ch->heap[0]);
+        astar_heap_destroy (ch->heap[1]);
+        free (ch->nodes);
+        free (ch->rank);
+        free (ch->up_first);
+        free (ch->up);
+        free (ch->down_first);
+        free (ch->down);
+        free (ch);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// SAVING AND LOADING
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+int
+astar_ch_save (const astar_ch_t * ch, const char * filename)
+{
+        assert (ch != NULL);
+        assert (filename != NULL);
+
+        FILE * fp = fopen (filename, "wb");
+        if (fp == NULL) return -1;
+
+        uint32_t n = ch->num_nodes;
+        uint32_t header[4] = { n, ch->num_up, ch->num_down, ch->shortcuts };
+        int ok = (fwrite (_magic, sizeof (_magic), 1, fp) == 1) &&
+                (fwrite (header, sizeof (header), 1, fp) == 1) &&
+                (fwrite (ch->rank, sizeof (uint32_t), n, fp) == n) &&
+                (fwrite (ch->up_first, sizeof (uint32_t), n + 1, fp) == n + 1) &&
+                (fwrite (ch->up, sizeof (astar_ch_edge_t), ch->num_up, fp) == ch->num_up) &&
+                (fwrite (ch->down_first, sizeof (uint32_t), n + 1, fp) == n + 1) &&
+                (fwrite (ch->down, sizeof (astar_ch_edge_t), ch->num_down, fp) == ch->num_down);
+
+        if (fclose (fp) != 0) ok = 0;
+        if (!ok && (errno == 0)) errno = EIO;
+        return ok ? 0 : -1;
+}
+
+
+astar_ch_t *
+astar_ch_load (const char * filename)
+{
+        assert (filename != NULL);
+
+        FILE * fp = fopen (filename, "rb");
+        if (fp == NULL) return NULL;
+
+        char magic[sizeof (_magic)];
+        uint32_t header[4];
+        if ((fread (magic, sizeof (magic), 1, fp) != 1) ||
+            (memcmp (magic, _magic, sizeof (magic)) != 0) ||
+            (fread (header, sizeof (header), 1, fp) != 1) ||
+            (header[0] == 0xffffffff)) {
+                fclose (fp);
+                return NULL;
+        }
+
+        uint32_t n = header[0];
+        astar_ch_t * ch = astar_ch_alloc (n);
+        ch->num_up = header[1];
+        ch->num_down = header[2];
+        ch->shortcuts = header[3];
+        ch->up_first = (uint32_t *) malloc ((n + 1) * sizeof (uint32_t));
+        ch->up = (astar_ch_edge_t *) malloc ((ch->num_up ? ch->num_up : 1) * sizeof (astar_ch_edge_t));
+        ch->down_first = (uint32_t *) malloc ((n + 1) * sizeof (uint32_t));
+        ch->down = (astar_ch_edge_t *) malloc ((ch->num_down ? ch->num_down : 1) * sizeof (astar_ch_edge_t));
+        check_null (ch->up_first, "astar_ch_load(), allocating memory");
+        check_null (ch->up, "astar_ch_load(), allocating memory");
+        check_null (ch->down_first, "astar_ch_load(), allocating memory");
+        check_null (ch->down, "astar_ch_load(), allocating memory");
+
+        int ok = (fread (ch->rank, sizeof (uint32_t), n, fp) == n) &&
+                (fread (ch->up_first, sizeof (uint32_t), n + 1, fp) == n + 1) &&
+                (fread (ch->up, sizeof (astar_ch_edge_t), ch->num_up, fp) == ch->num_up) &&
+                (fread (ch->down_first, sizeof (uint32_t), n + 1, fp) == n + 1) &&
+                (fread (ch->down, sizeof (astar_ch_edge_t), ch->num_down, fp) == ch->num_down);
+        fclose (fp);
+
+        // Don't trust edges that point (or skip) outside the hierarchy.
+        ok = ok && (ch->up_first[n] == ch->num_up) && (ch->down_first[n] == ch->num_down);
+        uint32_t i;
+        for (i = 0; ok && (i < ch->num_up); i++) {
+                ok = (ch->up[i].node < n) &&
+                        ((ch->up[i].middle < n) || (ch->up[i].middle == ASTAR_CH_NONE));
+        }
+        for (i = 0; ok && (i < ch->num_down); i++) {
+                ok = (ch->down[i].node < n) &&
+                        ((ch->down[i].middle < n) || (ch->down[i].middle == ASTAR_CH_NONE));
+        }
+        for (i = 0; ok && (i < n); i++) {
+                ok = (ch->up_first[i] <= ch->up_first[i + 1]) &&
+                        (ch->down_first[i] <= ch->down_first[i + 1]);
+        }
+
+        if (!ok) {
+                astar_ch_destroy (ch);
+                return NULL;
+        }
+        return ch;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// QUERIES
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+static inline astar_ch_node_t *
+astar_ch_node (astar_ch_t * ch, const uint32_t n)
+{
+        // The state of a node, initialised the first time this query
+        // touches it.
+        astar_ch_node_t * s = &ch->nodes[n];
+        if (s->search != ch->search) {
+                s->search = ch->search;
+                s->g[0] = s->g[1] = INFINITE;
+        }
+        return s;
+}
+
+
+static inline void
+astar_ch_step (astar_ch_t * ch, const int dir, uint32_t * best)
+{
+        // Settle the next node of one of the searches, and relax its upward
+        // edges.
+        uint32_t v, i;
+        uint32_t d = astar_heap_pop (ch->heap[dir], &v);
+        ch->loops++;
+
+        const uint32_t * first = dir ? ch->down_first : ch->up_first;
+        const astar_ch_edge_t * edges = dir ? ch->down : ch->up;
+        for (i = first[v]; i < first[v + 1]; i++) {
+                uint32_t w = edges[i].node, dw = d + edges[i].cost;
+                astar_ch_node_t * t = astar_ch_node (ch, w);
+                if (dw >= t->g[dir]) continue;
+                if (t->g[dir] == INFINITE) {
+                        astar_heap_add (ch->heap[dir], dw, w);
+                } else {
+                        astar_heap_update (ch->heap[dir], w, dw);
+                }
+                t->g[dir] = dw;
+                t->parent[dir] = v;
+                t->edge[dir] = i;
+
+                // Has the other search been here?
+                if ((t->g[!dir] != INFINITE) && (dw + t->g[!dir] < *best)) {
+                        *best = dw + t->g[!dir];
+                        ch->meet = w;
+                }
+        }
+}
+
+
+int
+astar_ch_run (astar_ch_t * ch, const uint32_t node0, const uint32_t node1)
+{
+        assert (ch != NULL);
+        assert (node0 < ch->num_nodes);
+        assert (node1 < ch->num_nodes);
+
+        // Store the start time.
+        gettimeofday (&ch->t0, &_tz);
+
+        ch->node0 = node0;
+        ch->node1 = node1;
+        ch->meet = ASTAR_CH_NONE;
+        ch->score = 0;
+        ch->loops = 0;
+        ch->have_route = 0;
+
+        if (++ch->search == 0) {
+                memset (ch->nodes, 0, ch->num_nodes * sizeof (astar_ch_node_t));
+                ch->search = 1;
+        }
+        astar_heap_clear (ch->heap[0]);
+        astar_heap_clear (ch->heap[1]);
+
+        // Handle the trivial case here.
+        if (node0 == node1) return astar_error (ch, ASTAR_TRIVIAL);
+
+        astar_ch_node (ch, node0)->g[0] = 0;
+        astar_ch_node (ch, node1)->g[1] = 0;
+        astar_heap_add (ch->heap[0], 0, node0);
+        astar_heap_add (ch->heap[1], 0, node1);
+
+        // Alternate between the searches, always advancing the one that's
+        // behind. Once neither can find anything cheaper than the best route
+        // so far, that's the route.
+        uint32_t best = INFINITE;
+        for (;;) {
+                uint32_t k0 = astar_heap_is_empty (ch->heap[0]) ? INFINITE : astar_heap_min (ch->heap[0]);
+                uint32_t k1 = astar_heap_is_empty (ch->heap[1]) ? INFINITE : astar_heap_min (ch->heap[1]);
+                if ((k0 >= best) && (k1 >= best)) break;
+                astar_ch_step (ch, k0 <= k1 ? 0 : 1, &best);
+        }
+
+        if (ch->meet == ASTAR_CH_NONE) return astar_error (ch, ASTAR_NOTFOUND);
+
+        ch->score = best;
+        ch->have_route = 1;
+        return astar_error (ch, ASTAR_FOUND);
+}
+
+
+// A growing list of nodes.
+typedef struct {
+        uint32_t *  node;
+        uint32_t    n;
+        uint32_t    alloc;
+} ch_route_t;
+
+
+static void
+ch_route_push (ch_route_t * route, const uint32_t node)
+{
+        if (route->n == route->alloc) {
+                route->alloc = route->alloc ? 2 * route->alloc : 64;
+                route->node = (uint32_t *) realloc (route->node, route->alloc * sizeof (uint32_t));
+                check_null (route->node, "ch_route_push(), growing route");
+        }
+        route->node[route->n++] = node;
+}
+
+
+static uint32_t
+ch_find_edge (const uint32_t * first, const astar_ch_edge_t * edges,
+              const uint32_t v, const uint32_t node)
+{
+        uint32_t i;
+        for (i = first[v]; edges[i].node != node; i++) assert (i + 1 < first[v + 1]);
+        return i;
+}
+
+
+static void
+ch_unpack (const astar_ch_t * ch, ch_route_t * route, const uint32_t u,
+           const uint32_t w, const uint32_t middle)
+{
+        // Add the nodes of the edge u->w to the route (u is already on it).
+        // A shortcut through v stands for u->v and v->w. v was contracted
+        // before both, so these are a downward edge into v and an upward
+        // edge out of it.
+        if (middle == ASTAR_CH_NONE) {
+                ch_route_push (route, w);
+                return;
+        }
+
+        uint32_t v = middle;
+        uint32_t e = ch_find_edge (ch->down_first, ch->down, v, u);
+        ch_unpack (ch, route, u, v, ch->down[e].middle);
+        e = ch_find_edge (ch->up_first, ch->up, v, w);
+        ch_unpack (ch, route, v, w, ch->up[e].middle);
+}
+
+
+uint32_t
+astar_ch_get_route (astar_ch_t * ch, uint32_t ** nodes)
+{
+        assert (ch != NULL);
+        assert (nodes != NULL);
+
+        if (!ch->have_route) return 0;
+
+        // The forward search's parents lead back from the meeting point to
+        // the start. List them start first.
+        ch_route_t up = { NULL, 0, 0 }, route = { NULL, 0, 0 };
+        uint32_t v, i;
+        for (v = ch->meet; v != ch->node0; v = ch->nodes[v].parent[0]) {
+                ch_route_push (&up, v);
+        }
+
+        ch_route_push (&route, ch->node0);
+        for (i = up.n, v = ch->node0; i-- > 0; v = up.node[i]) {
+                const astar_ch_edge_t * e = &ch->up[ch->nodes[up.node[i]].edge[0]];
+                ch_unpack (ch, &route, v, up.node[i], e->middle);
+        }
+        free (up.node);
+
+        // The backward search's parents lead on to the target.
+        for (v = ch->meet; v != ch->node1; v = ch->nodes[v].parent[1]) {
+                const astar_ch_edge_t * e = &ch->down[ch->nodes[v].edge[1]];
+                ch_unpack (ch, &route, v, ch->nodes[v].parent[1], e->middle);
+        }
+
+        *nodes = route.node;
+        return route.n;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TESTING
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef TEST_CH
+
+// The same kind of map as the graph tests: a random 60x40 map with moves in
+// eight directions, as a graph of squares (x + y * W).
+#define W 60
+#define H 40
+
+static uint8_t map[W * H];
+
+static const int32_t _dx[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+static const int32_t _dy[8] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+
+static uint32_t
+octile (const uint32_t node, const uint32_t goal)
+{
+        uint32_t dx = abs ((int32_t) (node % W) - (int32_t) (goal % W));
+        uint32_t dy = abs ((int32_t) (node / W) - (int32_t) (goal / W));
+        return dx > dy ? 10 * dx + 4 * dy : 10 * dy + 4 * dx;
+}
+
+
+#ifndef NUM_QUERIES
+#define NUM_QUERIES 2000
+#endif // NUM_QUERIES
+
+int
+main (int argc, char ** argv)
+{
+        uint32_t i, j, k, x, y, d, n = 0;
+        srand (0);
+
+        for (i = 0; i < W * H; i++) {
+                int r = rand () % 100;
+                map[i] = r < 25 ? COST_BLOCKED : (r < 40 ? 20 : 1);
+        }
+
+        uint32_t * from = (uint32_t *) malloc (8 * W * H * sizeof (uint32_t));
+        uint32_t * to = (uint32_t *) malloc (8 * W * H * sizeof (uint32_t));
+        uint32_t * cost = (uint32_t *) malloc (8 * W * H * sizeof (uint32_t));
+        assert ((from != NULL) && (to != NULL) && (cost != NULL));
+        for (y = 0; y < H; y++) {
+                for (x = 0; x < W; x++) {
+                        for (d = 0; d < 8; d++) {
+                                uint32_t x1 = x + _dx[d], y1 = y + _dy[d];
+                                if ((x1 >= W) || (y1 >= H)) continue;
+                                if (map[x + y * W] == COST_BLOCKED) continue;
+                                if (map[x1 + y1 * W] == COST_BLOCKED) continue;
+                                from[n] = x + y * W;
+                                to[n] = x1 + y1 * W;
+                                cost[n] = (d & 1 ? 14 : 10) + map[x1 + y1 * W];
+                                n++;
+                        }
+                }
+        }
+        astar_graph_t * g = astar_graph_from_edges (W * H, n, from, to, cost);
+        astar_graph_set_heuristic (g, octile);
+
+        astar_ch_t * ch = astar_ch_build (g);
+        printf("Contracted %u nodes, %u edges: %u shortcuts, %u up, %u down edges, %u us.\n",
+               W * H, n, ch->shortcuts, ch->num_up, ch->num_down, ch->usecs);
+
+        // Ranks are a permutation.
+        uint8_t * seen = (uint8_t *) calloc (W * H, 1);
+        for (i = 0; i < W * H; i++) {
+                assert ((ch->rank[i] < W * H) && !seen[ch->rank[i]]);
+                seen[ch->rank[i]] = 1;
+        }
+        free (seen);
+
+        // Save and reload it.
+        const char * filename = "test_ch.dat";
+        assert (astar_ch_save (ch, filename) == 0);
+        astar_ch_t * ch2 = astar_ch_load (filename);
+        assert (ch2 != NULL);
+        assert ((ch2->num_up == ch->num_up) && (ch2->num_down == ch->num_down));
+        remove (filename);
+        assert (astar_ch_load (filename) == NULL);
+
+        // Shortcuts that skip nodes that don't exist aren't loaded.
+        for (i = 0; (i < ch->num_up) && (ch->up[i].middle == ASTAR_CH_NONE); i++);
+        assert (i < ch->num_up);
+        ch->up[i].middle = W * H;
+        assert (astar_ch_save (ch, filename) == 0);
+        assert (astar_ch_load (filename) == NULL);
+        ch->up[i].middle = ch2->up[i].middle;
+        remove (filename);
+
+        // Queries find routes as cheap as A*, made of the original edges.
+        uint32_t * pairs = (uint32_t *) malloc (2 * NUM_QUERIES * sizeof (uint32_t));
+        for (i = 0; i < 2 * NUM_QUERIES; i++) pairs[i] = rand () % (W * H);
+
+        uint32_t found = 0, usecs_astar = 0, usecs_ch = 0, loops_astar = 0, loops_ch = 0;
+        for (i = 0; i < NUM_QUERIES; i++) {
+                uint32_t a = pairs[2 * i], b = pairs[2 * i + 1];
+                int r = astar_graph_run (g, a, b);
+                usecs_astar += g->usecs;
+                loops_astar += g->loops;
+                astar_ch_t * c = i & 1 ? ch2 : ch;
+                int r2 = astar_ch_run (c, a, b);
+                usecs_ch += c->usecs;
+                loops_ch += c->loops;
+                assert (r == r2);
+                if (r != ASTAR_FOUND) continue;
+                assert (c->score == g->score);
+                found++;
+
+                uint32_t * route, total = 0;
+                uint32_t len = astar_ch_get_route (c, &route);
+                assert ((route[0] == a) && (route[len - 1] == b));
+                for (j = 1; j < len; j++) {
+                        for (k = g->first[route[j - 1]]; g->target[k] != route[j]; k++) {
+                                assert (k + 1 < g->first[route[j - 1] + 1]);
+                        }
+                        total += g->cost[k];
+                }
+                assert (total == c->score);
+                free (route);
+        }
+        assert (found > NUM_QUERIES / 5);
+        assert (loops_ch < loops_astar);
+        printf("%u routes. A*: %u loops, %u us. CH: %u loops, %u us.\n",
+               found, loops_astar, usecs_astar, loops_ch, usecs_ch);
+        printf("Verified: Contraction Hierarchy queries find optimal routes.\n");
+
+        assert (astar_ch_run (ch, 0, 0) == ASTAR_TRIVIAL);
+        assert (!ch->have_route);
+
+        // Free edges are kept: a chain of them is cheaper than the
+        // direct edge, whatever order the nodes are contracted in.
+        const uint32_t zfrom[] = { 0, 1, 2, 3, 0, 1, 2, 3 };
+        const uint32_t zto[] = { 1, 2, 3, 4, 4, 0, 1, 2 };
+        const uint32_t zcost[] = { 0, 0, 0, 0, 5, 0, 0, 0 };
+        astar_graph_t * zg = astar_graph_from_edges (5, 8, zfrom, zto, zcost);
+        astar_ch_t * zch = astar_ch_build (zg);
+        for (i = 0; i < 5; i++) {
+                for (j = 0; j < 5; j++) {
+                        if (i == j) continue;
+                        int r = astar_graph_run (zg, i, j);
+                        assert (astar_ch_run (zch, i, j) == r);
+                        assert ((r != ASTAR_FOUND) || (zch->score == zg->score));
+                }
+        }
+        assert ((astar_ch_run (zch, 0, 4) == ASTAR_FOUND) && (zch->score == 0));
+        astar_ch_destroy (zch);
+        astar_graph_destroy (zg);
+        printf("Verified: free edges survive contraction.\n");
+
+        free (pairs);
+        astar_ch_destroy (ch);
+        astar_ch_destroy (ch2);
+        astar_graph_destroy (g);
+        free (from);
+        free (to);
+        free (cost);
+        printf("All tests were successful.\n");
+        return 0;
+}
+
+#endif // TEST_CH
+
+
+// End of file.
@@ -0,0 +1,214 @@
+/*
+
+$Id
+
+Copyright (C) 2009 Alexios Chouchoulas
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#ifndef __ASTAR_CH_H
+#define __ASTAR_CH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+#include "astar_graph.h"
+
+
+/*
+ * Contraction Hierarchies, for static graphs that are queried many times.
+ *
+ * Preprocessing contracts the nodes of a graph (see astar_graph.h) one by
+ * one, least important first. Contracting a node removes it from the graph,
+ * and adds shortcut edges between its neighbours wherever the route through
+ * it was the only shortest one. Each node's rank is its place in this order.
+ *
+ * Queries then run Dijkstra's algorithm from both ends at once, only ever
+ * moving to nodes of higher rank. Both searches stay small, so queries on
+ * large road networks take microseconds. Shortcuts are unpacked into the
+ * original edges when the route is retrieved.
+ *
+ * The graph must not change after preprocessing. The hierarchy can be saved
+ * to a file, so it only has to be built once.
+ */
+
+// No node, or no middle node (an original edge, not a shortcut).
+#define ASTAR_CH_NONE 0xffffffff
+
+// An edge of the hierarchy.
+typedef struct {
+	uint32_t    node;       // The node at the other end.
+	uint32_t    cost;
+	uint32_t    middle;     // The node a shortcut skips, or ASTAR_CH_NONE.
+} astar_ch_edge_t;
+
+// The query state of a node. Index 0 is the forward search (from the
+// starting node), index 1 the backward one (from the target).
+typedef struct {
+	uint32_t    g[2];       // Cost from the starting node or to the target.
+	uint32_t    parent[2];  // The node we reached this one from.
+	uint32_t    edge[2];    // Which edge of the parent we followed.
+	uint32_t    search;     // The query that last touched this node.
+} astar_ch_node_t;
+
+
+typedef struct {
+
+	///////////////////////////////////////////////////////////////////////////////
+	//
+	// The hierarchy.
+	//
+	///////////////////////////////////////////////////////////////////////////////
+
+	uint32_t    num_nodes;
+	uint32_t *  rank;       // Contraction order of each node.
+
+	// Edges to higher ranked nodes, in CSR form: node n has edges
+	// up_first[n] to up_first[n + 1] - 1.
+	uint32_t *  up_first;
+	astar_ch_edge_t * up;
+	uint32_t    num_up;
+
+	// Edges from higher ranked nodes, the same way. The edges of node n
+	// lead from their node to n.
+	uint32_t *  down_first;
+	astar_ch_edge_t * down;
+	uint32_t    num_down;
+
+	uint32_t    shortcuts;  // Number of shortcuts added.
+
+	///////////////////////////////////////////////////////////////////////////////
+	//
+	// Data needed to run queries.
+	//
+	///////////////////////////////////////////////////////////////////////////////
+
+	uint32_t    node0;      // Starting node.
+	uint32_t    node1;      // Target node.
+	uint32_t    meet;       // Where the searches met on the best route.
+
+	asheap_t *  heap[2];    // Open lists of the two searches.
+	astar_ch_node_t * nodes;
+	uint32_t    search;     // Current query.
+
+	struct timeval t0;      // Start of the query.
+
+	uint32_t    have_route:1;
+
+	///////////////////////////////////////////////////////////////////////////////
+	//
+	// Results
+	//
+	///////////////////////////////////////////////////////////////////////////////
+
+	uint32_t    score;	// Score of the route.
+	uint32_t    result;	// Result code of the query.
+	char *      str_result; // Stringified result code.
+	uint32_t    usecs;      // Query (or preprocessing) time in microseconds.
+	uint32_t    loops;      // Number of nodes settled by both searches.
+} astar_ch_t;
+
+
+/**
+ * Build a Contraction Hierarchy.
+ *
+ * This takes a while on large graphs. The hierarchy is independent of the
+ * graph it was built from, which may be destroyed. The heuristic, cost limit
+ * and timeout of the graph aren't used.
+ *
+ * @param g A graph search context.
+ *
+ * @return A pointer to a new astar_ch_t structure.
+ */
+
+astar_ch_t * astar_ch_build (const astar_graph_t * g);
+
+/**
+ * Destroy a Contraction Hierarchy, freeing all memory it uses.
+ *
+ * @param ch A Contraction Hierarchy.
+ */
+
+void astar_ch_destroy (astar_ch_t * ch);
+
+/**
+ * Save a Contraction Hierarchy to a file.
+ *
+ * The file is in the byte order of the machine that wrote it.
+ *
+ * @param ch A Contraction Hierarchy.
+ * @param filename The name of the file.
+ *
+ * @return 0 on success, or -1 if the file couldn't be written (errno is
+ * set).
+ */
+
+int astar_ch_save (const astar_ch_t * ch, const char * filename);
+
+/**
+ * Load a Contraction Hierarchy saved by astar_ch_save().
+ *
+ * @param filename The name of the file.
+ *
+ * @return A pointer to a new astar_ch_t structure, or NULL if the file
+ * couldn't be read or isn't a Contraction Hierarchy.
+ */
+
+astar_ch_t * astar_ch_load (const char * filename);
+
+/**
+ * Find the cheapest route between two nodes.
+ *
+ * @param ch A Contraction Hierarchy.
+ * @param node0 The starting node.
+ * @param node1 The target node.
+ *
+ * @return <tt>ASTAR_FOUND</tt>, <tt>ASTAR_NOTFOUND</tt> or
+ * <tt>ASTAR_TRIVIAL</tt>. The cost of the route is in the score field.
+ */
+
+int astar_ch_run (astar_ch_t * ch, const uint32_t node0, const uint32_t node1);
+
+/**
+ * Get the nodes of the route found by the last query.
+ *
+ * Shortcuts are unpacked, so consecutive nodes are joined by edges of the
+ * original graph.
+ *
+ * @param ch A Contraction Hierarchy.
+ *
+ * @param nodes A pointer to a uint32_t pointer. A new array will be
+ * allocated and returned there. Free it with free().
+ *
+ * @return The number of nodes in the route, or 0 if there's no route.
+ */
+
+uint32_t astar_ch_get_route (astar_ch_t * ch, uint32_t ** nodes);
+
+// Macros.
+#define astar_ch_have_route(ch) (ch)->have_route
+
+
+#ifdef __cplusplus
+};
+#endif // __cplusplus
+
+#endif // __ASTAR_CH_H
+
+// End of file.
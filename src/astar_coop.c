@@ -0,0 +1,950 @@
+/*
+
+$Id
+
+Copyright (C) 2009 Alexios Chouchoulas
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "astar_coop.h"
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CONSTANTS AND MACROS
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define check_null(p,err) \
+        if ((p) == NULL) {    \
+                perror (err); \
+                exit (EXIT_FAILURE); \
+        }
+
+// Used as return astar_error (co, error_code) to stop processing when
+// an error occurs. It updates statistics.
+#define astar_error(co,err)                                             \
+        (((co)->result=(err)),                                          \
+         ((co)->str_result=#err),                                       \
+         (co)->usecs = get_time_difference (&t0),                       \
+         (err))
+
+// Initial sizes of the hash tables (powers of two) and node pool.
+#define _TABLE_INITIAL 1024
+#define _NODES_INITIAL 1024
+
+// Nobody parks here.
+#define NEVER 0xffffffff
+
+// Heap keys are F, shifted left to make room for tie-breaking.
+#define TIE_BITS 10
+#define TIE_MAX ((1 << TIE_BITS) - 1)
+#define F_MAX ((1 << (32 - TIE_BITS)) - 1)
+
+// Check the time every this many loops.
+#define TIME_CHECK_MASK 255
+
+
+// The UTC timezone -- we only operate on time deltas.
+static struct timezone _tz = { 0, 0 };
+
+
+static inline uint32_t
+get_time_difference (struct timeval *t0)
+{
+        struct timeval t;
+        gettimeofday (&t, &_tz);
+        return (t.tv_sec * 1000000 + t.tv_usec) - (t0->tv_sec * 1000000 + t0->tv_usec);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// SPACE-TIME HASH TABLES
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+static inline uint32_t
+coop_hash (const uint32_t square, const uint32_t t)
+{
+        uint32_t h = (square * 0x9e3779b1u) ^ (t * 0x85ebca77u);
+        return h ^ (h >> 15);
+}
+
+
+// The slot of (square,t), or the empty slot where it would go. Linear
+// probing.
+static inline astar_coop_slot_t *
+coop_find (astar_coop_slot_t * table, const uint32_t mask,
+           const uint32_t square, const uint32_t t)
+{
+        uint32_t i = coop_hash (square, t) & mask;
+        for (;; i = (i + 1) & mask) {
+                astar_coop_slot_t * slot = &table[i];
+                if ((slot->value == 0) || ((slot->square == square) && (slot->t == t))) return slot;
+        }
+}
+
+
+// Double the size of a table.
+static astar_coop_slot_t *
+coop_grow (astar_coop_slot_t * table, uint32_t * mask)
+{
+        uint32_t i, size = *mask + 1;
+        astar_coop_slot_t * grown = (astar_coop_slot_t *) calloc (2 * size, sizeof (astar_coop_slot_t));
+        check_null (grown, "coop_grow(), growing table");
+        for (i = 0; i < size; i++) {
+                if (table[i].value == 0) continue;
+                *coop_find (grown, 2 * size - 1, table[i].square, table[i].t) = table[i];
+        }
+        free (table);
+        *mask = 2 * size - 1;
+        return grown;
+}
+
+
+static inline uint32_t
+coop_reserved (const astar_coop_t * co, const uint32_t square, const uint32_t t)
+{
+        // Most squares are never reserved, or only early on.
+        if (t >= co->last[square]) return 0;
+        return coop_find (co->reserved, co->reserved_mask, square, t)->value;
+}
+
+
+static void
+coop_reserve (astar_coop_t * co, const uint32_t square, const uint32_t t, const uint32_t agent)
+{
+        if (2 * (co->num_reserved + 1) > co->reserved_mask + 1) {
+                co->reserved = coop_grow (co->reserved, &co->reserved_mask);
+        }
+        astar_coop_slot_t * slot = coop_find (co->reserved, co->reserved_mask, square, t);
+        assert (slot->value == 0);
+        slot->square = square;
+        slot->t = t;
+        slot->value = agent;
+        co->num_reserved++;
+        if (t + 1 > co->last[square]) co->last[square] = t + 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CONSTRUCTION AND DESTRUCTION
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+astar_coop_t *
+astar_coop_new (astar_t * as, const uint32_t max_time)
+{
+        assert (as != NULL);
+        assert (as->layers == 1);
+        assert (max_time > 0);
+
+        if ((as->get == NULL) || !as->origin_set) return NULL;
+
+        astar_coop_t * co = (astar_coop_t *) calloc (1, sizeof (astar_coop_t));
+        check_null (co, "astar_coop_new(), allocating memory");
+        co->w = as->w;
+        co->h = as->h;
+        co->wrap = as->wrap;
+        memcpy (co->dx, as->dx, sizeof (co->dx));
+        memcpy (co->dy, as->dy, sizeof (co->dy));
+        memcpy (co->mc, as->mc, sizeof (co->mc));
+        memcpy (co->dirs, as->dirs, sizeof (co->dirs));
+        co->num_dirs = as->num_dirs;
+        co->max_time = max_time;
+        co->timeout = as->timeout;
+
+        // Obtain the cost plane.
+        uint32_t area = co->w * co->h, x, y;
+        co->cost = (uint8_t *) malloc (area);
+        co->parked = (uint32_t *) malloc (area * sizeof (uint32_t));
+        co->dist.cost = (uint32_t *) malloc (area * sizeof (uint32_t));
+        co->dist.closed = (uint8_t *) malloc (area);
+        co->extra.cost = (uint32_t *) malloc (area * sizeof (uint32_t));
+        co->extra.closed = (uint8_t *) malloc (area);
+        co->last = (uint32_t *) calloc (area, sizeof (uint32_t));
+        check_null (co->cost, "astar_coop_new(), allocating memory");
+        check_null (co->parked, "astar_coop_new(), allocating memory");
+        check_null (co->last, "astar_coop_new(), allocating memory");
+        check_null (co->dist.cost, "astar_coop_new(), allocating memory");
+        check_null (co->dist.closed, "astar_coop_new(), allocating memory");
+        check_null (co->extra.cost, "astar_coop_new(), allocating memory");
+        check_null (co->extra.closed, "astar_coop_new(), allocating memory");
+        for (y = 0; y < co->h; y++) {
+                for (x = 0; x < co->w; x++) {
+                        co->cost[x + y * co->w] = (*as->get)(as->origin_x + x, as->origin_y + y);
+                        co->parked[x + y * co->w] = NEVER;
+                }
+        }
+
+        co->reserved_mask = co->seen_mask = co->forbidden_mask = _TABLE_INITIAL - 1;
+        co->reserved = (astar_coop_slot_t *) calloc (_TABLE_INITIAL, sizeof (astar_coop_slot_t));
+        co->forbidden = (astar_coop_slot_t *) calloc (_TABLE_INITIAL, sizeof (astar_coop_slot_t));
+        co->seen = (astar_coop_slot_t *) calloc (_TABLE_INITIAL, sizeof (astar_coop_slot_t));
+        co->nodes_alloc = _NODES_INITIAL;
+        co->nodes = (astar_coop_node_t *) malloc (co->nodes_alloc * sizeof (astar_coop_node_t));
+        check_null (co->reserved, "astar_coop_new(), allocating memory");
+        check_null (co->forbidden, "astar_coop_new(), allocating memory");
+        check_null (co->seen, "astar_coop_new(), allocating memory");
+        check_null (co->nodes, "astar_coop_new(), allocating memory");
+        co->heap = astar_heap_new (_NODES_INITIAL, 0);
+        co->dist.heap = astar_heap_new (_NODES_INITIAL, 0);
+        co->extra.heap = astar_heap_new (_NODES_INITIAL, 0);
+
+        astar_coop_set_wait_cost (co, as->mc[DIR_N]);
+        co->result = ASTAR_NOTHING;
+        co->str_result = "ASTAR_NOTHING";
+        return co;
+}
+
+
+void
+astar_coop_destroy (astar_coop_t * co)
+{
+        assert (co != NULL);
+        astar_heap_destroy (co->heap);
+        free (co->cost);
+        free (co->parked);
+        free (co->last);
+        astar_heap_destroy (co->dist.heap);
+        astar_heap_destroy (co->extra.heap);
+        free (co->dist.cost);
+        free (co->dist.closed);
+        free (co->extra.cost);
+        free (co->extra.closed);
+        free (co->reserved);
+        free (co->forbidden);
+        free (co->seen);
+        free (co->nodes);
+        free (co->route);
+        free (co->moves);
+        free (co);
+}
+
+
+void
+astar_coop_clear (astar_coop_t * co)
+{
+        assert (co != NULL);
+        uint32_t area = co->w * co->h, i;
+        for (i = 0; i < area; i++) {
+                co->parked[i] = NEVER;
+                co->last[i] = 0;
+        }
+        memset (co->reserved, 0, (co->reserved_mask + 1) * sizeof (astar_coop_slot_t));
+        memset (co->forbidden, 0, (co->forbidden_mask + 1) * sizeof (astar_coop_slot_t));
+        co->num_reserved = 0;
+        co->num_forbidden = 0;
+        co->num_agents = 0;
+}
+
+
+void
+astar_coop_set_wait_cost (astar_coop_t * co, const uint32_t wait_cost)
+{
+        assert (co != NULL);
+        uint32_t i;
+        co->wait_cost = wait_cost;
+        co->turn_cost = wait_cost;
+        for (i = 0; i < co->num_dirs; i++) {
+                if ((uint32_t) co->mc[co->dirs[i]] < co->turn_cost) co->turn_cost = co->mc[co->dirs[i]];
+        }
+        co->extra.reduce = co->turn_cost;
+}
+
+
+void
+astar_coop_forbid (astar_coop_t * co, const uint32_t x, const uint32_t y, const uint32_t t)
+{
+        assert (co != NULL);
+        assert ((x < co->w) && (y < co->h));
+        uint32_t square = x + y * co->w;
+        if (coop_reserved (co, square, t) == 0) coop_reserve (co, square, t, ASTAR_COOP_FORBIDDEN);
+}
+
+
+void
+astar_coop_forbid_move (astar_coop_t * co, const uint32_t x, const uint32_t y,
+                        const uint8_t dir, const uint32_t t)
+{
+        assert (co != NULL);
+        assert ((x < co->w) && (y < co->h) && (dir < NUM_DIRS));
+        if (2 * (co->num_forbidden + 1) > co->forbidden_mask + 1) {
+                co->forbidden = coop_grow (co->forbidden, &co->forbidden_mask);
+        }
+
+        // Moves are keyed by the square they start from, and the turn and
+        // direction together.
+        uint32_t square = x + y * co->w;
+        astar_coop_slot_t * slot = coop_find (co->forbidden, co->forbidden_mask, square, (t << 4) | dir);
+        if (slot->value) return;
+        slot->square = square;
+        slot->t = (t << 4) | dir;
+        slot->value = 1;
+        co->num_forbidden++;
+}
+
+
+uint32_t
+astar_coop_reserved (const astar_coop_t * co,
+                     const uint32_t x, const uint32_t y, const uint32_t t)
+{
+        assert (co != NULL);
+        assert ((x < co->w) && (y < co->h));
+        uint32_t square = x + y * co->w;
+        if (t >= co->parked[square]) return coop_reserved (co, square, co->parked[square]);
+        return coop_reserved (co, square, t);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// MAIN CODE
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Move from square in direction dir, wrapping around the edges of the map if
+// needed. Returns 0xffffffff if the move leaves the grid.
+static inline uint32_t
+coop_step (const astar_coop_t * co, const uint32_t square, const int dir)
+{
+        uint32_t x = square % co->w + co->dx[dir], y = square / co->w + co->dy[dir];
+        if (x >= co->w) {
+                if (!(co->wrap & ASTAR_WRAP_X)) return 0xffffffff;
+                x = (int32_t) x < 0 ? x + co->w : x - co->w;
+        }
+        if (y >= co->h) {
+                if (!(co->wrap & ASTAR_WRAP_Y)) return 0xffffffff;
+                y = (int32_t) y < 0 ? y + co->h : y - co->h;
+        }
+        return x + y * co->w;
+}
+
+
+// Can an agent be on square at turn t?
+static inline int
+coop_free (const astar_coop_t * co, const uint32_t square, const uint32_t t)
+{
+        return (co->cost[square] != COST_BLOCKED) && (t < co->parked[square]) &&
+                (coop_reserved (co, square, t) == 0);
+}
+
+
+// Octile distance to the square the backwards search heads for, at the least
+// cost of each move.
+static inline uint32_t
+coop_rra_h (const astar_coop_t * co, const astar_coop_rra_t * rra, const uint32_t square)
+{
+        uint32_t dx = abs ((int32_t) (square % co->w) - (int32_t) (rra->toward % co->w));
+        uint32_t dy = abs ((int32_t) (square / co->w) - (int32_t) (rra->toward / co->w));
+        if ((co->wrap & ASTAR_WRAP_X) && (co->w - dx < dx)) dx = co->w - dx;
+        if ((co->wrap & ASTAR_WRAP_Y) && (co->h - dy < dy)) dy = co->h - dy;
+        uint32_t lo = dx < dy ? dx : dy, hi = dx < dy ? dy : dx;
+        return lo * rra->diagonal + (hi - lo) * rra->straight;
+}
+
+
+// Start a backwards search from goal to start. Moves are taken backwards: the
+// agent moving from adj to square pays for entering square.
+static void
+coop_rra_start (astar_coop_t * co, astar_coop_rra_t * rra,
+                const uint32_t goal, const uint32_t start)
+{
+        uint32_t area = co->w * co->h, i;
+        for (i = 0; i < area; i++) rra->cost[i] = 0xffffffff;
+        memset (rra->closed, 0, area);
+        astar_heap_clear (rra->heap);
+
+        rra->toward = start;
+        rra->straight = rra->diagonal = 0xffffffff;
+        for (i = 0; i < co->num_dirs; i++) {
+                int dir = co->dirs[i];
+                uint32_t c = co->mc[dir] - rra->reduce;
+                if (co->dx[dir] && co->dy[dir]) {
+                        if (c < rra->diagonal) rra->diagonal = c;
+                } else if (c < rra->straight) rra->straight = c;
+        }
+        if (rra->diagonal > 2 * rra->straight) rra->diagonal = 2 * rra->straight;
+
+        rra->cost[goal] = 0;
+        astar_heap_add (rra->heap, coop_rra_h (co, rra, goal), goal);
+}
+
+
+// The cost from square to the goal, or 0xffffffff if it can't be reached.
+// Resumes the backwards search until square is closed.
+static uint32_t
+coop_rra_cost (astar_coop_t * co, astar_coop_rra_t * rra, const uint32_t target)
+{
+        uint32_t i;
+        while (!rra->closed[target]) {
+                if (astar_heap_is_empty (rra->heap)) return 0xffffffff;
+                uint32_t square;
+                astar_heap_pop (rra->heap, &square);
+                if (rra->closed[square]) continue;
+                rra->closed[square] = 1;
+                uint32_t d = rra->cost[square];
+                for (i = 0; i < co->num_dirs; i++) {
+                        int dir = co->dirs[i];
+                        uint32_t adj = coop_step (co, square, dir);
+                        if ((adj == 0xffffffff) || (co->cost[adj] == COST_BLOCKED)) continue;
+                        uint32_t nd = d + co->mc[(dir + 4) & 7] + co->cost[square] - rra->reduce;
+                        if (nd >= rra->cost[adj]) continue;
+                        rra->cost[adj] = nd;
+                        astar_heap_add (rra->heap, nd + coop_rra_h (co, rra, adj), adj);
+                }
+        }
+        return rra->cost[target];
+}
+
+
+// Reach (square,t) from node parent with g. Adds or improves its node.
+static inline void
+coop_reach (astar_coop_t * co, const uint32_t parent, const uint32_t square, const uint32_t t,
+            const uint32_t g, const uint8_t dir)
+{
+        // Agents that can't stay on the target until a later turn must
+        // spend the turns until then somehow. Squares the target can't be
+        // reached from lead nowhere.
+        uint32_t h = coop_rra_cost (co, &co->dist, square);
+        if (h == 0xffffffff) return;
+        if (t < co->earliest) {
+                uint32_t late = (co->earliest - t) * co->turn_cost + coop_rra_cost (co, &co->extra, square);
+                if (late > h) h = late;
+        }
+
+        if (2 * (co->num_nodes + 1) > co->seen_mask + 1) {
+                co->seen = coop_grow (co->seen, &co->seen_mask);
+        }
+        astar_coop_slot_t * slot = coop_find (co->seen, co->seen_mask, square, t);
+        astar_coop_node_t * node;
+        if (slot->value) {
+                node = &co->nodes[slot->value - 1];
+                if (node->closed || (g >= node->g)) return;
+        } else {
+                if (co->num_nodes == co->nodes_alloc) {
+                        co->nodes_alloc *= 2;
+                        co->nodes = (astar_coop_node_t *)
+                                realloc (co->nodes, co->nodes_alloc * sizeof (astar_coop_node_t));
+                        check_null (co->nodes, "coop_reach(), growing node pool");
+                }
+                slot->square = square;
+                slot->t = t;
+                slot->value = ++co->num_nodes;
+                node = &co->nodes[co->num_nodes - 1];
+                node->square = square;
+                node->t = t;
+                node->closed = 0;
+        }
+        node->g = g;
+        node->parent = parent;
+        node->dir = dir;
+
+        // Stale heap entries are left in place, and skipped when popped.
+        // Among states with the same F, later ones go first: they are closer
+        // to the target. F saturates rather than wrap around the key (such
+        // states are only ordered by time among themselves).
+        uint32_t f = (g > F_MAX) || (h > F_MAX - g) ? F_MAX : g + h;
+        astar_heap_add (co->heap, (f << TIE_BITS) | (TIE_MAX - (t < TIE_MAX ? t : TIE_MAX)),
+                        slot->value - 1);
+}
+
+
+int
+astar_coop_find (astar_coop_t * co,
+                 const uint32_t x0, const uint32_t y0,
+                 const uint32_t x1, const uint32_t y1)
+{
+        assert (co != NULL);
+        assert ((x0 < co->w) && (y0 < co->h));
+        assert ((x1 < co->w) && (y1 < co->h));
+
+        struct timeval t0;
+        gettimeofday (&t0, &_tz);
+
+        co->steps = 0;
+        co->score = 0;
+        co->loops = 0;
+
+        uint32_t start = x0 + y0 * co->w, goal = x1 + y1 * co->w, i;
+        if (!coop_free (co, start, 0)) return astar_error (co, ASTAR_EMBEDDED);
+
+        coop_rra_start (co, &co->dist, goal, start);
+        coop_rra_start (co, &co->extra, goal, start);
+        if (coop_rra_cost (co, &co->dist, start) == 0xffffffff) return astar_error (co, ASTAR_NOTFOUND);
+
+        co->earliest = co->last[goal];
+
+        // Forget the last search. The table may be far larger than the last
+        // search needed, so only empty the slots it used. Parents aren't
+        // needed any more, and hold the slots until they're all found.
+        for (i = 0; i < co->num_nodes; i++) {
+                astar_coop_node_t * node = &co->nodes[i];
+                node->parent = coop_find (co->seen, co->seen_mask, node->square, node->t) - co->seen;
+        }
+        for (i = 0; i < co->num_nodes; i++) co->seen[co->nodes[i].parent].value = 0;
+        co->num_nodes = 0;
+        astar_heap_clear (co->heap);
+        coop_reach (co, 0, start, 0, 0, DIR_WAIT);
+
+        astar_coop_node_t * found = NULL;
+        while (!astar_heap_is_empty (co->heap)) {
+                uint32_t n;
+                astar_heap_pop (co->heap, &n);
+                astar_coop_node_t * node = &co->nodes[n];
+                if (node->closed) continue;
+                node->closed = 1;
+                co->loops++;
+
+                // Agents stop on the target, so nobody else may pass there
+                // afterwards.
+                if ((node->square == goal) && (node->t >= co->last[goal])) {
+                        found = node;
+                        break;
+                }
+
+                if (((co->loops & TIME_CHECK_MASK) == 0) && co->timeout &&
+                    (get_time_difference (&t0) >= co->timeout)) {
+                        return astar_error (co, ASTAR_TIMEOUT);
+                }
+
+                uint32_t t = node->t + 1, square = node->square, g = node->g;
+                if (t > co->max_time) continue;
+
+                // Wait...
+                if (coop_free (co, square, t)) {
+                        coop_reach (co, n, square, t, g + co->wait_cost, DIR_WAIT);
+                }
+
+                // ...or move, but don't swap squares with another agent.
+                for (i = 0; i < co->num_dirs; i++) {
+                        int dir = co->dirs[i];
+                        uint32_t adj = coop_step (co, square, dir);
+                        if ((adj == 0xffffffff) || !coop_free (co, adj, t) ||
+                            (coop_rra_cost (co, &co->dist, adj) == 0xffffffff)) continue;
+                        uint32_t other = coop_reserved (co, adj, t - 1);
+                        if (other && (other != ASTAR_COOP_FORBIDDEN) &&
+                            (coop_reserved (co, square, t) == other)) continue;
+                        if (co->num_forbidden &&
+                            coop_find (co->forbidden, co->forbidden_mask, square, ((t - 1) << 4) | dir)->value) {
+                                continue;
+                        }
+                        coop_reach (co, n, adj, t, g + co->mc[dir] + co->cost[adj], dir);
+
+                        // The node pool may have moved.
+                        node = &co->nodes[n];
+                }
+        }
+
+        if (found == NULL) return astar_error (co, ASTAR_NOTFOUND);
+
+        // Walk back to the start.
+        co->steps = found->t;
+        co->score = found->g;
+        co->route = (uint32_t *) realloc (co->route, (co->steps + 1) * sizeof (uint32_t));
+        co->moves = (uint8_t *) realloc (co->moves, co->steps + 1);
+        check_null (co->route, "astar_coop_find(), allocating route");
+        check_null (co->moves, "astar_coop_find(), allocating route");
+
+        astar_coop_node_t * node = found;
+        for (i = co->steps + 1; i-- > 0;) {
+                assert (node->t == i);
+                co->route[i] = node->square;
+                if (i > 0) co->moves[i - 1] = node->dir;
+                node = &co->nodes[node->parent];
+        }
+        co->moves[co->steps] = DIR_END;
+
+        if (co->steps == 0) return astar_error (co, ASTAR_TRIVIAL);
+        return astar_error (co, ASTAR_FOUND);
+}
+
+
+int
+astar_coop_run (astar_coop_t * co,
+                const uint32_t x0, const uint32_t y0,
+                const uint32_t x1, const uint32_t y1)
+{
+        int result = astar_coop_find (co, x0, y0, x1, y1);
+        if (result == ASTAR_EMBEDDED) return result;
+        if ((result != ASTAR_FOUND) && (result != ASTAR_TRIVIAL)) {
+                // It can't get anywhere, so it stays where it is.
+                astar_coop_park (co, x0, y0);
+                return result;
+        }
+
+        uint32_t i;
+        co->num_agents++;
+        for (i = 0; i <= co->steps; i++) coop_reserve (co, co->route[i], i, co->num_agents);
+        co->parked[co->route[co->steps]] = co->steps;
+        return result;
+}
+
+
+uint32_t
+astar_coop_park (astar_coop_t * co, const uint32_t x, const uint32_t y)
+{
+        assert (co != NULL);
+        assert ((x < co->w) && (y < co->h));
+        uint32_t square = x + y * co->w;
+        if (!coop_free (co, square, 0)) return 0;
+
+        coop_reserve (co, square, 0, ++co->num_agents);
+        co->parked[square] = 0;
+        return co->num_agents;
+}
+
+
+uint32_t
+astar_coop_get_directions (astar_coop_t * co, direction_t ** directions)
+{
+        assert (co != NULL);
+        assert (directions != NULL);
+        if ((co->result != ASTAR_FOUND) || (co->steps == 0)) return 0;
+
+        direction_t * dp = (direction_t *) malloc ((co->steps + 1) * sizeof (direction_t));
+        check_null (dp, "astar_coop_get_directions(), allocating directions");
+        memcpy (dp, co->moves, co->steps + 1);
+        *directions = dp;
+        return co->steps;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TESTING
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+#if defined(TEST_COOP) || defined(BENCH_COOP)
+
+// Follow the routes of all agents at once, parking each on its target when
+// it gets there. Returns the number of times two agents were on the same
+// square, or swapped squares, at the same turn. Route n has steps[n] moves
+// from (x[n],y[n]).
+static uint32_t
+count_collisions (const uint32_t w, const uint32_t h, const uint32_t num,
+                  uint32_t * x, uint32_t * y, direction_t ** routes, const uint32_t * steps,
+                  const astar_t * as)
+{
+        uint32_t * taken = (uint32_t *) calloc (w * h, sizeof (uint32_t));
+        uint32_t * was = (uint32_t *) calloc (w * h, sizeof (uint32_t));
+        uint32_t collisions = 0, t, n, longest = 0;
+        check_null (taken, "count_collisions(), allocating memory");
+        check_null (was, "count_collisions(), allocating memory");
+        for (n = 0; n < num; n++) {
+                if (steps[n] > longest) longest = steps[n];
+        }
+
+        for (t = 0; t <= longest; t++) {
+                memset (taken, 0, w * h * sizeof (uint32_t));
+                for (n = 0; n < num; n++) {
+                        if ((t > 0) && (t <= steps[n])) {
+                                uint8_t dir = routes[n][t - 1];
+                                uint32_t from = x[n] + y[n] * w;
+                                x[n] = (x[n] + w + astar_get_dx (as, dir)) % w;
+                                y[n] = (y[n] + h + astar_get_dy (as, dir)) % h;
+
+                                // Did we swap with whoever was here?
+                                uint32_t other = was[x[n] + y[n] * w];
+                                if (other && (other != n + 1) && (dir != DIR_WAIT) &&
+                                    (x[other - 1] + y[other - 1] * w == from)) collisions++;
+                        }
+                        uint32_t square = x[n] + y[n] * w;
+                        if (taken[square]) collisions++;
+                        taken[square] = n + 1;
+                }
+                memcpy (was, taken, w * h * sizeof (uint32_t));
+        }
+        free (taken);
+        free (was);
+        return collisions;
+}
+
+#endif // defined(TEST_COOP) || defined(BENCH_COOP)
+
+
+#ifdef TEST_COOP
+
+// A corridor with a passing place half way along it.
+//
+//   #######.###
+//   ...........
+//   ###########
+static uint8_t
+corridor_get (const uint32_t x, const uint32_t y)
+{
+        assert ((x < 11) && (y < 3));
+        if (y == 2) return COST_BLOCKED;
+        if ((y == 0) && (x != 7)) return COST_BLOCKED;
+        return 1;
+}
+
+
+// Rooms of 8x8 squares, with one-square doors between them.
+static uint8_t
+rooms_get (const uint32_t x, const uint32_t y)
+{
+        assert ((x < 64) && (y < 64));
+        if ((x % 8 == 7) && (y % 8 != 3)) return COST_BLOCKED;
+        if ((y % 8 == 7) && (x % 8 != 3)) return COST_BLOCKED;
+        return 1;
+}
+
+
+#define NUM_AGENTS 150
+
+int
+main (int argc, char ** argv)
+{
+        uint32_t i;
+        srand (0);
+
+        // Two agents walking along the corridor towards each other: one of
+        // them steps aside to let the other one pass.
+        astar_t * as = astar_new (11, 3, corridor_get, NULL);
+        astar_set_origin (as, 0, 0);
+        astar_set_movement_mode (as, DIR_CARDINAL);
+        astar_coop_t * co = astar_coop_new (as, 64);
+        assert (co != NULL);
+
+        uint32_t x[2] = { 1, 10 }, y[2] = { 1, 1 }, steps[2];
+        direction_t * routes[2];
+        assert (astar_coop_run (co, 1, 1, 9, 1) == ASTAR_FOUND);
+        assert (co->steps == 8);
+        steps[0] = astar_coop_get_directions (co, &routes[0]);
+        assert (astar_coop_run (co, 10, 1, 0, 1) == ASTAR_FOUND);
+        steps[1] = astar_coop_get_directions (co, &routes[1]);
+        assert (steps[1] > 10);
+        for (i = 0; i < steps[1]; i++) {
+                if (routes[1][i] == DIR_N) break;
+        }
+        assert (i < steps[1]);
+        assert (count_collisions (11, 3, 2, x, y, routes, steps, as) == 0);
+        assert (astar_coop_reserved (co, 9, 1, 1000) == 1);
+        assert (astar_coop_reserved (co, 7, 0, 6) == 2);
+
+        // Nobody may stay where the second agent will pass.
+        assert (astar_coop_run (co, 7, 0, 7, 0) != ASTAR_TRIVIAL);
+        for (i = 0; i < 2; i++) astar_free_directions (routes[i]);
+
+        // Agents that can't get anywhere are parked, and block the way.
+        astar_coop_clear (co);
+        assert (astar_coop_park (co, 5, 1) == 1);
+        assert (astar_coop_park (co, 5, 1) == 0);
+        assert (astar_coop_run (co, 3, 1, 9, 1) == ASTAR_NOTFOUND);
+        assert (astar_coop_reserved (co, 3, 1, 0) == 2);
+        assert (astar_coop_reserved (co, 3, 1, 1000) == 2);
+        assert (astar_coop_run (co, 4, 1, 0, 1) == ASTAR_NOTFOUND);
+        assert (astar_coop_run (co, 2, 1, 0, 1) == ASTAR_FOUND);
+        x[0] = 3;
+        x[1] = 2;
+        steps[0] = 0;
+        routes[0] = NULL;
+        steps[1] = astar_coop_get_directions (co, &routes[1]);
+        assert (count_collisions (11, 3, 2, x, y, routes, steps, as) == 0);
+        astar_free_directions (routes[1]);
+        astar_coop_destroy (co);
+        astar_destroy (as);
+        printf("Verified: agents make way for each other in corridors.\n");
+
+        // Many agents moving between rooms.
+        uint32_t rep;
+        for (rep = 0; rep < 2; rep++) {
+                as = astar_new (64, 64, rooms_get, NULL);
+                astar_set_origin (as, 0, 0);
+                astar_set_movement_mode (as, rep ? DIR_8WAY : DIR_CARDINAL);
+                co = astar_coop_new (as, 512);
+
+                uint32_t ax[NUM_AGENTS], ay[NUM_AGENTS], asteps[NUM_AGENTS];
+                uint32_t bx[NUM_AGENTS], by[NUM_AGENTS], found = 0, usecs = 0;
+                direction_t * aroutes[NUM_AGENTS];
+                uint8_t used[64 * 64] = { 0 }, goal[64 * 64] = { 0 };
+                for (i = 0; i < NUM_AGENTS; i++) {
+                        do {
+                                ax[i] = rand () % 64;
+                                ay[i] = rand () % 64;
+                        } while ((rooms_get (ax[i], ay[i]) == COST_BLOCKED) || used[ax[i] + ay[i] * 64]);
+                        used[ax[i] + ay[i] * 64] = 1;
+                }
+                for (i = 0; i < NUM_AGENTS; i++) {
+                        do {
+                                bx[i] = rand () % 64;
+                                by[i] = rand () % 64;
+                        } while ((rooms_get (bx[i], by[i]) == COST_BLOCKED) || goal[bx[i] + by[i] * 64]);
+                        goal[bx[i] + by[i] * 64] = 1;
+
+                        int r = astar_coop_run (co, ax[i], ay[i], bx[i], by[i]);
+                        usecs += co->usecs;
+                        asteps[i] = 0;
+                        aroutes[i] = NULL;
+                        if ((r == ASTAR_FOUND) || (r == ASTAR_TRIVIAL)) {
+                                found++;
+                                asteps[i] = astar_coop_get_directions (co, &aroutes[i]);
+                                continue;
+                        }
+
+                        // Agents that can't get anywhere stay put, and
+                        // later ones have to go round them.
+                        assert ((r == ASTAR_NOTFOUND) || (r == ASTAR_EMBEDDED));
+                }
+                assert (found > NUM_AGENTS * 9 / 10);
+
+                // Agents without a route stand still, and nobody runs into
+                // them.
+                uint32_t collisions = count_collisions (64, 64, NUM_AGENTS, ax, ay, aroutes, asteps, as);
+                printf("%s: %u of %u agents routed in %u us, %u collisions.\n",
+                       rep ? "8-way" : "Cardinal", found, NUM_AGENTS, usecs, collisions);
+                assert (collisions == 0);
+                for (i = 0; i < NUM_AGENTS; i++) free (aroutes[i]);
+                astar_coop_destroy (co);
+                astar_destroy (as);
+        }
+        printf("Verified: cooperative routes don't collide.\n");
+
+        printf("All tests were successful.\n");
+        return 0;
+}
+
+#endif // TEST_COOP
+
+
+#ifdef BENCH_COOP
+
+// A 256x256 map of 16x16 rooms, joined by doors four squares wide.
+#define SIZE 256
+static uint8_t bench_map [SIZE * SIZE];
+
+static uint8_t
+bench_get (const uint32_t x, const uint32_t y)
+{
+        return bench_map[x + y * SIZE];
+}
+
+
+#ifndef NUM_AGENTS
+#define NUM_AGENTS 500
+#endif // NUM_AGENTS
+
+int
+main (int argc, char ** argv)
+{
+        uint32_t i, x, y;
+        srand (0);
+        for (y = 0; y < SIZE; y++) {
+                for (x = 0; x < SIZE; x++) {
+                        int wall = ((x % 16 == 15) && (y % 16 < 6 || y % 16 > 9)) ||
+                                ((y % 16 == 15) && (x % 16 < 6 || x % 16 > 9));
+                        bench_map[x + y * SIZE] = wall ? COST_BLOCKED : 1 + (rand () % 8 == 0);
+                }
+        }
+
+        astar_t * as = astar_new (SIZE, SIZE, bench_get, NULL);
+        astar_init_grid (as, 0, 0, bench_get);
+        astar_set_movement_mode (as, DIR_8WAY);
+        astar_set_steering_penalty (as, 0);
+
+        // Agents go from anywhere to anywhere.
+        static uint32_t x0[NUM_AGENTS], y0[NUM_AGENTS], x1[NUM_AGENTS], y1[NUM_AGENTS];
+        static uint32_t steps[NUM_AGENTS];
+        static direction_t * routes[NUM_AGENTS];
+        static uint8_t used[SIZE * SIZE], goal[SIZE * SIZE];
+        for (i = 0; i < NUM_AGENTS; i++) {
+                do {
+                        x0[i] = rand () % SIZE;
+                        y0[i] = rand () % SIZE;
+                } while ((bench_get (x0[i], y0[i]) == COST_BLOCKED) || used[x0[i] + y0[i] * SIZE]);
+                used[x0[i] + y0[i] * SIZE] = 1;
+                do {
+                        x1[i] = rand () % SIZE;
+                        y1[i] = rand () % SIZE;
+                } while ((bench_get (x1[i], y1[i]) == COST_BLOCKED) || goal[x1[i] + y1[i] * SIZE]);
+                goal[x1[i] + y1[i] * SIZE] = 1;
+        }
+
+        // Every agent on its own first.
+        struct timeval t0;
+        uint32_t usecs, found = 0, collisions;
+        gettimeofday (&t0, &_tz);
+        for (i = 0; i < NUM_AGENTS; i++) {
+                steps[i] = 0;
+                routes[i] = NULL;
+                if (astar_run (as, x0[i], y0[i], x1[i], y1[i]) != ASTAR_FOUND) continue;
+                steps[i] = astar_get_directions (as, &routes[i]);
+                found++;
+        }
+        usecs = get_time_difference (&t0);
+        uint32_t ax[NUM_AGENTS], ay[NUM_AGENTS];
+        memcpy (ax, x0, sizeof (ax));
+        memcpy (ay, y0, sizeof (ay));
+        collisions = count_collisions (SIZE, SIZE, NUM_AGENTS, ax, ay, routes, steps, as);
+        printf("Independent A*: %u of %u agents routed in %u us, %u collisions.\n",
+               found, NUM_AGENTS, usecs, collisions);
+        for (i = 0; i < NUM_AGENTS; i++) {
+                if (routes[i] != NULL) astar_free_directions (routes[i]);
+        }
+
+        // Then cooperatively.
+        astar_coop_t * co = astar_coop_new (as, 4 * SIZE);
+        uint32_t loops = 0, turns = 0;
+        found = 0;
+        gettimeofday (&t0, &_tz);
+        for (i = 0; i < NUM_AGENTS; i++) {
+                steps[i] = 0;
+                routes[i] = NULL;
+                int r = astar_coop_run (co, x0[i], y0[i], x1[i], y1[i]);
+                loops += co->loops;
+                if (r != ASTAR_FOUND) continue;
+                steps[i] = astar_coop_get_directions (co, &routes[i]);
+                if (steps[i] > turns) turns = steps[i];
+                found++;
+        }
+        usecs = get_time_difference (&t0);
+        memcpy (ax, x0, sizeof (ax));
+        memcpy (ay, y0, sizeof (ay));
+        collisions = count_collisions (SIZE, SIZE, NUM_AGENTS, ax, ay, routes, steps, as);
+        printf("Cooperative A*: %u of %u agents routed in %u us (%u states, %u reservations), "
+               "all there in %u turns, %u collisions.\n",
+               found, NUM_AGENTS, usecs, loops, co->num_reserved, turns, collisions);
+        assert (found == NUM_AGENTS);
+        assert (collisions == 0);
+        for (i = 0; i < NUM_AGENTS; i++) {
+                if (routes[i] != NULL) astar_free_directions (routes[i]);
+        }
+
+        astar_coop_destroy (co);
+        astar_destroy (as);
+        return 0;
+}
+
+#endif // BENCH_COOP
+
+
+// End of file.
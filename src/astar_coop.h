@@ -0,0 +1,341 @@
+/*
+
+$Id
+
+Copyright (C) 2009 Alexios Chouchoulas
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#ifndef __ASTAR_COOP_H
+#define __ASTAR_COOP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+#include "astar.h"
+
+
+/*
+ * Cooperative pathfinding (Cooperative A*), for many agents sharing a map.
+ *
+ * Agents are routed one after the other. Each route reserves the squares it
+ * occupies at each turn in a shared space-time reservation table, and the
+ * agent stays on its target square once it gets there. Later agents search
+ * in space and time: a state is a square at a turn, and every turn an agent
+ * either moves to a neighbouring square or waits. States reserved by other
+ * agents can't be entered, and neither can two agents swap squares in one
+ * turn, so the routes never collide.
+ *
+ * Routes found earlier don't make way for later ones, so the order in which
+ * agents are routed matters. Agents moving diagonally may still cross each
+ * other's path between squares.
+ */
+
+// Reserved by astar_coop_forbid() rather than by an agent.
+#define ASTAR_COOP_FORBIDDEN 0xffffffff
+
+// A reserved state, or a state seen by the search, in a hash table.
+typedef struct {
+	uint32_t    square;     // Square, as x + y * w.
+	uint32_t    t;          // Turn.
+	uint32_t    value;      // Agent (plus one) or node index. 0 if empty.
+} astar_coop_slot_t;
+
+// A node of the space-time search.
+typedef struct {
+	uint32_t    square;
+	uint32_t    t;
+	uint32_t    g;
+	uint32_t    parent;     // Index of the parent node.
+	uint8_t     dir;        // The move that led here (or DIR_WAIT).
+	uint8_t     closed;
+} astar_coop_node_t;
+
+// A backwards search from the target towards the start, resumed whenever the
+// cost of a square it hasn't reached yet is needed.
+typedef struct {
+	uint32_t *  cost;       // Cost from each square to the target.
+	uint8_t *   closed;     // Is the cost of each square final?
+	asheap_t *  heap;
+	uint32_t    reduce;     // Subtracted from the cost of each move.
+	uint32_t    toward;     // The square the search heads for.
+	uint32_t    straight;   // Least cost of a cardinal move, less reduce.
+	uint32_t    diagonal;   // Least cost of a diagonal move, less reduce.
+} astar_coop_rra_t;
+
+
+typedef struct {
+
+	///////////////////////////////////////////////////////////////////////////////
+	//
+	// The map and cost model, copied from an A* context.
+	//
+	///////////////////////////////////////////////////////////////////////////////
+
+	uint32_t    w;
+	uint32_t    h;
+	uint32_t    wrap;
+	uint8_t *   cost;       // Cost plane, as x + y * w.
+	int32_t     dx[NUM_DIRS];
+	int32_t     dy[NUM_DIRS];
+	int32_t     mc[NUM_DIRS];
+	uint8_t     dirs[NUM_DIRS];
+	uint8_t     num_dirs;
+	uint32_t    wait_cost;  // Cost of waiting for a turn.
+	uint32_t    turn_cost;  // The least a turn can cost (moving or waiting).
+	uint32_t    max_time;   // Routes can't take more turns than this.
+	uint32_t    timeout;    // Time limit of each search (microseconds, 0 for none).
+
+	// The heuristic is the true cost to the target on the empty map, found
+	// by searching backwards from the target as far as needed (Reverse
+	// Resumable A*). Agents that must take some turns before they can stay
+	// on the target pay turn_cost for each turn, and the cost of their moves
+	// over turn_cost on top.
+	astar_coop_rra_t dist;  // Cost from each square to the target.
+	astar_coop_rra_t extra; // Likewise, less turn_cost for each move.
+
+	///////////////////////////////////////////////////////////////////////////////
+	//
+	// Reservations.
+	//
+	///////////////////////////////////////////////////////////////////////////////
+
+	astar_coop_slot_t * reserved;
+	uint32_t    num_reserved;
+	uint32_t    reserved_mask;
+
+	astar_coop_slot_t * forbidden; // Moves ruled out by astar_coop_forbid_move().
+	uint32_t    num_forbidden;
+	uint32_t    forbidden_mask;
+
+	uint32_t *  parked;     // Turn from which an agent stays on each square.
+	uint32_t *  last;       // Last turn each square is reserved (plus one).
+	uint32_t    num_agents; // Number of routes reserved.
+
+	///////////////////////////////////////////////////////////////////////////////
+	//
+	// Search state.
+	//
+	///////////////////////////////////////////////////////////////////////////////
+
+	asheap_t *  heap;
+	astar_coop_node_t * nodes;
+	uint32_t    num_nodes;
+	uint32_t    nodes_alloc;
+	astar_coop_slot_t * seen;
+	uint32_t    seen_mask;
+	uint32_t    earliest;   // First turn the agent may stay on the target.
+
+	///////////////////////////////////////////////////////////////////////////////
+	//
+	// Results
+	//
+	///////////////////////////////////////////////////////////////////////////////
+
+	uint32_t *  route;      // The square of the agent at each turn.
+	uint8_t *   moves;      // The move made at each turn.
+	uint32_t    steps;	// Number of turns in the route.
+	uint32_t    score;	// Score of the route.
+	uint32_t    result;	// Result code of the search.
+	char *      str_result; // Stringified result code.
+	uint32_t    usecs;      // Search time in microseconds.
+	uint32_t    loops;      // Number of states expanded.
+} astar_coop_t;
+
+
+/**
+ * Create a cooperative pathfinding context.
+ *
+ * The map (read through get(), or the grid cached by astar_init_grid()), the
+ * movement mode, move costs and timeout of the A* context are copied, and the
+ * context is no longer needed. The steering penalty isn't used, and neither
+ * is the heuristic: the cost to the target ignoring other agents is used
+ * instead, since the search has to look at every square at many turns.
+ *
+ * @param as An initialised A* context. Its origin must have been set, and
+ * get() must be set (e.g. by astar_init_grid()). Layered grids aren't
+ * supported.
+ *
+ * @param max_time The most turns a route may take. Searches give up on
+ * states later than this.
+ *
+ * @return A pointer to a new astar_coop_t structure, or NULL if the grid
+ * can't be read.
+ */
+
+astar_coop_t * astar_coop_new (astar_t * as, const uint32_t max_time);
+
+/**
+ * Destroy a cooperative pathfinding context, freeing all memory it uses.
+ *
+ * @param co A cooperative pathfinding context.
+ */
+
+void astar_coop_destroy (astar_coop_t * co);
+
+/**
+ * Drop all reservations and forbidden moves, e.g. to route a new set of
+ * agents.
+ *
+ * @param co A cooperative pathfinding context.
+ */
+
+void astar_coop_clear (astar_coop_t * co);
+
+/**
+ * Set the cost of waiting on a square for a turn.
+ *
+ * The default is the cost of a cardinal move.
+ *
+ * @param co A cooperative pathfinding context.
+ * @param wait_cost The cost of waiting.
+ */
+
+void astar_coop_set_wait_cost (astar_coop_t * co, const uint32_t wait_cost);
+
+/**
+ * Route an agent, avoiding the routes of the agents routed before it, and
+ * reserve its route.
+ *
+ * The agent starts moving on turn 0, and stays on the target square once
+ * it's there.
+ *
+ * @param co A cooperative pathfinding context.
+ * @param x0 The X ordinate of the starting square.
+ * @param y0 The Y ordinate of the starting square.
+ * @param x1 The X ordinate of the target square.
+ * @param y1 The Y ordinate of the target square.
+ *
+ * @return <tt>ASTAR_FOUND</tt>, <tt>ASTAR_NOTFOUND</tt> (the agent is
+ * parked on its starting square, as by astar_coop_park()),
+ * <tt>ASTAR_TIMEOUT</tt> (likewise), <tt>ASTAR_EMBEDDED</tt> if the starting
+ * square is blocked or taken (nothing is reserved), or
+ * <tt>ASTAR_TRIVIAL</tt> if the agent is already on its target (which is
+ * reserved for it).
+ */
+
+int astar_coop_run (astar_coop_t * co,
+		    const uint32_t x0, const uint32_t y0,
+		    const uint32_t x1, const uint32_t y1);
+
+/**
+ * Park an agent that won't move: reserve its square from turn 0 on, so
+ * agents routed after it go round it. Agents already routed through the
+ * square aren't routed again.
+ *
+ * @param co A cooperative pathfinding context.
+ * @param x The X ordinate of the square.
+ * @param y The Y ordinate of the square.
+ *
+ * @return The number of the agent (the first agent routed is 1), or 0 if
+ * the square is blocked or taken at turn 0.
+ */
+
+uint32_t astar_coop_park (astar_coop_t * co, const uint32_t x, const uint32_t y);
+
+/**
+ * Route an agent like astar_coop_run(), but don't reserve its route.
+ *
+ * The route is left in co->route (the square of the agent at each turn,
+ * as x + y * w) and co->moves, and may be read with
+ * astar_coop_get_directions().
+ *
+ * @param co A cooperative pathfinding context.
+ * @param x0 The X ordinate of the starting square.
+ * @param y0 The Y ordinate of the starting square.
+ * @param x1 The X ordinate of the target square.
+ * @param y1 The Y ordinate of the target square.
+ *
+ * @return As astar_coop_run().
+ */
+
+int astar_coop_find (astar_coop_t * co,
+		     const uint32_t x0, const uint32_t y0,
+		     const uint32_t x1, const uint32_t y1);
+
+/**
+ * Keep agents off a square at a turn, e.g. to constrain a search.
+ *
+ * Agents may not stay on their target if it's forbidden at a later turn.
+ * Dropped by astar_coop_clear().
+ *
+ * @param co A cooperative pathfinding context.
+ * @param x The X ordinate of the square.
+ * @param y The Y ordinate of the square.
+ * @param t The turn.
+ */
+
+void astar_coop_forbid (astar_coop_t * co, const uint32_t x, const uint32_t y, const uint32_t t);
+
+/**
+ * Forbid a move, e.g. to stop an agent from swapping squares with another
+ * one. Dropped by astar_coop_clear().
+ *
+ * @param co A cooperative pathfinding context.
+ * @param x The X ordinate of the square the move starts from.
+ * @param y The Y ordinate of the square the move starts from.
+ * @param dir The direction of the move (<tt>DIR_x</tt>).
+ * @param t The turn on which the move is made. The agent arrives on turn t
+ * + 1.
+ */
+
+void astar_coop_forbid_move (astar_coop_t * co, const uint32_t x, const uint32_t y,
+			     const uint8_t dir, const uint32_t t);
+
+/**
+ * Get the directions of the route found by the last search.
+ *
+ * Works like astar_get_directions(), except that <tt>DIR_WAIT</tt> means
+ * the agent stays where it is for a turn. Step n of the directions is taken
+ * on turn n.
+ *
+ * @param co A cooperative pathfinding context.
+ *
+ * @param directions A pointer to a direction_t pointer. A new array will be
+ * allocated and returned there (unless there's no route). Free it with
+ * astar_free_directions().
+ *
+ * @return The number of steps returned, or 0 if there's no route.
+ */
+
+uint32_t astar_coop_get_directions (astar_coop_t * co, direction_t ** directions);
+
+/**
+ * Is a square taken at a turn?
+ *
+ * @param co A cooperative pathfinding context.
+ * @param x The X ordinate of the square.
+ * @param y The Y ordinate of the square.
+ * @param t The turn.
+ *
+ * @return 0 if the square is free, otherwise the number of the agent that
+ * takes it (the first agent routed is 1), or <tt>ASTAR_COOP_FORBIDDEN</tt>.
+ */
+
+uint32_t astar_coop_reserved (const astar_coop_t * co,
+			      const uint32_t x, const uint32_t y, const uint32_t t);
+
+
+#ifdef __cplusplus
+};
+#endif // __cplusplus
+
+#endif // __ASTAR_COOP_H
+
+// End of file.
@@ -0,0 +1,717 @@
+/*
+
+$Id
+
+Copyright (C) 2009 Alexios Chouchoulas
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "astar_cpd.h"
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#  include <pthread.h>
+#  define ASTAR_THREADS
+#endif // HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CONSTANTS AND MACROS
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define check_null(p,err) \
+        if ((p) == NULL) {    \
+                perror (err); \
+                exit (EXIT_FAILURE); \
+        }
+
+// Initial size of the heaps.
+#define _HEAP_INITIAL 256
+
+// Unreachable.
+#define INFINITE 0xffffffff
+
+// The move of a run that leads nowhere, and of blocked targets (which may
+// join any run).
+#define RUN_NONE 0xf
+#define RUN_ANY  0xe
+
+#define run_start(r) ((r) >> 4)
+#define run_move(r)  ((r) & 0xf)
+
+// Saved databases start with this.
+static const char _magic[8] = { 'A', 'S', 'T', 'A', 'R', 'C', 'P', '1' };
+
+
+// The UTC timezone -- we only operate on time deltas.
+static struct timezone _tz = { 0, 0 };
+
+
+static inline uint32_t
+get_time_difference (struct timeval *t0)
+{
+        struct timeval t;
+        gettimeofday (&t, &_tz);
+        return (t.tv_sec * 1000000 + t.tv_usec) - (t0->tv_sec * 1000000 + t0->tv_usec);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// INTERNAL USE ONLY
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Move from (x,y) in direction dir, wrapping around the edges of the map if
+// needed. Returns 0 if the move leaves the grid.
+static inline int
+cpd_step (const astar_cpd_t * cpd, uint32_t * x, uint32_t * y, const int dir)
+{
+        uint32_t nx = *x + cpd->dx[dir], ny = *y + cpd->dy[dir];
+        if (nx >= cpd->w) {
+                if (!(cpd->wrap & ASTAR_WRAP_X)) return 0;
+                nx = (int32_t) nx < 0 ? nx + cpd->w : nx - cpd->w;
+        }
+        if (ny >= cpd->h) {
+                if (!(cpd->wrap & ASTAR_WRAP_Y)) return 0;
+                ny = (int32_t) ny < 0 ? ny + cpd->h : ny - cpd->h;
+        }
+        *x = nx;
+        *y = ny;
+        return 1;
+}
+
+
+// Interleave the bits of x and y.
+static uint64_t
+cpd_morton (const uint32_t x, const uint32_t y)
+{
+        uint64_t code = 0;
+        int i;
+        for (i = 0; i < 32; i++) {
+                code |= (uint64_t) ((x >> i) & 1) << (2 * i);
+                code |= (uint64_t) ((y >> i) & 1) << (2 * i + 1);
+        }
+        return code;
+}
+
+
+// A square and its Morton code, for sorting.
+typedef struct {
+        uint64_t        code;
+        uint32_t        cell;
+} _cpd_morton_t;
+
+static int
+cpd_cmp_morton (const void * a, const void * b)
+{
+        uint64_t ca = ((const _cpd_morton_t *) a)->code;
+        uint64_t cb = ((const _cpd_morton_t *) b)->code;
+        return ca < cb ? -1 : (ca > cb);
+}
+
+
+static astar_cpd_t *
+cpd_alloc (const uint32_t w, const uint32_t h)
+{
+        astar_cpd_t * cpd = (astar_cpd_t *) calloc (1, sizeof (astar_cpd_t));
+        check_null (cpd, "cpd_alloc(), allocating memory");
+        cpd->w = w;
+        cpd->h = h;
+        cpd->order = (uint32_t *) malloc (w * h * sizeof (uint32_t));
+        cpd->blocked = (uint8_t *) malloc (w * h);
+        cpd->first = (uint32_t *) malloc ((w * h + 1) * sizeof (uint32_t));
+        check_null (cpd->order, "cpd_alloc(), allocating memory");
+        check_null (cpd->blocked, "cpd_alloc(), allocating memory");
+        check_null (cpd->first, "cpd_alloc(), allocating memory");
+        return cpd;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// BUILDING THE DATABASE
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+// One database building job. Threads do every step-th source, starting with
+// the first-th.
+typedef struct {
+        astar_cpd_t *   cpd;
+        const uint8_t * cost;   // Cost plane of the grid.
+        const int32_t * mc;     // Move costs.
+        const uint8_t * dirs;   // Directions in use.
+        uint32_t        num_dirs;
+        const uint32_t * cells; // The squares in Morton order.
+        uint32_t **     rows;   // The runs of each source.
+        uint32_t *      nruns;  // How many there are.
+        uint32_t        first;
+        uint32_t        step;
+} _cpd_job_t;
+
+
+static void
+cpd_dijkstra (_cpd_job_t * job, uint32_t * dist, uint8_t * move, asheap_t * heap,
+              const uint32_t source)
+{
+        // Dijkstra's algorithm from the source. Every square inherits the
+        // first move of the route to it from its parent.
+        astar_cpd_t * cpd = job->cpd;
+        uint32_t area = cpd->w * cpd->h, i;
+
+        for (i = 0; i < area; i++) {
+                dist[i] = INFINITE;
+                move[i] = RUN_NONE;
+        }
+        if (cpd->blocked[source]) return;
+
+        dist[source] = 0;
+        astar_heap_clear (heap);
+        astar_heap_add (heap, 0, source);
+
+        // Stale heap entries are left in place and skipped when they're popped.
+        while (!astar_heap_is_empty (heap)) {
+                uint32_t ofs;
+                uint32_t g = astar_heap_pop (heap, &ofs);
+                if (g > dist[ofs]) continue;
+
+                uint32_t x = ofs % cpd->w, y = ofs / cpd->w;
+                for (i = 0; i < job->num_dirs; i++) {
+                        int dir = job->dirs[i];
+                        uint32_t adj_x = x, adj_y = y;
+                        if (!cpd_step (cpd, &adj_x, &adj_y, dir)) continue;
+
+                        uint32_t adj = adj_x + adj_y * cpd->w;
+                        if (cpd->blocked[adj]) continue;
+
+                        uint32_t adj_g = g + job->mc[dir] + job->cost[adj];
+                        if (adj_g < dist[adj]) {
+                                dist[adj] = adj_g;
+                                move[adj] = ofs == source ? dir : move[ofs];
+                                astar_heap_add (heap, adj_g, adj);
+                        }
+                }
+        }
+        move[source] = RUN_NONE;
+}
+
+
+static void
+cpd_compress (_cpd_job_t * job, const uint8_t * move, const uint32_t source)
+{
+        // Run-length encode the first moves, in Morton order. Blocked
+        // targets join the current run (or the next, at the start).
+        astar_cpd_t * cpd = job->cpd;
+        uint32_t area = cpd->w * cpd->h, i, n = 0, alloc = 16;
+        uint32_t * runs = (uint32_t *) malloc (alloc * sizeof (uint32_t));
+        check_null (runs, "cpd_compress(), allocating runs");
+        uint8_t last = RUN_ANY;
+
+        for (i = 0; i < area; i++) {
+                uint32_t cell = job->cells[i];
+                uint8_t m = cpd->blocked[cell] ? RUN_ANY : move[cell];
+                if ((m == RUN_ANY) || (m == last)) continue;
+                if (last == RUN_ANY) {
+                        // The first run starts at the very beginning.
+                        assert (n == 0);
+                        runs[n++] = m;
+                } else {
+                        if (n == alloc) {
+                                alloc *= 2;
+                                runs = (uint32_t *) realloc (runs, alloc * sizeof (uint32_t));
+                                check_null (runs, "cpd_compress(), growing runs");
+                        }
+                        runs[n++] = (i << 4) | m;
+                }
+                last = m;
+        }
+
+        // Every target is blocked.
+        if (n == 0) runs[n++] = RUN_NONE;
+
+        job->rows[source] = runs;
+        job->nruns[source] = n;
+}
+
+
+static void *
+cpd_worker (void * arg)
+{
+        _cpd_job_t * job = (_cpd_job_t *) arg;
+        uint32_t area = job->cpd->w * job->cpd->h, i;
+
+        // Every worker needs its own scratch space and heap.
+        uint32_t * dist = (uint32_t *) malloc (area * sizeof (uint32_t));
+        uint8_t * move = (uint8_t *) malloc (area);
+        check_null (dist, "cpd_worker(), allocating memory");
+        check_null (move, "cpd_worker(), allocating memory");
+        asheap_t * heap = astar_heap_new (_HEAP_INITIAL, 0);
+
+        for (i = job->first; i < area; i += job->step) {
+                cpd_dijkstra (job, dist, move, heap, i);
+                cpd_compress (job, move, i);
+        }
+
+        astar_heap_destroy (heap);
+        free (move);
+        free (dist);
+        return NULL;
+}
+
+
+astar_cpd_t *
+astar_cpd_build (astar_t * as, const uint32_t num_threads)
+{
+        assert (as != NULL);
+        assert (as->layers == 1);
+
+        if ((as->get == NULL) || !as->origin_set) return NULL;
+
+        struct timeval t0;
+        gettimeofday (&t0, &_tz);
+
+        uint32_t w = as->w, h = as->h, area = w * h, i, x, y;
+        astar_cpd_t * cpd = cpd_alloc (w, h);
+        cpd->wrap = as->wrap;
+        memcpy (cpd->dx, as->dx, sizeof (cpd->dx));
+        memcpy (cpd->dy, as->dy, sizeof (cpd->dy));
+
+        // Obtain the cost plane.
+        uint8_t * cost = (uint8_t *) malloc (area);
+        check_null (cost, "astar_cpd_build(), allocating cost plane");
+        for (y = 0; y < h; y++) {
+                for (x = 0; x < w; x++) {
+                        cost[x + y * w] = (*as->get)(as->origin_x + x, as->origin_y + y);
+                        cpd->blocked[x + y * w] = cost[x + y * w] == COST_BLOCKED;
+                }
+        }
+
+        // Sort the squares in Morton order.
+        _cpd_morton_t * codes = (_cpd_morton_t *) malloc (area * sizeof (_cpd_morton_t));
+        uint32_t * cells = (uint32_t *) malloc (area * sizeof (uint32_t));
+        check_null (codes, "astar_cpd_build(), allocating memory");
+        check_null (cells, "astar_cpd_build(), allocating memory");
+        for (i = 0; i < area; i++) {
+                codes[i].code = cpd_morton (i % w, i / w);
+                codes[i].cell = i;
+        }
+        qsort (codes, area, sizeof (_cpd_morton_t), cpd_cmp_morton);
+        for (i = 0; i < area; i++) {
+                cells[i] = codes[i].cell;
+                cpd->order[cells[i]] = i;
+        }
+        free (codes);
+
+        // One source at a time, in as many threads as we're allowed.
+        uint32_t ** rows = (uint32_t **) malloc (area * sizeof (uint32_t *));
+        uint32_t * nruns = (uint32_t *) malloc (area * sizeof (uint32_t));
+        check_null (rows, "astar_cpd_build(), allocating memory");
+        check_null (nruns, "astar_cpd_build(), allocating memory");
+
+        uint32_t nt = num_threads > area ? area : num_threads;
+        if (nt < 1) nt = 1;
+        _cpd_job_t * jobs = (_cpd_job_t *) malloc (nt * sizeof (_cpd_job_t));
+        check_null (jobs, "astar_cpd_build(), allocating jobs");
+        for (i = 0; i < nt; i++) {
+                jobs[i].cpd = cpd;
+                jobs[i].cost = cost;
+                jobs[i].mc = as->mc;
+                jobs[i].dirs = as->dirs;
+                jobs[i].num_dirs = as->num_dirs;
+                jobs[i].cells = cells;
+                jobs[i].rows = rows;
+                jobs[i].nruns = nruns;
+                jobs[i].first = i;
+                jobs[i].step = nt;
+        }
+
+#ifdef ASTAR_THREADS
+        if (nt > 1) {
+                pthread_t * threads = (pthread_t *) malloc (nt * sizeof (pthread_t));
+                check_null (threads, "astar_cpd_build(), allocating threads");
+                for (i = 0; i < nt; i++) {
+                        if (pthread_create (&threads[i], NULL, cpd_worker, &jobs[i])) {
+                                perror ("astar_cpd_build(), starting thread");
+                                exit (EXIT_FAILURE);
+                        }
+                }
+                for (i = 0; i < nt; i++) pthread_join (threads[i], NULL);
+                free (threads);
+        } else
+#endif // ASTAR_THREADS
+        {
+                // Single-threaded build (or no thread support).
+                jobs[0].step = 1;
+                cpd_worker (&jobs[0]);
+        }
+
+        free (jobs);
+        free (cells);
+        free (cost);
+
+        // Gather the runs in one array.
+        cpd->num_runs = 0;
+        for (i = 0; i < area; i++) cpd->num_runs += nruns[i];
+        cpd->runs = (uint32_t *) malloc (cpd->num_runs * sizeof (uint32_t));
+        check_null (cpd->runs, "astar_cpd_build(), allocating runs");
+        uint32_t n = 0;
+        for (i = 0; i < area; i++) {
+                cpd->first[i] = n;
+                memcpy (cpd->runs + n, rows[i], nruns[i] * sizeof (uint32_t));
+                n += nruns[i];
+                free (rows[i]);
+        }
+        cpd->first[area] = n;
+        free (rows);
+        free (nruns);
+
+        cpd->usecs = get_time_difference (&t0);
+        return cpd;
+}
+
+
+void
+astar_cpd_destroy (astar_cpd_t * cpd)
+{
+        assert (cpd != NULL);
+        free (cpd->order);
+        free (cpd->blocked);
+        free (cpd->first);
+        free (cpd->runs);
+        free (cpd);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// SAVING AND LOADING
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+int
+astar_cpd_save (const astar_cpd_t * cpd, const char * filename)
+{
+        assert (cpd != NULL);
+        assert (filename != NULL);
+
+        FILE * fp = fopen (filename, "wb");
+        if (fp == NULL) return -1;
+
+        uint32_t area = cpd->w * cpd->h;
+        uint32_t header[4] = { cpd->w, cpd->h, cpd->wrap, cpd->num_runs };
+        int ok = (fwrite (_magic, sizeof (_magic), 1, fp) == 1) &&
+                (fwrite (header, sizeof (header), 1, fp) == 1) &&
+                (fwrite (cpd->dx, sizeof (cpd->dx), 1, fp) == 1) &&
+                (fwrite (cpd->dy, sizeof (cpd->dy), 1, fp) == 1) &&
+                (fwrite (cpd->order, sizeof (uint32_t), area, fp) == area) &&
+                (fwrite (cpd->blocked, 1, area, fp) == area) &&
+                (fwrite (cpd->first, sizeof (uint32_t), area + 1, fp) == area + 1) &&
+                (fwrite (cpd->runs, sizeof (uint32_t), cpd->num_runs, fp) == cpd->num_runs);
+
+        if (fclose (fp) != 0) ok = 0;
+        if (!ok && (errno == 0)) errno = EIO;
+        return ok ? 0 : -1;
+}
+
+
+astar_cpd_t *
+astar_cpd_load (const char * filename)
+{
+        assert (filename != NULL);
+
+        FILE * fp = fopen (filename, "rb");
+        if (fp == NULL) return NULL;
+
+        char magic[sizeof (_magic)];
+        uint32_t header[4];
+        if ((fread (magic, sizeof (magic), 1, fp) != 1) ||
+            (memcmp (magic, _magic, sizeof (magic)) != 0) ||
+            (fread (header, sizeof (header), 1, fp) != 1) ||
+            (header[0] == 0) || (header[1] == 0) ||
+            ((uint64_t) header[0] * header[1] >= 0xffffffff) ||
+            ((uint64_t) header[0] * header[1] >= SIZE_MAX / sizeof (uint64_t))) {
+                fclose (fp);
+                return NULL;
+        }
+
+        astar_cpd_t * cpd = cpd_alloc (header[0], header[1]);
+        uint32_t area = cpd->w * cpd->h, i;
+        cpd->wrap = header[2];
+        cpd->num_runs = header[3];
+        cpd->runs = (uint32_t *) malloc ((cpd->num_runs ? cpd->num_runs : 1) * sizeof (uint32_t));
+        check_null (cpd->runs, "astar_cpd_load(), allocating runs");
+
+        int ok = (fread (cpd->dx, sizeof (cpd->dx), 1, fp) == 1) &&
+                (fread (cpd->dy, sizeof (cpd->dy), 1, fp) == 1) &&
+                (fread (cpd->order, sizeof (uint32_t), area, fp) == area) &&
+                (fread (cpd->blocked, 1, area, fp) == area) &&
+                (fread (cpd->first, sizeof (uint32_t), area + 1, fp) == area + 1) &&
+                (fread (cpd->runs, sizeof (uint32_t), cpd->num_runs, fp) == cpd->num_runs);
+        fclose (fp);
+
+        // Every source needs at least one run, and the first starts at the
+        // beginning. Runs are in order, and lead somewhere (or nowhere).
+        ok = ok && (cpd->first[0] == 0) && (cpd->first[area] == cpd->num_runs);
+        for (i = 0; ok && (i < NUM_DIRS); i++) {
+                ok = (cpd->dx[i] >= -1) && (cpd->dx[i] <= 1) && (cpd->dy[i] >= -1) && (cpd->dy[i] <= 1);
+        }
+        for (i = 0; ok && (i < area); i++) {
+                ok = (cpd->first[i] < cpd->first[i + 1]) && (cpd->first[i + 1] <= cpd->num_runs) &&
+                        (cpd->order[i] < area) && (run_start (cpd->runs[cpd->first[i]]) == 0);
+        }
+        for (i = 0; ok && (i < cpd->num_runs); i++) {
+                uint8_t m = run_move (cpd->runs[i]);
+                ok = (m < NUM_DIRS) || (m == RUN_NONE);
+        }
+        for (i = 0; ok && (i < area); i++) {
+                uint32_t j;
+                for (j = cpd->first[i] + 1; ok && (j < cpd->first[i + 1]); j++) {
+                        ok = (run_start (cpd->runs[j - 1]) < run_start (cpd->runs[j])) &&
+                                (run_start (cpd->runs[j]) < area);
+                }
+        }
+
+        if (!ok) {
+                astar_cpd_destroy (cpd);
+                return NULL;
+        }
+        return cpd;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// QUERIES
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+static inline uint8_t
+cpd_lookup (const astar_cpd_t * cpd, const uint32_t source, const uint32_t target)
+{
+        // Find the last run of the source that starts at or before the
+        // target.
+        if ((source == target) || cpd->blocked[target]) return ASTAR_CPD_NONE;
+
+        uint32_t pos = cpd->order[target];
+        uint32_t lo = cpd->first[source], hi = cpd->first[source + 1];
+        while (hi - lo > 1) {
+                uint32_t mid = (lo + hi) / 2;
+                if (run_start (cpd->runs[mid]) <= pos) lo = mid;
+                else hi = mid;
+        }
+
+        uint8_t m = run_move (cpd->runs[lo]);
+        return m == RUN_NONE ? ASTAR_CPD_NONE : m;
+}
+
+
+uint8_t
+astar_cpd_first_move (const astar_cpd_t * cpd,
+                      const uint32_t x0, const uint32_t y0,
+                      const uint32_t x1, const uint32_t y1)
+{
+        assert (cpd != NULL);
+        assert ((x0 < cpd->w) && (y0 < cpd->h));
+        assert ((x1 < cpd->w) && (y1 < cpd->h));
+        return cpd_lookup (cpd, x0 + y0 * cpd->w, x1 + y1 * cpd->w);
+}
+
+
+uint32_t
+astar_cpd_get_directions (const astar_cpd_t * cpd,
+                          const uint32_t x0, const uint32_t y0,
+                          const uint32_t x1, const uint32_t y1,
+                          direction_t ** directions)
+{
+        assert (cpd != NULL);
+        assert (directions != NULL);
+        assert ((x0 < cpd->w) && (y0 < cpd->h));
+        assert ((x1 < cpd->w) && (y1 < cpd->h));
+
+        // Follow the first moves. A route never visits a square twice, so
+        // it's never longer than the grid is large.
+        uint32_t target = x1 + y1 * cpd->w, x = x0, y = y0;
+        uint32_t n = 0, alloc = 64, area = cpd->w * cpd->h;
+        uint8_t m = cpd_lookup (cpd, x + y * cpd->w, target);
+        if (m == ASTAR_CPD_NONE) return 0;
+
+        direction_t * dp = (direction_t *) malloc (alloc * sizeof (direction_t));
+        check_null (dp, "astar_cpd_get_directions(), allocating directions");
+        while (m != ASTAR_CPD_NONE) {
+                if (n + 1 == alloc) {
+                        alloc *= 2;
+                        dp = (direction_t *) realloc (dp, alloc * sizeof (direction_t));
+                        check_null (dp, "astar_cpd_get_directions(), growing directions");
+                }
+                dp[n++] = m;
+                if (!cpd_step (cpd, &x, &y, m) || (n > area)) {
+                        free (dp);
+                        return 0;
+                }
+                m = cpd_lookup (cpd, x + y * cpd->w, target);
+        }
+
+        // Terminate the directions (for good measure).
+        dp[n] = DIR_END;
+        if ((x + y * cpd->w) != target) {
+                free (dp);
+                return 0;
+        }
+
+        *directions = dp;
+        return n;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TESTING
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef TEST_CPD
+
+// A 48x32 arena: rooms with doors, and some rough ground.
+#define W 48
+#define H 32
+
+static uint8_t
+arena_get (const uint32_t x, const uint32_t y)
+{
+        assert ((x < W) && (y < H));
+        if ((x % 12 == 0) && (y % 8 != 4)) return COST_BLOCKED;
+        if ((y % 16 == 0) && (x % 12 != 6)) return COST_BLOCKED;
+        return ((x * 7 + y * 13) % 11) == 0 ? 30 : 1;
+}
+
+
+#ifndef NUM_QUERIES
+#define NUM_QUERIES 1000
+#endif // NUM_QUERIES
+
+int
+main (int argc, char ** argv)
+{
+        uint32_t i, j, mode;
+        srand (0);
+
+        for (mode = 0; mode < 2; mode++) {
+                astar_t * as = astar_new (W, H, arena_get, NULL);
+                astar_set_origin (as, 0, 0);
+                astar_set_movement_mode (as, mode ? DIR_8WAY : DIR_CARDINAL);
+
+                // Exact searches, with the same costs as the database.
+                astar_set_steering_penalty (as, 0);
+                astar_set_heuristic_factor (as, 0);
+
+                astar_cpd_t * cpd = astar_cpd_build (as, 1);
+                astar_cpd_t * cpd4 = astar_cpd_build (as, 4);
+                assert (cpd != NULL);
+                assert (cpd4->num_runs == cpd->num_runs);
+                assert (memcmp (cpd4->runs, cpd->runs, cpd->num_runs * sizeof (uint32_t)) == 0);
+                printf("%s: %u runs (%.1f per square, %u bytes), %u us with 1 thread, %u us with 4.\n",
+                       mode ? "8-way" : "Cardinal", cpd->num_runs,
+                       (double) cpd->num_runs / (W * H), cpd->num_runs * 4,
+                       cpd->usecs, cpd4->usecs);
+                astar_cpd_destroy (cpd4);
+
+                // Save and reload it.
+                const char * filename = "test_cpd.dat";
+                assert (astar_cpd_save (cpd, filename) == 0);
+                astar_cpd_t * cpd2 = astar_cpd_load (filename);
+                assert (cpd2 != NULL);
+                assert (memcmp (cpd2->runs, cpd->runs, cpd->num_runs * sizeof (uint32_t)) == 0);
+                remove (filename);
+                astar_cpd_destroy (cpd2);
+
+                // Runs with moves that don't exist, or out of order, aren't
+                // loaded.
+                uint32_t saved = cpd->runs[1];
+                cpd->runs[1] = (saved & ~0xf) | NUM_DIRS;
+                assert (astar_cpd_save (cpd, filename) == 0);
+                assert (astar_cpd_load (filename) == NULL);
+                for (i = 0; cpd->first[i + 1] - cpd->first[i] < 3; i++);
+                cpd->runs[1] = saved;
+                saved = cpd->runs[cpd->first[i] + 2];
+                cpd->runs[cpd->first[i] + 2] = cpd->runs[cpd->first[i] + 1];
+                assert (astar_cpd_save (cpd, filename) == 0);
+                assert (astar_cpd_load (filename) == NULL);
+                cpd->runs[cpd->first[i] + 2] = saved;
+                remove (filename);
+
+                // Routes cost the same as the cheapest ones found by A*.
+                uint32_t found = 0, usecs_astar = 0, usecs_cpd = 0;
+                for (i = 0; i < NUM_QUERIES; i++) {
+                        uint32_t x0 = rand () % W, y0 = rand () % H;
+                        uint32_t x1 = rand () % W, y1 = rand () % H;
+                        int r = astar_run (as, x0, y0, x1, y1);
+                        usecs_astar += as->usecs;
+
+                        struct timeval t0;
+                        direction_t * directions;
+                        gettimeofday (&t0, &_tz);
+                        uint32_t steps = astar_cpd_get_directions (cpd, x0, y0, x1, y1, &directions);
+                        usecs_cpd += get_time_difference (&t0);
+
+                        if (r != ASTAR_FOUND) {
+                                assert (steps == 0);
+                                continue;
+                        }
+                        assert (steps > 0);
+                        found++;
+
+                        uint32_t x = x0, y = y0, total = 0;
+                        for (j = 0; j < steps; j++) {
+                                uint8_t dir = directions[j];
+                                assert (cpd_step (cpd, &x, &y, dir));
+                                assert (arena_get (x, y) != COST_BLOCKED);
+                                total += as->mc[dir] + arena_get (x, y);
+                        }
+                        assert ((x == x1) && (y == y1));
+                        assert (total == as->score);
+                        astar_free_directions (directions);
+                }
+                assert (found > NUM_QUERIES / 2);
+                printf("%u routes. A*: %u us, CPD: %u us.\n", found, usecs_astar, usecs_cpd);
+
+                astar_cpd_destroy (cpd);
+                astar_destroy (as);
+        }
+        printf("Verified: compressed path databases follow the cheapest routes.\n");
+
+        printf("All tests were successful.\n");
+        return 0;
+}
+
+#endif // TEST_CPD
+
+
+// End of file.
@@ -0,0 +1,179 @@
+/*
+
+$Id
+
+Copyright (C) 2009 Alexios Chouchoulas
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#ifndef __ASTAR_CPD_H
+#define __ASTAR_CPD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+#include "astar.h"
+
+
+/*
+ * Compressed path databases, for static grids that are queried so often
+ * that there's no time to search at all.
+ *
+ * For every square of the grid (the source), the database holds the first
+ * move of the cheapest route to every other square (the target). Routes are
+ * followed by looking up the first move, taking it, and repeating from the
+ * square it leads to.
+ *
+ * Targets are listed in Morton (Z-curve) order, so squares that are close
+ * together tend to be next to each other in the list. The first moves
+ * towards them are mostly the same, so the list of each source compresses
+ * well as runs of the same move. Blocked targets can't be reached anyway,
+ * and join whichever run is next to them.
+ *
+ * Routes cost the same as with astar_run() on the same grid, except that
+ * there's no steering penalty.
+ */
+
+// No move: the target is the source, blocked, or can't be reached.
+#define ASTAR_CPD_NONE 0xff
+
+typedef struct {
+	uint32_t    w;          // Width of the grid.
+	uint32_t    h;          // Height of the grid.
+	uint32_t    wrap;       // The axes along which the map wraps around.
+
+	int32_t     dx[NUM_DIRS];
+	int32_t     dy[NUM_DIRS];
+
+	uint32_t *  order;      // Position of each square in Morton order.
+	uint8_t *   blocked;    // Is each square blocked?
+
+	// The runs of each source, in CSR form: square n has runs first[n] to
+	// first[n + 1] - 1. Each run is the Morton position of its first
+	// target, shifted left by four, or'ed with the move.
+	uint32_t *  first;
+	uint32_t *  runs;
+	uint32_t    num_runs;
+
+	uint32_t    usecs;      // Time taken to build the database.
+} astar_cpd_t;
+
+
+/**
+ * Build a compressed path database for the search grid.
+ *
+ * Runs Dijkstra's algorithm from every square of the grid, with the movement
+ * mode, move costs (see astar_set_cost()) and map of the A* context. This
+ * takes a long time on large grids: use as many threads as there are cores.
+ * Layered grids aren't supported.
+ *
+ * @param as An initialised A* context. Its origin must have been set, and
+ * get() must be set (e.g. by astar_init_grid()).
+ *
+ * @param num_threads The number of threads used to build the database. Values
+ * of 0 or 1 build it in the calling thread. Ignored if the library was built
+ * without thread support.
+ *
+ * @return A pointer to a new astar_cpd_t structure, or NULL if the grid
+ * can't be read.
+ */
+
+astar_cpd_t * astar_cpd_build (astar_t * as, const uint32_t num_threads);
+
+/**
+ * Destroy a compressed path database, freeing all memory it uses.
+ *
+ * @param cpd A compressed path database.
+ */
+
+void astar_cpd_destroy (astar_cpd_t * cpd);
+
+/**
+ * Save a compressed path database to a file.
+ *
+ * The file is in the byte order of the machine that wrote it.
+ *
+ * @param cpd A compressed path database.
+ * @param filename The name of the file.
+ *
+ * @return 0 on success, or -1 if the file couldn't be written (errno is
+ * set).
+ */
+
+int astar_cpd_save (const astar_cpd_t * cpd, const char * filename);
+
+/**
+ * Load a compressed path database saved by astar_cpd_save().
+ *
+ * @param filename The name of the file.
+ *
+ * @return A pointer to a new astar_cpd_t structure, or NULL if the file
+ * couldn't be read or isn't a compressed path database.
+ */
+
+astar_cpd_t * astar_cpd_load (const char * filename);
+
+/**
+ * Get the first move of the cheapest route between two squares.
+ *
+ * @param cpd A compressed path database.
+ * @param x0 The X ordinate of the starting square.
+ * @param y0 The Y ordinate of the starting square.
+ * @param x1 The X ordinate of the target square.
+ * @param y1 The Y ordinate of the target square.
+ *
+ * @return A direction (<tt>DIR_x</tt>), or <tt>ASTAR_CPD_NONE</tt>.
+ */
+
+uint8_t astar_cpd_first_move (const astar_cpd_t * cpd,
+			      const uint32_t x0, const uint32_t y0,
+			      const uint32_t x1, const uint32_t y1);
+
+/**
+ * Get the directions of the cheapest route between two squares.
+ *
+ * Works like astar_get_directions(), but no search is needed.
+ *
+ * @param cpd A compressed path database.
+ * @param x0 The X ordinate of the starting square.
+ * @param y0 The Y ordinate of the starting square.
+ * @param x1 The X ordinate of the target square.
+ * @param y1 The Y ordinate of the target square.
+ *
+ * @param directions A pointer to a direction_t pointer. A new array will
+ * be allocated and returned there (unless there's no route). Free it with
+ * astar_free_directions().
+ *
+ * @return The number of steps returned, or 0 if there's no route (or the
+ * squares are the same).
+ */
+
+uint32_t astar_cpd_get_directions (const astar_cpd_t * cpd,
+				   const uint32_t x0, const uint32_t y0,
+				   const uint32_t x1, const uint32_t y1,
+				   direction_t ** directions);
+
+
+#ifdef __cplusplus
+};
+#endif // __cplusplus
+
+#endif // __ASTAR_CPD_H
+
+// End of file.
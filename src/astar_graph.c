@@ -0,0 +1,534 @@
+/*
+
+$Id
+
+Copyright (C) 2009 Alexios Chouchoulas
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "astar_graph.h"
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CONSTANTS AND MACROS
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define check_null(p,err) \
+        if ((p) == NULL) {    \
+                perror (err); \
+                exit (EXIT_FAILURE); \
+        }
+
+// Initial size of the heap. Like grid searches, most graph searches only
+// visit a small part of the graph.
+#define _HEAP_INITIAL 256
+
+// Used as return astar_error (g, error_code) to stop processing when an
+// error occurs. It updates statistics.
+#define astar_error(g, err) \
+        (((g)->result=(err)),                                           \
+         ((g)->str_result=#err),                                        \
+         (g)->usecs = get_time_difference (&(g)->t0),                   \
+         (err))
+
+
+// The UTC timezone -- we only operate on time deltas.
+static struct timezone _tz = { 0, 0 };
+
+
+static inline uint32_t
+get_time_difference (struct timeval *t0)
+{
+        struct timeval t;
+        gettimeofday (&t, &_tz);
+        return (t.tv_sec * 1000000 + t.tv_usec) - (t0->tv_sec * 1000000 + t0->tv_usec);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CONSTRUCTION AND DESTRUCTION
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+static astar_graph_t *
+astar_graph_alloc (const uint32_t num_nodes, const uint32_t num_edges)
+{
+        astar_graph_t * g = (astar_graph_t *) calloc (1, sizeof (astar_graph_t));
+        check_null (g, "astar_graph_alloc(), allocating memory");
+
+        g->num_nodes = num_nodes;
+        g->num_edges = num_edges;
+
+        // The edge arrays are allocated in one block, so they're contiguous.
+        g->first = (uint32_t *) malloc ((num_nodes + 1 + 2 * num_edges) * sizeof (uint32_t));
+        check_null (g->first, "astar_graph_alloc(), allocating edges");
+        g->target = g->first + num_nodes + 1;
+        g->cost = g->target + num_edges;
+
+        // Search state. Nodes are fresh until a search touches them, so this
+        // is never cleared between searches.
+        g->nodes = (astar_gnode_t *) calloc (num_nodes ? num_nodes : 1, sizeof (astar_gnode_t));
+        check_null (g->nodes, "astar_graph_alloc(), allocating nodes");
+        g->search = 0;
+
+        g->heap = astar_heap_new (_HEAP_INITIAL, 0);
+        astar_heap_track (g->heap, num_nodes);
+
+        g->max_cost = 0;
+        g->timeout = 0;
+        g->heuristic = NULL;
+        g->str_result = NULL;
+        return g;
+}
+
+
+astar_graph_t *
+astar_graph_new (const uint32_t num_nodes, const uint32_t num_edges,
+                 const uint32_t * first, const uint32_t * target,
+                 const uint32_t * cost)
+{
+        assert (first != NULL);
+        assert (first[0] == 0);
+        assert (first[num_nodes] == num_edges);
+        assert ((num_edges == 0) || ((target != NULL) && (cost != NULL)));
+
+        astar_graph_t * g = astar_graph_alloc (num_nodes, num_edges);
+        memcpy (g->first, first, (num_nodes + 1) * sizeof (uint32_t));
+        if (num_edges) {
+                memcpy (g->target, target, num_edges * sizeof (uint32_t));
+                memcpy (g->cost, cost, num_edges * sizeof (uint32_t));
+        }
+        return g;
+}
+
+
+astar_graph_t *
+astar_graph_from_edges (const uint32_t num_nodes, const uint32_t num_edges,
+                        const uint32_t * from, const uint32_t * to,
+                        const uint32_t * cost)
+{
+        assert ((num_edges == 0) || ((from != NULL) && (to != NULL) && (cost != NULL)));
+
+        astar_graph_t * g = astar_graph_alloc (num_nodes, num_edges);
+        uint32_t i;
+
+        // Counting sort: count the edges leaving each node, then place them
+        // after the edges of the nodes before it.
+        memset (g->first, 0, (num_nodes + 1) * sizeof (uint32_t));
+        for (i = 0; i < num_edges; i++) {
+                assert ((from[i] < num_nodes) && (to[i] < num_nodes));
+                g->first[from[i] + 1]++;
+        }
+        for (i = 0; i < num_nodes; i++) g->first[i + 1] += g->first[i];
+
+        uint32_t * next = (uint32_t *) malloc ((num_nodes ? num_nodes : 1) * sizeof (uint32_t));
+        check_null (next, "astar_graph_from_edges(), allocating memory");
+        memcpy (next, g->first, num_nodes * sizeof (uint32_t));
+        for (i = 0; i < num_edges; i++) {
+                uint32_t e = next[from[i]]++;
+                g->target[e] = to[i];
+                g->cost[e] = cost[i];
+        }
+        free (next);
+
+        return g;
+}
+
+
+void
+astar_graph_destroy (astar_graph_t * g)
+{
+        assert (g != NULL);
+        astar_heap_destroy (g->heap);
+        free (g->nodes);
+        free (g->first);
+        free (g);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CONFIGURATION
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+void
+astar_graph_set_heuristic (astar_graph_t * g,
+                           uint32_t (*heuristic) (const uint32_t node,
+                                                  const uint32_t goal))
+{
+        assert (g != NULL);
+        g->heuristic = heuristic;
+}
+
+
+void
+astar_graph_set_max_cost (astar_graph_t * g, const uint32_t max_cost)
+{
+        assert (g != NULL);
+        g->max_cost = max_cost;
+}
+
+
+void
+astar_graph_set_timeout (astar_graph_t * g, const uint32_t usecs)
+{
+        assert (g != NULL);
+        g->timeout = usecs;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// MAIN CODE
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+static inline astar_gnode_t *
+astar_graph_node (astar_graph_t * g, const uint32_t n)
+{
+        // The state of a node, initialised the first time this search
+        // touches it.
+        astar_gnode_t * s = &g->nodes[n];
+        if (s->search != g->search) {
+                s->search = g->search;
+                s->g = 0;
+                s->h = g->heuristic != NULL ? (*g->heuristic) (n, g->node1) : 0;
+                s->f = 0;
+                s->parent = n;
+                s->open = 0;
+                s->closed = 0;
+        }
+        return s;
+}
+
+
+static inline void
+astar_graph_add_open (astar_graph_t * g, astar_gnode_t * s, const uint32_t n,
+                      const uint32_t parent, const uint32_t gval)
+{
+        s->g = gval;
+        s->f = gval + s->h;
+        s->parent = parent;
+        s->open = 1;
+        astar_heap_add (g->heap, s->f, n);
+        g->open++;
+}
+
+
+static inline void
+astar_graph_add_closed (astar_graph_t * g, astar_gnode_t * s, const uint32_t n)
+{
+        s->open = 0;
+        s->closed = 1;
+        g->open--;
+        g->closed++;
+
+        // Keep track of the node nearest the target (judging by the
+        // heuristic), in case we don't reach it.
+        if (s->h < g->bestscore) {
+                g->bestscore = s->h;
+                g->bestnode = n;
+                g->have_best = 1;
+        }
+}
+
+
+static void
+astar_graph_mark_route (astar_graph_t * g, const uint32_t n)
+{
+        // Count the steps to the end of the route, and note what it cost.
+        uint32_t i;
+        g->steps = 0;
+        for (i = n; i != g->node0; i = g->nodes[i].parent) g->steps++;
+        g->bestnode = n;
+        g->score = g->nodes[n].g;
+        g->have_route = 1;
+}
+
+
+int
+astar_graph_run (astar_graph_t * g, const uint32_t node0, const uint32_t node1)
+{
+        assert (g != NULL);
+        assert (node0 < g->num_nodes);
+        assert (node1 < g->num_nodes);
+
+        // Store the start time.
+        gettimeofday (&g->t0, &_tz);
+
+        g->node0 = node0;
+        g->node1 = node1;
+        g->steps = 0;
+        g->score = 0;
+        g->loops = 0;
+        g->updates = 0;
+        g->open = 0;
+        g->closed = 0;
+        g->have_route = 0;
+        g->have_best = 0;
+        g->bestscore = 0xffffffff;
+        g->bestnode = node0;
+
+        // A new search: every node is fresh again. Clear them the hard way
+        // once every four billion searches.
+        if (++g->search == 0) {
+                memset (g->nodes, 0, g->num_nodes * sizeof (astar_gnode_t));
+                g->search = 1;
+        }
+        astar_heap_clear (g->heap);
+
+        // Handle the trivial case here.
+        if (node0 == node1) return astar_error (g, ASTAR_TRIVIAL);
+
+        astar_graph_add_open (g, astar_graph_node (g, node0), node0, node0, 0);
+
+        while (!astar_heap_is_empty (g->heap)) {
+                uint32_t n;
+                astar_heap_pop (g->heap, &n);
+                astar_gnode_t * s = &g->nodes[n];
+                g->loops++;
+
+                // Have we just reached the target?
+                if (n == node1) {
+                        astar_graph_mark_route (g, n);
+                        return astar_error (g, ASTAR_FOUND);
+                }
+
+                // Out of time? Settle for the best node so far.
+                if (g->timeout && (get_time_difference (&g->t0) >= g->timeout)) {
+                        if (g->have_best) astar_graph_mark_route (g, g->bestnode);
+                        return astar_error (g, ASTAR_TIMEOUT);
+                }
+
+                astar_graph_add_closed (g, s, n);
+
+                // Add the neighbours. The edges are contiguous, so this is a
+                // linear scan.
+                uint32_t e, end = g->first[n + 1];
+                for (e = g->first[n]; e < end; e++) {
+                        uint32_t t = g->target[e];
+                        astar_gnode_t * adj = astar_graph_node (g, t);
+                        if (adj->closed) continue;
+
+                        uint32_t gval = s->g + g->cost[e];
+                        if ((g->max_cost != 0) && (gval >= g->max_cost)) continue;
+
+                        if (!adj->open) {
+                                astar_graph_add_open (g, adj, t, n, gval);
+                        } else if (gval < adj->g) {
+                                // A better route to an open node.
+                                adj->g = gval;
+                                adj->f = gval + adj->h;
+                                adj->parent = n;
+                                astar_heap_update (g->heap, t, adj->f);
+                                g->updates++;
+                        }
+                }
+        }
+
+        // We ran out of nodes to check. There's no route, but record the best
+        // one found so far.
+        if (g->have_best) astar_graph_mark_route (g, g->bestnode);
+        return astar_error (g, ASTAR_NOTFOUND);
+}
+
+
+uint32_t
+astar_graph_get_route (astar_graph_t * g, uint32_t ** nodes)
+{
+        assert (g != NULL);
+        assert (nodes != NULL);
+
+        if (!g->have_route) return 0;
+
+        // Follow the parents back from the end of the route.
+        uint32_t n = g->steps + 1, i = n, node = g->bestnode;
+        *nodes = (uint32_t *) malloc (n * sizeof (uint32_t));
+        check_null (*nodes, "astar_graph_get_route(), allocating route");
+        while (i > 0) {
+                (*nodes)[--i] = node;
+                node = g->nodes[node].parent;
+        }
+        assert ((*nodes)[0] == g->node0);
+        return n;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TESTING
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef TEST_GRAPH
+
+// A random 60x40 map, as a graph of squares with moves in eight directions.
+// Nodes are squares (x + y * W); moves cost 10 (or 14 diagonally) plus the
+// cost of the square they lead to. Walls have no edges at all.
+#define W 60
+#define H 40
+
+static uint8_t map[W * H];
+
+static const int32_t _dx[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+static const int32_t _dy[8] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+
+// The octile distance, which never overestimates.
+static uint32_t
+octile (const uint32_t node, const uint32_t goal)
+{
+        uint32_t dx = abs ((int32_t) (node % W) - (int32_t) (goal % W));
+        uint32_t dy = abs ((int32_t) (node / W) - (int32_t) (goal / W));
+        return dx > dy ? 10 * dx + 4 * dy : 10 * dy + 4 * dx;
+}
+
+
+int
+main (int argc, char ** argv)
+{
+        uint32_t i, j, x, y, d, n = 0;
+        srand (0);
+
+        // Walls, and patches of rough ground.
+        for (i = 0; i < W * H; i++) {
+                int r = rand () % 100;
+                map[i] = r < 25 ? COST_BLOCKED : (r < 40 ? 20 : 1);
+        }
+
+        uint32_t * from = (uint32_t *) malloc (8 * W * H * sizeof (uint32_t));
+        uint32_t * to = (uint32_t *) malloc (8 * W * H * sizeof (uint32_t));
+        uint32_t * cost = (uint32_t *) malloc (8 * W * H * sizeof (uint32_t));
+        assert ((from != NULL) && (to != NULL) && (cost != NULL));
+
+        // List the edges in reverse, so from_edges() has sorting to do.
+        for (d = 8; d-- > 0; ) {
+                for (y = 0; y < H; y++) {
+                        for (x = 0; x < W; x++) {
+                                uint32_t x1 = x + _dx[d], y1 = y + _dy[d];
+                                if ((x1 >= W) || (y1 >= H)) continue;
+                                if (map[x + y * W] == COST_BLOCKED) continue;
+                                if (map[x1 + y1 * W] == COST_BLOCKED) continue;
+                                from[n] = x + y * W;
+                                to[n] = x1 + y1 * W;
+                                cost[n] = (d & 1 ? 14 : 10) + map[x1 + y1 * W];
+                                n++;
+                        }
+                }
+        }
+
+        astar_graph_t * g = astar_graph_from_edges (W * H, n, from, to, cost);
+        astar_graph_t * csr = astar_graph_new (W * H, n, g->first, g->target, g->cost);
+        assert (g->first[W * H] == n);
+        for (i = 0; i < W * H; i++) {
+                assert (g->first[i] <= g->first[i + 1]);
+                for (j = g->first[i]; j < g->first[i + 1]; j++) {
+                        assert (octile (i, g->target[j]) <= 14);
+                }
+        }
+        printf("Verified: %u edges sorted into CSR form.\n", n);
+
+        // A* and Dijkstra find routes of the same cost, and A* looks at
+        // fewer nodes.
+        uint32_t loops_astar = 0, loops_dijkstra = 0, found = 0;
+        struct timeval t0;
+        gettimeofday (&t0, &_tz);
+        astar_graph_set_heuristic (g, octile);
+        for (i = 0; i < 500; i++) {
+                uint32_t a = rand () % (W * H), b = rand () % (W * H);
+                int r = astar_graph_run (g, a, b);
+                loops_astar += g->loops;
+                int r2 = astar_graph_run (csr, a, b);
+                loops_dijkstra += csr->loops;
+                assert (r == r2);
+                if (r == ASTAR_TRIVIAL) continue;
+                assert (g->have_route == csr->have_route);
+                if (r != ASTAR_FOUND) continue;
+                assert (g->score == csr->score);
+                found++;
+
+                // The route follows edges, and costs what the score says.
+                uint32_t * route, total = 0, k;
+                uint32_t len = astar_graph_get_route (g, &route);
+                assert ((len == g->steps + 1) && (route[0] == a) && (route[len - 1] == b));
+                for (j = 1; j < len; j++) {
+                        for (k = g->first[route[j - 1]]; g->target[k] != route[j]; k++) {
+                                assert (k + 1 < g->first[route[j - 1] + 1]);
+                        }
+                        total += g->cost[k];
+                }
+                assert (total == g->score);
+                free (route);
+        }
+        assert (found > 100);
+        assert (loops_astar < loops_dijkstra);
+        printf("%u routes, %u loops with A*, %u with Dijkstra, %u us.\n", found,
+               loops_astar, loops_dijkstra, get_time_difference (&t0));
+        printf("Verified: A* finds optimal routes on graphs.\n");
+
+        // Unreachable targets leave the route to the nearest node reached.
+        // Find a wall to aim at.
+        for (i = 0; map[i] != COST_BLOCKED; i++);
+        for (j = 0; map[j] == COST_BLOCKED; j++);
+        assert (astar_graph_run (g, j, i) == ASTAR_NOTFOUND);
+        assert (g->have_route && (g->bestnode != i) && (g->closed > 0));
+        assert (astar_graph_run (g, j, j) == ASTAR_TRIVIAL);
+        assert (!g->have_route);
+
+        // Cost limits. Find a target we can reach first.
+        for (i = W * H - 1; astar_graph_run (g, j, i) != ASTAR_FOUND; i--);
+        uint32_t score = g->score;
+        astar_graph_set_max_cost (g, score);
+        assert (astar_graph_run (g, j, i) == ASTAR_NOTFOUND);
+        astar_graph_set_max_cost (g, score + 1);
+        assert (astar_graph_run (g, j, i) == ASTAR_FOUND);
+        astar_graph_set_max_cost (g, 0);
+
+        // Timeouts (this may or may not expire).
+        astar_graph_set_timeout (g, 1);
+        int r = astar_graph_run (g, j, i);
+        assert ((r == ASTAR_FOUND) || (r == ASTAR_TIMEOUT));
+        astar_graph_set_timeout (g, 0);
+        printf("Verified: unreachable targets, cost limits and timeouts.\n");
+
+        astar_graph_destroy (g);
+        astar_graph_destroy (csr);
+        free (from);
+        free (to);
+        free (cost);
+        printf("All tests were successful.\n");
+        return 0;
+}
+
+#endif // TEST_GRAPH
+
+
+// End of file.
@@ -0,0 +1,265 @@
+/*
+
+$Id
+
+Copyright (C) 2009 Alexios Chouchoulas
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#ifndef __ASTAR_GRAPH_H
+#define __ASTAR_GRAPH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+#include "astar.h"
+
+
+/*
+ * A* on general weighted graphs: navigation meshes, waypoint networks, road
+ * maps and the like. Nodes are numbered 0 to num_nodes - 1. The graph is
+ * stored in compressed sparse row (CSR) form: the edges leaving node n are
+ * edges first[n] to first[n + 1] - 1, and edge e leads to node target[e] at
+ * a cost of cost[e]. All edges are directed; undirected graphs list every
+ * edge once in each direction.
+ *
+ * The search uses the same open list (asheap_t) as the grid search, and the
+ * same result codes, limits and statistics. Costs are plain integers, with
+ * no per-node cost or steering penalty: put whatever the graph needs in the
+ * edge costs.
+ */
+
+// The search state of a graph node.
+typedef struct {
+	uint32_t    f;
+	uint32_t    g;
+	uint32_t    h;
+	uint32_t    parent;     // The node we reached this one from.
+	uint32_t    search;     // The search that last touched this node.
+	uint32_t    open:1;     // Is this in the open set?
+	uint32_t    closed:1;   // Is this in the closed list?
+} astar_gnode_t;
+
+
+typedef struct {
+
+	///////////////////////////////////////////////////////////////////////////////
+	//
+	// The graph.
+	//
+	///////////////////////////////////////////////////////////////////////////////
+
+	uint32_t    num_nodes;
+	uint32_t    num_edges;
+	uint32_t *  first;      // num_nodes + 1 edge indices.
+	uint32_t *  target;     // num_edges target nodes.
+	uint32_t *  cost;       // num_edges edge costs.
+
+	///////////////////////////////////////////////////////////////////////////////
+	//
+	// Configuration.
+	//
+	///////////////////////////////////////////////////////////////////////////////
+
+	// Stop calculating when the route incurs this much cost (0 for no limit).
+
+	uint32_t    max_cost;
+
+	// Maximum search time in microseconds (1000000us=1s).
+
+	uint32_t    timeout;
+
+	// The heuristic function. Given two nodes, estimate the cost of the
+	// cheapest route between them. It must not overestimate it for the
+	// routes found to be optimal. If NULL, the search is Dijkstra's.
+
+	uint32_t  (* heuristic) (const uint32_t node, const uint32_t goal);
+
+	///////////////////////////////////////////////////////////////////////////////
+	//
+	// Data needed to run the algorithm
+	//
+	///////////////////////////////////////////////////////////////////////////////
+
+	uint32_t    node0;      // Starting node.
+	uint32_t    node1;      // Target node.
+
+	asheap_t *  heap;       // The open list: F |-> node mappings.
+	astar_gnode_t * nodes;  // Search state, one per node.
+	uint32_t    search;     // Current search. Nodes of other searches are fresh.
+
+	struct timeval t0;      // Start of the search.
+
+	uint32_t    have_route:1;
+	uint32_t    have_best:1;
+	uint32_t    bestscore;  // Lowest H of a closed node.
+
+	///////////////////////////////////////////////////////////////////////////////
+	//
+	// Results
+	//
+	///////////////////////////////////////////////////////////////////////////////
+
+	uint32_t    steps;	// Number of edges in the route.
+	uint32_t    score;	// Score of the route.
+	uint32_t    result;	// Result code of the routing.
+	char *      str_result; // Stringified result code.
+	uint32_t    usecs;      // Search time in microseconds.
+	uint32_t    loops;      // Number of search loops.
+	uint32_t    updates;    // Keeps track of heap updates (they're expensive).
+	uint32_t    open;       // Number of open nodes.
+	uint32_t    closed;     // Number of closed nodes.
+
+	uint32_t    bestnode;   // If a route wasn't found, the best node we could reach.
+} astar_graph_t;
+
+
+/**
+ * Create a new graph search context from a graph in CSR form.
+ *
+ * The arrays are copied, so the caller may free them.
+ *
+ * @param num_nodes The number of nodes.
+ *
+ * @param num_edges The number of edges.
+ *
+ * @param first An array of num_nodes + 1 edge indices. The edges leaving
+ * node n are first[n] to first[n + 1] - 1. first[0] must be 0, and
+ * first[num_nodes] must be num_edges.
+ *
+ * @param target An array of num_edges nodes, the targets of the edges.
+ *
+ * @param cost An array of num_edges edge costs.
+ *
+ * @return A pointer to a new astar_graph_t structure.
+ */
+
+astar_graph_t * astar_graph_new (const uint32_t num_nodes, const uint32_t num_edges,
+				 const uint32_t * first, const uint32_t * target,
+				 const uint32_t * cost);
+
+/**
+ * Create a new graph search context from a list of edges.
+ *
+ * Edge i leads from node from[i] to node to[i] at a cost of cost[i]. The
+ * edges may be in any order; they are sorted into CSR form (keeping the
+ * order of the edges leaving each node).
+ *
+ * @param num_nodes The number of nodes.
+ * @param num_edges The number of edges.
+ * @param from An array of num_edges source nodes.
+ * @param to An array of num_edges target nodes.
+ * @param cost An array of num_edges edge costs.
+ *
+ * @return A pointer to a new astar_graph_t structure.
+ */
+
+astar_graph_t * astar_graph_from_edges (const uint32_t num_nodes, const uint32_t num_edges,
+					const uint32_t * from, const uint32_t * to,
+					const uint32_t * cost);
+
+/**
+ * Destroy a graph search context, freeing all memory it uses.
+ *
+ * @param g A graph search context.
+ */
+
+void astar_graph_destroy (astar_graph_t * g);
+
+/**
+ * Set the heuristic function.
+ *
+ * @param g A graph search context.
+ *
+ * @param heuristic Given two nodes, return a lower bound of the cost of the
+ * cheapest route between them. NULL turns the heuristic off (every estimate
+ * is zero).
+ */
+
+void astar_graph_set_heuristic (astar_graph_t * g,
+				uint32_t (*heuristic) (const uint32_t node,
+						       const uint32_t goal));
+
+/**
+ * Set the maximum route cost.
+ *
+ * Works like astar_set_max_cost(): nodes that cost this much or more to
+ * reach aren't considered.
+ *
+ * @param g A graph search context.
+ * @param max_cost The maximum cost, or 0 for no limit.
+ */
+
+void astar_graph_set_max_cost (astar_graph_t * g, const uint32_t max_cost);
+
+/**
+ * Set the search timeout.
+ *
+ * Works like astar_set_timeout(). If the timeout expires, the search
+ * returns <tt>ASTAR_TIMEOUT</tt> and the route to the closed node that
+ * looked nearest to the target is available.
+ *
+ * @param g A graph search context.
+ * @param usecs The timeout in microseconds, or 0 for no limit.
+ */
+
+void astar_graph_set_timeout (astar_graph_t * g, const uint32_t usecs);
+
+/**
+ * Find a route between two nodes.
+ *
+ * @param g A graph search context.
+ * @param node0 The starting node.
+ * @param node1 The target node.
+ *
+ * @return <tt>ASTAR_FOUND</tt>, <tt>ASTAR_NOTFOUND</tt>,
+ * <tt>ASTAR_TRIVIAL</tt> or <tt>ASTAR_TIMEOUT</tt>. Like grid searches,
+ * unsuccessful searches still leave the route to the best node they reached.
+ */
+
+int astar_graph_run (astar_graph_t * g, const uint32_t node0, const uint32_t node1);
+
+/**
+ * Get the nodes of the route found by the last search.
+ *
+ * The first node is the starting node, and the last is the target (or the
+ * best node reached, if the target wasn't).
+ *
+ * @param g A graph search context.
+ *
+ * @param nodes A pointer to a uint32_t pointer. A new array will be
+ * allocated and returned there. Free it with free().
+ *
+ * @return The number of nodes in the route (the number of steps plus one),
+ * or 0 if there's no route.
+ */
+
+uint32_t astar_graph_get_route (astar_graph_t * g, uint32_t ** nodes);
+
+// Macros.
+#define astar_graph_have_route(g) (g)->have_route
+
+
+#ifdef __cplusplus
+};
+#endif // __cplusplus
+
+#endif // __ASTAR_GRAPH_H
+
+// End of file.
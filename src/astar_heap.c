@@ -49,14 +49,48 @@ FILE * __heap_debugfp;
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-#define PARENT_OF(x) (((x)-1)>>1)
-#define CHILD1(x)    (((x)<<1)+1)
-#define CHILD2(x)    (((x)<<1)+2)
+#define PARENT_OF(x) (((x) - 1) / ASTAR_HEAP_ARITY)
+#define CHILD1(x)    ((x) * ASTAR_HEAP_ARITY + 1)
+
+// The children of node x are CHILD1(x) to CHILD1(x) + ASTAR_HEAP_ARITY - 1. The
+// entry array is placed so that CHILD1(x) is a multiple of the arity times
+// the size of an entry from a cache line boundary.
+#define CACHE_LINE 64
 
 
 #define check_null(p,err) if ((p) == NULL) { perror (err); exit (EXIT_FAILURE); }
 
 
+// Store an entry, keeping track of its position.
+#define heap_set(heap, i, x)                                            \
+	do {                                                            \
+		(heap)->e[i] = (x);                                     \
+		if ((heap)->pos != NULL) (heap)->pos[(x).ofs] = (i);    \
+	} while (0)
+
+
+static void
+astar_heap_realloc (asheap_t * heap, uint32_t alloc)
+{
+	// Aligned memory can't be realloc()ed, so copy the entries over.
+	size_t size = (alloc + ASTAR_HEAP_ARITY) * sizeof (asheap_entry_t) + CACHE_LINE;
+	void * raw = malloc (size);
+	check_null (raw, "heap_realloc(), resizing heap");
+
+	uintptr_t aligned = ((uintptr_t) raw + CACHE_LINE - 1) & ~((uintptr_t) CACHE_LINE - 1);
+	asheap_entry_t * e = (asheap_entry_t *) aligned + ASTAR_HEAP_ARITY - 1;
+
+	if (heap->raw != NULL) {
+		memcpy (e, heap->e, heap->length * sizeof (asheap_entry_t));
+		free (heap->raw);
+	}
+
+	heap->raw = raw;
+	heap->e = e;
+	heap->alloc = alloc;
+}
+
+
 asheap_t *
 astar_heap_new (uint32_t initial_length, uint32_t delta)
 {
@@ -65,12 +99,12 @@ astar_heap_new (uint32_t initial_length, uint32_t delta)
 
 	// Set initial values.
 	heap->length = 0;
+	heap->peak = 0;
 	heap->delta = delta;
-	heap->alloc = initial_length;
-	heap->data = (uint32_t *) malloc (sizeof (uint32_t) * heap->alloc);
-	check_null (heap->data, "heap_new(), allocating data block");
-	heap->squares = (square_t **) malloc (sizeof (square_t *) * heap->alloc);
-	check_null (heap->squares, "heap_new(), allocating payload block");
+	heap->raw = NULL;
+	heap->pos = NULL;
+	heap->pos_size = 0;
+	astar_heap_realloc (heap, initial_length > 0 ? initial_length : 1);
 
 	return heap;
 }
@@ -79,13 +113,44 @@ astar_heap_new (uint32_t initial_length, uint32_t delta)
 void
 astar_heap_destroy (asheap_t * heap)
 {
-	free (heap->data);
-	free (heap->squares);
+	free (heap->raw);
+	free (heap->pos);
 	free (heap);
 }
 
 
-inline void
+void
+astar_heap_shrink (asheap_t * heap, uint32_t alloc)
+{
+	assert (heap != NULL);
+
+	// Never drop entries in use.
+	if (alloc < heap->length) alloc = heap->length;
+	if (alloc == 0) alloc = 1;
+	if (alloc >= heap->alloc) return;
+
+	__debug ("Shrinking heap from %u to %u entries.\n", heap->alloc, alloc);
+	astar_heap_realloc (heap, alloc);
+}
+
+
+void
+astar_heap_track (asheap_t * heap, uint32_t size)
+{
+	assert (heap != NULL);
+	assert (heap->length == 0);
+
+	free (heap->pos);
+	heap->pos = NULL;
+	heap->pos_size = size;
+	if (size == 0) return;
+
+	heap->pos = (uint32_t *) malloc (size * sizeof (uint32_t));
+	check_null (heap->pos, "heap_track(), allocating position index");
+}
+
+
+void
 astar_heap_clear (asheap_t * heap)
 {
 	assert (heap != NULL);
@@ -96,7 +161,7 @@ astar_heap_clear (asheap_t * heap)
 uint32_t
 astar_heap_sizeof (asheap_t * heap)
 {
-	return sizeof (asheap_t) + sizeof (uint32_t) * 2 * (heap)->alloc;
+	return sizeof (asheap_t) + sizeof (asheap_entry_t) * (heap)->alloc;
 }
 
 
@@ -107,14 +172,12 @@ astar_heap_highlight (asheap_t * heap, uint32_t highlight)
 {
 	uint32_t i;
 	for (i=0; i<heap->length; i++) {
-		uint32_t val = heap->data[i];
+		uint32_t val = heap->e[i].key;
 		int p = i > 0? PARENT_OF(i): 0;
-		if (val == highlight) printf ("%2d -> \033[0;7m%3d\033[0m", i, val, p);
-		else printf ("%2d -> %3d", i, val, p);
+		if (val == highlight) printf ("%2d -> \033[0;7m%3d\033[0m", i, val);
+		else printf ("%2d -> %3d", i, val);
 		if (i > 0) printf(" <- %3d", p);
-#ifdef SQUARE_HAS_OFS
-		printf(" ofs=%u \n", heap->squares[i]->ofs);
-#endif
+		printf(" ofs=%u \n", heap->e[i].ofs);
 	}
 	printf("\n");
 }
@@ -128,62 +191,86 @@ astar_heap_highlight (asheap_t * heap, uint32_t highlight)
 #endif // ASTAR_DEBUG || HEAP_DEBUG || TEST_HEAP
 
 
-void
-astar_heap_add (asheap_t * heap, uint32_t val, square_t * square)
+static inline uint32_t
+astar_heap_sift_up (asheap_t * heap, uint32_t i, const asheap_entry_t x)
 {
-	assert (heap != NULL);
+	// Move the hole at i up until x can go in it. This keeps the heap
+	// consistent (all children have greater values).
+	asheap_entry_t * e = heap->e;
 
-	// Is is full?
-	if (heap->length == heap->alloc) {
-		heap->alloc += heap->delta;
-		heap->data = (uint32_t *) realloc (heap->data, sizeof (uint32_t) * heap->alloc);
-		check_null (heap->data, "heap_add(), growing data block");
-		heap->squares = (square_t **) realloc (heap->squares,
-						       sizeof (square_t *) * heap->alloc);
-		check_null (heap->squares, "heap_add(), growing payload block");
+	while (i > 0) {
+		uint32_t parent = PARENT_OF (i);
+		if (e[parent].key <= x.key) break;
+		heap_set (heap, i, e[parent]);
+		i = parent;
 	}
+	heap_set (heap, i, x);
 
-	// Is it empty? Trivial case.
-	if (heap->length == 0) {
-		heap->data[0] = val;
-		heap->squares[0] = square;
-		heap->length = 1;
-		return;
-	}
+	// Return the final offset of the value in the heap.
+	return i;
+}
 
-	// Stick the new value at the end.
-	heap->data [heap->length] = val;
-	heap->squares [heap->length] = square;
 
-	// Bubble up.
-	register uint32_t parent_val, parent_ofs;
-	register uint32_t i = heap->length;
-	void * parent_payload;
-	while (i > 0) {
+static inline void
+astar_heap_sift_down (asheap_t * heap, uint32_t i, const asheap_entry_t x)
+{
+	// Move the hole at i down until x can go in it.
+	asheap_entry_t * e = heap->e;
+	uint32_t n = heap->length;
 
-		// Get parent value.
-		parent_ofs = PARENT_OF(i);
-		parent_val = heap->data [parent_ofs];
-		parent_payload = heap->squares [parent_ofs];
-		
-		// If the parent is greater then val, swap them.
-		if (parent_val > val) {
-			heap->data [i] = parent_val;
-			heap->data [parent_ofs] = val;
-
-			heap->squares [i] = parent_payload;
-			heap->squares [parent_ofs] = square;
-
-			// Loop again.
-			i = parent_ofs;
+	for (;;) {
+
+#ifdef HEAP_DEBUG
+		astar_heap_highlight (heap, x.key);
+#endif
+
+		uint32_t j, child = CHILD1 (i), min = child;
+		if (child >= n) break;
+
+		// Locate the minimal child. When all children exist, the loop
+		// has a constant trip count and compiles to a branchless
+		// min-of-N.
+		if (child + ASTAR_HEAP_ARITY <= n) {
+			for (j = child + 1; j < child + ASTAR_HEAP_ARITY; j++) {
+				if (e[j].key < e[min].key) min = j;
+			}
 		} else {
-			// Not greater, end bubbling up.
-			break;
+			for (j = child + 1; j < n; j++) {
+				if (e[j].key < e[min].key) min = j;
+			}
 		}
+
+#ifdef HEAP_DEBUG
+		__debug("\t\tComparing %d against %d\n", x.key, e[min].key);
+#endif
+
+		// This node is less than or equal to all of its children.
+		if (x.key <= e[min].key) break;
+
+		heap_set (heap, i, e[min]);
+		i = min;
 	}
+	heap_set (heap, i, x);
+}
+
+
+void
+astar_heap_add (asheap_t * heap, uint32_t key, uint32_t ofs)
+{
+	assert (heap != NULL);
+
+	// Is is full? Grow by delta, or double if delta is zero.
+	if (heap->length == heap->alloc) {
+		astar_heap_realloc (heap, heap->alloc + (heap->delta ? heap->delta : heap->alloc));
+	}
+
+	// Stick the new value at the end and bubble up.
+	asheap_entry_t x = { key, ofs };
+	astar_heap_sift_up (heap, heap->length, x);
 
 	// Increase the number of elements.
 	heap->length++;
+	if (heap->length > heap->peak) heap->peak = heap->length;
 }
 
 
@@ -196,79 +283,18 @@ astar_heap_is_empty (asheap_t * heap)
 
 
 uint32_t
-astar_heap_pop (asheap_t * heap, square_t ** square)
+astar_heap_pop (asheap_t * heap, uint32_t * ofs)
 {
 	assert (heap != NULL);
 	assert (heap->length > 0);
 
-	// Trivial case; singleton element.
-	if (heap->length == 1) {
-		heap->length = 0;
-		if (square != NULL) *square = heap->squares [0];
-		return heap->data [0];
-	}
-
 	// Get the root value and payload.
-	uint32_t retval = heap->data [0];
-	if (square != NULL) *square = heap->squares [0];
-
-	// Move the last value to the root.
-	uint32_t val = heap->data [heap->length - 1];
-	heap->data[0] = val;
-	heap->squares[0] = heap->squares [heap->length - 1];
+	uint32_t retval = heap->e[0].key;
+	if (ofs != NULL) *ofs = heap->e[0].ofs;
 
-	// Adjust the length.
+	// Move the last value to the root and bubble down.
 	heap->length--;
-	
-	// Bubble down.
-	uint32_t child_val1, child_val2, child_ofs1, child_ofs2;
-	uint32_t i = 0;
-
-	for (;;) {
-
-#ifdef HEAP_DEBUG
-		astar_heap_highlight (heap, val);
-#endif
-
-		// Get the two child nodes.
-		child_ofs1 = CHILD1 (i);
-		child_ofs2 = CHILD2 (i);
-
-		// Get the values of the child nodes. If a value doesn't exist,
-		// we use MAXINT, which results in no swaps.
-		// NB: For max-heaps, 0 must be used instead.
-		child_val1 = child_ofs1 < heap->length? heap->data[child_ofs1]: 0xffffffff;
-		child_val2 = child_ofs2 < heap->length? heap->data[child_ofs2]: 0xffffffff;
-		
-#ifdef HEAP_DEBUG
-		__debug("\t\tComparing %d against %d and %d\n", val, child_val1, child_val2);
-#endif
-
-		// This node is less than or equal to both of its children (if they exist).
-		if ((val <= child_val1) && (val <= child_val2)) break;
-
-		// Locate the minimal child. Use child_ofs1 and child_val1.
-		if (child_val2 < child_val1) {
-			child_val1 = child_val2;
-			child_ofs1 = child_ofs2;
-		}
-		
-#ifdef HEAP_DEBUG
-		__debug("\t\tSwap data[%d]=%d with data[%d]=%d\n", i, val, child_ofs1, child_val1);
-#endif
-
-		// Swap using data[i]=val and data[child_ofs1]=child_val1.
-		heap->data [i] = child_val1;
-		heap->data [child_ofs1] = val;
-
-		void * root_payload = heap->squares [i];
-		heap->squares [i] = heap->squares [child_ofs1];
-		heap->squares [child_ofs1] = root_payload;
-
-		// Loop again, bubbling down.
-		i = child_ofs1;
-		continue;
-	}
+	if (heap->length > 0) astar_heap_sift_down (heap, 0, heap->e[heap->length]);
 
 	// Return the value that used to be the root.
 	return retval;
@@ -276,96 +302,75 @@ astar_heap_pop (asheap_t * heap, square_t ** square)
 
 
 static inline int32_t
-astar_heap_getofs (asheap_t * heap, square_t * payload)
+astar_heap_getofs (asheap_t * heap, uint32_t ofs)
 {
 	uint32_t i;
-	for (i = 0; i <= heap->length; i++) {
-		if (heap->squares[i] == payload) return i;
-	}
-	return -1;
-}
-
-
-inline static uint32_t
-astar_heap_bubble_up (asheap_t * heap, square_t * payload, int32_t heapofs)
-{
-	// Bubble up. This keeps the heap consistent (all children
-	// have greater values).
-
-	register uint32_t parent_val, parent_ofs;
-	register uint32_t val;
-	register int32_t i = heapofs;
-
-	// Let's do this thang.
-	while (i > 0) {
-
-#ifdef HEAP_DEBUG
-		__debug("*** BUBBLING UP, i=%d\n", i);
-		astar_heap_fprint (heap, __heap_debugfp);
-#endif // HEAP_DEBUG
-
-		// Get the current value of f.
-		val = heap->data[i];
-
-		// Get parent value.
-		parent_ofs = PARENT_OF(i);
-		parent_val = heap->data [parent_ofs];
-		__debug ("*** THIS:   i=%d val=%d, ofs=%u\n", i, val, heap->squares[i]->ofs);
-		__debug ("*** PARENT: i=%d val=%d, ofs=%u\n", parent_ofs, parent_val, heap->squares[parent_ofs]->ofs);
-		
-		// If the parent is greater then val, swap them.
-		if (parent_val > val) {
-
-			// Swap the values.
-			heap->data [i] = parent_val;
-			heap->data [parent_ofs] = val;
-
-			// Swap the payload (grid offset).
-			square_t * tmp = heap->squares [i];
-			heap->squares [i] = heap->squares [parent_ofs];
-			heap->squares [parent_ofs] = tmp;
-
-			__debug ("*** SWAPPED\n\n");
-			__debug ("*** THIS:   i=%d val=%d, ofs=%u\n", i, val, heap->squares[i]->ofs);
-			__debug ("*** PARENT: i=%d val=%d, ofs=%u\n", parent_ofs, parent_val, heap->squares[parent_ofs]->ofs);
-
-			// Loop again.
-			i = parent_ofs;
 
-		} else {
-			// Not greater, stop here.
-			break;
-		}
+	// Is it tracked?
+	if (heap->pos != NULL) {
+		assert (ofs < heap->pos_size);
+		i = heap->pos[ofs];
+		assert ((i < heap->length) && (heap->e[i].ofs == ofs));
+		return i;
 	}
 
-	// Return the final offset of the value in the heap.
-	return i;
+	for (i = 0; i < heap->length; i++) {
+		if (heap->e[i].ofs == ofs) return i;
+	}
+	return -1;
 }
 
 
 uint32_t
-astar_heap_update (asheap_t * heap, square_t * payload)
+astar_heap_update (asheap_t * heap, uint32_t ofs, uint32_t key)
 {
 	assert (heap != NULL);
 	assert (heap->length > 0);
 
 	// First, we need to find which element on the heap has the specified
-	// payload (square). This is an expensive O(n) operation, but it's one
-	// we only do rarely -- I hope.
-	int32_t ofs = astar_heap_getofs (heap, payload);
-	assert (ofs >= 0);
+	// payload (square). Unless positions are tracked, this is an expensive
+	// O(n) operation.
+	int32_t i = astar_heap_getofs (heap, ofs);
+	assert (i >= 0);
 
 	// Sanity check -- we can only lower a value as we only bubble up.
-	assert (heap->data[ofs] >= payload->f);
+	assert (heap->e[i].key >= key);
+
+	// Update the value and bubble up to keep the heap consistent.
+	__debug("Set heap->e[%d].key = %d (new_val)\n", i, key);
+	heap->e[i].key = key;
+	return astar_heap_sift_up (heap, i, heap->e[i]);
+}
+
 
-	// Update the value.
-	__debug("Set heap->data[%d (ofs)] = %d (new_val)\n", ofs, payload->f);
-	heap->data [ofs] = payload->f;
+uint32_t
+astar_heap_prune (asheap_t * heap, uint32_t keep)
+{
+	assert (heap != NULL);
+	if (heap->length <= keep) return 0;
+
+	// Sort the heap in place: pop the root into the slot each pop frees
+	// at the end. This leaves the entries in descending order.
+	uint32_t i, n = heap->length;
+	for (i = n; i > 0; i--) {
+		asheap_entry_t x;
+		x.key = astar_heap_pop (heap, &x.ofs);
+		heap->e[i - 1] = x;
+	}
 
-	// Bubble up to keep the heap consistent.
-	uint32_t new_ofs = astar_heap_bubble_up (heap, payload, ofs);
+	// Reverse them. An array in ascending order is a valid heap.
+	for (i = 0; i < n / 2; i++) {
+		asheap_entry_t x = heap->e[i];
+		heap->e[i] = heap->e[n - 1 - i];
+		heap->e[n - 1 - i] = x;
+	}
 
-	return new_ofs;
+	// Drop the largest ones.
+	heap->length = keep;
+	if (heap->pos != NULL) {
+		for (i = 0; i < keep; i++) heap->pos[heap->e[i].ofs] = i;
+	}
+	return n - keep;
 }
 
 
@@ -375,14 +380,7 @@ astar_heap_fprint (asheap_t * heap, FILE * fp)
 	uint32_t i;
 
 	for (i = 0; i < heap->length; i++) {
-#ifdef SQUARE_HAS_OFS
-		fprintf (fp, "%d -> %d ofs=%u (ptr=%p) square->f = %u\n",
-			 i, heap->data[i], heap->squares[i]->ofs, heap->squares[i],
-			 heap->squares[i]->f);
-		assert (heap->data[i] == heap->squares[i]->f);
-#else
-		fprintf (fp, "%d -> %d ptr=%p\n", i, heap->data[i], heap->squares[i]);
-#endif // SQUARE_HAS_OFS
+		fprintf (fp, "%d -> %d ofs=%u\n", i, heap->e[i].key, heap->e[i].ofs);
 	}
 }
 
@@ -414,50 +412,130 @@ main (int argc, char ** argv)
 	__heap_debugfp = stderr;
 #endif // HEAP_DEBUG
 
-	asheap_t * h = astar_heap_new (10, 100);
+	asheap_t * h = astar_heap_new (10, 0);
 	uint32_t i;
 	srand(0);
 
-	printf ("Size of void * on this system: %d bytes\n", sizeof (void *));
-
+	// The payload of each entry is a function of its key.
 	for (i = 0; i < NUM_INS; i++) {
 		uint32_t x = rand() % 1000;
-
-		// We use 32-bit integers as payload, rather than
-		// pointers. On 64-bit boxes, pointers are 64 bits wide. Fix
-		// this.
-
-#if __WORDSIZE == 64
-		uint64_t xx = x;
-		printf ("Adding #%d (%d) -> %p (%llu)...\n", i, x, (void*)xx, (void*)xx);
-#else
-		uint32_t xx = x;
-		printf ("Adding #%d (%d) -> %p (%u)...\n", i, x, (void*)xx, (void*)xx);
-#endif // __WORDSIZE == 64
-
-		astar_heap_add (h, x, (void*)xx);
+		printf ("Adding #%d (%d) -> %u...\n", i, x, x * 3);
+		astar_heap_add (h, x, x * 3);
 	}
 	assert (h->length == NUM_INS);
+	assert (h->peak == NUM_INS);
+	assert (h->alloc >= NUM_INS);
+
+	// Lower some keys.
+	for (i = 0; i < 10; i++) {
+		uint32_t pos = astar_heap_update (h, h->e[h->length - 1 - i].ofs, 0);
+		assert (h->e[pos].key == 0);
+		h->e[pos].ofs = 0;
+	}
+	printf ("Updating has been verified to move keys to the right place.\n");
+
+	// Pruning keeps the smallest entries.
+	uint32_t n = h->length, max_kept = 0;
+	assert (astar_heap_prune (h, n) == 0);
+	assert (astar_heap_prune (h, n / 2) == n - n / 2);
+	assert (h->length == n / 2);
+	for (i = 0; i < h->length; i++) {
+		if (h->e[i].key > max_kept) max_kept = h->e[i].key;
+	}
+	for (i = h->length; i < n; i++) {
+		assert (h->e[i].key >= max_kept);
+		assert (h->e[i].ofs == h->e[i].key * 3);
+	}
+	printf ("Pruning has been verified to drop the largest keys.\n");
+
+	astar_heap_shrink (h, 0);
+	assert (h->alloc == h->length);
+	assert (h->peak == n);
+	printf ("Shrinking has been verified to keep the entries in use.\n");
 
 	uint32_t prev = 0;
 	while (!astar_heap_is_empty (h)) {
-		square_t * payload;
-		uint32_t next = astar_heap_pop (h, &payload);
-		prev = next;
+		uint32_t ofs;
+		uint32_t next = astar_heap_pop (h, &ofs);
 		assert (next >= prev);
-#if __WORDSIZE == 64
-		assert ((uint64_t) payload == (uint64_t) next);
-#else
-		assert ((uint32_t) payload == (uint32_t) next);
-#endif // __WORDSIZE
+		prev = next;
+		assert (ofs == next * 3);
 	}
 
 	printf ("Popping has been verified to be monotonic.\n");
 	printf ("Key to payload mapping has been verified to be consistent.\n");
+
+	// With unique payloads, positions can be tracked.
+	astar_heap_track (h, NUM_INS);
+	for (i = 0; i < NUM_INS; i++) astar_heap_add (h, 1000 + rand() % 1000, i);
+	for (i = 0; i < NUM_INS; i += 3) {
+		uint32_t pos = astar_heap_update (h, i, h->e[h->pos[i]].key - 1000);
+		assert ((h->e[pos].ofs == i) && (h->pos[i] == pos));
+	}
+	assert (astar_heap_prune (h, NUM_INS / 2) == NUM_INS - NUM_INS / 2);
+	for (i = 0; i < h->length; i++) assert (h->pos[h->e[i].ofs] == i);
+	prev = 0;
+	while (!astar_heap_is_empty (h)) {
+		uint32_t ofs, next = astar_heap_pop (h, &ofs);
+		assert (next >= prev);
+		prev = next;
+		for (i = 0; i < h->length; i += h->length / 8 + 1) {
+			assert (h->pos[h->e[i].ofs] == i);
+		}
+	}
+	printf ("Position tracking has been verified to be consistent.\n");
+
 	astar_heap_destroy (h);
 }
 
 #endif // TEST_HEAP
 
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// BENCHMARKING
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef BENCH_HEAP
+
+#ifndef BENCH_OPS
+#define BENCH_OPS 4000000
+#endif // BENCH_OPS
+
+int
+main (int argc, char ** argv)
+{
+	// Mimic the open list of a search: keys rise slowly as the frontier
+	// moves away from the start, and each pop is followed by one or two
+	// additions.
+	asheap_t * h = astar_heap_new (256, 0);
+	struct timeval t0, t1;
+	uint32_t i, j, ops = 0, base = 0, sum = 0;
+	srand(0);
+
+	gettimeofday (&t0, NULL);
+	for (i = 0; ops < BENCH_OPS; i++) {
+		for (j = 0; j <= (i & 1); j++) astar_heap_add (h, base + rand() % 64, i);
+		base = astar_heap_pop (h, NULL);
+		sum += base;
+		ops += 2 + (i & 1);
+	}
+	while (!astar_heap_is_empty (h)) {
+		sum += astar_heap_pop (h, NULL);
+		ops++;
+	}
+	gettimeofday (&t1, NULL);
+
+	double usecs = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec);
+	printf ("Arity %u: %u operations, peak %u entries, %.1f ns per operation (%u).\n",
+		ASTAR_HEAP_ARITY, ops, h->peak, usecs * 1000 / ops, sum);
+	astar_heap_destroy (h);
+	return 0;
+}
+
+#endif // BENCH_HEAP
+
+
 // End of file.
@@ -44,8 +44,8 @@ extern "C" {
 
 
 /*
- * This defines one square in the grid, and is the binary heap's payload. It
- * maintains f, g, and h values for a grid square.
+ * This defines one square in the grid. It maintains f, g, and h values for a
+ * grid square. The heap refers to squares by their offset in the grid.
  *
  * We also maintain a bitfield that stores compactly the necessary flags to
  * represent this square.
@@ -73,25 +73,54 @@ typedef struct {
 	uint32_t    ofs;
 #endif
 
-	// This bitfield uses 18 of 32 bits.
+	// This bitfield uses 24 of 32 bits.
 
 	uint32_t    cost:8;     // We assign a base cost 0-255. 255=impassable.
 	uint32_t    open:1;	// Is this in the open set?
 	uint32_t    closed:1;	// Is this in the closed list?
-	uint32_t    dir:3;      // Direction to this square's parent.
-	uint32_t    rdir:3;     // Source->Destination direction.
+	uint32_t    dir:4;      // Direction to this square's parent.
+	uint32_t    rdir:4;     // Source->Destination direction.
+	uint32_t    up:1;       // A portal leads to the layer above (layered grids).
+	uint32_t    down:1;     // A portal leads to the layer below (layered grids).
 	uint32_t    route:1;    // This is part of the final route.
 	uint32_t    init:1;     // This square has been initialised.
+	uint32_t    seen:1;     // Has been reached, so g is valid.
+	uint32_t    incons:1;   // Closed, but g improved since (anytime search).
 
 } square_t;
 
 
+/*
+ * The heap is d-ary: each node has ASTAR_HEAP_ARITY children, stored next to
+ * each other. Entries pack the key (the F value) with the grid offset of the
+ * square, so a node and its payload are in the same eight bytes, and the
+ * array is aligned so that all children of a node with arity 4 or 8 share
+ * one cache line. Wider heaps are shallower, so popping touches fewer cache
+ * lines, at the expense of more comparisons per level. Define
+ * ASTAR_HEAP_ARITY when building the library to change it (2 gives a binary
+ * heap).
+ */
+
+#ifndef ASTAR_HEAP_ARITY
+#define ASTAR_HEAP_ARITY 4
+#endif // ASTAR_HEAP_ARITY
+
+
+typedef struct {
+	uint32_t     key;       // Sort key (F).
+	uint32_t     ofs;       // Payload (grid offset of the square).
+} asheap_entry_t;
+
+
 typedef struct {
-	uint32_t  *  data;	// Data.
-	square_t  ** squares;   // Payload (array of square_t pointers)
+	asheap_entry_t * e;     // Entries.
+	void *       raw;       // The allocated block (e is aligned within it).
+	uint32_t *   pos;       // Position of each payload (if tracked).
+	uint32_t     pos_size;  // Number of payloads tracked.
 	uint32_t     length;	// Entries in use.
 	uint32_t     alloc;	// Entries allocated.
-	uint32_t     delta;     // Size increase.
+	uint32_t     delta;     // Size increase (0 to double the size).
+	uint32_t     peak;      // Most entries ever in use.
 } asheap_t;
 
 
@@ -101,24 +130,46 @@ asheap_t * astar_heap_new (uint32_t initial_length, uint32_t delta);
 void astar_heap_destroy (asheap_t * heap);
 
 
-inline void astar_heap_clear (asheap_t * heap);
+// Release unused entries, keeping at least alloc (and all entries in use).
+void astar_heap_shrink (asheap_t * heap, uint32_t alloc);
+
+
+// Keep track of the position of every entry, so astar_heap_update() finds
+// it in constant time. Payloads must be unique and less than size. A size of
+// 0 stops tracking. The heap must be empty.
+void astar_heap_track (asheap_t * heap, uint32_t size);
+
+
+void astar_heap_clear (asheap_t * heap);
 
 
 uint32_t astar_heap_sizeof (asheap_t * heap);
 
 
-void astar_heap_add (asheap_t * heap, uint32_t val, square_t * payload);
+void astar_heap_add (asheap_t * heap, uint32_t key, uint32_t ofs);
 
 
-uint32_t astar_heap_pop (asheap_t * heap, square_t ** payload);
+// Remove the entry with the smallest key. Returns the key, and stores the
+// payload in *ofs (if ofs isn't NULL).
+uint32_t astar_heap_pop (asheap_t * heap, uint32_t * ofs);
 
 
-uint32_t astar_heap_update (asheap_t * heap, square_t * payload);
+// Lower the key of the entry with payload ofs. Returns its new position.
+uint32_t astar_heap_update (asheap_t * heap, uint32_t ofs, uint32_t key);
+
+
+// Keep the smallest keep entries and drop the rest. Returns the number of
+// entries dropped, which are left in e[] right after the last entry kept.
+uint32_t astar_heap_prune (asheap_t * heap, uint32_t keep);
 
 
 int astar_heap_is_empty (asheap_t * heap);
 
 
+// The smallest key on a non-empty heap.
+#define astar_heap_min(heap) ((heap)->e[0].key)
+
+
 void astar_heap_print (asheap_t * heap);
 
 
@@ -0,0 +1,749 @@
+/*
+
+$Id
+
+Copyright (C) 2009 Alexios Chouchoulas
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "astar_service.h"
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#  include <pthread.h>
+#  define ASTAR_THREADS
+#endif // HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CONSTANTS AND MACROS
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define check_null(p,err) \
+        if ((p) == NULL) {    \
+                perror (err); \
+                exit (EXIT_FAILURE); \
+        }
+
+// States of requests.
+#define REQ_FREE    0
+#define REQ_QUEUED  1
+#define REQ_RUNNING 2
+#define REQ_DONE    3
+
+// Queue keys: higher priorities first, then first come, first served. The
+// order of submission wraps around every 2^24 queries, which only upsets
+// the order of the few queued at the time.
+#define queue_key(sv,priority) ((((uint32_t) (255 - (priority))) << 24) | ((sv)->seq++ & 0xffffff))
+
+// Tickets of dropped searches wait for no request.
+#define NO_REQUEST 0xffffffff
+
+
+// The UTC timezone -- we only operate on time deltas.
+static struct timezone _tz = { 0, 0 };
+
+
+static inline uint32_t
+get_time_difference (struct timeval *t0)
+{
+        struct timeval t;
+        gettimeofday (&t, &_tz);
+        return (t.tv_sec * 1000000 + t.tv_usec) - (t0->tv_sec * 1000000 + t0->tv_usec);
+}
+
+
+// Workers share everything under a single lock. Searches take far longer
+// than anything done under it.
+#ifdef ASTAR_THREADS
+
+typedef struct {
+        astar_service_t *   sv;
+        astar_t *           as;
+} _worker_t;
+
+typedef struct {
+        pthread_mutex_t     lock;
+        pthread_cond_t      work;       // Signalled when searches are queued.
+        pthread_t *         threads;
+        _worker_t *         workers;
+} _sync_t;
+
+#define sync_of(sv)   ((_sync_t *) (sv)->sync)
+#define lock(sv)      pthread_mutex_lock (&sync_of (sv)->lock)
+#define unlock(sv)    pthread_mutex_unlock (&sync_of (sv)->lock)
+#define wake_one(sv)  pthread_cond_signal (&sync_of (sv)->work)
+
+#else
+
+#define lock(sv)
+#define unlock(sv)
+#define wake_one(sv)
+
+#endif // ASTAR_THREADS
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// REQUESTS AND TICKETS
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+static inline int
+same_query (const astar_query_t * a, const astar_query_t * b)
+{
+        return (a->x0 == b->x0) && (a->y0 == b->y0) && (a->x1 == b->x1) && (a->y1 == b->y1);
+}
+
+
+static void
+free_request (astar_service_t * sv, const uint32_t r)
+{
+        astar_service_request_t * req = &sv->requests[r];
+        if (req->state == REQ_QUEUED) sv->stats.queued--;
+        if (req->reply.directions != NULL) astar_free_directions (req->reply.directions);
+        memset (req, 0, sizeof (astar_service_request_t));
+        sv->num_requests--;
+}
+
+
+// Take the next request off the queue. Returns 0xffffffff if there isn't
+// one. Cancelled requests (and old entries of requests whose priority was
+// raised) are skipped: their keys no longer match.
+static uint32_t
+next_request (astar_service_t * sv)
+{
+        while (!astar_heap_is_empty (sv->queue)) {
+                uint32_t r, key = astar_heap_pop (sv->queue, &r);
+                astar_service_request_t * req = &sv->requests[r];
+                if ((req->state != REQ_QUEUED) || (req->key != key)) continue;
+
+                req->state = REQ_RUNNING;
+                sv->stats.queued--;
+                sv->stats.running++;
+                sv->stats.wait_usecs += get_time_difference (&req->submitted);
+                return r;
+        }
+        return 0xffffffff;
+}
+
+
+// Search for a request. Called without the lock: nobody else touches a
+// running request's query or reply.
+static void
+run_request (astar_service_t * sv, astar_t * as, const uint32_t r)
+{
+        astar_service_request_t * req = &sv->requests[r];
+        astar_query_t * q = &req->query;
+        req->reply.result = astar_run (as, q->x0, q->y0, q->x1, q->y1);
+        req->reply.score = as->score;
+        req->reply.usecs = as->usecs;
+        req->reply.steps = 0;
+        req->reply.directions = NULL;
+        if (req->reply.result == ASTAR_FOUND) {
+                req->reply.steps = astar_get_directions (as, &req->reply.directions);
+        }
+        req->reply.latency = get_time_difference (&req->submitted);
+}
+
+
+// Put a finished request on the completion list.
+static void
+complete_request (astar_service_t * sv, const uint32_t r)
+{
+        astar_service_request_t * req = &sv->requests[r];
+        req->state = REQ_DONE;
+        req->next = 0;
+        sv->stats.running--;
+        sv->stats.completed++;
+        sv->stats.search_usecs += req->reply.usecs;
+        if (sv->done_last) sv->requests[sv->done_last - 1].next = r + 1;
+        else sv->done_first = r + 1;
+        sv->done_last = r + 1;
+}
+
+
+#ifdef ASTAR_THREADS
+
+static void *
+service_worker (void * arg)
+{
+        _worker_t * worker = (_worker_t *) arg;
+        astar_service_t * sv = worker->sv;
+
+        lock (sv);
+        for (;;) {
+                uint32_t r;
+                while (!sv->stop && ((r = next_request (sv)) == 0xffffffff)) {
+                        pthread_cond_wait (&sync_of (sv)->work, &sync_of (sv)->lock);
+                }
+                if (sv->stop) break;
+
+                unlock (sv);
+                run_request (sv, worker->as, r);
+                lock (sv);
+                complete_request (sv, r);
+        }
+        unlock (sv);
+        return NULL;
+}
+
+#endif // ASTAR_THREADS
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CONSTRUCTION AND DESTRUCTION
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+astar_service_t *
+astar_service_new (astar_t ** contexts, const uint32_t num_contexts, const uint32_t capacity)
+{
+        assert (contexts != NULL);
+        assert (num_contexts > 0);
+        assert (capacity > 0);
+
+        astar_service_t * sv = (astar_service_t *) calloc (1, sizeof (astar_service_t));
+        check_null (sv, "astar_service_new(), allocating memory");
+        sv->contexts = (astar_t **) malloc (num_contexts * sizeof (astar_t *));
+        check_null (sv->contexts, "astar_service_new(), allocating memory");
+        memcpy (sv->contexts, contexts, num_contexts * sizeof (astar_t *));
+        sv->num_contexts = num_contexts;
+        sv->capacity = capacity;
+        sv->requests = (astar_service_request_t *) calloc (capacity, sizeof (astar_service_request_t));
+        sv->tickets = (astar_service_ticket_t *) calloc (2 * capacity, sizeof (astar_service_ticket_t));
+        check_null (sv->requests, "astar_service_new(), allocating memory");
+        check_null (sv->tickets, "astar_service_new(), allocating memory");
+        sv->queue = astar_heap_new (capacity, 0);
+        sv->next_id = 1;
+
+#ifdef ASTAR_THREADS
+        uint32_t i;
+        _sync_t * sync = (_sync_t *) calloc (1, sizeof (_sync_t));
+        check_null (sync, "astar_service_new(), allocating memory");
+        sync->threads = (pthread_t *) malloc (num_contexts * sizeof (pthread_t));
+        sync->workers = (_worker_t *) malloc (num_contexts * sizeof (_worker_t));
+        check_null (sync->threads, "astar_service_new(), allocating memory");
+        check_null (sync->workers, "astar_service_new(), allocating memory");
+        pthread_mutex_init (&sync->lock, NULL);
+        pthread_cond_init (&sync->work, NULL);
+        sv->sync = sync;
+
+        for (i = 0; i < num_contexts; i++) {
+                sync->workers[i].sv = sv;
+                sync->workers[i].as = contexts[i];
+                if (pthread_create (&sync->threads[i], NULL, service_worker, &sync->workers[i])) {
+                        perror ("astar_service_new(), starting thread");
+                        exit (EXIT_FAILURE);
+                }
+        }
+#endif // ASTAR_THREADS
+
+        return sv;
+}
+
+
+void
+astar_service_destroy (astar_service_t * sv)
+{
+        assert (sv != NULL);
+        uint32_t i;
+
+#ifdef ASTAR_THREADS
+        _sync_t * sync = sync_of (sv);
+        lock (sv);
+        sv->stop = 1;
+        pthread_cond_broadcast (&sync->work);
+        unlock (sv);
+        for (i = 0; i < sv->num_contexts; i++) pthread_join (sync->threads[i], NULL);
+        pthread_cond_destroy (&sync->work);
+        pthread_mutex_destroy (&sync->lock);
+        free (sync->threads);
+        free (sync->workers);
+        free (sync);
+#endif // ASTAR_THREADS
+
+        for (i = 0; i < sv->capacity; i++) {
+                if (sv->requests[i].reply.directions != NULL) {
+                        astar_free_directions (sv->requests[i].reply.directions);
+                }
+        }
+        astar_heap_destroy (sv->queue);
+        free (sv->requests);
+        free (sv->tickets);
+        free (sv->contexts);
+        free (sv);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// MAIN CODE
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Drop the least urgent queued request, if it's less urgent than priority.
+// Its tickets are delivered as dropped. Returns the freed request, or
+// 0xffffffff.
+static uint32_t
+drop_request (astar_service_t * sv, const uint8_t priority)
+{
+        uint32_t i, victim = 0xffffffff;
+        for (i = 0; i < sv->capacity; i++) {
+                astar_service_request_t * req = &sv->requests[i];
+                if ((req->state != REQ_QUEUED) || (req->query.priority >= priority)) continue;
+                if ((victim == 0xffffffff) || (req->key > sv->requests[victim].key)) victim = i;
+        }
+        if (victim == 0xffffffff) return victim;
+
+        astar_service_request_t * req = &sv->requests[victim];
+        while (req->tickets) {
+                astar_service_ticket_t * ticket = &sv->tickets[req->tickets - 1];
+                uint32_t t = req->tickets;
+                req->tickets = ticket->next;
+                ticket->request = NO_REQUEST;
+                ticket->next = sv->dropped;
+                sv->dropped = t;
+                sv->stats.dropped++;
+        }
+        free_request (sv, victim);
+        return victim;
+}
+
+
+uint32_t
+astar_submit (astar_service_t * sv, const astar_query_t * query,
+              astar_callback_t callback, void * arg)
+{
+        assert (sv != NULL);
+        assert (query != NULL);
+        assert (callback != NULL);
+        uint32_t i, r = 0xffffffff, t = 0xffffffff;
+
+        lock (sv);
+        sv->stats.submitted++;
+
+        // Every query needs a ticket. There are twice as many tickets as
+        // searches, for queries sharing searches (and dropped ones).
+        if (sv->num_tickets < 2 * sv->capacity) {
+                for (t = 0; sv->tickets[t].id; t++);
+        }
+
+        // Is somebody already waiting for the same search? If it's still
+        // queued, it's now at least as urgent as this query.
+        for (i = 0; (t != 0xffffffff) && (i < sv->capacity); i++) {
+                astar_service_request_t * req = &sv->requests[i];
+                if ((req->state == REQ_FREE) || !same_query (&req->query, query)) continue;
+                if ((req->state == REQ_QUEUED) && (query->priority > req->query.priority)) {
+                        req->query.priority = query->priority;
+                        req->key = queue_key (sv, query->priority);
+                        astar_heap_add (sv->queue, req->key, i);
+                }
+                sv->stats.merged++;
+                r = i;
+                break;
+        }
+
+        // If not, queue a new search.
+        if ((t != 0xffffffff) && (r == 0xffffffff)) {
+                if (sv->num_requests < sv->capacity) {
+                        for (r = 0; sv->requests[r].state != REQ_FREE; r++);
+                } else {
+                        r = drop_request (sv, query->priority);
+                }
+                if (r != 0xffffffff) {
+                        astar_service_request_t * req = &sv->requests[r];
+                        req->query = *query;
+                        req->state = REQ_QUEUED;
+                        req->key = queue_key (sv, query->priority);
+                        gettimeofday (&req->submitted, &_tz);
+                        astar_heap_add (sv->queue, req->key, r);
+                        sv->num_requests++;
+                        if (++sv->stats.queued > sv->stats.peak_queued) sv->stats.peak_queued = sv->stats.queued;
+                        wake_one (sv);
+                }
+        }
+
+        if (r == 0xffffffff) {
+                sv->stats.rejected++;
+                unlock (sv);
+                return 0;
+        }
+
+        // Issue the ticket.
+        astar_service_ticket_t * ticket = &sv->tickets[t];
+        uint32_t id = sv->next_id++;
+        if (sv->next_id == 0) sv->next_id = 1;
+        ticket->id = id;
+        ticket->query = *query;
+        ticket->request = r;
+        ticket->next = sv->requests[r].tickets;
+        ticket->callback = callback;
+        ticket->arg = arg;
+        sv->requests[r].tickets = t + 1;
+        sv->num_tickets++;
+        unlock (sv);
+        return id;
+}
+
+
+// Unlink ticket t from a list. Returns 1 if it was there.
+static int
+unlink_ticket (astar_service_t * sv, uint32_t * list, const uint32_t t)
+{
+        for (; *list; list = &sv->tickets[*list - 1].next) {
+                if (*list != t + 1) continue;
+                *list = sv->tickets[t].next;
+                return 1;
+        }
+        return 0;
+}
+
+
+int
+astar_service_cancel (astar_service_t * sv, const uint32_t ticket)
+{
+        assert (sv != NULL);
+        uint32_t t;
+        if (ticket == 0) return 0;
+
+        lock (sv);
+        for (t = 0; (t < 2 * sv->capacity) && (sv->tickets[t].id != ticket); t++);
+        if (t == 2 * sv->capacity) {
+                unlock (sv);
+                return 0;
+        }
+
+        uint32_t r = sv->tickets[t].request;
+        if (r == NO_REQUEST) {
+                unlink_ticket (sv, &sv->dropped, t);
+        } else {
+                unlink_ticket (sv, &sv->requests[r].tickets, t);
+
+                // Nobody wants this search any more. Running and finished
+                // searches are freed when they're delivered.
+                if ((sv->requests[r].tickets == 0) && (sv->requests[r].state == REQ_QUEUED)) {
+                        free_request (sv, r);
+                }
+        }
+        memset (&sv->tickets[t], 0, sizeof (astar_service_ticket_t));
+        sv->num_tickets--;
+        sv->stats.cancelled++;
+        unlock (sv);
+        return 1;
+}
+
+
+// Take the first ticket off a list and call it back (without the lock).
+static void
+deliver (astar_service_t * sv, uint32_t * list, const astar_reply_t * reply)
+{
+        astar_service_ticket_t ticket = sv->tickets[*list - 1];
+        memset (&sv->tickets[*list - 1], 0, sizeof (astar_service_ticket_t));
+        sv->num_tickets--;
+        *list = ticket.next;
+        unlock (sv);
+        (*ticket.callback) (ticket.id, &ticket.query, reply, ticket.arg);
+        lock (sv);
+}
+
+
+uint32_t
+astar_service_poll (astar_service_t * sv)
+{
+        assert (sv != NULL);
+        uint32_t called = 0;
+
+#ifndef ASTAR_THREADS
+        // No workers: search here, one query per call.
+        uint32_t r = next_request (sv);
+        if (r != 0xffffffff) {
+                run_request (sv, sv->contexts[0], r);
+                complete_request (sv, r);
+        }
+#endif // ASTAR_THREADS
+
+        lock (sv);
+        uint32_t done = sv->done_first;
+        sv->done_first = sv->done_last = 0;
+
+        // Callbacks may cancel tickets (or submit queries that join these
+        // searches), so the lists are re-read after each one.
+        static const astar_reply_t dropped = { ASTAR_DROPPED, 0, 0, NULL, 0, 0 };
+        while (sv->dropped) {
+                deliver (sv, &sv->dropped, &dropped);
+                called++;
+        }
+        while (done) {
+                astar_service_request_t * req = &sv->requests[done - 1];
+                while (req->tickets) {
+                        deliver (sv, &req->tickets, &req->reply);
+                        called++;
+                }
+                uint32_t next = req->next;
+                free_request (sv, done - 1);
+                done = next;
+        }
+        unlock (sv);
+        return called;
+}
+
+
+void
+astar_service_get_stats (astar_service_t * sv, astar_service_stats_t * stats)
+{
+        assert (sv != NULL);
+        assert (stats != NULL);
+        lock (sv);
+        *stats = sv->stats;
+        unlock (sv);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TESTING
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef TEST_SERVICE
+
+#include <unistd.h>
+
+// A 64x64 maze of walls with gaps. Blocks while hold is set, to keep the
+// workers busy.
+static volatile int hold = 0;
+
+static uint8_t
+maze_get (const uint32_t x, const uint32_t y)
+{
+        assert ((x < 64) && (y < 64));
+        while (hold) usleep (100);
+        if ((x % 8 == 4) && ((y * 7 + x) % 16 > 2)) return COST_BLOCKED;
+        return 1 + (x * y) % 3;
+}
+
+
+// Replies received by the test callback.
+#define MAX_QUERIES 256
+
+static uint32_t num_replies = 0;
+static uint32_t reply_ticket[MAX_QUERIES];
+static int reply_result[MAX_QUERIES];
+static uint32_t reply_score[MAX_QUERIES];
+static astar_query_t reply_query[MAX_QUERIES];
+
+static void
+callback (const uint32_t ticket, const astar_query_t * query,
+          const astar_reply_t * reply, void * arg)
+{
+        assert (num_replies < MAX_QUERIES);
+        assert ((reply->result != ASTAR_FOUND) || (reply->directions[reply->steps] == DIR_END));
+        reply_ticket[num_replies] = ticket;
+        reply_result[num_replies] = reply->result;
+        reply_score[num_replies] = reply->score;
+        reply_query[num_replies] = *query;
+        num_replies++;
+        (*(uint32_t *) arg)++;
+}
+
+
+static astar_t *
+new_context ()
+{
+        astar_t * as = astar_new (64, 64, maze_get, NULL);
+        astar_set_origin (as, 0, 0);
+        astar_set_movement_mode (as, DIR_8WAY);
+        return as;
+}
+
+
+static void
+random_query (astar_query_t * q)
+{
+        do {
+                q->x0 = rand () % 64;
+                q->y0 = rand () % 64;
+        } while (maze_get (q->x0, q->y0) == COST_BLOCKED);
+        do {
+                q->x1 = rand () % 64;
+                q->y1 = rand () % 64;
+        } while (maze_get (q->x1, q->y1) == COST_BLOCKED);
+        q->priority = rand () % 4;
+}
+
+
+// Wait for replies, polling like a game loop would.
+static void
+poll_until (astar_service_t * sv, const uint32_t replies)
+{
+        uint32_t tick;
+        for (tick = 0; num_replies < replies; tick++) {
+                astar_service_poll (sv);
+                usleep (1000);
+                assert (tick < 20000);
+        }
+        astar_service_poll (sv);
+}
+
+
+#ifdef ASTAR_THREADS
+
+// Several threads submitting at once.
+static astar_service_t * shared_sv;
+static uint32_t accepted[4], answered[4];
+
+static void *
+submitter (void * arg)
+{
+        uint32_t n = (uint32_t) (size_t) arg, i;
+        for (i = 0; i < 32; i++) {
+                astar_query_t q = { n, i, 63 - n, 63 - i, i % 4 };
+                if (maze_get (q.x0, q.y0) == COST_BLOCKED) q.x0++;
+                if (astar_submit (shared_sv, &q, callback, &answered[n])) accepted[n]++;
+        }
+        return NULL;
+}
+
+#endif // ASTAR_THREADS
+
+
+#define NUM_CONTEXTS 4
+
+int
+main (int argc, char ** argv)
+{
+        astar_t * contexts[NUM_CONTEXTS], * as = new_context ();
+        astar_service_stats_t stats;
+        uint32_t i, j, count = 0;
+        srand (0);
+        for (i = 0; i < NUM_CONTEXTS; i++) contexts[i] = new_context ();
+
+        // Replies match searching on the spot.
+        astar_service_t * sv = astar_service_new (contexts, NUM_CONTEXTS, 128);
+        astar_query_t queries[100];
+        uint32_t tickets[100];
+        for (i = 0; i < 100; i++) {
+                random_query (&queries[i]);
+                tickets[i] = astar_submit (sv, &queries[i], callback, &count);
+                assert (tickets[i] != 0);
+        }
+        poll_until (sv, 100);
+        assert (count == 100);
+        for (i = 0; i < 100; i++) {
+                for (j = 0; reply_ticket[j] != tickets[i]; j++) assert (j < 100);
+                assert (same_query (&reply_query[j], &queries[i]));
+                astar_query_t * q = &queries[i];
+                assert (astar_run (as, q->x0, q->y0, q->x1, q->y1) == reply_result[j]);
+                assert (as->score == reply_score[j]);
+        }
+        printf("Verified: replies match synchronous searches.\n");
+
+        // Identical queries share a search, and the more urgent priority.
+        num_replies = count = 0;
+        astar_query_t q = { 1, 1, 62, 62, 0 };
+        uint32_t first = astar_submit (sv, &q, callback, &count);
+        q.priority = 3;
+        uint32_t second = astar_submit (sv, &q, callback, &count);
+        assert (first && second && (first != second));
+        astar_service_get_stats (sv, &stats);
+        assert (stats.merged == 1);
+        poll_until (sv, 2);
+        assert ((reply_score[0] == reply_score[1]) && (reply_result[0] == ASTAR_FOUND));
+        astar_service_get_stats (sv, &stats);
+        assert (stats.completed == 101);
+        printf("Verified: identical queries share a search.\n");
+
+        // Cancelled queries aren't called back.
+        num_replies = count = 0;
+        first = astar_submit (sv, &queries[0], callback, &count);
+        second = astar_submit (sv, &queries[1], callback, &count);
+        assert (astar_service_cancel (sv, first) == 1);
+        assert (astar_service_cancel (sv, first) == 0);
+        poll_until (sv, 1);
+        assert ((count == 1) && (reply_ticket[0] == second));
+        assert (astar_service_cancel (sv, second) == 0);
+        astar_service_destroy (sv);
+        printf("Verified: cancelled queries aren't called back.\n");
+
+        // A full service turns queries away, or drops less urgent ones.
+        num_replies = count = 0;
+        sv = astar_service_new (contexts, 2, 8);
+        hold = 1;
+        for (i = 0; i < 8; i++) {
+                astar_query_t q = { i, 0, 63, 63 - i, 0 };
+                assert (astar_submit (sv, &q, callback, &count) != 0);
+        }
+        astar_query_t late = { 0, 8, 63, 63, 0 };
+        assert (astar_submit (sv, &late, callback, &count) == 0);
+        late.priority = 1;
+        assert (astar_submit (sv, &late, callback, &count) != 0);
+        astar_service_get_stats (sv, &stats);
+        assert ((stats.rejected == 1) && (stats.dropped == 1) && (stats.peak_queued >= 6));
+        hold = 0;
+        poll_until (sv, 9);
+        for (i = j = 0; i < num_replies; i++) {
+                if (reply_result[i] != ASTAR_DROPPED) continue;
+                assert ((reply_query[i].y1 == 56) && (reply_query[i].priority == 0));
+                j++;
+        }
+        assert (j == 1);
+        astar_service_get_stats (sv, &stats);
+        assert ((stats.queued == 0) && (stats.running == 0) && (stats.completed == 8));
+        astar_service_destroy (sv);
+        printf("Verified: full services degrade gracefully.\n");
+
+#ifdef ASTAR_THREADS
+        // Many producers, many consumers.
+        num_replies = count = 0;
+        shared_sv = sv = astar_service_new (contexts, NUM_CONTEXTS, 64);
+        pthread_t threads[4];
+        for (i = 0; i < 4; i++) pthread_create (&threads[i], NULL, submitter, (void *) (size_t) i);
+        for (i = 0; i < 4; i++) pthread_join (threads[i], NULL);
+        uint32_t total = accepted[0] + accepted[1] + accepted[2] + accepted[3];
+        poll_until (sv, total);
+        for (i = 0; i < 4; i++) assert (accepted[i] == answered[i]);
+        astar_service_get_stats (sv, &stats);
+        assert (stats.submitted == 128);
+        assert (stats.submitted == total + stats.rejected);
+        astar_service_destroy (sv);
+        printf("Verified: %u of 128 queries from four threads accepted and answered.\n", total);
+#endif // ASTAR_THREADS
+
+        for (i = 0; i < NUM_CONTEXTS; i++) astar_destroy (contexts[i]);
+        astar_destroy (as);
+        printf("All tests were successful.\n");
+        return 0;
+}
+
+#endif // TEST_SERVICE
+
+
+// End of file.
@@ -0,0 +1,230 @@
+/*
+
+$Id
+
+Copyright (C) 2009 Alexios Chouchoulas
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#ifndef __ASTAR_SERVICE_H
+#define __ASTAR_SERVICE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+#include <sys/time.h>
+
+#include "astar.h"
+
+
+/*
+ * A pathfinding service, for programs that can't wait for astar_run() to
+ * finish (game loops, for instance).
+ *
+ * Queries are submitted from any thread, and queued by priority. Worker
+ * threads take them off the queue, each searching with its own A* context.
+ * Finished searches wait on a completion list until the main thread calls
+ * astar_service_poll() (once per tick, say), which calls back whoever
+ * submitted them, in the main thread.
+ *
+ * A query that's the same as one already queued or being searched for
+ * doesn't start another search: both callers get the same reply. The
+ * number of queries waiting is bounded. When the service is full, queries
+ * are turned away (or the least urgent query waiting is dropped for a more
+ * urgent one), and the caller finds out at once instead of stalling.
+ *
+ * Without thread support, astar_service_poll() runs one search itself
+ * every time it's called.
+ */
+
+// A query.
+typedef struct {
+	uint32_t    x0;         // Starting square.
+	uint32_t    y0;
+	uint32_t    x1;         // Target square.
+	uint32_t    y1;
+	uint8_t     priority;   // Higher priorities are searched first.
+} astar_query_t;
+
+// The reply to a query.
+typedef struct {
+	int         result;     // Result code of the search (or ASTAR_DROPPED).
+	uint32_t    score;      // Score of the route.
+	uint32_t    steps;      // Number of directions.
+	direction_t * directions; // DIR_END-terminated, or NULL if there's no route.
+	uint32_t    usecs;      // Search time in microseconds.
+	uint32_t    latency;    // Time from submission to the end of the search.
+} astar_reply_t;
+
+// Called by astar_service_poll() with the reply to a query. The reply (and
+// its directions) belongs to the service, and is freed when the callback
+// returns. Callbacks may submit or cancel queries.
+typedef void (* astar_callback_t) (const uint32_t ticket, const astar_query_t * query,
+				   const astar_reply_t * reply, void * arg);
+
+// Statistics, for throttling and for tuning the size of the service.
+typedef struct {
+	uint32_t    submitted;  // Queries submitted.
+	uint32_t    merged;     // Queries answered by another caller's search.
+	uint32_t    rejected;   // Queries turned away because the service was full.
+	uint32_t    dropped;    // Queries dropped for more urgent ones.
+	uint32_t    cancelled;  // Queries cancelled.
+	uint32_t    completed;  // Searches finished.
+	uint32_t    queued;     // Searches waiting now.
+	uint32_t    peak_queued; // The most searches ever waiting.
+	uint32_t    running;    // Searches running now.
+	uint64_t    wait_usecs; // Total time searches waited to start.
+	uint64_t    search_usecs; // Total time spent searching.
+} astar_service_stats_t;
+
+// A search, and the queries waiting for it.
+typedef struct {
+	astar_query_t query;
+	astar_reply_t reply;
+	uint32_t    state;      // Free, queued, running or done.
+	uint32_t    key;        // Key of the request in the queue.
+	uint32_t    tickets;    // First ticket waiting for it (plus one).
+	uint32_t    next;       // Next request on the completion list (plus one).
+	struct timeval submitted;
+} astar_service_request_t;
+
+// A query waiting for a search.
+typedef struct {
+	uint32_t    id;         // Ticket number, or 0 if free.
+	astar_query_t query;
+	uint32_t    request;    // The search it's waiting for.
+	uint32_t    next;       // Next ticket waiting for the same search (plus one).
+	astar_callback_t callback;
+	void *      arg;
+} astar_service_ticket_t;
+
+
+typedef struct {
+	astar_t **  contexts;   // One A* context per worker.
+	uint32_t    num_contexts;
+	uint32_t    capacity;   // The most searches at once (and half the most queries).
+
+	astar_service_request_t * requests;
+	astar_service_ticket_t * tickets;
+	uint32_t    num_requests;
+	uint32_t    num_tickets;
+	uint32_t    next_id;    // Number of the next ticket.
+	uint32_t    seq;        // Order of submission, for fairness.
+
+	asheap_t *  queue;      // Queued searches, by priority and order.
+	uint32_t    done_first; // Completion list (plus one).
+	uint32_t    done_last;
+	uint32_t    dropped;    // Tickets of dropped searches (plus one).
+
+	astar_service_stats_t stats;
+	void *      sync;       // Locks and threads.
+	uint32_t    stop;       // Workers should exit.
+} astar_service_t;
+
+
+/**
+ * Create a pathfinding service.
+ *
+ * @param contexts An array of initialised A* contexts, one per worker
+ * thread, all set up the same way (map, origin, movement mode, costs, and
+ * so on). Their get() functions must be safe to call from several threads
+ * at once. The service uses them until it's destroyed, but doesn't free
+ * them.
+ *
+ * @param num_contexts The number of contexts (and worker threads).
+ *
+ * @param capacity The most searches the service holds at once (queued,
+ * running, or waiting for astar_service_poll()). Up to twice as many
+ * queries may wait for them.
+ *
+ * @return A pointer to a new astar_service_t structure.
+ */
+
+astar_service_t * astar_service_new (astar_t ** contexts, const uint32_t num_contexts,
+				     const uint32_t capacity);
+
+/**
+ * Stop the workers and destroy a pathfinding service. Searches still
+ * running are waited for. Nobody is called back for queries not yet
+ * delivered.
+ *
+ * @param sv A pathfinding service.
+ */
+
+void astar_service_destroy (astar_service_t * sv);
+
+/**
+ * Submit a query.
+ *
+ * Never waits for a search. Safe to call from any thread.
+ *
+ * @param sv A pathfinding service.
+ * @param query The query. It's copied.
+ * @param callback Called from astar_service_poll() with the reply.
+ * @param arg Passed on to the callback.
+ *
+ * @return A ticket number (never 0), or 0 if the service is full. When full,
+ * the least urgent query still queued is dropped instead (its callback is
+ * given <tt>ASTAR_DROPPED</tt>), if it has a lower priority than this one.
+ */
+
+uint32_t astar_submit (astar_service_t * sv, const astar_query_t * query,
+		       astar_callback_t callback, void * arg);
+
+/**
+ * Cancel a query. Its callback won't be called. If nobody else is waiting
+ * for the same search, the search is dropped (unless it's already running).
+ *
+ * @param sv A pathfinding service.
+ * @param ticket The ticket number returned by astar_submit().
+ *
+ * @return 1 if the query was cancelled, 0 if the ticket isn't known (or its
+ * reply has already been delivered).
+ */
+
+int astar_service_cancel (astar_service_t * sv, const uint32_t ticket);
+
+/**
+ * Deliver the replies of finished searches, calling the callbacks of their
+ * queries in this thread.
+ *
+ * @param sv A pathfinding service.
+ *
+ * @return The number of callbacks called.
+ */
+
+uint32_t astar_service_poll (astar_service_t * sv);
+
+/**
+ * Get the statistics of a service.
+ *
+ * @param sv A pathfinding service.
+ * @param stats Filled in with the statistics.
+ */
+
+void astar_service_get_stats (astar_service_t * sv, astar_service_stats_t * stats);
+
+
+#ifdef __cplusplus
+};
+#endif // __cplusplus
+
+#endif // __ASTAR_SERVICE_H
+
+// End of file.